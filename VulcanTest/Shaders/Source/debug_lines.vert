@@ -0,0 +1,23 @@
+#version 450
+#extension GL_EXT_multiview : require
+
+// Debug lines arrive in world space, written by the CPU into the transient geometry ring every frame.
+layout(binding = 3) uniform view_buffer_object
+{
+    mat4 view_proj[8];
+} views;
+
+layout(push_constant) uniform view_pass
+{
+    uint first_view;
+} pass;
+
+layout(location = 0) in vec3 in_position;
+layout(location = 1) in vec3 in_color;
+
+layout(location = 0) out vec3 frag_color;
+
+void main() {
+    gl_Position = views.view_proj[gl_ViewIndex + pass.first_view] * vec4(in_position, 1.0);
+    frag_color = in_color;
+}
\ No newline at end of file
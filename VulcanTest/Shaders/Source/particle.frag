@@ -0,0 +1,12 @@
+#version 450
+
+layout(location = 0) in vec4 frag_color;
+layout(location = 1) in vec2 frag_corner;
+
+layout(location = 0) out vec4 out_color;
+
+void main() {
+    float falloff = max(1.0 - dot(frag_corner, frag_corner), 0.0);
+
+    out_color = vec4(frag_color.rgb * frag_color.a * falloff, 0.0);
+}
@@ -0,0 +1,55 @@
+#version 450
+#extension GL_EXT_multiview : require
+
+// Six vertices per live particle, expanded into a camera-facing quad. The instance index walks
+// this frame's alive list, whose length the simulation wrote straight into the indirect draw.
+struct Particle
+{
+    vec4 position;
+    vec4 velocity;
+};
+
+layout(binding = 0) uniform uniform_buffer_object
+{
+    mat4 model;
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+layout(binding = 1) uniform view_buffer_object
+{
+    mat4 view_proj[8];
+} views;
+
+layout(std430, binding = 2) readonly buffer particle_buffer
+{
+    Particle particles[];
+} state;
+
+layout(std430, binding = 3) readonly buffer alive_list
+{
+    uint index[];
+} alive;
+
+layout(push_constant) uniform view_pass
+{
+    uint first_view;
+} pass;
+
+layout(location = 0) out vec4 frag_color;
+layout(location = 1) out vec2 frag_corner;
+
+const float PARTICLE_SIZE = 0.01;
+const vec2 corners[6] = vec2[6](vec2(-1.0, -1.0), vec2(1.0, -1.0), vec2(1.0, 1.0), vec2(-1.0, -1.0), vec2(1.0, 1.0), vec2(-1.0, 1.0));
+
+void main() {
+    Particle particle = state.particles[alive.index[gl_InstanceIndex]];
+    vec2 corner = corners[gl_VertexIndex];
+    float age = 1.0 - particle.position.w / particle.velocity.w;
+    vec4 center = views.view_proj[gl_ViewIndex + pass.first_view] * vec4(particle.position.xyz, 1.0);
+
+    // Offsetting in clip space faces the camera in every view and still shrinks with distance.
+    gl_Position = center + vec4(corner * PARTICLE_SIZE * vec2(ubo.proj[0][0], ubo.proj[1][1]), 0.0, 0.0);
+    frag_color = vec4(mix(vec3(1.0, 0.8, 0.3), vec3(0.9, 0.2, 0.1), age), 1.0 - age);
+    frag_corner = corner;
+}
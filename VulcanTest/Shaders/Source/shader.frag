@@ -2,11 +2,137 @@
 
 layout(binding = 1) uniform sampler2D tex_sampler;
 
+struct Light
+{
+    vec4 position;
+    vec4 color;
+    vec4 direction;
+    vec4 params;
+};
+
+layout(binding = 5) uniform lighting_buffer_object
+{
+    mat4 view;
+    mat4 inverse_proj;
+    vec4 camera_position;
+    vec4 ambient;
+    uvec4 grid;
+    vec4 depth;
+    vec4 screen;
+} lighting;
+
+layout(std430, binding = 6) readonly buffer light_buffer
+{
+    Light lights[];
+} light_list;
+
+// Per-cluster light counts, then MAX_LIGHTS_PER_CLUSTER light indices per cluster.
+layout(std430, binding = 7) readonly buffer light_grid_buffer
+{
+    uint data[];
+} light_grid;
+
+layout(binding = 8) uniform shadow_buffer_object
+{
+    mat4 cascades[4];
+    vec4 splits;
+    vec4 texel_sizes;
+    // xyz direction the light travels, w cascade count.
+    vec4 light;
+} shadow;
+
+layout(binding = 9) uniform sampler2DArrayShadow shadow_map;
+
+layout(set = 1, binding = 0) uniform material_buffer_object
+{
+    vec4 diffuse;
+    vec4 specular;
+    vec4 params;
+} material;
+
 layout(location = 0) in vec3 frag_color;
 layout(location = 1) in vec2 frag_tex_coord;
+layout(location = 2) in vec3 frag_world_position;
+layout(location = 3) in vec3 frag_normal;
 
 layout(location = 0) out vec4 out_color;
 
+const uint MAX_LIGHTS_PER_CLUSTER = 128;
+const float LIGHT_SPOT = 1.0;
+
+// The first cascade whose slice reaches the fragment, pushed off the surface by a texel against acne,
+// then a 2x2 bilinear compare on each of four taps.
+float sun_visibility(vec3 normal, float view_depth)
+{
+    uint cascade_count = uint(shadow.light.w);
+    uint cascade = 0;
+
+    while (cascade + 1 < cascade_count && view_depth > shadow.splits[cascade])
+        cascade++;
+
+    vec3 offset_position = frag_world_position + normal * shadow.texel_sizes[cascade] * 1.5;
+    vec4 light_position = shadow.cascades[cascade] * vec4(offset_position, 1.0);
+    vec2 uv = light_position.xy * 0.5 + 0.5;
+    vec2 texel = 1.0 / vec2(textureSize(shadow_map, 0).xy);
+    float visibility = 0.0;
+
+    for (int tap = 0; tap < 4; tap++)
+    {
+        vec2 tap_offset = vec2(float(tap & 1) - 0.5, float(tap >> 1) - 0.5) * texel;
+        visibility += texture(shadow_map, vec4(uv + tap_offset, float(cascade), min(light_position.z, 1.0)));
+    }
+    return visibility * 0.25;
+}
+
 void main() {
-    out_color = texture(tex_sampler, frag_tex_coord);
+    vec3 base_color = material.diffuse.rgb;
+
+    if (material.params.x > 0.5)
+        base_color *= texture(tex_sampler, frag_tex_coord).rgb;
+
+    if (lighting.grid.w == 0 && shadow.light.w == 0.0)
+    {
+        out_color = vec4(base_color, material.diffuse.a);
+        return;
+    }
+
+    // The same slicing as light_cull.comp: screen tile from the fragment position, slice from the view depth.
+    float view_depth = -(lighting.view * vec4(frag_world_position, 1.0)).z;
+    uint slice = min(uint(max(log(view_depth / lighting.depth.x), 0.0) * lighting.depth.z), lighting.grid.z - 1);
+    uvec2 tile = min(uvec2(gl_FragCoord.xy / lighting.screen.xy * vec2(lighting.grid.xy)), lighting.grid.xy - 1);
+    uint cluster_count = lighting.grid.x * lighting.grid.y * lighting.grid.z;
+    uint cluster = (slice * lighting.grid.y + tile.y) * lighting.grid.x + tile.x;
+    uint light_count = lighting.grid.w > 0 ? light_grid.data[cluster] : 0;
+
+    vec3 normal = normalize(frag_normal);
+    vec3 to_eye = normalize(lighting.camera_position.xyz - frag_world_position);
+    float shininess = max(material.specular.w, 1.0);
+    vec3 color = lighting.ambient.rgb * base_color;
+
+    if (shadow.light.w > 0.0)
+        color += max(dot(normal, -shadow.light.xyz), 0.0) * sun_visibility(normal, view_depth) * base_color;
+
+    for (uint index = 0; index < light_count; index++)
+    {
+        Light light = light_list.lights[light_grid.data[cluster_count + cluster * MAX_LIGHTS_PER_CLUSTER + index]];
+        vec3 to_light = light.position.xyz - frag_world_position;
+        float distance = length(to_light);
+
+        if (distance >= light.position.w)
+            continue;
+
+        vec3 light_direction = to_light / distance;
+        // Inverse square, windowed to reach zero at the light's range.
+        float window = clamp(1.0 - pow(distance / light.position.w, 4.0), 0.0, 1.0);
+        float attenuation = window * window / (1.0 + distance * distance);
+        float diffuse = max(dot(normal, light_direction), 0.0);
+        float specular = diffuse > 0.0 ? pow(max(dot(normal, normalize(light_direction + to_eye)), 0.0), shininess) : 0.0;
+
+        if (light.params.y == LIGHT_SPOT)
+            attenuation *= smoothstep(light.direction.w, light.params.x, dot(-light_direction, light.direction.xyz));
+
+        color += light.color.rgb * light.color.w * attenuation * (diffuse * base_color + specular * material.specular.rgb);
+    }
+
+    out_color = vec4(color, material.diffuse.a);
 }
\ No newline at end of file
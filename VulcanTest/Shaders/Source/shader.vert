@@ -1,4 +1,5 @@
 #version 450
+#extension GL_EXT_multiview : require
 
 layout(binding = 0) uniform uniform_buffer_object
 {
@@ -7,15 +8,47 @@ layout(binding = 0) uniform uniform_buffer_object
     mat4 proj;
 } ubo;
 
+layout(std430, binding = 2) readonly buffer instance_buffer
+{
+    mat4 models[];
+} instances;
+
+layout(binding = 3) uniform view_buffer_object
+{
+    mat4 view_proj[8];
+} views;
+
+layout(std430, binding = 4) readonly buffer visible_list
+{
+    uint index[];
+} visible_instances;
+
+layout(push_constant) uniform view_pass
+{
+    uint first_view;
+} pass;
+
 layout(location = 0) in vec3 in_position;
 layout(location = 1) in vec3 in_color;
 layout(location = 2) in vec2 in_tex_coords;
+layout(location = 3) in vec3 in_normal;
+layout(location = 4) in vec4 in_tangent;
 
 layout(location = 0) out vec3 frag_color;
 layout(location = 1) out vec2 frag_tex_coord;
+layout(location = 2) out vec3 frag_world_position;
+layout(location = 3) out vec3 frag_normal;
+layout(location = 4) out vec4 frag_tangent;
 
 void main() {
-    gl_Position = ubo.proj * ubo.view * ubo.model * vec4(in_position, 1.0);
+    mat4 model = ubo.model * instances.models[visible_instances.index[gl_InstanceIndex]];
+    vec4 world_position = model * vec4(in_position, 1.0);
+
+    gl_Position = views.view_proj[gl_ViewIndex + pass.first_view] * world_position;
     frag_color = in_color;
     frag_tex_coord = in_tex_coords;
+    frag_world_position = world_position.xyz;
+    // Instances only scale uniformly, so the model matrix carries normals too.
+    frag_normal = mat3(model) * in_normal;
+    frag_tangent = vec4(mat3(model) * in_tangent.xyz, in_tangent.w);
 }
\ No newline at end of file
@@ -0,0 +1,33 @@
+#version 450
+
+layout(binding = 0) uniform uniform_buffer_object
+{
+    mat4 model;
+    mat4 view;
+    mat4 proj;
+} ubo;
+
+layout(std430, binding = 2) readonly buffer instance_buffer
+{
+    mat4 models[];
+} instances;
+
+layout(binding = 8) uniform shadow_buffer_object
+{
+    mat4 cascades[4];
+    vec4 splits;
+    vec4 texel_sizes;
+    vec4 light;
+} shadow;
+
+layout(push_constant) uniform shadow_pass
+{
+    uint cascade;
+} pass;
+
+layout(location = 0) in vec3 in_position;
+
+// Every instance casts, including ones outside the camera's view.
+void main() {
+    gl_Position = shadow.cascades[pass.cascade] * ubo.model * instances.models[gl_InstanceIndex] * vec4(in_position, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#version 450
+
+layout(binding = 0) uniform sampler2D scene_image;
+
+layout(push_constant) uniform upscale_constants
+{
+    vec2 scale;
+    vec2 source_size;
+    uint edge_aware;
+} upscale;
+
+layout(location = 0) in vec2 frag_uv;
+
+layout(location = 0) out vec4 out_color;
+
+float luma(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+void main() {
+    vec2 texel = 1.0 / upscale.source_size;
+    // Bilinear taps stay inside the rendered corner, the rest of the target holds older frames.
+    vec2 low = 0.5 * texel;
+    vec2 high = upscale.scale - 0.5 * texel;
+    vec2 uv = clamp(frag_uv * upscale.scale, low, high);
+    vec3 color = texture(scene_image, uv).rgb;
+
+    if (upscale.edge_aware == 0)
+    {
+        out_color = vec4(color, 1.0);
+        return;
+    }
+
+    // Sharpen against the cross neighbours to win back detail lost to the lower resolution, less so
+    // where the local contrast is high, and never past the neighbourhood's range, so edges do not ring.
+    vec3 north = texture(scene_image, clamp(uv - vec2(0.0, texel.y), low, high)).rgb;
+    vec3 south = texture(scene_image, clamp(uv + vec2(0.0, texel.y), low, high)).rgb;
+    vec3 west = texture(scene_image, clamp(uv - vec2(texel.x, 0.0), low, high)).rgb;
+    vec3 east = texture(scene_image, clamp(uv + vec2(texel.x, 0.0), low, high)).rgb;
+    vec3 lowest = min(color, min(min(north, south), min(west, east)));
+    vec3 highest = max(color, max(max(north, south), max(west, east)));
+    float contrast = luma(highest) - luma(lowest);
+    float amount = clamp(1.0 / upscale.scale.x - 1.0, 0.0, 1.0) * 0.5 * (1.0 - smoothstep(0.05, 0.5, contrast));
+    vec3 sharpened = color + (color - 0.25 * (north + south + west + east)) * amount * 4.0;
+
+    out_color = vec4(clamp(sharpened, lowest, highest), 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#version 450
+
+layout(location = 0) out vec2 frag_uv;
+
+// One triangle covering the screen, uv spans 0..1 over the visible part.
+void main() {
+    frag_uv = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(frag_uv * 2.0 - 1.0, 0.0, 1.0);
+}
\ No newline at end of file
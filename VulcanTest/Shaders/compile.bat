@@ -1,2 +1,18 @@
-D:\VulkanSDK\1.3.275.0\Bin\glslc.exe Source\shader.vert -o vert.spv
-D:\VulkanSDK\1.3.275.0\Bin\glslc.exe Source\shader.frag -o frag.spv
\ No newline at end of file
+"%VULKAN_SDK%\Bin\glslc.exe" Source\shader.vert -o vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\shader.frag -o frag.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\rgba_to_yuv.comp -o yuv.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\depth_pyramid.comp -o depth_pyramid.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\occlusion_cull.comp -o occlusion_cull.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\debug_lines.vert -o debug_lines_vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\debug_lines.frag -o debug_lines_frag.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\skin.comp -o skin.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\particles.comp -o particles.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\particle.vert -o particle_vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\particle.frag -o particle_frag.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\light_cull.comp -o light_cull.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\shadow.vert -o shadow_vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\upscale.vert -o upscale_vert.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\upscale.frag -o upscale_frag.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\post_tonemap.comp -o post_tonemap.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\post_fxaa.comp -o post_fxaa.spv
+"%VULKAN_SDK%\Bin\glslc.exe" Source\post_sharpen.comp -o post_sharpen.spv
@@ -0,0 +1,410 @@
+#include "asset_manager.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+uint64_t hash_content(uint32_t type, const vector<uint8_t>& bytes)
+{
+    uint64_t hash = (14695981039346656037ull ^ type) * 1099511628211ull;
+
+    for (uint8_t byte : bytes)
+    {
+        hash ^= byte;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static bool read_file(const string& path, vector<uint8_t>& bytes)
+{
+    TRACE_ZONE("read_file");
+    ifstream file(path, ios::ate | ios::binary);
+
+    if (!file.is_open())
+        return false;
+
+    bytes.resize(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+
+    return static_cast<bool>(file);
+}
+
+bool AssetManager::PendingLoad::operator<(const PendingLoad& other) const
+{
+    if (priority != other.priority)
+        return priority < other.priority;
+    return sequence > other.sequence;
+}
+
+AssetManager::AssetManager(WorkerPool& workers, uint64_t cache_bytes) : workers(workers), cache_bytes(cache_bytes)
+{
+}
+
+uint32_t AssetManager::register_loader(AssetLoader loader)
+{
+    loaders.push_back(move(loader));
+    return static_cast<uint32_t>(loaders.size() - 1);
+}
+
+AssetId AssetManager::request(uint32_t type, const string& path, int32_t priority)
+{
+    lock_guard<mutex> lock(assets_mutex);
+    auto known = assets_by_path.find(path);
+
+    stats.requests++;
+
+    if (known == assets_by_path.end())
+    {
+        AssetId asset = static_cast<AssetId>(assets.size());
+
+        assets.emplace_back();
+        assets[asset].path = path;
+        assets[asset].type = type;
+        assets[asset].refs = 1;
+        assets_by_path[path] = asset;
+        queue_load(asset, priority);
+
+        return asset;
+    }
+
+    AssetId asset = resolve_locked(known->second);
+    Asset& record = assets[asset];
+
+    if (record.state == ASSET_EVICTED)
+    {
+        record.state = ASSET_QUEUED;
+        queue_load(asset, priority);
+    }
+    else if (record.cached)
+    {
+        lru.erase(record.lru_position);
+        record.cached = false;
+        stats.cache_hits++;
+    }
+    else
+        stats.path_hits++;
+
+    record.refs++;
+    return asset;
+}
+
+void AssetManager::add_ref(AssetId asset)
+{
+    lock_guard<mutex> lock(assets_mutex);
+    Asset& record = assets[resolve_locked(asset)];
+
+    if (record.cached)
+    {
+        lru.erase(record.lru_position);
+        record.cached = false;
+    }
+    if (record.state == ASSET_EVICTED)
+    {
+        record.state = ASSET_QUEUED;
+        queue_load(resolve_locked(asset), 0);
+    }
+    record.refs++;
+}
+
+void AssetManager::release(AssetId asset)
+{
+    lock_guard<mutex> lock(assets_mutex);
+    Asset& record = assets[resolve_locked(asset)];
+
+    if (record.refs == 0)
+    {
+        cout << "Releasing asset " << record.path << " error: no references left!" << endl;
+        return;
+    }
+
+    if (--record.refs == 0 and record.state == ASSET_READY)
+    {
+        lru.push_front(resolve_locked(asset));
+        record.lru_position = lru.begin();
+        record.cached = true;
+    }
+}
+
+AssetId AssetManager::resolve(AssetId asset) const
+{
+    lock_guard<mutex> lock(assets_mutex);
+
+    return resolve_locked(asset);
+}
+
+AssetId AssetManager::resolve_locked(AssetId asset) const
+{
+    while (assets[asset].alias != INVALID_ASSET)
+        asset = assets[asset].alias;
+    return asset;
+}
+
+AssetState AssetManager::state(AssetId asset) const
+{
+    lock_guard<mutex> lock(assets_mutex);
+
+    return assets[resolve_locked(asset)].state;
+}
+
+bool AssetManager::is_ready(AssetId asset) const
+{
+    return state(asset) == ASSET_READY;
+}
+
+void AssetManager::queue_load(AssetId asset, int32_t priority)
+{
+    pending_loads.push_back({ priority, next_sequence++, asset });
+    push_heap(pending_loads.begin(), pending_loads.end());
+    loads_in_flight++;
+
+    workers.submit([this]() { load_next(); });
+}
+
+void AssetManager::load_next()
+{
+    TRACE_ZONE("load_asset");
+    AssetId asset;
+    string path;
+    uint32_t type;
+    vector<uint8_t> bytes;
+    vector<uint8_t> candidate_bytes;
+    shared_ptr<void> data;
+    uint64_t content_hash;
+    AssetId candidate = INVALID_ASSET;
+    string candidate_path;
+
+    {
+        lock_guard<mutex> lock(assets_mutex);
+
+        pop_heap(pending_loads.begin(), pending_loads.end());
+        asset = pending_loads.back().asset;
+        pending_loads.pop_back();
+        path = assets[asset].path;
+        type = assets[asset].type;
+    }
+
+    bool file_read = read_file(path, bytes);
+    content_hash = hash_content(type, bytes);
+
+    {
+        lock_guard<mutex> lock(assets_mutex);
+        auto same_content = file_read ? assets_by_content.find(content_hash) : assets_by_content.end();
+
+        if (same_content != assets_by_content.end() and same_content->second != asset and assets[same_content->second].type == type)
+        {
+            candidate = same_content->second;
+            candidate_path = assets[candidate].path;
+        }
+    }
+
+    // A matching hash only nominates a candidate; its file is read again and compared byte for byte.
+    if (candidate != INVALID_ASSET and !(read_file(candidate_path, candidate_bytes) and candidate_bytes == bytes))
+        candidate = INVALID_ASSET;
+
+    {
+        lock_guard<mutex> lock(assets_mutex);
+        auto same_content = candidate != INVALID_ASSET ? assets_by_content.find(content_hash) : assets_by_content.end();
+
+        if (same_content != assets_by_content.end() and same_content->second == candidate)
+        {
+            AssetId target = candidate;
+
+            assets[asset].alias = target;
+            assets[target].refs += assets[asset].refs;
+            assets[asset].refs = 0;
+            if (assets[target].cached and assets[target].refs > 0)
+            {
+                lru.erase(assets[target].lru_position);
+                assets[target].cached = false;
+            }
+
+            stats.content_hits++;
+            loads_in_flight--;
+            loads_changed.notify_all();
+            return;
+        }
+
+        if (file_read)
+        {
+            assets[asset].content_hash = content_hash;
+            assets_by_content[content_hash] = asset;
+        }
+    }
+
+    if (file_read)
+        data = loaders[type].decode(path, bytes);
+
+    lock_guard<mutex> lock(assets_mutex);
+
+    if (data)
+    {
+        assets[asset].data = move(data);
+        assets[asset].state = ASSET_DECODED;
+        decoded_assets.push_back(asset);
+        stats.loads++;
+    }
+    else
+    {
+        cout << "Loading asset " << path << " error!" << endl;
+        assets[asset].state = ASSET_FAILED;
+        if (file_read)
+            assets_by_content.erase(content_hash);
+        stats.failures++;
+    }
+
+    loads_in_flight--;
+    loads_changed.notify_all();
+}
+
+void AssetManager::update()
+{
+    TRACE_ZONE("update_assets");
+    vector<AssetId> ready;
+
+    {
+        lock_guard<mutex> lock(assets_mutex);
+        ready.swap(decoded_assets);
+    }
+
+    for (AssetId asset : ready)
+    {
+        shared_ptr<void> data;
+        uint32_t type;
+
+        {
+            lock_guard<mutex> lock(assets_mutex);
+            data = move(assets[asset].data);
+            type = assets[asset].type;
+        }
+
+        uint64_t bytes = loaders[type].create(asset, data);
+
+        lock_guard<mutex> lock(assets_mutex);
+        Asset& record = assets[asset];
+
+        record.bytes = bytes;
+        record.state = ASSET_READY;
+        resident += bytes;
+
+        if (record.refs == 0)
+        {
+            lru.push_front(asset);
+            record.lru_position = lru.begin();
+            record.cached = true;
+        }
+    }
+
+    uint64_t excess;
+    {
+        lock_guard<mutex> lock(assets_mutex);
+        excess = resident > cache_bytes ? resident - cache_bytes : 0;
+    }
+    if (excess > 0)
+        trim(excess);
+}
+
+void AssetManager::wait_all()
+{
+    unique_lock<mutex> lock(assets_mutex);
+
+    loads_changed.wait(lock, [this]() { return loads_in_flight == 0; });
+}
+
+void AssetManager::wait_decoded(AssetId asset)
+{
+    unique_lock<mutex> lock(assets_mutex);
+
+    loads_changed.wait(lock, [this, asset]() { return assets[resolve_locked(asset)].state != ASSET_QUEUED; });
+}
+
+void AssetManager::evict(AssetId asset)
+{
+    Asset& record = assets[asset];
+
+    lru.erase(record.lru_position);
+    record.cached = false;
+    record.state = ASSET_EVICTED;
+    resident -= record.bytes;
+    record.bytes = 0;
+
+    auto same_content = assets_by_content.find(record.content_hash);
+    if (same_content != assets_by_content.end() and same_content->second == asset)
+        assets_by_content.erase(same_content);
+
+    stats.evictions++;
+}
+
+void AssetManager::trim(uint64_t bytes)
+{
+    vector<pair<AssetId, uint32_t>> victims;
+    uint64_t freed = 0;
+
+    {
+        lock_guard<mutex> lock(assets_mutex);
+
+        while (freed < bytes and !lru.empty())
+        {
+            AssetId asset = lru.back();
+
+            freed += assets[asset].bytes;
+            victims.push_back({ asset, assets[asset].type });
+            evict(asset);
+        }
+    }
+
+    for (const auto& [asset, type] : victims)
+        loaders[type].destroy(asset);
+}
+
+void AssetManager::destroy_all()
+{
+    vector<pair<AssetId, uint32_t>> victims;
+
+    wait_all();
+
+    {
+        lock_guard<mutex> lock(assets_mutex);
+
+        for (AssetId asset = 0; asset < assets.size(); asset++)
+        {
+            Asset& record = assets[asset];
+
+            if (record.state == ASSET_READY)
+                victims.push_back({ asset, record.type });
+
+            record.data.reset();
+            record.state = ASSET_EVICTED;
+            record.cached = false;
+            record.bytes = 0;
+        }
+        decoded_assets.clear();
+        assets_by_content.clear();
+        lru.clear();
+        resident = 0;
+    }
+
+    for (const auto& [asset, type] : victims)
+        loaders[type].destroy(asset);
+}
+
+uint64_t AssetManager::resident_bytes() const
+{
+    lock_guard<mutex> lock(assets_mutex);
+
+    return resident;
+}
+
+void AssetManager::print_stats() const
+{
+    lock_guard<mutex> lock(assets_mutex);
+
+    cout << "Assets: " << stats.requests << " requests, " << stats.loads << " loads, "
+        << stats.path_hits << " path hits, " << stats.content_hits << " content hits, "
+        << stats.cache_hits << " cache hits, " << stats.evictions << " evictions, "
+        << stats.failures << " failures, " << resident / (1024 * 1024) << " MB resident" << endl;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "worker_pool.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t AssetId;
+const AssetId INVALID_ASSET = UINT32_MAX;
+
+enum AssetState : uint32_t
+{
+    ASSET_QUEUED,
+    ASSET_DECODED,
+    ASSET_READY,
+    ASSET_EVICTED,
+    ASSET_FAILED
+};
+
+struct AssetLoader
+{
+    // Worker thread: turns the file contents into CPU-side data, null on failure.
+    std::function<std::shared_ptr<void>(const std::string& path, const std::vector<uint8_t>& bytes)> decode;
+    // Main thread: creates GPU resources for the asset and returns the bytes they occupy.
+    std::function<uint64_t(AssetId asset, const std::shared_ptr<void>& data)> create;
+    // Main thread: releases the GPU resources created for the asset.
+    std::function<void(AssetId asset)> destroy;
+};
+
+struct AssetStats
+{
+    uint64_t requests = 0;
+    uint64_t loads = 0;
+    uint64_t path_hits = 0;
+    uint64_t content_hits = 0;
+    uint64_t cache_hits = 0;
+    uint64_t evictions = 0;
+    uint64_t failures = 0;
+};
+
+// Seeded with the loader type, so a mesh and a texture with the same bytes never share a key.
+uint64_t hash_content(uint32_t type, const std::vector<uint8_t>& bytes);
+
+// Loads assets by path on the worker pool. Files with identical contents share one
+// asset, references keep assets resident, and released assets stay cached in LRU
+// order until the resident total exceeds the cache limit.
+class AssetManager
+{
+public:
+    AssetManager(WorkerPool& workers, uint64_t cache_bytes);
+
+    uint32_t register_loader(AssetLoader loader);
+
+    // Returns a referenced handle; higher priority loads are decoded first.
+    AssetId request(uint32_t type, const std::string& path, int32_t priority = 0);
+    void add_ref(AssetId asset);
+    void release(AssetId asset);
+
+    // Handles to files whose contents matched an earlier load resolve to that asset.
+    AssetId resolve(AssetId asset) const;
+    AssetState state(AssetId asset) const;
+    bool is_ready(AssetId asset) const;
+
+    // Main thread: creates GPU resources for decoded assets and evicts past the cache limit.
+    void update();
+    void wait_all();
+    // Blocks until the asset has left the load queue: decoded, ready or failed.
+    void wait_decoded(AssetId asset);
+    void trim(uint64_t bytes);
+    void destroy_all();
+
+    uint64_t resident_bytes() const;
+    void print_stats() const;
+
+private:
+    struct Asset
+    {
+        std::string path;
+        uint32_t type = 0;
+        AssetState state = ASSET_QUEUED;
+        AssetId alias = INVALID_ASSET;
+        uint64_t content_hash = 0;
+        uint32_t refs = 0;
+        uint64_t bytes = 0;
+        std::shared_ptr<void> data;
+        bool cached = false;
+        std::list<AssetId>::iterator lru_position;
+    };
+
+    struct PendingLoad
+    {
+        int32_t priority;
+        uint64_t sequence;
+        AssetId asset;
+
+        bool operator<(const PendingLoad& other) const;
+    };
+
+    WorkerPool& workers;
+    uint64_t cache_bytes;
+    std::vector<AssetLoader> loaders;
+
+    mutable std::mutex assets_mutex;
+    std::condition_variable loads_changed;
+    std::vector<Asset> assets;
+    std::unordered_map<std::string, AssetId> assets_by_path;
+    std::unordered_map<uint64_t, AssetId> assets_by_content;
+    std::vector<PendingLoad> pending_loads;
+    std::vector<AssetId> decoded_assets;
+    std::list<AssetId> lru;
+    uint64_t next_sequence = 0;
+    uint32_t loads_in_flight = 0;
+    uint64_t resident = 0;
+    AssetStats stats;
+
+    AssetId resolve_locked(AssetId asset) const;
+    void queue_load(AssetId asset, int32_t priority);
+    void load_next();
+    void evict(AssetId asset);
+};
@@ -0,0 +1,78 @@
+#include "batch_manifest.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static string file_stem(const string& path)
+{
+    size_t name_start = path.find_last_of("/\\") + 1;
+    size_t extension = path.find_last_of('.');
+
+    if (extension == string::npos or extension < name_start)
+        extension = path.size();
+    return path.substr(name_start, extension - name_start);
+}
+
+static bool parse_float(const string& text, float& value)
+{
+    char* end = nullptr;
+
+    value = strtof(text.c_str(), &end);
+    return end != text.c_str() and *end == '\0';
+}
+
+bool load_batch_manifest(const string& path, vector<BatchJob>& jobs)
+{
+    ifstream file(path);
+    string line;
+    uint32_t line_number = 0;
+
+    if (!file.is_open())
+    {
+        cout << "Opening batch manifest " << path << " error!" << endl;
+        return false;
+    }
+
+    while (getline(file, line))
+    {
+        istringstream fields(line.substr(0, line.find('#')));
+        BatchJob job;
+
+        line_number++;
+        if (!(fields >> job.model_path))
+            continue;
+
+        if (!(fields >> job.texture_path))
+        {
+            cout << "Batch manifest line " << line_number << " needs a model and a texture" << endl;
+            continue;
+        }
+
+        // The camera is all or nothing: an output name in its place would read as a zero yaw.
+        vector<string> extra;
+        string field;
+        while (fields >> field)
+            extra.push_back(field);
+
+        if (extra.size() == 1 or extra.size() == 2 or extra.size() > 4)
+        {
+            cout << "Batch manifest line " << line_number << " needs yaw, pitch and distance before the output name" << endl;
+            continue;
+        }
+        if (extra.size() >= 3 and (!parse_float(extra[0], job.yaw) or !parse_float(extra[1], job.pitch) or !parse_float(extra[2], job.distance)))
+        {
+            cout << "Batch manifest line " << line_number << " has a camera that is not three numbers" << endl;
+            continue;
+        }
+        job.output_name = extra.size() == 4 ? extra[3] : file_stem(job.model_path);
+
+        jobs.push_back(job);
+    }
+
+    cout << "Loaded " << jobs.size() << " batch jobs from " << path << endl;
+    return !jobs.empty();
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct BatchJob
+{
+    std::string model_path;
+    std::string texture_path;
+    // Camera orbit around the model's bounding sphere; distance is in radii.
+    float yaw = 45.0f;
+    float pitch = 30.0f;
+    float distance = 2.5f;
+    // Output file name without extension, defaults to the model file name.
+    std::string output_name;
+};
+
+// One job per line: model texture [yaw pitch distance [output]], '#' starts a comment.
+bool load_batch_manifest(const std::string& path, std::vector<BatchJob>& jobs);
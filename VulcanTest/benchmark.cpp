@@ -0,0 +1,776 @@
+#include "benchmark.h"
+#include "bvh.h"
+#include "mesh_attributes.h"
+#include "trace.h"
+#include "transform_store.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+static vector<BenchmarkScene> make_benchmark_scenes()
+{
+    return
+    {
+        { "orbit",
+            { { 0.0f, { 2.0f, 2.0f, 2.0f }, { 0.0f, 0.0f, 0.0f } },
+              { 4.0f, { -2.0f, 2.0f, 2.0f }, { 0.0f, 0.0f, 0.0f } },
+              { 8.0f, { -2.0f, -2.0f, 2.0f }, { 0.0f, 0.0f, 0.0f } },
+              { 12.0f, { 2.0f, 2.0f, 2.0f }, { 0.0f, 0.0f, 0.0f } } },
+            { 0.0f, 0.0f, 1.0f }, 30.0f },
+        { "close_up",
+            { { 0.0f, { 0.6f, 0.6f, 0.6f }, { 0.0f, 0.0f, 0.0f } },
+              { 10.0f, { 0.3f, 0.9f, 0.4f }, { 0.0f, 0.0f, 0.1f } } },
+            { 1.0f, 0.0f, 0.0f }, 90.0f },
+        { "fly_through",
+            { { 0.0f, { 4.0f, 0.0f, 0.5f }, { 0.0f, 0.0f, 0.0f } },
+              { 5.0f, { 0.2f, 0.0f, 0.1f }, { -1.0f, 0.0f, 0.0f } },
+              { 10.0f, { -4.0f, 0.0f, 0.5f }, { 0.0f, 0.0f, 0.0f } } },
+            { 0.0f, 1.0f, 0.0f }, 45.0f }
+    };
+}
+
+static CameraKey sample_camera_path(const vector<CameraKey>& path, float time)
+{
+    if (time <= path.front().time)
+        return path.front();
+
+    for (size_t key = 1; key < path.size(); key++)
+    {
+        if (time <= path[key].time)
+        {
+            const CameraKey& from = path[key - 1];
+            const CameraKey& to = path[key];
+            float blend = (time - from.time) / (to.time - from.time);
+
+            return { time, glm::mix(from.eye, to.eye, blend), glm::mix(from.target, to.target, blend) };
+        }
+    }
+    return path.back();
+}
+
+TimingSummary summarize_timings(vector<double> samples)
+{
+    TimingSummary summary{};
+    double total = 0.0;
+
+    if (samples.empty())
+        return summary;
+
+    sort(samples.begin(), samples.end());
+
+    auto percentile = [&samples](double fraction)
+    {
+        size_t rank = static_cast<size_t>(ceil(fraction * samples.size()));
+        return samples[min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+    };
+
+    for (double sample : samples)
+        total += sample;
+
+    summary.mean = total / samples.size();
+    summary.p50 = percentile(0.50);
+    summary.p95 = percentile(0.95);
+    summary.p99 = percentile(0.99);
+    summary.max = samples.back();
+
+    return summary;
+}
+
+BenchmarkRunner::BenchmarkRunner(uint32_t warmup_frames, uint32_t measured_frames)
+    : warmup_frames(warmup_frames), measured_frames(measured_frames), scenes(make_benchmark_scenes())
+{
+    start_scene();
+}
+
+bool BenchmarkRunner::finished() const
+{
+    return scene_index >= scenes.size();
+}
+
+const BenchmarkScene& BenchmarkRunner::scene() const
+{
+    return scenes[min(scene_index, scenes.size() - 1)];
+}
+
+float BenchmarkRunner::scene_time() const
+{
+    return scene_frame * frame_delta;
+}
+
+glm::mat4 BenchmarkRunner::model_matrix() const
+{
+    return glm::rotate(glm::mat4(1.0f), scene_time() * glm::radians(scene().spin_degrees_per_second), scene().spin_axis);
+}
+
+glm::mat4 BenchmarkRunner::view_matrix() const
+{
+    CameraKey camera = sample_camera_path(scene().camera_path, scene_time());
+
+    return glm::lookAt(camera.eye, camera.target, glm::vec3(0.0f, 0.0f, 1.0f));
+}
+
+void BenchmarkRunner::record_frame(double cpu_ms, double gpu_ms)
+{
+    if (finished())
+        return;
+
+    if (scene_frame >= warmup_frames)
+    {
+        cpu_samples.push_back(cpu_ms);
+        if (gpu_ms >= 0.0)
+            gpu_samples.push_back(gpu_ms);
+    }
+
+    scene_frame++;
+    if (scene_frame == warmup_frames)
+        measure_start = chrono::steady_clock::now();
+    if (scene_frame >= warmup_frames + measured_frames)
+        finish_scene();
+}
+
+// The clock starts once the last warm-up frame is recorded, or with the scene when there is no warm-up.
+void BenchmarkRunner::start_scene()
+{
+    scene_frame = 0;
+    measure_start = chrono::steady_clock::now();
+}
+
+void BenchmarkRunner::finish_scene()
+{
+    SceneResult result{};
+    double wall_seconds = chrono::duration<double>(chrono::steady_clock::now() - measure_start).count();
+
+    result.name = scenes[scene_index].name;
+    result.frames = static_cast<uint32_t>(cpu_samples.size());
+    result.throughput_fps = wall_seconds > 0.0 ? result.frames / wall_seconds : 0.0;
+    result.cpu_ms = summarize_timings(cpu_samples);
+    result.gpu_ms = summarize_timings(gpu_samples);
+    results.push_back(result);
+
+    cpu_samples.clear();
+    gpu_samples.clear();
+    scene_index++;
+    start_scene();
+}
+
+void BenchmarkRunner::print_results() const
+{
+    for (const SceneResult& result : results)
+    {
+        cout << result.name << ": " << result.throughput_fps << " fps"
+            << ", cpu p50/p95/p99/max " << result.cpu_ms.p50 << "/" << result.cpu_ms.p95 << "/" << result.cpu_ms.p99 << "/" << result.cpu_ms.max << " ms"
+            << ", gpu p50/p95/p99/max " << result.gpu_ms.p50 << "/" << result.gpu_ms.p95 << "/" << result.gpu_ms.p99 << "/" << result.gpu_ms.max << " ms" << endl;
+    }
+}
+
+static void write_summary(ofstream& file, const char* name, const TimingSummary& summary)
+{
+    file << "      \"" << name << "\": { \"mean\": " << summary.mean << ", \"p50\": " << summary.p50
+        << ", \"p95\": " << summary.p95 << ", \"p99\": " << summary.p99 << ", \"max\": " << summary.max << " }";
+}
+
+static string escape_json(const string& text)
+{
+    string escaped;
+
+    for (char symbol : text)
+    {
+        if (symbol == '"' or symbol == '\\')
+            escaped += '\\';
+        escaped += symbol;
+    }
+    return escaped;
+}
+
+bool BenchmarkRunner::write_json(const string& path, const string& device_name, const string& configuration) const
+{
+    ofstream file(path);
+
+    if (!file)
+    {
+        cout << "Opening benchmark output " << path << " error!" << endl;
+        return false;
+    }
+
+    file << "{\n";
+    file << "  \"device\": \"" << escape_json(device_name) << "\",\n";
+    file << "  \"configuration\": \"" << escape_json(configuration) << "\",\n";
+    file << "  \"warmup_frames\": " << warmup_frames << ",\n";
+    file << "  \"measured_frames\": " << measured_frames << ",\n";
+    file << "  \"scenes\": [\n";
+
+    for (size_t result_index = 0; result_index < results.size(); result_index++)
+    {
+        const SceneResult& result = results[result_index];
+
+        file << "    {\n";
+        file << "      \"name\": \"" << escape_json(result.name) << "\",\n";
+        file << "      \"frames\": " << result.frames << ",\n";
+        file << "      \"throughput_fps\": " << result.throughput_fps << ",\n";
+        write_summary(file, "cpu_ms", result.cpu_ms);
+        file << ",\n";
+        write_summary(file, "gpu_ms", result.gpu_ms);
+        file << "\n    }" << (result_index + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    file << "  ]\n}\n";
+    cout << "Benchmark results written to " << path << endl;
+    return true;
+}
+
+static size_t find_string_end(const string& text, size_t quote)
+{
+    size_t position = quote + 1;
+
+    while (position < text.size() and text[position] != '"')
+        position += text[position] == '\\' ? 2 : 1;
+    return min(position, text.size());
+}
+
+// Reads back the file produced by write_json: scene name -> "cpu_ms.p95" style keys.
+static map<string, map<string, double>> read_baseline(const string& path)
+{
+    map<string, map<string, double>> baseline;
+    ifstream file(path);
+    stringstream buffer;
+    string text, scene, group;
+    size_t position = 0;
+
+    buffer << file.rdbuf();
+    text = buffer.str();
+
+    while (position < text.size())
+    {
+        if (text[position] == '"')
+        {
+            size_t end = find_string_end(text, position);
+            string token = text.substr(position + 1, end - position - 1);
+            size_t value_start = text.find_first_not_of(" \t\r\n:", end + 1);
+
+            position = end + 1;
+            if (value_start == string::npos)
+                break;
+
+            if (text[value_start] == '"')
+            {
+                size_t value_end = find_string_end(text, value_start);
+
+                if (token == "name")
+                    scene = text.substr(value_start + 1, value_end - value_start - 1);
+                position = value_end + 1;
+            }
+            else if (text[value_start] == '{')
+                group = token;
+            else if (isdigit(static_cast<unsigned char>(text[value_start])) or text[value_start] == '-')
+                baseline[scene][group.empty() ? token : group + "." + token] = atof(text.c_str() + value_start);
+            continue;
+        }
+
+        if (text[position] == '}')
+            group.clear();
+        position++;
+    }
+    return baseline;
+}
+
+bool BenchmarkRunner::compare_with_baseline(const string& path, double tolerance) const
+{
+    map<string, map<string, double>> baseline = read_baseline(path);
+    bool passed = true;
+
+    if (baseline.empty())
+    {
+        cout << "Reading benchmark baseline " << path << " error!" << endl;
+        return false;
+    }
+
+    for (const SceneResult& result : results)
+    {
+        auto scene = baseline.find(result.name);
+        map<string, double> current =
+        {
+            { "cpu_ms.p50", result.cpu_ms.p50 }, { "cpu_ms.p95", result.cpu_ms.p95 }, { "cpu_ms.p99", result.cpu_ms.p99 },
+            { "gpu_ms.p50", result.gpu_ms.p50 }, { "gpu_ms.p95", result.gpu_ms.p95 }, { "gpu_ms.p99", result.gpu_ms.p99 }
+        };
+
+        if (scene == baseline.end())
+        {
+            cout << result.name << ": no baseline" << endl;
+            continue;
+        }
+
+        for (const auto& [metric, value] : current)
+        {
+            auto reference = scene->second.find(metric);
+
+            if (reference == scene->second.end() or reference->second <= 0.0)
+                continue;
+
+            if (value > reference->second * (1.0 + tolerance))
+            {
+                cout << result.name << " " << metric << " regressed: " << value << " ms vs baseline " << reference->second << " ms" << endl;
+                passed = false;
+            }
+        }
+
+        auto reference_fps = scene->second.find("throughput_fps");
+        if (reference_fps != scene->second.end() and result.throughput_fps < reference_fps->second * (1.0 - tolerance))
+        {
+            cout << result.name << " throughput regressed: " << result.throughput_fps << " fps vs baseline " << reference_fps->second << " fps" << endl;
+            passed = false;
+        }
+    }
+
+    cout << (passed ? "Benchmark within tolerance of baseline" : "Benchmark regressed against baseline") << endl;
+    return passed;
+}
+
+template <typename Function>
+static double time_ms(uint32_t iterations, Function function)
+{
+    auto start = chrono::steady_clock::now();
+
+    for (uint32_t iteration = 0; iteration < iterations; iteration++)
+        function();
+
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() / iterations;
+}
+
+void run_transform_benchmark()
+{
+    const uint32_t branching = 8;
+
+    for (uint32_t node_count : { 10000u, 100000u, 1000000u })
+    {
+        mt19937 random(42);
+        uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+        TransformStore store;
+        vector<glm::vec3> translations(node_count);
+        vector<glm::quat> rotations(node_count);
+        vector<glm::mat4> reference(node_count);
+        vector<glm::mat4> output(node_count);
+        uint32_t iterations = max(3u, 2000000u / node_count);
+        uint32_t recomputed = 0;
+        float max_error = 0.0f;
+
+        store.reserve(node_count);
+        for (uint32_t node = 0; node < node_count; node++)
+        {
+            glm::vec3 axis = glm::normalize(glm::vec3(distribution(random), distribution(random), 1.0f));
+
+            translations[node] = glm::vec3(distribution(random), distribution(random), distribution(random));
+            rotations[node] = glm::angleAxis(distribution(random) * 3.14159265f, axis);
+            store.add_node(node == 0 ? TransformStore::NO_PARENT : static_cast<int32_t>((node - 1) / branching),
+                translations[node], rotations[node], glm::vec3(1.0f));
+        }
+
+        double full_ms = time_ms(iterations, [&]()
+            {
+                store.mark_all_dirty();
+                store.update(output.data());
+            });
+
+        double partial_ms = time_ms(iterations, [&]()
+            {
+                for (uint32_t change = 0; change < node_count / 100; change++)
+                {
+                    uint32_t node = random() % node_count;
+                    store.set_rotation(node, rotations[node]);
+                }
+                recomputed = store.update(output.data());
+            });
+
+        double clean_ms = time_ms(iterations, [&]() { store.update(output.data()); });
+
+        double reference_ms = time_ms(iterations, [&]()
+            {
+                for (uint32_t node = 0; node < node_count; node++)
+                {
+                    glm::mat4 local = glm::translate(glm::mat4(1.0f), translations[node]) * glm::mat4_cast(rotations[node]);
+                    reference[node] = node == 0 ? local : reference[(node - 1) / branching] * local;
+                }
+            });
+
+        for (uint32_t node = 0; node < node_count; node++)
+            for (int column = 0; column < 4; column++)
+                for (int row = 0; row < 4; row++)
+                    max_error = max(max_error, abs(reference[node][column][row] - output[node][column][row]));
+
+        cout << "transforms " << node_count << ": full " << full_ms << " ms (" << full_ms * 1e6 / node_count << " ns/node)"
+            << ", 1% dirty " << partial_ms << " ms (" << recomputed << " recomputed)"
+            << ", clean " << clean_ms << " ms"
+            << ", glm reference " << reference_ms << " ms"
+            << ", max error " << max_error << endl;
+    }
+}
+
+// Unwelded torus triangle list. The last column and row repeat the first positions with other
+// texture coordinates, so the welding has seams to split along, like any UV-mapped closed mesh.
+static void add_torus(uint32_t segments, uint32_t rings, MeshStreams& mesh, vector<glm::vec3>& normals, vector<glm::vec3>& tangents)
+{
+    const float major_radius = 1.0f;
+    const float minor_radius = 0.35f;
+    const float two_pi = 6.28318531f;
+    const uint32_t quad_corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+
+    for (uint32_t segment = 0; segment < segments; segment++)
+    {
+        for (uint32_t ring = 0; ring < rings; ring++)
+        {
+            for (const uint32_t* offset : quad_corners)
+            {
+                uint32_t column = segment + offset[0];
+                uint32_t row = ring + offset[1];
+                float u = two_pi * (column % segments) / segments;
+                float v = two_pi * (row % rings) / rings;
+                glm::vec3 normal(cos(v) * cos(u), cos(v) * sin(u), sin(v));
+
+                mesh.positions.push_back(glm::vec3(cos(u), sin(u), 0.0f) * major_radius + normal * minor_radius);
+                mesh.tex_coords.push_back(glm::vec2(static_cast<float>(column) / segments, static_cast<float>(row) / rings));
+                normals.push_back(normal);
+                tangents.push_back(glm::vec3(-sin(u), cos(u), 0.0f));
+            }
+        }
+    }
+}
+
+void run_mesh_attribute_benchmark()
+{
+    WorkerPool workers;
+
+    for (uint32_t segments : { 256u, 512u, 1024u })
+    {
+        MeshStreams mesh;
+        vector<glm::vec3> normals;
+        vector<glm::vec3> tangents;
+        MeshAttributeSettings serial;
+        MeshAttributeSettings parallel;
+        MeshAttributeStats stats;
+        float max_normal_error = 0.0f;
+        float max_tangent_error = 0.0f;
+
+        add_torus(segments, segments / 2, mesh, normals, tangents);
+
+        uint32_t triangle_count = static_cast<uint32_t>(mesh.positions.size() / 3);
+        uint32_t iterations = max(3u, 2000000u / triangle_count);
+
+        // One chunk covering the whole mesh never leaves the calling thread.
+        serial.grain = triangle_count;
+        mesh.missing_normals.assign(triangle_count, 1);
+
+        double serial_ms = time_ms(iterations, [&]() { stats = generate_mesh_attributes(mesh, serial, workers); });
+        double parallel_ms = time_ms(iterations, [&]() { stats = generate_mesh_attributes(mesh, parallel, workers); });
+
+        for (size_t corner = 0; corner < mesh.positions.size(); corner++)
+        {
+            max_normal_error = max(max_normal_error, acos(min(glm::dot(mesh.normals[corner], normals[corner]), 1.0f)));
+            max_tangent_error = max(max_tangent_error, acos(min(glm::dot(glm::vec3(mesh.tangents[corner]), tangents[corner]), 1.0f)));
+        }
+
+        cout << "mesh attributes " << triangle_count << " triangles: 1 thread " << serial_ms << " ms"
+            << ", " << workers.size() + 1 << " threads " << parallel_ms << " ms (" << triangle_count / parallel_ms / 1000.0 << " Mtri/s, "
+            << serial_ms / parallel_ms << "x)"
+            << ", " << stats.welded_positions << " positions, " << stats.fallback_tangents << " fallback tangents"
+            << ", max error normal " << max_normal_error * 57.2957795f << " deg, tangent " << max_tangent_error * 57.2957795f << " deg" << endl;
+    }
+}
+
+static bool outside_frustum(const Frustum& frustum, const Aabb& box)
+{
+    for (const glm::vec4& plane : frustum.planes)
+    {
+        glm::vec3 corner(plane.x > 0.0f ? box.max.x : box.min.x, plane.y > 0.0f ? box.max.y : box.min.y, plane.z > 0.0f ? box.max.z : box.min.z);
+
+        if (glm::dot(glm::vec3(plane), corner) + plane.w < 0.0f)
+            return true;
+    }
+    return false;
+}
+
+// Entry distance, or -1 when the ray misses the box.
+static float ray_box_distance(const Ray& ray, const Aabb& box)
+{
+    float entry_t = 0.0f;
+    float exit_t = ray.t_max;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float t0 = (box.min[axis] - ray.origin[axis]) / ray.direction[axis];
+        float t1 = (box.max[axis] - ray.origin[axis]) / ray.direction[axis];
+
+        entry_t = max(entry_t, min(t0, t1));
+        exit_t = min(exit_t, max(t0, t1));
+    }
+    return entry_t <= exit_t ? entry_t : -1.0f;
+}
+
+static void run_scene_bvh_benchmark(uint32_t object_count)
+{
+    mt19937 random(7);
+    uniform_real_distribution<float> coordinate(-100.0f, 100.0f);
+    uniform_real_distribution<float> half_size(0.25f, 1.0f);
+    uniform_real_distribution<float> nudge(-0.5f, 0.5f);
+    vector<Aabb> bounds(object_count);
+    vector<Ray> rays(1000);
+    vector<uint32_t> visible;
+    vector<uint32_t> reference;
+    SceneBvh bvh;
+    uint32_t iterations = max(3u, 1000000u / object_count);
+    uint32_t refitted = 0;
+    uint32_t hits = 0;
+    uint32_t mismatches = 0;
+    glm::vec3 eye(0.0f, -120.0f, 20.0f);
+    Frustum frustum = frustum_from_matrix(glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 150.0f)
+        * glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, 1.0f)));
+
+    for (Aabb& box : bounds)
+    {
+        glm::vec3 center(coordinate(random), coordinate(random), coordinate(random));
+        glm::vec3 half(half_size(random));
+
+        box.min = center - half;
+        box.max = center + half;
+    }
+    for (Ray& ray : rays)
+    {
+        ray.origin = eye;
+        ray.direction = glm::normalize(glm::vec3(coordinate(random), coordinate(random), coordinate(random)) - eye);
+    }
+
+    auto brute_force_cull = [&]()
+        {
+            reference.clear();
+            for (uint32_t object = 0; object < object_count; object++)
+                if (!outside_frustum(frustum, bounds[object]))
+                    reference.push_back(object);
+        };
+    auto check_cull = [&]()
+        {
+            visible.clear();
+            bvh.cull(frustum, visible);
+            brute_force_cull();
+            sort(visible.begin(), visible.end());
+            mismatches += visible == reference ? 0 : 1;
+        };
+
+    double build_ms = time_ms(3, [&]() { bvh.build(bounds); });
+    double cull_ms = time_ms(iterations, [&]()
+        {
+            visible.clear();
+            bvh.cull(frustum, visible);
+        });
+    double brute_force_ms = time_ms(iterations, brute_force_cull);
+
+    check_cull();
+
+    // Every refit, 1% of the objects move a little.
+    double refit_ms = time_ms(iterations, [&]()
+        {
+            for (uint32_t change = 0; change < object_count / 100; change++)
+            {
+                uint32_t object = random() % object_count;
+                glm::vec3 offset(nudge(random), nudge(random), nudge(random));
+
+                bounds[object].min = bounds[object].min + offset;
+                bounds[object].max = bounds[object].max + offset;
+                bvh.update(object, bounds[object]);
+            }
+            refitted = bvh.refit();
+        });
+
+    check_cull();
+
+    auto object_hit = [&](uint32_t object, const Ray& ray) { return ray_box_distance(ray, bounds[object]); };
+    double ray_ms = time_ms(iterations, [&]()
+        {
+            hits = 0;
+            for (const Ray& ray : rays)
+            {
+                uint32_t object;
+                float t;
+
+                hits += bvh.intersect(ray, object_hit, object, t) ? 1 : 0;
+            }
+        });
+
+    for (uint32_t ray_index = 0; ray_index < 32; ray_index++)
+    {
+        uint32_t object = UINT32_MAX;
+        uint32_t closest = UINT32_MAX;
+        float t = FLT_MAX;
+        float closest_t = FLT_MAX;
+
+        bvh.intersect(rays[ray_index], object_hit, object, t);
+        for (uint32_t candidate = 0; candidate < object_count; candidate++)
+        {
+            float distance = ray_box_distance(rays[ray_index], bounds[candidate]);
+
+            if (distance >= 0.0f and distance < closest_t)
+            {
+                closest_t = distance;
+                closest = candidate;
+            }
+        }
+        mismatches += object == closest ? 0 : 1;
+    }
+
+    cout << "scene bvh " << object_count << " objects, " << bvh.node_count() << " nodes: build " << build_ms << " ms"
+        << ", frustum query " << cull_ms * 1000.0 << " us (brute force " << brute_force_ms * 1000.0 << " us, " << visible.size() << " visible)"
+        << ", refit 1% " << refit_ms * 1000.0 << " us (" << refitted << " nodes, SAH cost " << bvh.degradation() << "x)"
+        << ", ray " << ray_ms * 1000.0 / rays.size() << " us (" << hits << "/" << rays.size() << " hit)"
+        << ", " << mismatches << " mismatches" << endl;
+}
+
+static void run_triangle_bvh_benchmark(uint32_t segments)
+{
+    mt19937 random(11);
+    uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+    MeshStreams mesh;
+    vector<glm::vec3> normals;
+    vector<glm::vec3> tangents;
+    vector<uint32_t> indices;
+    vector<Ray> rays(10000);
+    TriangleBvh bvh;
+    uint32_t hits = 0;
+    uint32_t mismatches = 0;
+
+    add_torus(segments, segments / 2, mesh, normals, tangents);
+    indices.resize(mesh.positions.size());
+    iota(indices.begin(), indices.end(), 0u);
+
+    // From a shell around the torus toward points inside its bounds, so most rays hit.
+    for (Ray& ray : rays)
+    {
+        glm::vec3 target(distribution(random) * 1.35f, distribution(random) * 1.35f, distribution(random) * 0.35f);
+
+        ray.origin = glm::normalize(glm::vec3(distribution(random), distribution(random), distribution(random))) * 3.0f;
+        ray.direction = glm::normalize(target - ray.origin);
+    }
+
+    double build_ms = time_ms(1, [&]() { bvh.build(mesh.positions, indices); });
+    double ray_ms = time_ms(3, [&]()
+        {
+            hits = 0;
+            for (const Ray& ray : rays)
+            {
+                TriangleHit hit;
+
+                hits += bvh.intersect(ray, hit) ? 1 : 0;
+            }
+        });
+
+    double brute_force_ms = time_ms(1, [&]()
+        {
+            for (uint32_t ray_index = 0; ray_index < 16; ray_index++)
+            {
+                const Ray& ray = rays[ray_index];
+                TriangleHit hit;
+                float closest_t = FLT_MAX;
+
+                bvh.intersect(ray, hit);
+                for (size_t corner = 0; corner < mesh.positions.size(); corner += 3)
+                {
+                    glm::vec3 edge_1 = mesh.positions[corner + 1] - mesh.positions[corner];
+                    glm::vec3 edge_2 = mesh.positions[corner + 2] - mesh.positions[corner];
+                    glm::vec3 p = glm::cross(ray.direction, edge_2);
+                    float determinant = glm::dot(edge_1, p);
+                    glm::vec3 to_origin = ray.origin - mesh.positions[corner];
+                    glm::vec3 q = glm::cross(to_origin, edge_1);
+                    float u, v, t;
+
+                    if (abs(determinant) < 1e-12f)
+                        continue;
+                    u = glm::dot(to_origin, p) / determinant;
+                    v = glm::dot(ray.direction, q) / determinant;
+                    t = glm::dot(edge_2, q) / determinant;
+                    if (u >= 0.0f and v >= 0.0f and u + v <= 1.0f and t >= 0.0f)
+                        closest_t = min(closest_t, t);
+                }
+                mismatches += abs(closest_t - hit.t) <= 1e-4f or (closest_t == FLT_MAX and hit.triangle == UINT32_MAX) ? 0 : 1;
+            }
+        }) / 16.0;
+
+    cout << "triangle bvh " << bvh.triangle_count() << " triangles, " << bvh.node_count() << " nodes: build " << build_ms << " ms"
+        << ", ray " << ray_ms * 1000.0 / rays.size() << " us (" << hits << "/" << rays.size() << " hit)"
+        << ", brute force " << brute_force_ms * 1000.0 << " us, " << mismatches << " mismatches" << endl;
+}
+
+void run_bvh_benchmark()
+{
+    for (uint32_t object_count : { 10000u, 100000u })
+        run_scene_bvh_benchmark(object_count);
+    for (uint32_t segments : { 256u, 1024u })
+        run_triangle_bvh_benchmark(segments);
+}
+
+static void traced_work(uint32_t index, volatile uint64_t& sink)
+{
+    TRACE_ZONE("benchmark_zone");
+    sink = sink + index;
+}
+
+void run_trace_benchmark()
+{
+    const uint32_t zones = 1000000;
+    const uint32_t iterations = 5;
+    WorkerPool workers;
+    volatile uint64_t sink = 0;
+    volatile uint64_t ticks = 0;
+    uint32_t thread_count = workers.size() + 1;
+
+    auto zone_loop = [&]()
+        {
+            for (uint32_t index = 0; index < zones; index++)
+                traced_work(index, sink);
+        };
+
+    double empty_ms = time_ms(iterations, [&]()
+        {
+            for (uint32_t index = 0; index < zones; index++)
+                sink = sink + index;
+        });
+    double clock_ms = time_ms(iterations, [&]()
+        {
+            for (uint32_t index = 0; index < zones; index++)
+                ticks = trace_ticks();
+        });
+    double steady_clock_ms = time_ms(iterations, [&]()
+        {
+            for (uint32_t index = 0; index < zones; index++)
+                ticks = chrono::steady_clock::now().time_since_epoch().count();
+        });
+    double disabled_ms = time_ms(iterations, zone_loop);
+
+    trace_start();
+    double enabled_ms = time_ms(iterations, zone_loop);
+    // Every thread records into its own buffer, so the cost per zone should not grow with the thread count.
+    double threaded_ms = time_ms(iterations, [&]()
+        {
+            workers.parallel_for(zones * thread_count, zones / 16, [](uint32_t begin, uint32_t end)
+                {
+                    volatile uint64_t local_sink = 0;
+
+                    for (uint32_t index = begin; index < end; index++)
+                        traced_work(index, local_sink);
+                });
+        });
+    trace_stop();
+
+    double to_ns = 1e6 / zones;
+
+    cout << "trace zones: empty loop " << empty_ms * to_ns << " ns"
+        << ", disabled +" << (disabled_ms - empty_ms) * to_ns << " ns"
+        << ", enabled +" << (enabled_ms - empty_ms) * to_ns << " ns"
+        << ", enabled on " << thread_count << " threads " << threaded_ms * to_ns << " ns"
+        << "; clock read: trace " << clock_ms * to_ns << " ns, steady_clock " << steady_clock_ms * to_ns << " ns" << endl;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct CameraKey
+{
+    float time;
+    glm::vec3 eye;
+    glm::vec3 target;
+};
+
+struct BenchmarkScene
+{
+    std::string name;
+    std::vector<CameraKey> camera_path;
+    glm::vec3 spin_axis;
+    float spin_degrees_per_second;
+};
+
+struct TimingSummary
+{
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+struct SceneResult
+{
+    std::string name;
+    uint32_t frames = 0;
+    double throughput_fps = 0.0;
+    TimingSummary cpu_ms;
+    TimingSummary gpu_ms;
+};
+
+TimingSummary summarize_timings(std::vector<double> samples);
+
+// Times TransformStore updates on 10k, 100k and 1M node hierarchies against a scalar glm reference.
+void run_transform_benchmark();
+// Times normal and tangent generation on torus meshes of 65k to 1M triangles, on one thread and on
+// the whole pool, and checks the results against the analytic surface frame.
+void run_mesh_attribute_benchmark();
+// Times scene BVH builds, frustum queries, refits and ray casts over 10k and 100k random boxes, and
+// triangle BVH ray picking on torus meshes up to 1M triangles, each checked against brute force.
+void run_bvh_benchmark();
+// Times trace zones against an empty loop with tracing disabled and enabled, on one thread and on
+// the whole pool, along with one read of the trace clock and of steady_clock.
+void run_trace_benchmark();
+
+class BenchmarkRunner
+{
+public:
+    BenchmarkRunner(uint32_t warmup_frames, uint32_t measured_frames);
+
+    bool finished() const;
+    const BenchmarkScene& scene() const;
+    float scene_time() const;
+    glm::mat4 model_matrix() const;
+    glm::mat4 view_matrix() const;
+
+    void record_frame(double cpu_ms, double gpu_ms);
+
+    void print_results() const;
+    // configuration names the anti-aliasing mode, so runs of one scene set can be compared side by side.
+    bool write_json(const std::string& path, const std::string& device_name, const std::string& configuration) const;
+    bool compare_with_baseline(const std::string& path, double tolerance) const;
+
+private:
+    const float frame_delta = 1.0f / 60.0f;
+
+    uint32_t warmup_frames;
+    uint32_t measured_frames;
+    std::vector<BenchmarkScene> scenes;
+    std::vector<SceneResult> results;
+
+    size_t scene_index = 0;
+    uint32_t scene_frame = 0;
+    std::vector<double> cpu_samples;
+    std::vector<double> gpu_samples;
+    std::chrono::steady_clock::time_point measure_start;
+
+    void start_scene();
+    void finish_scene();
+};
@@ -0,0 +1,679 @@
+#include "bvh.h"
+#include "simd_math.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+static const uint32_t BIN_COUNT = 16;
+// Cost of visiting a node relative to testing one primitive, for the SAH.
+static const float TRAVERSAL_COST = 1.0f;
+
+// Top-down build result, preorder: a node's left child always follows it.
+struct BinaryNode
+{
+    Aabb bounds;
+    // Primitives order[first, first + count) of the whole subtree.
+    uint32_t first = 0;
+    uint32_t count = 0;
+    // Zero for leaves, the root is never anyone's child.
+    uint32_t left = 0;
+    uint32_t right = 0;
+};
+
+struct BinaryBuild
+{
+    const vector<Aabb>& bounds;
+    vector<glm::vec3> centers;
+    vector<uint32_t>& order;
+    vector<BinaryNode>& nodes;
+    uint32_t max_leaf_size;
+    // Leaves above max_leaf_size are only made when splitting costs more, and never above this.
+    uint32_t max_sah_leaf_size;
+};
+
+glm::vec3 Aabb::center() const
+{
+    return (min + max) * 0.5f;
+}
+
+float Aabb::surface_area() const
+{
+    glm::vec3 extent = max - min;
+
+    if (extent.x < 0.0f or extent.y < 0.0f or extent.z < 0.0f)
+        return 0.0f;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+Frustum frustum_from_matrix(const glm::mat4& clip)
+{
+    Frustum frustum;
+    glm::vec4 rows[4];
+
+    for (int row = 0; row < 4; row++)
+        rows[row] = glm::vec4(clip[0][row], clip[1][row], clip[2][row], clip[3][row]);
+
+    frustum.planes[0] = rows[3] + rows[0];
+    frustum.planes[1] = rows[3] - rows[0];
+    frustum.planes[2] = rows[3] + rows[1];
+    frustum.planes[3] = rows[3] - rows[1];
+    frustum.planes[4] = rows[2];
+    frustum.planes[5] = rows[3] - rows[2];
+
+    for (glm::vec4& plane : frustum.planes)
+        plane = plane / glm::length(glm::vec3(plane));
+    return frustum;
+}
+
+static uint32_t build_binary(BinaryBuild& build, uint32_t first, uint32_t count)
+{
+    uint32_t node_index = static_cast<uint32_t>(build.nodes.size());
+    BinaryNode node;
+    Aabb center_bounds;
+    float best_cost = FLT_MAX;
+    int best_axis = -1;
+    uint32_t best_split = 0;
+    uint32_t middle;
+
+    node.first = first;
+    node.count = count;
+    for (uint32_t index = first; index < first + count; index++)
+    {
+        node.bounds.grow(build.bounds[build.order[index]]);
+        center_bounds.grow(build.centers[build.order[index]]);
+    }
+    build.nodes.push_back(node);
+    if (count <= build.max_leaf_size)
+        return node_index;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float extent = center_bounds.max[axis] - center_bounds.min[axis];
+        Aabb bins[BIN_COUNT];
+        uint32_t bin_counts[BIN_COUNT] = {};
+        float right_areas[BIN_COUNT];
+        uint32_t right_counts[BIN_COUNT];
+        Aabb left;
+        Aabb right;
+        uint32_t left_count = 0;
+        uint32_t right_count = 0;
+
+        if (extent <= 0.0f)
+            continue;
+
+        for (uint32_t index = first; index < first + count; index++)
+        {
+            uint32_t primitive = build.order[index];
+            uint32_t bin = min(static_cast<uint32_t>((build.centers[primitive][axis] - center_bounds.min[axis]) * (BIN_COUNT / extent)), BIN_COUNT - 1);
+
+            bins[bin].grow(build.bounds[primitive]);
+            bin_counts[bin]++;
+        }
+
+        // Split s puts bins [0, s) on the left.
+        for (uint32_t split = BIN_COUNT - 1; split > 0; split--)
+        {
+            right.grow(bins[split]);
+            right_count += bin_counts[split];
+            right_areas[split] = right.surface_area();
+            right_counts[split] = right_count;
+        }
+        for (uint32_t split = 1; split < BIN_COUNT; split++)
+        {
+            float split_cost;
+
+            left.grow(bins[split - 1]);
+            left_count += bin_counts[split - 1];
+            if (left_count == 0 or right_counts[split] == 0)
+                continue;
+
+            split_cost = left.surface_area() * left_count + right_areas[split] * right_counts[split];
+            if (split_cost < best_cost)
+            {
+                best_cost = split_cost;
+                best_axis = axis;
+                best_split = split;
+            }
+        }
+    }
+
+    if (best_axis >= 0)
+    {
+        float extent = center_bounds.max[best_axis] - center_bounds.min[best_axis];
+        float leaf_cost = node.bounds.surface_area() * count;
+
+        if (count <= build.max_sah_leaf_size and node.bounds.surface_area() * TRAVERSAL_COST + best_cost >= leaf_cost)
+            return node_index;
+
+        middle = static_cast<uint32_t>(partition(build.order.begin() + first, build.order.begin() + first + count, [&](uint32_t primitive)
+            {
+                return min(static_cast<uint32_t>((build.centers[primitive][best_axis] - center_bounds.min[best_axis]) * (BIN_COUNT / extent)), BIN_COUNT - 1) < best_split;
+            }) - build.order.begin());
+    }
+    else
+    {
+        // Every center in the same place: no plane separates them, so halve the range.
+        if (count <= build.max_sah_leaf_size)
+            return node_index;
+        middle = first + count / 2;
+    }
+
+    if (middle == first or middle == first + count)
+        middle = first + count / 2;
+
+    uint32_t left_child = build_binary(build, first, middle - first);
+    uint32_t right_child = build_binary(build, middle, first + count - middle);
+
+    build.nodes[node_index].left = left_child;
+    build.nodes[node_index].right = right_child;
+    return node_index;
+}
+
+static void build_binary_tree(const vector<Aabb>& bounds, uint32_t max_leaf_size, uint32_t max_sah_leaf_size,
+    vector<uint32_t>& order, vector<BinaryNode>& nodes)
+{
+    BinaryBuild build{ bounds, vector<glm::vec3>(bounds.size()), order, nodes, max_leaf_size, max_sah_leaf_size };
+
+    order.resize(bounds.size());
+    for (uint32_t primitive = 0; primitive < bounds.size(); primitive++)
+    {
+        order[primitive] = primitive;
+        build.centers[primitive] = bounds[primitive].center();
+    }
+
+    nodes.clear();
+    nodes.reserve(2 * bounds.size());
+    if (!bounds.empty())
+        build_binary(build, 0, static_cast<uint32_t>(bounds.size()));
+}
+
+void SceneBvh::build(const vector<Aabb>& bounds)
+{
+    vector<BinaryNode> binary;
+
+    object_bounds = bounds;
+    object_nodes.assign(bounds.size(), 0);
+    object_slots.assign(bounds.size(), 0);
+    nodes.clear();
+    dirty_nodes.clear();
+
+    build_binary_tree(bounds, 1, 1, order, binary);
+    if (!binary.empty())
+        collapse(binary, 0, LEAF, 0);
+
+    node_dirty.assign(nodes.size(), 0);
+    slot_area_sum = 0.0f;
+    for (const Node& node : nodes)
+        for (uint32_t slot = 0; slot < 4; slot++)
+            if (node.count[slot] > 0)
+                slot_area_sum += slot_bounds(node, slot).surface_area();
+    built_cost = sah_cost();
+}
+
+// Pulls grandchildren up into the slots of their parents, largest box first, until the node has four.
+uint32_t SceneBvh::collapse(const vector<BinaryNode>& binary, uint32_t binary_index, uint32_t parent, uint32_t parent_slot)
+{
+    uint32_t node_index = static_cast<uint32_t>(nodes.size());
+    uint32_t slots[4];
+    uint32_t slot_count = 0;
+    Node node{};
+
+    if (binary[binary_index].left == 0)
+        slots[slot_count++] = binary_index;
+    else
+    {
+        slots[slot_count++] = binary[binary_index].left;
+        slots[slot_count++] = binary[binary_index].right;
+    }
+
+    while (slot_count < 4)
+    {
+        int largest = -1;
+        float largest_area = -1.0f;
+
+        for (uint32_t slot = 0; slot < slot_count; slot++)
+        {
+            const BinaryNode& candidate = binary[slots[slot]];
+
+            if (candidate.left != 0 and candidate.bounds.surface_area() > largest_area)
+            {
+                largest = static_cast<int>(slot);
+                largest_area = candidate.bounds.surface_area();
+            }
+        }
+        if (largest < 0)
+            break;
+
+        slots[slot_count++] = binary[slots[largest]].right;
+        slots[largest] = binary[slots[largest]].left;
+    }
+
+    node.parent = parent;
+    node.parent_slot = parent_slot;
+    for (uint32_t slot = 0; slot < 4; slot++)
+    {
+        node.child[slot] = LEAF;
+        set_slot(node, slot, Aabb{});
+    }
+    nodes.push_back(node);
+
+    for (uint32_t slot = 0; slot < slot_count; slot++)
+    {
+        const BinaryNode& child = binary[slots[slot]];
+        uint32_t child_node = LEAF;
+
+        if (child.left != 0)
+            child_node = collapse(binary, slots[slot], node_index, slot);
+        else
+            for (uint32_t index = child.first; index < child.first + child.count; index++)
+            {
+                object_nodes[order[index]] = node_index;
+                object_slots[order[index]] = static_cast<uint8_t>(slot);
+            }
+
+        nodes[node_index].child[slot] = child_node;
+        nodes[node_index].first[slot] = child.first;
+        nodes[node_index].count[slot] = child.count;
+        set_slot(nodes[node_index], slot, child.bounds);
+    }
+    return node_index;
+}
+
+void SceneBvh::set_slot(Node& node, uint32_t slot, const Aabb& bounds)
+{
+    node.min_x[slot] = bounds.min.x;
+    node.min_y[slot] = bounds.min.y;
+    node.min_z[slot] = bounds.min.z;
+    node.max_x[slot] = bounds.max.x;
+    node.max_y[slot] = bounds.max.y;
+    node.max_z[slot] = bounds.max.z;
+}
+
+void SceneBvh::move_slot(Node& node, uint32_t slot, const Aabb& bounds)
+{
+    slot_area_sum += bounds.surface_area() - slot_bounds(node, slot).surface_area();
+    set_slot(node, slot, bounds);
+}
+
+Aabb SceneBvh::slot_bounds(const Node& node, uint32_t slot) const
+{
+    Aabb bounds;
+
+    bounds.min = glm::vec3(node.min_x[slot], node.min_y[slot], node.min_z[slot]);
+    bounds.max = glm::vec3(node.max_x[slot], node.max_y[slot], node.max_z[slot]);
+    return bounds;
+}
+
+Aabb SceneBvh::node_bounds(const Node& node) const
+{
+    Aabb bounds;
+
+    for (uint32_t slot = 0; slot < 4; slot++)
+        if (node.count[slot] > 0)
+            bounds.grow(slot_bounds(node, slot));
+    return bounds;
+}
+
+// Expected box tests per query, relative to testing the root.
+float SceneBvh::sah_cost() const
+{
+    float root_area = nodes.empty() ? 0.0f : node_bounds(nodes[0]).surface_area();
+
+    return root_area > 0.0f ? slot_area_sum / root_area : 0.0f;
+}
+
+void SceneBvh::mark_dirty(uint32_t node)
+{
+    if (node_dirty[node])
+        return;
+    node_dirty[node] = 1;
+    dirty_nodes.push_back(node);
+    push_heap(dirty_nodes.begin(), dirty_nodes.end());
+}
+
+void SceneBvh::update(uint32_t object, const Aabb& bounds)
+{
+    if (object_bounds[object].min == bounds.min and object_bounds[object].max == bounds.max)
+        return;
+    object_bounds[object] = bounds;
+    move_slot(nodes[object_nodes[object]], object_slots[object], bounds);
+    mark_dirty(object_nodes[object]);
+}
+
+uint32_t SceneBvh::refit()
+{
+    uint32_t refitted = 0;
+
+    // Parents always come before their children, so the largest dirty index has no dirty descendants.
+    while (!dirty_nodes.empty())
+    {
+        uint32_t node_index = dirty_nodes.front();
+        const Node& node = nodes[node_index];
+
+        pop_heap(dirty_nodes.begin(), dirty_nodes.end());
+        dirty_nodes.pop_back();
+        node_dirty[node_index] = 0;
+        refitted++;
+
+        if (node.parent == LEAF)
+            continue;
+
+        Aabb bounds = node_bounds(node);
+        Aabb parent_slot = slot_bounds(nodes[node.parent], node.parent_slot);
+
+        if (parent_slot.min == bounds.min and parent_slot.max == bounds.max)
+            continue;
+        move_slot(nodes[node.parent], node.parent_slot, bounds);
+        mark_dirty(node.parent);
+    }
+    return refitted;
+}
+
+float SceneBvh::degradation() const
+{
+    return built_cost > 0.0f ? sah_cost() / built_cost : 1.0f;
+}
+
+void SceneBvh::cull(const Frustum& frustum, vector<uint32_t>& visible) const
+{
+    struct Entry
+    {
+        uint32_t node;
+        // Planes the node's box straddles; the ones it is entirely inside need no more tests below it.
+        uint32_t planes;
+    };
+    vector<Entry> stack;
+    float4 zero = splat4(0.0f);
+
+    if (nodes.empty())
+        return;
+
+    stack.reserve(64);
+    stack.push_back({ 0, 0x3F });
+    while (!stack.empty())
+    {
+        Entry entry = stack.back();
+        const Node& node = nodes[entry.node];
+        float4 min_x = load4(node.min_x);
+        float4 min_y = load4(node.min_y);
+        float4 min_z = load4(node.min_z);
+        float4 max_x = load4(node.max_x);
+        float4 max_y = load4(node.max_y);
+        float4 max_z = load4(node.max_z);
+        uint32_t slot_planes[4] = {};
+        int outside = 0;
+
+        stack.pop_back();
+        for (uint32_t plane = 0; plane < 6; plane++)
+        {
+            const glm::vec4& p = frustum.planes[plane];
+            float4 nx = splat4(p.x);
+            float4 ny = splat4(p.y);
+            float4 nz = splat4(p.z);
+            float4 d = splat4(p.w);
+            float4 far_distance;
+            float4 near_distance;
+            int straddling;
+
+            if ((entry.planes & (1u << plane)) == 0)
+                continue;
+
+            // The corner furthest along the plane normal decides whether a box is outside, the nearest whether it is entirely inside.
+            far_distance = add4(add4(mul4(nx, p.x > 0.0f ? max_x : min_x), mul4(ny, p.y > 0.0f ? max_y : min_y)),
+                add4(mul4(nz, p.z > 0.0f ? max_z : min_z), d));
+            near_distance = add4(add4(mul4(nx, p.x > 0.0f ? min_x : max_x), mul4(ny, p.y > 0.0f ? min_y : max_y)),
+                add4(mul4(nz, p.z > 0.0f ? min_z : max_z), d));
+
+            outside |= less_mask4(far_distance, zero);
+            straddling = less_mask4(near_distance, zero);
+            for (uint32_t slot = 0; slot < 4; slot++)
+                if (straddling & (1 << slot))
+                    slot_planes[slot] |= 1u << plane;
+        }
+
+        for (uint32_t slot = 0; slot < 4; slot++)
+        {
+            if (node.count[slot] == 0 or (outside & (1 << slot)))
+                continue;
+
+            if (node.child[slot] == LEAF or slot_planes[slot] == 0)
+                visible.insert(visible.end(), order.begin() + node.first[slot], order.begin() + node.first[slot] + node.count[slot]);
+            else
+                stack.push_back({ node.child[slot], slot_planes[slot] });
+        }
+    }
+}
+
+bool SceneBvh::intersect(const Ray& ray, const ObjectHit& hit_object, uint32_t& object, float& t) const
+{
+    struct Entry
+    {
+        float t;
+        uint32_t node;
+    };
+    vector<Entry> stack;
+    Ray candidate_ray = ray;
+    float4 origin_x = splat4(ray.origin.x);
+    float4 origin_y = splat4(ray.origin.y);
+    float4 origin_z = splat4(ray.origin.z);
+    float4 inverse_x = splat4(1.0f / ray.direction.x);
+    float4 inverse_y = splat4(1.0f / ray.direction.y);
+    float4 inverse_z = splat4(1.0f / ray.direction.z);
+    bool hit = false;
+
+    if (nodes.empty())
+        return false;
+
+    stack.reserve(64);
+    stack.push_back({ 0.0f, 0 });
+    while (!stack.empty())
+    {
+        Entry entry = stack.back();
+        const Node& node = nodes[entry.node];
+        float near_t[4];
+        uint32_t slots[4];
+        uint32_t slot_count = 0;
+        int missed;
+
+        stack.pop_back();
+        if (entry.t > candidate_ray.t_max)
+            continue;
+
+        float4 t0_x = mul4(sub4(load4(node.min_x), origin_x), inverse_x);
+        float4 t1_x = mul4(sub4(load4(node.max_x), origin_x), inverse_x);
+        float4 t0_y = mul4(sub4(load4(node.min_y), origin_y), inverse_y);
+        float4 t1_y = mul4(sub4(load4(node.max_y), origin_y), inverse_y);
+        float4 t0_z = mul4(sub4(load4(node.min_z), origin_z), inverse_z);
+        float4 t1_z = mul4(sub4(load4(node.max_z), origin_z), inverse_z);
+        float4 entry_t = max4(max4(min4(t0_x, t1_x), min4(t0_y, t1_y)), max4(min4(t0_z, t1_z), splat4(0.0f)));
+        float4 exit_t = min4(min4(max4(t0_x, t1_x), max4(t0_y, t1_y)), min4(max4(t0_z, t1_z), splat4(candidate_ray.t_max)));
+
+        missed = less_mask4(exit_t, entry_t);
+        store4(near_t, entry_t);
+
+        // Furthest first onto the stack, so the nearest child is visited next.
+        for (uint32_t slot = 0; slot < 4; slot++)
+        {
+            uint32_t position = slot_count++;
+
+            if (node.count[slot] == 0 or (missed & (1 << slot)))
+            {
+                slot_count--;
+                continue;
+            }
+            while (position > 0 and near_t[slots[position - 1]] < near_t[slot])
+            {
+                slots[position] = slots[position - 1];
+                position--;
+            }
+            slots[position] = slot;
+        }
+
+        for (uint32_t index = 0; index < slot_count; index++)
+        {
+            uint32_t slot = slots[index];
+
+            if (node.child[slot] != LEAF)
+            {
+                stack.push_back({ near_t[slot], node.child[slot] });
+                continue;
+            }
+
+            for (uint32_t entry_index = node.first[slot]; entry_index < node.first[slot] + node.count[slot]; entry_index++)
+            {
+                float distance = hit_object(order[entry_index], candidate_ray);
+
+                if (distance >= 0.0f and distance < candidate_ray.t_max)
+                {
+                    candidate_ray.t_max = distance;
+                    object = order[entry_index];
+                    hit = true;
+                }
+            }
+        }
+    }
+
+    if (hit)
+        t = candidate_ray.t_max;
+    return hit;
+}
+
+uint32_t SceneBvh::object_count() const
+{
+    return static_cast<uint32_t>(object_bounds.size());
+}
+
+uint32_t SceneBvh::node_count() const
+{
+    return static_cast<uint32_t>(nodes.size());
+}
+
+void TriangleBvh::build(const vector<glm::vec3>& positions, const vector<uint32_t>& indices)
+{
+    uint32_t triangle_count = static_cast<uint32_t>(indices.size() / 3);
+    vector<Aabb> bounds(triangle_count);
+    vector<BinaryNode> binary;
+
+    for (uint32_t triangle = 0; triangle < triangle_count; triangle++)
+        for (uint32_t corner = 0; corner < 3; corner++)
+            bounds[triangle].grow(positions[indices[3 * triangle + corner]]);
+
+    build_binary_tree(bounds, 2, 8, triangles, binary);
+
+    corners.resize(3 * static_cast<size_t>(triangle_count));
+    for (uint32_t index = 0; index < triangle_count; index++)
+        for (uint32_t corner = 0; corner < 3; corner++)
+            corners[3 * index + corner] = positions[indices[3 * triangles[index] + corner]];
+
+    nodes.resize(binary.size());
+    for (size_t node = 0; node < binary.size(); node++)
+    {
+        nodes[node].bounds = binary[node].bounds;
+        nodes[node].first = binary[node].first;
+        nodes[node].count = binary[node].left == 0 ? binary[node].count : 0;
+        nodes[node].right_child = binary[node].right;
+    }
+}
+
+static bool ray_hits_box(const Aabb& bounds, const glm::vec3& origin, const glm::vec3& inverse_direction, float t_max, float& entry_t)
+{
+    glm::vec3 t0 = (bounds.min - origin) * inverse_direction;
+    glm::vec3 t1 = (bounds.max - origin) * inverse_direction;
+    glm::vec3 near_t = glm::min(t0, t1);
+    glm::vec3 far_t = glm::max(t0, t1);
+    float exit_t = min(min(far_t.x, far_t.y), min(far_t.z, t_max));
+
+    entry_t = max(max(near_t.x, near_t.y), max(near_t.z, 0.0f));
+    return entry_t <= exit_t;
+}
+
+bool TriangleBvh::intersect(const Ray& ray, TriangleHit& hit) const
+{
+    glm::vec3 inverse_direction(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+    float t_max = min(ray.t_max, hit.t);
+    vector<uint32_t> stack;
+    bool found = false;
+    float entry_t;
+
+    if (nodes.empty() or !ray_hits_box(nodes[0].bounds, ray.origin, inverse_direction, t_max, entry_t))
+        return false;
+
+    stack.reserve(64);
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        const Node& node = nodes[stack.back()];
+
+        stack.pop_back();
+        if (node.count > 0)
+        {
+            // Moller-Trumbore, both faces count.
+            for (uint32_t index = node.first; index < node.first + node.count; index++)
+            {
+                const glm::vec3* corner = &corners[3 * index];
+                glm::vec3 edge_1 = corner[1] - corner[0];
+                glm::vec3 edge_2 = corner[2] - corner[0];
+                glm::vec3 p = glm::cross(ray.direction, edge_2);
+                float determinant = glm::dot(edge_1, p);
+                glm::vec3 to_origin;
+                glm::vec3 q;
+                float inverse_determinant;
+                float u, v, t;
+
+                if (abs(determinant) < 1e-12f)
+                    continue;
+
+                inverse_determinant = 1.0f / determinant;
+                to_origin = ray.origin - corner[0];
+                u = glm::dot(to_origin, p) * inverse_determinant;
+                if (u < 0.0f or u > 1.0f)
+                    continue;
+
+                q = glm::cross(to_origin, edge_1);
+                v = glm::dot(ray.direction, q) * inverse_determinant;
+                if (v < 0.0f or u + v > 1.0f)
+                    continue;
+
+                t = glm::dot(edge_2, q) * inverse_determinant;
+                if (t < 0.0f or t >= t_max)
+                    continue;
+
+                t_max = t;
+                hit.triangle = triangles[index];
+                hit.t = t;
+                hit.u = u;
+                hit.v = v;
+                found = true;
+            }
+            continue;
+        }
+
+        uint32_t left = static_cast<uint32_t>(&node - nodes.data()) + 1;
+        uint32_t right = node.right_child;
+        float left_t, right_t;
+        bool left_hit = ray_hits_box(nodes[left].bounds, ray.origin, inverse_direction, t_max, left_t);
+        bool right_hit = ray_hits_box(nodes[right].bounds, ray.origin, inverse_direction, t_max, right_t);
+
+        // The nearer child goes on top.
+        if (left_hit and right_hit)
+        {
+            stack.push_back(left_t < right_t ? right : left);
+            stack.push_back(left_t < right_t ? left : right);
+        }
+        else if (left_hit or right_hit)
+            stack.push_back(left_hit ? left : right);
+    }
+    return found;
+}
+
+uint32_t TriangleBvh::triangle_count() const
+{
+    return static_cast<uint32_t>(triangles.size());
+}
+
+uint32_t TriangleBvh::node_count() const
+{
+    return static_cast<uint32_t>(nodes.size());
+}
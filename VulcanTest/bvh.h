@@ -0,0 +1,151 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <cfloat>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct BinaryNode;
+
+struct Aabb
+{
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+
+    void grow(const glm::vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    void grow(const Aabb& other)
+    {
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+    }
+
+    glm::vec3 center() const;
+    // Zero for empty boxes.
+    float surface_area() const;
+};
+
+struct Ray
+{
+    glm::vec3 origin = glm::vec3(0.0f);
+    // Not necessarily unit length; hit distances are in multiples of it.
+    glm::vec3 direction = glm::vec3(0.0f, 0.0f, 1.0f);
+    float t_max = FLT_MAX;
+};
+
+// Six inward-facing planes: a point is inside when dot(plane.xyz, point) + plane.w >= 0 for all of them.
+struct Frustum
+{
+    glm::vec4 planes[6];
+};
+
+// Planes of a 0..1 depth clip matrix, in the space the matrix maps from.
+Frustum frustum_from_matrix(const glm::mat4& clip);
+
+// Four-wide BVH over object boxes, built top-down with binned SAH and refitted in place as objects
+// move. Nodes keep their four children's boxes as structure-of-arrays, so a frustum or ray test
+// covers all four with one set of SIMD operations. Every leaf slot holds exactly one object.
+class SceneBvh
+{
+public:
+    typedef std::function<float(uint32_t object, const Ray& ray)> ObjectHit;
+
+    void build(const std::vector<Aabb>& bounds);
+    // Records an object's new box; refit() brings the nodes above it up to date.
+    void update(uint32_t object, const Aabb& bounds);
+    // Refits only the nodes above updated objects, children before parents. Returns the nodes refitted.
+    uint32_t refit();
+    // SAH cost of the refitted tree over the cost it was built with. Refits keep the topology,
+    // so objects that move far apart make it grow; rebuild when it gets too large.
+    float degradation() const;
+
+    // Appends every object whose box is at least partly inside the frustum. Subtrees entirely
+    // inside are appended without testing their children.
+    void cull(const Frustum& frustum, std::vector<uint32_t>& visible) const;
+    // Closest object along the ray. Boxes only find candidates: hit_object returns the distance to the
+    // object itself, or a negative value when the ray misses it.
+    bool intersect(const Ray& ray, const ObjectHit& hit_object, uint32_t& object, float& t) const;
+
+    uint32_t object_count() const;
+    uint32_t node_count() const;
+
+private:
+    static const uint32_t LEAF = UINT32_MAX;
+
+    struct Node
+    {
+        float min_x[4], min_y[4], min_z[4];
+        float max_x[4], max_y[4], max_z[4];
+        // Child node, or LEAF. Either way the slot covers the objects order[first, first + count);
+        // empty slots have a count of zero.
+        uint32_t child[4];
+        uint32_t first[4];
+        uint32_t count[4];
+        uint32_t parent;
+        uint32_t parent_slot;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Aabb> object_bounds;
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> object_nodes;
+    std::vector<uint8_t> object_slots;
+    std::vector<uint32_t> dirty_nodes;
+    std::vector<uint8_t> node_dirty;
+    // Surface area of every occupied slot, kept up to date by updates and refits.
+    float slot_area_sum = 0.0f;
+    float built_cost = 0.0f;
+
+    uint32_t collapse(const std::vector<BinaryNode>& binary, uint32_t binary_index, uint32_t parent, uint32_t parent_slot);
+    void set_slot(Node& node, uint32_t slot, const Aabb& bounds);
+    // Replaces an occupied slot's box and keeps slot_area_sum in step.
+    void move_slot(Node& node, uint32_t slot, const Aabb& bounds);
+    Aabb slot_bounds(const Node& node, uint32_t slot) const;
+    Aabb node_bounds(const Node& node) const;
+    float sah_cost() const;
+    void mark_dirty(uint32_t node);
+};
+
+struct TriangleHit
+{
+    // Index of the triangle in the mesh's index list, divided by three.
+    uint32_t triangle = UINT32_MAX;
+    float t = FLT_MAX;
+    // Barycentric weights of the second and third corner.
+    float u = 0.0f;
+    float v = 0.0f;
+};
+
+// Binary SAH BVH over one mesh's triangles for exact ray picking. Corners are copied in leaf order,
+// so each leaf's triangles are contiguous in memory.
+class TriangleBvh
+{
+public:
+    void build(const std::vector<glm::vec3>& positions, const std::vector<uint32_t>& indices);
+    // Keeps the closer of hit and the closest triangle along the ray, up to ray.t_max.
+    bool intersect(const Ray& ray, TriangleHit& hit) const;
+
+    uint32_t triangle_count() const;
+    uint32_t node_count() const;
+
+private:
+    struct Node
+    {
+        Aabb bounds;
+        // Leaves: first corner triple and triangle count. Interior nodes: the left child follows
+        // the node, right_child holds the other and count is zero.
+        uint32_t first = 0;
+        uint32_t count = 0;
+        uint32_t right_child = 0;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<glm::vec3> corners;
+    std::vector<uint32_t> triangles;
+};
@@ -0,0 +1,289 @@
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "capture_writer.h"
+
+#include <stb_image_write.h>
+
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+bool parse_capture_format(const string& name, CaptureFormat& format)
+{
+    if (name == "png")
+        format = CAPTURE_PNG;
+    else if (name == "exr")
+        format = CAPTURE_EXR;
+    else if (name == "raw")
+        format = CAPTURE_RAW;
+    else
+        return false;
+    return true;
+}
+
+static bool is_bgra(VkFormat format)
+{
+    return format == VK_FORMAT_B8G8R8A8_SRGB or format == VK_FORMAT_B8G8R8A8_UNORM;
+}
+
+static bool is_srgb(VkFormat format)
+{
+    return format == VK_FORMAT_B8G8R8A8_SRGB or format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+static float srgb_to_linear(uint8_t value)
+{
+    float normalized = value / 255.0f;
+
+    if (normalized <= 0.04045f)
+        return normalized / 12.92f;
+    return pow((normalized + 0.055f) / 1.055f, 2.4f);
+}
+
+static float read_depth(VkFormat format, const uint8_t* texel)
+{
+    uint32_t bits;
+
+    memcpy(&bits, texel, sizeof(bits));
+    if (format == VK_FORMAT_D24_UNORM_S8_UINT)
+        return (bits & 0xFFFFFF) / 16777215.0f;
+
+    float depth;
+    memcpy(&depth, &bits, sizeof(depth));
+    return depth;
+}
+
+template <typename T>
+static void put(ofstream& file, T value)
+{
+    file.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static void put_attribute(ofstream& file, const char* name, const char* type, uint32_t size)
+{
+    file.write(name, strlen(name) + 1);
+    file.write(type, strlen(type) + 1);
+    put<uint32_t>(file, size);
+}
+
+// Minimal scanline OpenEXR writer: 32-bit float channels, no compression.
+// Channel names must be sorted alphabetically, planes hold width * height floats each.
+static bool write_exr(const string& path, uint32_t width, uint32_t height,
+    const vector<const char*>& channel_names, const vector<vector<float>>& planes)
+{
+    ofstream file(path, ios::binary);
+    uint32_t channel_list_size = 1;
+    uint32_t line_size = static_cast<uint32_t>(channel_names.size()) * width * sizeof(float);
+
+    if (!file.is_open())
+        return false;
+
+    for (const char* name : channel_names)
+        channel_list_size += static_cast<uint32_t>(strlen(name)) + 1 + 16;
+
+    put<uint32_t>(file, 20000630);
+    put<uint32_t>(file, 2);
+
+    put_attribute(file, "channels", "chlist", channel_list_size);
+    for (const char* name : channel_names)
+    {
+        file.write(name, strlen(name) + 1);
+        put<int32_t>(file, 2);
+        put<uint32_t>(file, 0);
+        put<int32_t>(file, 1);
+        put<int32_t>(file, 1);
+    }
+    put<uint8_t>(file, 0);
+
+    put_attribute(file, "compression", "compression", 1);
+    put<uint8_t>(file, 0);
+
+    for (const char* window : { "dataWindow", "displayWindow" })
+    {
+        put_attribute(file, window, "box2i", 16);
+        put<int32_t>(file, 0);
+        put<int32_t>(file, 0);
+        put<int32_t>(file, static_cast<int32_t>(width) - 1);
+        put<int32_t>(file, static_cast<int32_t>(height) - 1);
+    }
+
+    put_attribute(file, "lineOrder", "lineOrder", 1);
+    put<uint8_t>(file, 0);
+    put_attribute(file, "pixelAspectRatio", "float", 4);
+    put<float>(file, 1.0f);
+    put_attribute(file, "screenWindowCenter", "v2f", 8);
+    put<float>(file, 0.0f);
+    put<float>(file, 0.0f);
+    put_attribute(file, "screenWindowWidth", "float", 4);
+    put<float>(file, 1.0f);
+    put<uint8_t>(file, 0);
+
+    uint64_t first_line = static_cast<uint64_t>(file.tellp()) + height * sizeof(uint64_t);
+    for (uint32_t y = 0; y < height; y++)
+        put<uint64_t>(file, first_line + y * (8ull + line_size));
+
+    for (uint32_t y = 0; y < height; y++)
+    {
+        put<int32_t>(file, static_cast<int32_t>(y));
+        put<uint32_t>(file, line_size);
+        for (const vector<float>& plane : planes)
+            file.write(reinterpret_cast<const char*>(plane.data() + static_cast<size_t>(y) * width), width * sizeof(float));
+    }
+
+    return static_cast<bool>(file);
+}
+
+static bool write_raw(const string& path, const uint8_t* data, size_t size)
+{
+    ofstream file(path, ios::binary);
+
+    file.write(reinterpret_cast<const char*>(data), size);
+    return static_cast<bool>(file);
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    stop();
+}
+
+void CaptureWriter::start(const string& directory, CaptureFormat format, uint32_t queue_depth)
+{
+    error_code error;
+
+    this->directory = directory;
+    this->format = format;
+    this->queue_depth = queue_depth;
+    stopping = false;
+
+    filesystem::create_directories(directory, error);
+    if (error)
+        cout << "Creating capture directory " << directory << " error: " << error.message() << endl;
+
+    writer = thread(&CaptureWriter::writer_loop, this);
+}
+
+bool CaptureWriter::submit(CaptureJob job)
+{
+    {
+        lock_guard<mutex> lock(queue_mutex);
+
+        if (queue.size() >= queue_depth)
+            return false;
+        queue.push_back(move(job));
+    }
+    queue_ready.notify_one();
+
+    return true;
+}
+
+void CaptureWriter::stop()
+{
+    if (!writer.joinable())
+        return;
+
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_ready.notify_one();
+    writer.join();
+}
+
+bool CaptureWriter::running() const
+{
+    return writer.joinable();
+}
+
+uint64_t CaptureWriter::written() const
+{
+    return frames_written;
+}
+
+void CaptureWriter::writer_loop()
+{
+    while (true)
+    {
+        CaptureJob job;
+
+        {
+            unique_lock<mutex> lock(queue_mutex);
+
+            queue_ready.wait(lock, [this]() { return stopping or !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            job = move(queue.front());
+            queue.pop_front();
+        }
+
+        write(job);
+        if (job.done)
+            job.done();
+    }
+}
+
+void CaptureWriter::write(const CaptureJob& job)
+{
+    string frame_number = to_string(job.frame);
+    string base_name = directory + "/" + (job.name.empty() ? "frame_" + string(frame_number.size() < 6 ? 6 - frame_number.size() : 0, '0') + frame_number : job.name);
+    size_t pixel_count = static_cast<size_t>(job.width) * job.height;
+    bool bgra = is_bgra(job.color_format);
+    bool written = true;
+
+    if (format == CAPTURE_RAW)
+    {
+        string size = "_" + to_string(job.width) + "x" + to_string(job.height);
+
+        written = write_raw(base_name + size + ".raw", job.color, pixel_count * 4);
+        if (job.depth)
+            written = write_raw(base_name + size + "_depth.raw", job.depth, pixel_count * 4) and written;
+    }
+    else if (format == CAPTURE_PNG)
+    {
+        vector<uint8_t> rgba(job.color, job.color + pixel_count * 4);
+
+        if (bgra)
+            for (size_t pixel = 0; pixel < pixel_count; pixel++)
+                swap(rgba[pixel * 4], rgba[pixel * 4 + 2]);
+
+        written = stbi_write_png((base_name + ".png").c_str(), job.width, job.height, 4, rgba.data(), job.width * 4) != 0;
+    }
+    else
+    {
+        vector<vector<float>> planes(3, vector<float>(pixel_count));
+        bool srgb = is_srgb(job.color_format);
+
+        for (size_t pixel = 0; pixel < pixel_count; pixel++)
+        {
+            const uint8_t* texel = job.color + pixel * 4;
+
+            for (int channel = 0; channel < 3; channel++)
+            {
+                uint8_t value = texel[bgra ? channel : 2 - channel];
+                planes[channel][pixel] = srgb ? srgb_to_linear(value) : value / 255.0f;
+            }
+        }
+
+        written = write_exr(base_name + ".exr", job.width, job.height, { "B", "G", "R" }, planes);
+    }
+
+    if (job.depth and format != CAPTURE_RAW)
+    {
+        vector<vector<float>> depth(1, vector<float>(pixel_count));
+
+        for (size_t pixel = 0; pixel < pixel_count; pixel++)
+            depth[0][pixel] = read_depth(job.depth_format, job.depth + pixel * 4);
+
+        written = write_exr(base_name + "_depth.exr", job.width, job.height, { "Z" }, depth) and written;
+    }
+
+    if (written)
+        frames_written++;
+    else
+        cout << "Writing capture " << base_name << " error!" << endl;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum CaptureFormat : uint32_t
+{
+    CAPTURE_PNG,
+    CAPTURE_EXR,
+    CAPTURE_RAW
+};
+
+struct CaptureJob
+{
+    uint64_t frame = 0;
+    // File name without extension, frame_<number> when empty.
+    std::string name;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    VkFormat color_format = VK_FORMAT_UNDEFINED;
+    const uint8_t* color = nullptr;
+    VkFormat depth_format = VK_FORMAT_UNDEFINED;
+    const uint8_t* depth = nullptr;
+    // Called on the writer thread once the pixels are no longer needed.
+    std::function<void()> done;
+};
+
+bool parse_capture_format(const std::string& name, CaptureFormat& format);
+
+// Writes captured frames to disk on a background thread. submit() never blocks:
+// when the queue is full the job is rejected and the caller drops the capture.
+class CaptureWriter
+{
+public:
+    CaptureWriter() = default;
+    ~CaptureWriter();
+
+    void start(const std::string& directory, CaptureFormat format, uint32_t queue_depth);
+    bool submit(CaptureJob job);
+    void stop();
+
+    bool running() const;
+    uint64_t written() const;
+
+private:
+    std::string directory;
+    CaptureFormat format = CAPTURE_PNG;
+    uint32_t queue_depth = 0;
+
+    std::thread writer;
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<CaptureJob> queue;
+    bool stopping = false;
+    std::atomic<uint64_t> frames_written{ 0 };
+
+    void writer_loop();
+    void write(const CaptureJob& job);
+};
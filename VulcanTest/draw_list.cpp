@@ -0,0 +1,82 @@
+#include "draw_list.h"
+
+#include <algorithm>
+#include <array>
+
+using namespace std;
+
+static uint64_t quantize_depth(float depth, float far_plane)
+{
+    const uint64_t depth_max = (1u << 24) - 1;
+    float normalized = min(max(depth / far_plane, 0.0f), 1.0f);
+
+    return static_cast<uint64_t>(normalized * depth_max);
+}
+
+uint64_t make_opaque_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth, float far_plane)
+{
+    return (static_cast<uint64_t>(pipeline & 0xFF) << 56) |
+        (static_cast<uint64_t>(material & 0xFFFF) << 40) |
+        (static_cast<uint64_t>(mesh & 0xFFFF) << 24) |
+        quantize_depth(depth, far_plane);
+}
+
+uint64_t make_transparent_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth, float far_plane)
+{
+    const uint64_t depth_max = (1u << 24) - 1;
+
+    return (static_cast<uint64_t>(pipeline & 0xFF) << 56) |
+        ((depth_max - quantize_depth(depth, far_plane)) << 32) |
+        (static_cast<uint64_t>(material & 0xFFFF) << 16) |
+        static_cast<uint64_t>(mesh & 0xFFFF);
+}
+
+uint32_t key_pipeline(uint64_t key)
+{
+    return static_cast<uint32_t>(key >> 56);
+}
+
+void radix_sort(vector<DrawItem>& items, vector<DrawItem>& scratch)
+{
+    array<uint32_t, 256> counts;
+
+    if (items.empty())
+        return;
+
+    scratch.resize(items.size());
+
+    for (uint32_t shift = 0; shift < 64; shift += 8)
+    {
+        counts.fill(0);
+        for (const DrawItem& item : items)
+            counts[(item.key >> shift) & 0xFF]++;
+
+        if (counts[(items[0].key >> shift) & 0xFF] == items.size())
+            continue;
+
+        uint32_t offset = 0;
+        for (uint32_t& bucket : counts)
+        {
+            uint32_t bucket_size = bucket;
+            bucket = offset;
+            offset += bucket_size;
+        }
+
+        for (const DrawItem& item : items)
+            scratch[counts[(item.key >> shift) & 0xFF]++] = item;
+
+        items.swap(scratch);
+    }
+}
+
+void DrawList::clear()
+{
+    opaque.clear();
+    transparent.clear();
+}
+
+void DrawList::sort()
+{
+    radix_sort(opaque, scratch);
+    radix_sort(transparent, scratch);
+}
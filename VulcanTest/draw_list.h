@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+enum PipelineId : uint32_t
+{
+    PIPELINE_OPAQUE = 0,
+    PIPELINE_TRANSPARENT = 1
+};
+
+struct DrawItem
+{
+    uint64_t key;
+    uint32_t submesh;
+};
+
+struct DrawStats
+{
+    uint64_t draws = 0;
+    uint64_t pipeline_binds = 0;
+    uint64_t material_binds = 0;
+
+    uint64_t pipeline_binds_avoided() const { return draws - pipeline_binds; }
+    uint64_t material_binds_avoided() const { return draws - material_binds; }
+};
+
+// Key layout, high to low bits: pipeline (8) | material (16) | mesh (16) | depth (24).
+// Transparent items swap material/mesh and depth so they stay back-to-front.
+uint64_t make_opaque_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth, float far_plane);
+uint64_t make_transparent_key(uint32_t pipeline, uint32_t material, uint32_t mesh, float depth, float far_plane);
+uint32_t key_pipeline(uint64_t key);
+
+void radix_sort(std::vector<DrawItem>& items, std::vector<DrawItem>& scratch);
+
+class DrawList
+{
+public:
+    std::vector<DrawItem> opaque;
+    std::vector<DrawItem> transparent;
+
+    void clear();
+    void sort();
+
+private:
+    std::vector<DrawItem> scratch;
+};
@@ -0,0 +1,100 @@
+#include "frame_pacing.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+void FramePacer::set_frame_rate_cap(double frames_per_second)
+{
+    if (frames_per_second > 0.0)
+        frame_interval = chrono::duration_cast<clock::duration>(chrono::duration<double>(1.0 / frames_per_second));
+    else
+        frame_interval = clock::duration::zero();
+}
+
+void FramePacer::set_present_tracking(bool enabled)
+{
+    present_tracking = enabled;
+}
+
+void FramePacer::throttle()
+{
+    TRACE_ZONE("throttle");
+    const clock::duration spin_margin = chrono::milliseconds(1);
+    clock::time_point now = clock::now();
+
+    if (frame_interval == clock::duration::zero())
+        return;
+
+    if (now < next_frame_time)
+    {
+        if (next_frame_time - now > spin_margin)
+            this_thread::sleep_until(next_frame_time - spin_margin);
+        while (clock::now() < next_frame_time)
+            this_thread::yield();
+    }
+
+    next_frame_time = max(now, next_frame_time) + frame_interval;
+}
+
+void FramePacer::mark_input(uint64_t present_id)
+{
+    current.present_id = present_id;
+    current.input_time = clock::now();
+}
+
+void FramePacer::mark_submit()
+{
+    double input_to_submit_ms;
+
+    current.submit_time = clock::now();
+    input_to_submit_ms = chrono::duration<double, milli>(current.submit_time - current.input_time).count();
+
+    submitted_frames++;
+    total_input_to_submit_ms += input_to_submit_ms;
+    max_input_to_submit_ms = max(max_input_to_submit_ms, input_to_submit_ms);
+
+    if (present_tracking)
+        pending.push_back(current);
+}
+
+void FramePacer::mark_presented(uint64_t present_id)
+{
+    clock::time_point present_time = clock::now();
+
+    while (!pending.empty() and pending.front().present_id <= present_id)
+    {
+        double input_to_present_ms = chrono::duration<double, milli>(present_time - pending.front().input_time).count();
+
+        presented_frames++;
+        total_input_to_present_ms += input_to_present_ms;
+        max_input_to_present_ms = max(max_input_to_present_ms, input_to_present_ms);
+        pending.pop_front();
+    }
+}
+
+void FramePacer::discard_pending()
+{
+    pending.clear();
+}
+
+uint64_t FramePacer::oldest_pending_present() const
+{
+    return pending.empty() ? 0 : pending.front().present_id;
+}
+
+void FramePacer::print_stats() const
+{
+    if (submitted_frames == 0)
+        return;
+
+    cout << "Input to submit: avg " << total_input_to_submit_ms / submitted_frames << " ms, max " << max_input_to_submit_ms << " ms" << endl;
+
+    if (presented_frames > 0)
+        cout << "Input to present: avg " << total_input_to_present_ms / presented_frames << " ms, max " << max_input_to_present_ms << " ms" << endl;
+    else if (!present_tracking)
+        cout << "Input to present: unavailable without VK_KHR_present_wait" << endl;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+
+class FramePacer
+{
+public:
+    void set_frame_rate_cap(double frames_per_second);
+    void set_present_tracking(bool enabled);
+    void throttle();
+
+    void mark_input(uint64_t present_id);
+    void mark_submit();
+    void mark_presented(uint64_t present_id);
+    void discard_pending();
+
+    uint64_t oldest_pending_present() const;
+    void print_stats() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct PendingFrame
+    {
+        uint64_t present_id;
+        clock::time_point input_time;
+        clock::time_point submit_time;
+    };
+
+    clock::duration frame_interval = clock::duration::zero();
+    clock::time_point next_frame_time{};
+    bool present_tracking = false;
+
+    PendingFrame current{};
+    std::deque<PendingFrame> pending;
+
+    uint64_t submitted_frames = 0;
+    uint64_t presented_frames = 0;
+    double total_input_to_submit_ms = 0.0;
+    double max_input_to_submit_ms = 0.0;
+    double total_input_to_present_ms = 0.0;
+    double max_input_to_present_ms = 0.0;
+};
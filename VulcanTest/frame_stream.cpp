@@ -0,0 +1,179 @@
+#include "frame_stream.h"
+
+#include <iomanip>
+#include <iostream>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <csignal>
+#endif
+
+using namespace std;
+
+bool parse_stream_format(const string& name, StreamFormat& format)
+{
+    if (name == "y4m")
+        format = STREAM_Y4M;
+    else if (name == "raw")
+        format = STREAM_RAW;
+    else
+        return false;
+    return true;
+}
+
+FrameStream::~FrameStream()
+{
+    stop();
+}
+
+bool FrameStream::start(const string& path, StreamFormat format, uint32_t width, uint32_t height,
+    uint32_t frame_rate, uint32_t queue_depth)
+{
+    if (path == "-")
+    {
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        output = stdout;
+        owns_output = false;
+    }
+    else
+    {
+        output = fopen(path.c_str(), "wb");
+        owns_output = true;
+    }
+
+    if (!output)
+    {
+        cout << "Opening stream output " << path << " error!" << endl;
+        return false;
+    }
+
+#ifndef _WIN32
+    // A consumer closing the pipe should end the stream, not the process.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    this->format = format;
+    this->width = width;
+    this->height = height;
+    this->frame_rate = frame_rate;
+    this->queue_depth = queue_depth;
+    stopping = false;
+    broken = false;
+
+    if (format == STREAM_Y4M)
+        fprintf(output, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", width, height, frame_rate);
+
+    writer = thread(&FrameStream::writer_loop, this);
+    return true;
+}
+
+bool FrameStream::push(StreamFrame frame)
+{
+    auto wait_start = chrono::steady_clock::now();
+    unique_lock<mutex> lock(queue_mutex);
+
+    queue_changed.wait(lock, [this]() { return broken or queue.size() < queue_depth; });
+    blocked_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - wait_start).count();
+
+    if (broken)
+        return false;
+
+    if (frames_written == 0 and queue.empty())
+        first_push = chrono::steady_clock::now();
+    queue.push_back(move(frame));
+    lock.unlock();
+    queue_changed.notify_all();
+
+    return true;
+}
+
+void FrameStream::stop()
+{
+    if (!writer.joinable())
+        return;
+
+    {
+        lock_guard<mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_changed.notify_all();
+    writer.join();
+
+    fflush(output);
+    if (owns_output)
+        fclose(output);
+    output = nullptr;
+}
+
+bool FrameStream::running() const
+{
+    return writer.joinable();
+}
+
+bool FrameStream::failed() const
+{
+    lock_guard<mutex> lock(queue_mutex);
+
+    return broken;
+}
+
+void FrameStream::print_stats() const
+{
+    lock_guard<mutex> lock(queue_mutex);
+    double seconds = frames_written > 1 ? chrono::duration<double>(last_write - first_push).count() : 0.0;
+
+    cout << fixed << setprecision(1) << "Streamed " << frames_written << " frames " << width << "x" << height;
+    if (seconds > 0.0)
+        cout << " at " << frames_written / seconds << " fps, " << bytes_written / seconds / (1024.0 * 1024.0) << " MB/s";
+    cout << ", render blocked " << blocked_ms << " ms" << (broken ? ", consumer closed the stream" : "")
+        << defaultfloat << setprecision(6) << endl;
+}
+
+void FrameStream::writer_loop()
+{
+    while (true)
+    {
+        StreamFrame frame;
+
+        {
+            unique_lock<mutex> lock(queue_mutex);
+
+            queue_changed.wait(lock, [this]() { return stopping or !queue.empty(); });
+            if (queue.empty())
+                return;
+
+            frame = move(queue.front());
+            queue.pop_front();
+        }
+
+        bool written = !broken and write(frame);
+        if (frame.done)
+            frame.done();
+
+        {
+            lock_guard<mutex> lock(queue_mutex);
+
+            if (written)
+            {
+                frames_written++;
+                bytes_written += frame.size;
+                last_write = chrono::steady_clock::now();
+            }
+            else
+                broken = true;
+        }
+        queue_changed.notify_all();
+    }
+}
+
+bool FrameStream::write(const StreamFrame& frame)
+{
+    if (format == STREAM_Y4M and fputs("FRAME\n", output) < 0)
+        return false;
+
+    return fwrite(frame.data, 1, frame.size, output) == frame.size;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum StreamFormat : uint32_t
+{
+    STREAM_Y4M,
+    STREAM_RAW
+};
+
+struct StreamFrame
+{
+    uint64_t frame = 0;
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    // Called on the writer thread once the frame has been written.
+    std::function<void()> done;
+};
+
+bool parse_stream_format(const std::string& name, StreamFormat& format);
+
+// Streams YUV420 frames to stdout ("-"), a file or a named pipe on a background thread.
+// push() blocks while the queue is full so a slow consumer throttles the renderer.
+class FrameStream
+{
+public:
+    FrameStream() = default;
+    ~FrameStream();
+
+    bool start(const std::string& path, StreamFormat format, uint32_t width, uint32_t height,
+        uint32_t frame_rate, uint32_t queue_depth);
+    bool push(StreamFrame frame);
+    void stop();
+
+    bool running() const;
+    bool failed() const;
+    void print_stats() const;
+
+private:
+    FILE* output = nullptr;
+    bool owns_output = false;
+    StreamFormat format = STREAM_Y4M;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t frame_rate = 60;
+    uint32_t queue_depth = 0;
+
+    std::thread writer;
+    mutable std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::deque<StreamFrame> queue;
+    bool stopping = false;
+    bool broken = false;
+
+    uint64_t frames_written = 0;
+    uint64_t bytes_written = 0;
+    double blocked_ms = 0.0;
+    std::chrono::steady_clock::time_point first_push;
+    std::chrono::steady_clock::time_point last_write;
+
+    void writer_loop();
+    bool write(const StreamFrame& frame);
+};
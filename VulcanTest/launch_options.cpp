@@ -0,0 +1,271 @@
+#include "launch_options.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+
+using namespace std;
+
+static bool parse_present_mode(const string& name, VkPresentModeKHR& present_mode)
+{
+    if (name == "fifo")
+        present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    else if (name == "fifo_relaxed")
+        present_mode = VK_PRESENT_MODE_FIFO_RELAXED_KHR;
+    else if (name == "mailbox")
+        present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+    else if (name == "immediate")
+        present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+    else
+        return false;
+    return true;
+}
+
+LaunchOptions parse_launch_options(int argc, char** argv)
+{
+    LaunchOptions options{};
+
+    for (int arg_index = 1; arg_index < argc; arg_index++)
+    {
+        string arg = argv[arg_index];
+        bool has_value = arg_index + 1 < argc;
+
+        if (arg == "--present-mode" and has_value)
+        {
+            if (!parse_present_mode(argv[++arg_index], options.present_mode))
+                cout << "Unknown present mode " << argv[arg_index] << ", using mailbox" << endl;
+        }
+        else if (arg == "--swapchain-images" and has_value)
+            options.swap_chain_images = static_cast<uint32_t>(atoi(argv[++arg_index]));
+        else if (arg == "--fps-cap" and has_value)
+            options.frame_rate_cap = atof(argv[++arg_index]);
+        else if (arg == "--low-latency")
+            options.low_latency = true;
+        else if (arg == "--headless")
+            options.headless = true;
+        else if (arg == "--size" and has_value)
+        {
+            if (sscanf(argv[++arg_index], "%ux%u", &options.width, &options.height) != 2)
+                cout << "Size must look like 1280x720" << endl;
+        }
+        else if (arg == "--device" and has_value)
+            options.device_index = static_cast<uint32_t>(atoi(argv[++arg_index]));
+        else if (arg == "--frames" and has_value)
+            options.frame_limit = strtoull(argv[++arg_index], nullptr, 10);
+        else if (arg == "--benchmark")
+            options.benchmark = true;
+        else if (arg == "--benchmark-frames" and has_value)
+            options.benchmark_frames = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--warmup-frames" and has_value)
+            options.warmup_frames = static_cast<uint32_t>(max(0, atoi(argv[++arg_index])));
+        else if (arg == "--benchmark-output" and has_value)
+            options.benchmark_output = argv[++arg_index];
+        else if (arg == "--baseline" and has_value)
+            options.baseline_path = argv[++arg_index];
+        else if (arg == "--tolerance" and has_value)
+            options.baseline_tolerance = atof(argv[++arg_index]);
+        else if (arg == "--transform-benchmark")
+            options.transform_benchmark = true;
+        else if (arg == "--mesh-benchmark")
+            options.mesh_benchmark = true;
+        else if (arg == "--bvh-benchmark")
+            options.bvh_benchmark = true;
+        else if (arg == "--trace-benchmark")
+            options.trace_benchmark = true;
+        else if (arg == "--trace" and has_value)
+            options.trace_output = argv[++arg_index];
+        else if (arg == "--instances" and has_value)
+            options.instance_count = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--model" and has_value)
+            options.model_path = argv[++arg_index];
+        else if (arg == "--crease-angle" and has_value)
+            options.crease_angle = min(max(atof(argv[++arg_index]), 0.0), 180.0);
+        else if (arg == "--area-weighted-normals")
+            options.area_weighted_normals = true;
+        else if (arg == "--texture" and has_value)
+            options.texture_path = argv[++arg_index];
+        else if (arg == "--asset-cache-mb" and has_value)
+            options.asset_cache_mb = static_cast<uint32_t>(atoi(argv[++arg_index]));
+        else if (arg == "--occlusion")
+            options.occlusion_culling = true;
+        else if (arg == "--occlusion-probe")
+            options.occlusion_probe = true;
+        else if (arg == "--bvh-culling")
+            options.bvh_culling = true;
+        else if (arg == "--debug-bounds")
+            options.debug_bounds = true;
+        else if (arg == "--transient-kb" and has_value)
+            options.transient_geometry_kb = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--skinning")
+            options.skinning = true;
+        else if (arg == "--skin-poses" and has_value)
+            options.skin_poses = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--skin-joints" and has_value)
+            options.skin_joints = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--particles" and has_value)
+            options.particle_count = static_cast<uint32_t>(max(0, atoi(argv[++arg_index])));
+        else if (arg == "--no-async-compute")
+            options.async_compute = false;
+        else if (arg == "--lights" and has_value)
+            options.light_count = static_cast<uint32_t>(max(0, atoi(argv[++arg_index])));
+        else if (arg == "--scale-light-range")
+            options.scale_light_range = true;
+        else if (arg == "--shadows" and has_value)
+            options.shadow_cascades = static_cast<uint32_t>(min(max(2, atoi(argv[++arg_index])), 4));
+        else if (arg == "--shadow-size" and has_value)
+            options.shadow_map_size = static_cast<uint32_t>(max(256, atoi(argv[++arg_index])));
+        else if (arg == "--gpu-budget" and has_value)
+            options.gpu_budget_ms = max(0.0, atof(argv[++arg_index]));
+        else if (arg == "--min-scale" and has_value)
+            options.min_render_scale = min(max(atof(argv[++arg_index]), 0.25), 1.0);
+        else if (arg == "--bilinear-upscale")
+            options.edge_aware_upscale = false;
+        else if (arg == "--post")
+            options.post_processing = true;
+        else if (arg == "--no-fxaa")
+            options.fxaa = false;
+        else if (arg == "--sharpen" and has_value)
+            options.sharpen = min(max(atof(argv[++arg_index]), 0.0), 1.0);
+        else if (arg == "--msaa" and has_value)
+            options.msaa_samples = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--serial-startup")
+            options.serial_startup = true;
+        else if (arg == "--memory-report" and has_value)
+            options.memory_report_interval = static_cast<uint32_t>(atoi(argv[++arg_index]));
+        else if (arg == "--memory-budget-fraction" and has_value)
+            options.memory_budget_fraction = atof(argv[++arg_index]);
+        else if (arg == "--capture" and has_value)
+            options.capture_directory = argv[++arg_index];
+        else if (arg == "--capture-format" and has_value)
+        {
+            if (!parse_capture_format(argv[++arg_index], options.capture_format))
+                cout << "Unknown capture format " << argv[arg_index] << ", using png" << endl;
+        }
+        else if (arg == "--capture-depth")
+            options.capture_depth = true;
+        else if (arg == "--capture-every" and has_value)
+            options.capture_interval = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--capture-ring" and has_value)
+            options.capture_ring_size = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--views" and has_value)
+            options.view_count = static_cast<uint32_t>(clamp(atoi(argv[++arg_index]), 1, static_cast<int>(MAX_VIEW_COUNT)));
+        else if (arg == "--view-passes")
+            options.view_passes = true;
+        else if (arg == "--stream" and has_value)
+            options.stream_output = argv[++arg_index];
+        else if (arg == "--stream-format" and has_value)
+        {
+            if (!parse_stream_format(argv[++arg_index], options.stream_format))
+                cout << "Unknown stream format " << argv[arg_index] << ", using y4m" << endl;
+        }
+        else if (arg == "--stream-fps" and has_value)
+            options.stream_frame_rate = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--stream-queue" and has_value)
+            options.stream_queue_depth = static_cast<uint32_t>(max(1, atoi(argv[++arg_index])));
+        else if (arg == "--batch" and has_value)
+            options.batch_manifest = argv[++arg_index];
+        else if (arg == "--batch-prefetch" and has_value)
+            options.batch_prefetch = static_cast<uint32_t>(max(0, atoi(argv[++arg_index])));
+        else
+            cout << "Unknown option " << arg << endl;
+    }
+
+    // Batch renders capture every frame, one thumbnail per manifest line.
+    if (!options.batch_manifest.empty())
+    {
+        options.headless = true;
+        options.stream_output.clear();
+        options.capture_interval = 1;
+        if (options.capture_directory.empty())
+            options.capture_directory = "thumbnails";
+    }
+
+    // The YUV420 conversion works on 8x2 pixel blocks.
+    if (!options.stream_output.empty())
+    {
+        options.headless = true;
+        options.width = (options.width + 7) / 8 * 8;
+        options.height = (options.height + 1) / 2 * 2;
+    }
+
+    // Layered targets exist only offscreen; swap chain images and the YUV stream have a single layer.
+    if (options.view_count > 1 and (!options.headless or !options.stream_output.empty()))
+    {
+        cout << "Multiple views need --headless without --stream, rendering one view" << endl;
+        options.view_count = 1;
+    }
+
+    // The depth pyramid is built from a single depth layer.
+    if (options.occlusion_culling and options.view_count > 1)
+    {
+        cout << "Occlusion culling needs a single view, culling disabled" << endl;
+        options.occlusion_culling = false;
+    }
+
+    // Skinning buffers are sized for one model and the chain rig reuses its joints for every scene.
+    if (options.skinning and !options.batch_manifest.empty())
+    {
+        cout << "Skinning renders a single model, skinning disabled for batches" << endl;
+        options.skinning = false;
+    }
+
+    // Posed vertices leave the rest-pose bounds the culling pass tests against.
+    if (options.skinning and options.occlusion_culling)
+    {
+        cout << "Skinned poses leave the culling bounds, occlusion culling disabled" << endl;
+        options.occlusion_culling = false;
+    }
+
+    // The GPU pass owns the visible lists, every view reads the same list and skinned poses draw fixed instance ranges.
+    if (options.bvh_culling and (options.occlusion_culling or options.view_count > 1 or options.skinning))
+    {
+        cout << "BVH culling needs a single view without occlusion culling or skinning, BVH culling disabled" << endl;
+        options.bvh_culling = false;
+    }
+
+    // Clusters are built from the first view's frustum only.
+    if (options.light_count > 0 and options.view_count > 1)
+    {
+        cout << "Clustered lights need a single view, lights disabled" << endl;
+        options.light_count = 0;
+    }
+
+    // Cascades are split along the first view's frustum only.
+    if (options.shadow_cascades > 0 and options.view_count > 1)
+    {
+        cout << "Shadow cascades follow a single view, shadows disabled" << endl;
+        options.shadow_cascades = 0;
+    }
+
+    // Only the scaled corner of the depth buffer is written, the pyramid and depth captures expect all of it.
+    if (options.gpu_budget_ms > 0.0 and (options.occlusion_culling or options.capture_depth or options.view_count > 1))
+    {
+        cout << "Dynamic resolution needs a single view without occlusion culling or depth capture, rendering at full resolution" << endl;
+        options.gpu_budget_ms = 0.0;
+    }
+
+    // Multisampled depth can't feed the pyramid or be copied out, and layered targets stay single-sampled.
+    if (options.msaa_samples > 1 and (options.occlusion_culling or options.capture_depth or options.view_count > 1))
+    {
+        cout << "MSAA needs a single view without occlusion culling or depth capture, MSAA disabled" << endl;
+        options.msaa_samples = 1;
+    }
+
+    if (options.post_processing and options.view_count > 1)
+    {
+        cout << "Post-processing works on a single view, post-processing disabled" << endl;
+        options.post_processing = false;
+    }
+
+    // There is no window to close: benchmarks and batches end on their own and streams end with their reader.
+    if (options.headless and options.frame_limit == 0 and !options.benchmark and options.batch_manifest.empty()
+        and options.stream_output.empty())
+    {
+        cout << "Headless runs without --frames render " << DEFAULT_HEADLESS_FRAMES << " frames" << endl;
+        options.frame_limit = DEFAULT_HEADLESS_FRAMES;
+    }
+
+    return options;
+}
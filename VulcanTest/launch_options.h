@@ -0,0 +1,98 @@
+#pragma once
+
+#include "capture_writer.h"
+#include "frame_stream.h"
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <string>
+
+const uint32_t MAX_VIEW_COUNT = 8;
+// Frames a headless run renders when nothing else decides when it ends.
+const uint64_t DEFAULT_HEADLESS_FRAMES = 600;
+
+struct LaunchOptions
+{
+    VkPresentModeKHR present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+    uint32_t swap_chain_images = 0;
+    double frame_rate_cap = 0.0;
+    bool low_latency = false;
+
+    bool headless = false;
+    uint32_t width = 800;
+    uint32_t height = 640;
+    uint32_t device_index = 0;
+    uint64_t frame_limit = 0;
+
+    bool benchmark = false;
+    uint32_t benchmark_frames = 600;
+    uint32_t warmup_frames = 60;
+    std::string benchmark_output = "benchmark.json";
+    std::string baseline_path;
+    double baseline_tolerance = 0.1;
+    bool transform_benchmark = false;
+    bool mesh_benchmark = false;
+    bool bvh_benchmark = false;
+    bool trace_benchmark = false;
+    // Chrome trace JSON of the CPU zones, and GPU frames where the device can calibrate its clock.
+    std::string trace_output;
+
+    uint32_t memory_report_interval = 0;
+    double memory_budget_fraction = 0.9;
+
+    std::string model_path = "Models/donut.obj";
+    std::string texture_path = "Textures/Gabe.jpg";
+    uint32_t asset_cache_mb = 256;
+    // Faces without normals in the model are smoothed up to this angle between them.
+    double crease_angle = 60.0;
+    bool area_weighted_normals = false;
+
+    uint32_t instance_count = 1;
+    bool occlusion_culling = false;
+    // Every 64th frame skips the occlusion test to time the scene without it. Always on under --benchmark.
+    bool occlusion_probe = false;
+    // Frustum culls instances on the CPU against a scene BVH and draws only the visible ones.
+    bool bvh_culling = false;
+    bool debug_bounds = false;
+    uint32_t transient_geometry_kb = 1024;
+    bool skinning = false;
+    uint32_t skin_poses = 16;
+    uint32_t skin_joints = 8;
+    uint32_t particle_count = 0;
+    bool async_compute = true;
+    uint32_t light_count = 0;
+    // Shrinks light ranges with the cube root of the count, so lights per cluster stay flat as lights are added.
+    bool scale_light_range = false;
+    uint32_t shadow_cascades = 0;
+    uint32_t shadow_map_size = 2048;
+    // GPU frame time the render scale is fitted to, 0 renders at full resolution.
+    double gpu_budget_ms = 0.0;
+    double min_render_scale = 0.5;
+    bool edge_aware_upscale = true;
+    // Tonemapping, FXAA and sharpening in compute over an HDR target, the alternative to MSAA.
+    bool post_processing = false;
+    bool fxaa = true;
+    double sharpen = 0.25;
+    uint32_t msaa_samples = 1;
+    bool serial_startup = false;
+
+    std::string capture_directory;
+    CaptureFormat capture_format = CAPTURE_PNG;
+    bool capture_depth = false;
+    uint32_t capture_interval = 1;
+    uint32_t capture_ring_size = 4;
+
+    uint32_t view_count = 1;
+    bool view_passes = false;
+
+    std::string stream_output;
+    StreamFormat stream_format = STREAM_Y4M;
+    uint32_t stream_frame_rate = 60;
+    uint32_t stream_queue_depth = 4;
+
+    std::string batch_manifest;
+    uint32_t batch_prefetch = 4;
+};
+
+LaunchOptions parse_launch_options(int argc, char** argv);
@@ -0,0 +1,127 @@
+#include "light_clusters.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace std;
+
+uint32_t ClusterGrid::cluster_count() const
+{
+    return tiles_x * tiles_y * slices;
+}
+
+uint32_t ClusterGrid::cluster_index(uint32_t x, uint32_t y, uint32_t z) const
+{
+    return (z * tiles_y + y) * tiles_x + x;
+}
+
+uint32_t ClusterGrid::slice(float view_depth) const
+{
+    float position = log(max(view_depth, near_plane) / near_plane) / log(far_plane / near_plane);
+
+    return min(static_cast<uint32_t>(position * slices), slices - 1);
+}
+
+float ClusterGrid::slice_depth(uint32_t z) const
+{
+    return near_plane * pow(far_plane / near_plane, static_cast<float>(z) / slices);
+}
+
+ClusterBounds cluster_bounds(const ClusterGrid& grid, const glm::mat4& inverse_proj, uint32_t x, uint32_t y, uint32_t z)
+{
+    ClusterBounds bounds = { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+    float depths[2] = { grid.slice_depth(z), grid.slice_depth(z + 1) };
+
+    // Each tile corner unprojects to a ray from the eye; the cluster spans those rays between its slice depths.
+    for (uint32_t corner = 0; corner < 4; corner++)
+    {
+        float ndc_x = -1.0f + 2.0f * (x + (corner & 1)) / grid.tiles_x;
+        float ndc_y = -1.0f + 2.0f * (y + (corner >> 1)) / grid.tiles_y;
+        glm::vec4 point = inverse_proj * glm::vec4(ndc_x, ndc_y, 0.0f, 1.0f);
+        glm::vec3 ray = glm::vec3(point) / point.w;
+
+        for (float depth : depths)
+        {
+            glm::vec3 at_depth = ray * (depth / -ray.z);
+
+            bounds.min = glm::min(bounds.min, at_depth);
+            bounds.max = glm::max(bounds.max, at_depth);
+        }
+    }
+    return bounds;
+}
+
+bool sphere_intersects_bounds(const glm::vec3& center, float radius, const ClusterBounds& bounds)
+{
+    glm::vec3 offset = center - glm::clamp(center, bounds.min, bounds.max);
+
+    return glm::dot(offset, offset) <= radius * radius;
+}
+
+void assign_lights(const ClusterGrid& grid, const glm::mat4& view, const glm::mat4& inverse_proj,
+    const vector<GpuLight>& lights, uint32_t max_per_cluster, vector<uint32_t>& counts, vector<uint32_t>& indices)
+{
+    vector<glm::vec3> view_centers(lights.size());
+
+    counts.assign(grid.cluster_count(), 0);
+    indices.assign(static_cast<size_t>(grid.cluster_count()) * max_per_cluster, 0);
+
+    for (size_t light = 0; light < lights.size(); light++)
+        view_centers[light] = glm::vec3(view * glm::vec4(glm::vec3(lights[light].position), 1.0f));
+
+    for (uint32_t z = 0; z < grid.slices; z++)
+        for (uint32_t y = 0; y < grid.tiles_y; y++)
+            for (uint32_t x = 0; x < grid.tiles_x; x++)
+            {
+                uint32_t cluster = grid.cluster_index(x, y, z);
+                ClusterBounds bounds = cluster_bounds(grid, inverse_proj, x, y, z);
+
+                for (uint32_t light = 0; light < lights.size() and counts[cluster] < max_per_cluster; light++)
+                {
+                    if (sphere_intersects_bounds(view_centers[light], lights[light].position.w, bounds))
+                        indices[static_cast<size_t>(cluster) * max_per_cluster + counts[cluster]++] = light;
+                }
+            }
+}
+
+static float unit_random(uint32_t& state)
+{
+    state = state * 1664525u + 1013904223u;
+    return (state >> 8) / 16777216.0f;
+}
+
+vector<GpuLight> make_light_field(uint32_t count, const glm::vec3& box_min, const glm::vec3& box_max, float range)
+{
+    vector<GpuLight> lights(count);
+    uint32_t state = 12345;
+
+    for (GpuLight& light : lights)
+    {
+        glm::vec3 position = box_min + (box_max - box_min) * glm::vec3(unit_random(state), unit_random(state), unit_random(state));
+        float hue = 6.0f * unit_random(state);
+        glm::vec3 color = glm::clamp(glm::vec3(abs(hue - 3.0f) - 1.0f, 2.0f - abs(hue - 2.0f), 2.0f - abs(hue - 4.0f)), 0.0f, 1.0f);
+        bool spot = unit_random(state) < 0.25f;
+
+        light.position = glm::vec4(position, range);
+        light.color = glm::vec4(color, 1.0f);
+        // Spots point down at the scene with a random tilt.
+        light.direction = glm::vec4(glm::normalize(glm::vec3(unit_random(state) - 0.5f, unit_random(state) - 0.5f, -1.0f)), cos(0.6f));
+        light.params = glm::vec4(cos(0.4f), static_cast<float>(spot ? LIGHT_SPOT : LIGHT_POINT), 0.0f, 0.0f);
+    }
+    return lights;
+}
+
+void animate_lights(const vector<GpuLight>& base, float time, uint32_t begin, uint32_t end, GpuLight* out)
+{
+    for (uint32_t light = begin; light < end; light++)
+    {
+        float phase = 2.39996f * light;
+        float speed = 0.5f + 0.25f * (light % 5);
+        float radius = 0.25f * base[light].position.w;
+
+        out[light] = base[light];
+        out[light].position.x += radius * cos(phase + speed * time);
+        out[light].position.y += radius * sin(phase + speed * time);
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <cstdint>
+#include <vector>
+
+// Per-cluster list capacity, shared with light_cull.comp and shader.frag.
+const uint32_t MAX_LIGHTS_PER_CLUSTER = 128;
+
+enum LightType : uint32_t
+{
+    LIGHT_POINT,
+    LIGHT_SPOT
+};
+
+// Matches the light struct in light_cull.comp and shader.frag (std430).
+struct GpuLight
+{
+    // xyz world position, w range.
+    glm::vec4 position;
+    // rgb color, w intensity.
+    glm::vec4 color;
+    // xyz spot direction, w cosine of the outer cone angle.
+    glm::vec4 direction;
+    // x cosine of the inner cone angle, y LightType.
+    glm::vec4 params;
+};
+
+// Screen tiles times exponentially spaced depth slices between the near and far planes, so
+// clusters stay roughly cube shaped in view space.
+struct ClusterGrid
+{
+    uint32_t tiles_x = 16;
+    uint32_t tiles_y = 9;
+    uint32_t slices = 24;
+    float near_plane = 0.1f;
+    float far_plane = 10.0f;
+
+    uint32_t cluster_count() const;
+    uint32_t cluster_index(uint32_t x, uint32_t y, uint32_t z) const;
+    uint32_t slice(float view_depth) const;
+    float slice_depth(uint32_t z) const;
+};
+
+struct ClusterBounds
+{
+    glm::vec3 min;
+    glm::vec3 max;
+};
+
+// View-space box around one cluster. inverse_proj maps NDC back to view space.
+ClusterBounds cluster_bounds(const ClusterGrid& grid, const glm::mat4& inverse_proj, uint32_t x, uint32_t y, uint32_t z);
+bool sphere_intersects_bounds(const glm::vec3& center, float radius, const ClusterBounds& bounds);
+
+// CPU reference for light_cull.comp. Writes counts[cluster] and indices[cluster * max_per_cluster + n].
+// Lights past max_per_cluster are dropped in light order, as on the GPU.
+void assign_lights(const ClusterGrid& grid, const glm::mat4& view, const glm::mat4& inverse_proj,
+    const std::vector<GpuLight>& lights, uint32_t max_per_cluster, std::vector<uint32_t>& counts, std::vector<uint32_t>& indices);
+
+// A deterministic mix of point and spot lights scattered through a box, every one with the given range.
+std::vector<GpuLight> make_light_field(uint32_t count, const glm::vec3& box_min, const glm::vec3& box_max, float range);
+// Moves lights [begin, end) around their own small orbits into out, indexed like base.
+void animate_lights(const std::vector<GpuLight>& base, float time, uint32_t begin, uint32_t end, GpuLight* out);
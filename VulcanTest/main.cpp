@@ -11,6 +11,7 @@
 #include <vulkan/vulkan.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_aligned.hpp>
 #include <stb_image.h>
 #include <tiny_obj_loader.h>
 
@@ -20,14 +21,52 @@
 #include <fstream>
 #include <array>
 #include <chrono>
+#include <map>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+
+#include "asset_manager.h"
+#include "batch_manifest.h"
+#include "benchmark.h"
+#include "bvh.h"
+#include "capture_writer.h"
+#include "draw_list.h"
+#include "frame_pacing.h"
+#include "frame_stream.h"
+#include "launch_options.h"
+#include "light_clusters.h"
+#include "memory_tracker.h"
+#include "mesh_attributes.h"
+#include "resolution_controller.h"
+#include "resource_registry.h"
+#include "shadow_cascades.h"
+#include "skinning.h"
+#include "task_graph.h"
+#include "trace.h"
+#include "transient_ring.h"
+#include "transform_store.h"
 
 using namespace std;
 
+// Packed members: GLM_FORCE_DEFAULT_ALIGNED_GENTYPES pads the default vectors on some compilers, and skin.comp
+// reads and writes vertices as fifteen floats.
 struct Vertex
 {
-    glm::vec3 position;
-    glm::vec3 color;
-    glm::vec2 tex_coord;
+    glm::packed_vec3 position;
+    glm::packed_vec3 color;
+    glm::packed_vec2 tex_coord;
+    glm::packed_vec3 normal;
+    glm::packed_vec4 tangent;
 
     static VkVertexInputBindingDescription get_binding_description()
     {
@@ -40,9 +79,9 @@ struct Vertex
         return binding_description;
     }
 
-    static array<VkVertexInputAttributeDescription, 3> get_attribute_descriptions()
+    static array<VkVertexInputAttributeDescription, 5> get_attribute_descriptions()
     {
-        array<VkVertexInputAttributeDescription, 3> attribute_descriptions{};
+        array<VkVertexInputAttributeDescription, 5> attribute_descriptions{};
         attribute_descriptions[0].binding = 0;
         attribute_descriptions[0].location = 0;
         attribute_descriptions[0].format = VK_FORMAT_R32G32B32_SFLOAT;
@@ -58,10 +97,24 @@ struct Vertex
         attribute_descriptions[2].format = VK_FORMAT_R32G32_SFLOAT;
         attribute_descriptions[2].offset = offsetof(Vertex, tex_coord);
 
+        attribute_descriptions[3].binding = 0;
+        attribute_descriptions[3].location = 3;
+        attribute_descriptions[3].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attribute_descriptions[3].offset = offsetof(Vertex, normal);
+
+        attribute_descriptions[4].binding = 0;
+        attribute_descriptions[4].location = 4;
+        attribute_descriptions[4].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        attribute_descriptions[4].offset = offsetof(Vertex, tangent);
+
         return attribute_descriptions;
     }
 };
 
+static_assert(sizeof(Vertex) == 15 * sizeof(float), "Vertex layout must match skin.comp");
+static_assert(offsetof(Vertex, normal) == 8 * sizeof(float) and offsetof(Vertex, tangent) == 11 * sizeof(float),
+    "Vertex offsets must match skin.comp");
+
 struct UniformBufferObject
 {
     glm::mat4 model;
@@ -69,23 +122,308 @@ struct UniformBufferObject
     glm::mat4 proj;
 };
 
+struct ViewBufferObject
+{
+    glm::mat4 view_proj[MAX_VIEW_COUNT];
+};
+
+struct Material
+{
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+    float shininess;
+    float dissolve;
+    bool textured;
+};
+
+struct MaterialBufferObject
+{
+    glm::vec4 diffuse;
+    glm::vec4 specular;
+    glm::vec4 params;
+};
+
+// Shared by light_cull.comp and shader.frag.
+struct LightingBufferObject
+{
+    glm::mat4 view;
+    glm::mat4 inverse_proj;
+    glm::vec4 camera_position;
+    glm::vec4 ambient;
+    // Tiles across, tiles down, depth slices, light count.
+    glm::uvec4 grid;
+    // Near plane, far plane, slices / log(far / near).
+    glm::vec4 depth;
+    glm::vec4 screen;
+};
+
+// Shared by shadow.vert and shader.frag.
+struct ShadowBufferObject
+{
+    glm::mat4 cascades[MAX_SHADOW_CASCADES];
+    // Far view depth of each cascade.
+    glm::vec4 splits;
+    glm::vec4 texel_sizes;
+    // xyz direction the light travels, w cascade count.
+    glm::vec4 light;
+};
+
+// Pushed to upscale.frag.
+struct UpscaleConstants
+{
+    // Rendered extent over the scene target's extent.
+    glm::vec2 scale;
+    glm::vec2 source_size;
+    uint32_t edge_aware;
+};
+
+enum PostPass : uint32_t
+{
+    POST_TONEMAP,
+    POST_FXAA,
+    POST_SHARPEN,
+    POST_PASS_COUNT
+};
+
+struct PostConstants
+{
+    glm::uvec2 extent;
+    float sharpen;
+    // The swap chain encodes sRGB on write, so the last pass hands it linear colour.
+    uint32_t linear_output;
+};
+
+struct GpuTimelinePoint
+{
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    uint64_t value = 0;
+};
+
+struct QueueTimeline
+{
+    VkQueue queue = VK_NULL_HANDLE;
+    VkSemaphore semaphore = VK_NULL_HANDLE;
+    uint64_t next_value = 1;
+};
+
+struct SubmitWait
+{
+    VkSemaphore semaphore;
+    uint64_t value;
+    VkPipelineStageFlags stage;
+};
+
+struct RetiredSwapChain
+{
+    GpuTimelinePoint retired_after;
+    VkSwapchainKHR swap_chain;
+    vector<VkFramebuffer> framebuffers;
+    vector<VkImageView> image_views;
+    VkImage depth_image;
+    VkDeviceMemory depth_image_memory;
+    VkImageView depth_image_view;
+    // Fences of its presents still in flight, or without present fences, the presents queued before it was retired
+    // and whether the chain that replaced it has handed out every image since.
+    vector<VkFence> present_fences;
+    uint64_t presents_before;
+    bool successor_acquired;
+};
+
+struct ResizeStats
+{
+    uint32_t recreations = 0;
+    uint32_t frames_since_recreate = UINT32_MAX;
+    double total_recreate_ms = 0.0;
+    double max_recreate_ms = 0.0;
+    double max_frame_ms_resizing = 0.0;
+    double max_frame_ms_steady = 0.0;
+    // Retired chains released without present fences, and the worst frame that released one.
+    uint32_t unfenced_releases = 0;
+    bool unfenced_release_in_frame = false;
+    double max_frame_ms_unfenced_release = 0.0;
+};
+
+struct OcclusionStats
+{
+    uint64_t frames = 0;
+    uint64_t instances_tested = 0;
+    uint64_t instances_culled = 0;
+    uint64_t late_instances = 0;
+    uint64_t culled_frames = 0;
+    double culled_gpu_ms = 0.0;
+    uint64_t probe_frames = 0;
+    double probe_gpu_ms = 0.0;
+};
+
+struct CullParams
+{
+    glm::vec4 sphere;
+    uint32_t viewport[2];
+    uint32_t instance_count;
+    uint32_t levels;
+    uint32_t phase;
+    uint32_t test_occlusion;
+};
+
+// Mirrors particles.comp. Only the GPU writes it; the CPU hands it over as indirect arguments.
+struct ParticleCounters
+{
+    VkDrawIndirectCommand draws[2];
+    VkDispatchIndirectCommand simulate;
+    uint32_t simulate_padding;
+    VkDispatchIndirectCommand emit;
+    uint32_t emit_padding;
+    uint32_t dead_count;
+    uint32_t emit_count;
+};
+
+static_assert(offsetof(ParticleCounters, dead_count) == 64, "ParticleCounters layout must match particles.comp");
+
+enum ParticleStage : uint32_t
+{
+    PARTICLE_PREPARE,
+    PARTICLE_SIMULATE,
+    PARTICLE_EMIT
+};
+
+struct ParticleParams
+{
+    glm::vec4 emitter;
+    glm::vec4 gravity;
+    float lifetime;
+    float speed;
+    float floor_height;
+    uint32_t stage;
+    uint32_t slot;
+    uint32_t previous_slot;
+    uint32_t emit_request;
+    uint32_t seed;
+};
+
+// Where a draw takes its instances from: all of them, or one of the lists written by the cull shader.
+enum DrawSource : uint32_t
+{
+    DRAW_ALL_INSTANCES,
+    DRAW_EARLY_LIST,
+    DRAW_LATE_LIST,
+    DRAW_VISIBLE_LIST,
+    DRAW_NOTHING
+};
+
+struct Submesh
+{
+    uint32_t first_index;
+    uint32_t index_count;
+    uint32_t material;
+    uint32_t mesh;
+    glm::vec3 center;
+};
+
+struct MeshData
+{
+    vector<Vertex> vertices;
+    vector<uint32_t> indices;
+    vector<Material> materials;
+    vector<Submesh> submeshes;
+    shared_ptr<TriangleBvh> bvh;
+};
+
+struct TextureData
+{
+    unique_ptr<stbi_uc, void (*)(void*)> pixels{ nullptr, stbi_image_free };
+    int width = 0;
+    int height = 0;
+};
+
+struct GpuMesh
+{
+    ResourceHandle vertex_buffer;
+    ResourceHandle index_buffer;
+    vector<Material> materials;
+    vector<Submesh> submeshes;
+    ResourceHandle material_buffer;
+    ResourceHandle material_pool;
+    ResourceHandle skin_buffer;
+    ResourceHandle morph_buffer;
+    Skin skin;
+    uint32_t vertex_count = 0;
+    vector<VkDescriptorSet> material_sets;
+    glm::vec3 center = glm::vec3(0.0f);
+    float radius = 1.0f;
+    shared_ptr<const TriangleBvh> bvh;
+};
+
+struct GpuTexture
+{
+    ResourceHandle image;
+    ResourceHandle view;
+};
+
+struct StagingBuffer
+{
+    VkBuffer buffer;
+    VkDeviceMemory memory;
+};
+
+struct ReadbackSlot
+{
+    VkBuffer buffer = VK_NULL_HANDLE;
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    uint8_t* mapped = nullptr;
+    VkDeviceSize size = 0;
+    VkDeviceSize depth_offset = 0;
+    VkExtent2D extent{};
+    uint64_t frame = 0;
+    string name;
+    atomic<bool> busy{ false };
+};
+
+struct BatchRequest
+{
+    AssetId model;
+    AssetId texture;
+};
+
 class VulkanManager
 {
 public:
-    VulkanManager()
+    VulkanManager(const LaunchOptions& launch_options) : options(launch_options)
     {
         make_window();
         start_vulkan();
-        process();
+        // A failed startup, such as an unreadable batch manifest, has nothing to render.
+        if (exit_code == EXIT_SUCCESS)
+            process();
         cleanup();
     }
 
+    int get_exit_code() const
+    {
+        return exit_code;
+    }
+
 private:
     const int MAX_FRAMES_IN_FLIGHT = 2;
-    const string model_path = "Models/donut.obj";
-
-    vector<Vertex> verticles;
-    vector<uint32_t> indices;
+    // Without present fences, presents after the replacing chain's first one before a retired chain is let go.
+    const uint64_t RETIRED_SWAP_CHAIN_PRESENTS = 8;
+    LaunchOptions options;
+    const bool streaming = !options.stream_output.empty();
+    const bool dynamic_resolution = options.gpu_budget_ms > 0.0;
+    int exit_code = EXIT_SUCCESS;
+    uint64_t frames_drawn = 0;
+    const float near_plane = 0.1f;
+    const float far_plane = 10.0f;
+
+    vector<Material> materials;
+    vector<Submesh> submeshes;
+    DrawList draw_list;
+    DrawStats draw_stats;
+    // Every this many frames the occlusion test is skipped to measure what culling saves.
+    const uint32_t OCCLUSION_PROBE_INTERVAL = 64;
+    // Unculled probe frames cost a frame time spike, so only measuring runs take them.
+    const bool occlusion_probes = options.benchmark or options.occlusion_probe;
+    const uint32_t CULL_LIST_COUNT = 3;
+    UniformBufferObject frame_ubo{};
     vector<const char*> device_extensions = 
     {
         VK_KHR_SWAPCHAIN_EXTENSION_NAME
@@ -93,45 +431,320 @@ private:
     vector<VkImage> swap_chain_images;
     vector<VkImageView> swap_chain_image_views;
     vector<VkFramebuffer> swap_chain_framebuffers;
+    vector<VkDeviceMemory> offscreen_image_memory;
     GLFWwindow* window;
     VkInstance vulkan_instance;
     VkPhysicalDevice phys_device = VK_NULL_HANDLE;
     VkDevice logical_device;
     VkSurfaceKHR surface;
-    VkSwapchainKHR swap_chain;
+    VkSwapchainKHR swap_chain = VK_NULL_HANDLE;
     VkFormat swap_chain_image_format;
     VkExtent2D swap_chain_extent;
     VkDescriptorSetLayout descriptor_set_layout;
     VkPipelineLayout pipeline_layout;
     VkRenderPass render_pass;
     VkPipeline pipeline;
+    VkPipeline transparent_pipeline;
+    VkPipeline debug_line_pipeline = VK_NULL_HANDLE;
     VkCommandPool command_pool;
     VkDescriptorPool descriptor_pool;
     vector<VkDescriptorSet> descriptor_sets;
+    VkDescriptorSetLayout material_set_layout;
+    vector<VkDescriptorSet> material_descriptor_sets;
     vector<VkCommandBuffer> command_buffers;
     uint32_t current_frame = 0;
     bool frame_buffer_resized = false;
-
-    VkBuffer vertex_buffer;
-    VkDeviceMemory vertex_buffer_memory;
-    VkBuffer index_buffer;
-    VkDeviceMemory index_buffer_memory;
+    vector<RetiredSwapChain> retired_swap_chains;
+    vector<bool> swap_chain_images_acquired;
+    uint32_t swap_chain_images_acquired_count = 0;
+    ResizeStats resize_stats;
+    chrono::steady_clock::time_point last_frame_time;
+
+    FramePacer frame_pacer;
+    bool present_wait_supported = false;
+    bool surface_maintenance_enabled = false;
+    bool swapchain_maintenance_supported = false;
+    vector<const char*> instance_extensions;
+    vector<VkFence> present_fences;
+    vector<bool> present_fences_pending;
+    uint64_t presents_queued = 0;
+    uint64_t next_present_id = 1;
+    uint64_t last_present_id = 0;
+    PFN_vkWaitForPresentKHR wait_for_present = nullptr;
+    bool anisotropy_supported = false;
+    bool memory_budget_supported = false;
+    MemoryTracker memory_tracker;
+    ResourceRegistry resources;
+
+    VkQueryPool timestamp_pool = VK_NULL_HANDLE;
+    bool timestamps_supported = false;
+    float timestamp_period = 1.0f;
+    uint32_t timestamp_valid_bits = 64;
+    vector<bool> frame_timestamps_written;
+    // GPU intervals go into the trace on the CPU timeline through a device clock reading paired with steady_clock.
+    bool gpu_trace_supported = false;
+    PFN_vkGetCalibratedTimestampsEXT get_calibrated_timestamps = nullptr;
+    uint64_t gpu_clock_ticks = 0;
+    int64_t gpu_clock_ns = 0;
+
+    vector<unique_ptr<ReadbackSlot>> readback_slots;
+    vector<int32_t> frame_readback_slots;
+    VkMemoryPropertyFlags readback_memory_properties = 0;
+    // Signalled whenever a slot stops being busy, on the writer threads too.
+    mutex readback_mutex;
+    condition_variable readback_freed;
+    bool capture_supported = false;
+    bool multiview = false;
+    uint32_t view_pass_count = 1;
+    vector<VkImageView> layer_image_views;
+    vector<VkImageView> depth_layer_views;
+    uint64_t captures_dropped = 0;
+    CaptureWriter capture_writer;
+    string capture_name;
+
+    vector<BatchJob> batch_jobs;
+    uint32_t batch_failures = 0;
+    bool batch_camera = false;
+    glm::mat4 batch_model = glm::mat4(1.0f);
+    glm::mat4 batch_view = glm::mat4(1.0f);
+    chrono::steady_clock::time_point batch_start;
+
+    VkRenderPass late_render_pass = VK_NULL_HANDLE;
+    VkDescriptorSetLayout depth_pyramid_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout depth_pyramid_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline depth_pyramid_pipeline = VK_NULL_HANDLE;
+    VkDescriptorSetLayout cull_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout cull_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline cull_pipeline = VK_NULL_HANDLE;
+    VkSampler depth_pyramid_sampler = VK_NULL_HANDLE;
+    VkImage depth_pyramid = VK_NULL_HANDLE;
+    VkDeviceMemory depth_pyramid_memory = VK_NULL_HANDLE;
+    VkImageView depth_pyramid_view = VK_NULL_HANDLE;
+    vector<VkImageView> depth_pyramid_level_views;
+    vector<ResourceHandle> depth_pyramid_resources;
+    VkExtent2D depth_pyramid_extent{};
+    uint32_t depth_pyramid_levels = 0;
+    VkDescriptorPool occlusion_descriptor_pool = VK_NULL_HANDLE;
+    vector<VkDescriptorSet> depth_pyramid_descriptor_sets;
+    vector<VkDescriptorSet> cull_descriptor_sets;
+    VkBuffer visibility_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory visibility_buffer_memory = VK_NULL_HANDLE;
+    vector<VkBuffer> cull_count_buffers;
+    vector<VkDeviceMemory> cull_count_buffers_memory;
+    vector<uint32_t*> cull_counts_mapped;
+    vector<VkBuffer> indirect_buffers;
+    vector<VkDeviceMemory> indirect_buffers_memory;
+    vector<VkDrawIndexedIndirectCommand*> indirect_commands_mapped;
+    vector<size_t> indirect_capacity;
+    vector<uint64_t> frame_cull_numbers;
+    OcclusionStats occlusion_stats;
+
+    FrameStream frame_stream;
+    VkDescriptorSetLayout yuv_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout yuv_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline yuv_pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool yuv_descriptor_pool = VK_NULL_HANDLE;
+    vector<VkDescriptorSet> yuv_descriptor_sets;
+    VkSampler yuv_sampler = VK_NULL_HANDLE;
+    vector<VkBuffer> yuv_buffers;
+    vector<VkDeviceMemory> yuv_buffers_memory;
+    double last_gpu_frame_ms = -1.0;
+    unique_ptr<BenchmarkRunner> benchmark;
+
+    VkBuffer vertex_buffer = VK_NULL_HANDLE;
+    VkBuffer index_buffer = VK_NULL_HANDLE;
     vector<VkBuffer> uniform_buffers;
     vector<VkDeviceMemory> uniform_buffers_memory;
     vector<void*> uniform_buffers_mapped;
-
-    VkImage texture_image;
-    VkDeviceMemory texture_image_memory;
-    VkImageView texture_image_view;
+    vector<VkBuffer> view_buffers;
+    vector<VkDeviceMemory> view_buffers_memory;
+    vector<void*> view_buffers_mapped;
+    vector<VkBuffer> shadow_buffers;
+    vector<VkDeviceMemory> shadow_buffers_memory;
+    vector<void*> shadow_buffers_mapped;
+    vector<VkBuffer> instance_buffers;
+    vector<VkDeviceMemory> instance_buffers_memory;
+    vector<void*> instance_buffers_mapped;
+    vector<VkBuffer> visible_instance_buffers;
+    vector<VkDeviceMemory> visible_instance_buffers_memory;
+    vector<uint32_t*> visible_instances_mapped;
+    // Instances each frame's scene passes draw: all of them unless BVH culling is on.
+    vector<uint32_t> drawn_instance_counts;
+    // Instance boxes in the space the instance matrices map to, around the bound mesh's sphere.
+    SceneBvh scene_bvh;
+    bool scene_bvh_stale = true;
+    vector<Aabb> instance_boxes;
+    vector<uint32_t> visible_instances;
+    shared_ptr<const TriangleBvh> scene_mesh_bvh;
+    uint64_t bvh_frames = 0;
+    uint64_t bvh_visible = 0;
+    double bvh_cull_ms = 0.0;
+    uint32_t bvh_builds = 0;
+    TransformStore scene_transforms = TransformStore(MAX_FRAMES_IN_FLIGHT);
+    VkDeviceSize material_stride;
+    VkBuffer transient_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory transient_buffer_memory = VK_NULL_HANDLE;
+    TransientRing transient_geometry;
+    TransientAllocation debug_vertices;
+    TransientAllocation debug_indices;
+    uint32_t debug_index_count = 0;
+
+    VkDescriptorSetLayout skin_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout skin_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline skin_pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool skin_descriptor_pool = VK_NULL_HANDLE;
+    vector<VkDescriptorSet> skin_descriptor_sets;
+    vector<VkBuffer> skin_palette_buffers;
+    vector<VkDeviceMemory> skin_palette_buffers_memory;
+    vector<glm::mat4*> skin_palettes_mapped;
+    vector<VkBuffer> morph_weight_buffers;
+    vector<VkDeviceMemory> morph_weight_buffers_memory;
+    vector<float*> morph_weights_mapped;
+    vector<VkBuffer> skinned_vertex_buffers;
+    vector<VkDeviceMemory> skinned_vertex_buffers_memory;
+    Skin scene_skin;
+    VkBuffer skin_weight_buffer = VK_NULL_HANDLE;
+    VkBuffer morph_target_buffer = VK_NULL_HANDLE;
+    uint32_t skinned_vertex_count = 0;
+    uint32_t skin_pose_count = 0;
+    double skin_sample_ms = 0.0;
+    uint64_t skin_samples = 0;
+
+    VkDescriptorSetLayout particle_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout particle_compute_layout = VK_NULL_HANDLE;
+    VkPipeline particle_compute_pipeline = VK_NULL_HANDLE;
+    VkDescriptorSetLayout particle_draw_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout particle_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline particle_pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool particle_descriptor_pool = VK_NULL_HANDLE;
+    vector<VkDescriptorSet> particle_compute_sets;
+    vector<VkDescriptorSet> particle_draw_sets;
+    vector<VkBuffer> particle_buffers;
+    vector<VkDeviceMemory> particle_buffers_memory;
+    vector<VkBuffer> alive_list_buffers;
+    vector<VkDeviceMemory> alive_list_buffers_memory;
+    VkBuffer dead_list_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory dead_list_buffer_memory = VK_NULL_HANDLE;
+    VkBuffer particle_counter_buffer = VK_NULL_HANDLE;
+    VkDeviceMemory particle_counter_buffer_memory = VK_NULL_HANDLE;
+    ParticleParams particle_params{};
+    float particle_time = 0.0f;
+    double particle_emit_carry = 0.0;
+    bool particle_timestamps = false;
+    uint32_t particle_timestamp_valid_bits = 64;
+    double particle_gpu_ms = 0.0;
+    uint64_t particle_frames_timed = 0;
+
+    ClusterGrid light_grid;
+    float light_range = 0.0f;
+    vector<GpuLight> base_lights;
+    vector<VkBuffer> lighting_buffers;
+    vector<VkDeviceMemory> lighting_buffers_memory;
+    vector<void*> lighting_buffers_mapped;
+    vector<VkBuffer> light_buffers;
+    vector<VkDeviceMemory> light_buffers_memory;
+    vector<GpuLight*> lights_mapped;
+    vector<VkBuffer> light_grid_buffers;
+    vector<VkDeviceMemory> light_grid_buffers_memory;
+    VkDescriptorSetLayout light_cull_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout light_cull_layout = VK_NULL_HANDLE;
+    VkPipeline light_cull_pipeline = VK_NULL_HANDLE;
+    VkDescriptorPool light_descriptor_pool = VK_NULL_HANDLE;
+    vector<VkDescriptorSet> light_cull_sets;
+
+    ShadowCascades shadow_cascades;
+    vector<glm::mat4> shadow_casters;
+    VkRenderPass shadow_render_pass = VK_NULL_HANDLE;
+    VkPipeline shadow_pipeline = VK_NULL_HANDLE;
+    VkImage shadow_atlas = VK_NULL_HANDLE;
+    VkDeviceMemory shadow_atlas_memory = VK_NULL_HANDLE;
+    VkImageView shadow_atlas_view = VK_NULL_HANDLE;
+    vector<VkImageView> shadow_layer_views;
+    vector<VkFramebuffer> shadow_framebuffers;
+    VkSampler shadow_sampler = VK_NULL_HANDLE;
+    uint64_t shadow_draws = 0;
+    uint64_t shadow_draws_saved = 0;
+
+    // With dynamic resolution the scene renders into the top-left render_extent of a swap-chain-sized
+    // target, and the upscale pass stretches that region over the swap chain image.
+    ResolutionController resolution;
+    VkExtent2D render_extent{};
+    vector<float> frame_render_scales;
+    VkImage scene_color_image = VK_NULL_HANDLE;
+    VkDeviceMemory scene_color_memory = VK_NULL_HANDLE;
+    VkImageView scene_color_view = VK_NULL_HANDLE;
+    vector<ResourceHandle> color_target_resources;
+    VkRenderPass upscale_render_pass = VK_NULL_HANDLE;
+    vector<VkFramebuffer> upscale_framebuffers;
+    VkDescriptorSetLayout upscale_set_layout = VK_NULL_HANDLE;
+    VkPipelineLayout upscale_pipeline_layout = VK_NULL_HANDLE;
+    VkPipeline upscale_pipeline = VK_NULL_HANDLE;
+    VkSampler upscale_sampler = VK_NULL_HANDLE;
+    VkDescriptorSet upscale_descriptor_set = VK_NULL_HANDLE;
+    // Without post-processing the upscale is a raster pass; with it the final blit stretches the image.
+    bool raster_upscale = false;
+
+    // With MSAA the scene renders into msaa_color_image and resolves into whatever target it had before.
+    VkSampleCountFlagBits msaa_samples = VK_SAMPLE_COUNT_1_BIT;
+    VkImage msaa_color_image = VK_NULL_HANDLE;
+    VkDeviceMemory msaa_color_memory = VK_NULL_HANDLE;
+    VkImageView msaa_color_view = VK_NULL_HANDLE;
+
+    // Post-processing: the scene target is float, tonemap and FXAA ping-pong between the two 8-bit images,
+    // and sharpen writes back into the scene target, which is blitted to the swap chain image.
+    bool post_processing = false;
+    const VkFormat POST_HDR_FORMAT = VK_FORMAT_R16G16B16A16_SFLOAT;
+    array<VkImage, 2> post_images{};
+    array<VkDeviceMemory, 2> post_image_memory{};
+    array<VkImageView, 2> post_image_views{};
+    VkDescriptorSetLayout post_set_layout = VK_NULL_HANDLE;
+    array<VkPipelineLayout, POST_PASS_COUNT> post_pipeline_layouts{};
+    array<VkPipeline, POST_PASS_COUNT> post_pipelines{};
+    array<VkDescriptorSet, POST_PASS_COUNT> post_descriptor_sets{};
+    double post_gpu_ms = 0.0;
+    uint64_t post_frames_timed = 0;
+
+    bool async_compute = false;
+    uint32_t compute_family_index = 0;
+    QueueTimeline compute_timeline;
+    VkCommandPool compute_command_pool = VK_NULL_HANDLE;
+    vector<VkCommandBuffer> compute_command_buffers;
+
+    VkImageView texture_image_view = VK_NULL_HANDLE;
+    glm::vec3 mesh_center = glm::vec3(0.0f);
+    float mesh_radius = 1.0f;
     VkSampler texture_sampler;
 
+    vector<char> vert_shader_code;
+    vector<char> frag_shader_code;
+    vector<char> yuv_shader_code;
+    vector<char> debug_vert_shader_code;
+    vector<char> debug_frag_shader_code;
+    vector<char> particle_vert_shader_code;
+    vector<char> particle_frag_shader_code;
+    vector<char> shadow_vert_shader_code;
+    vector<char> upscale_vert_shader_code;
+    vector<char> upscale_frag_shader_code;
+
+    WorkerPool workers;
+    AssetManager assets{ workers, static_cast<uint64_t>(options.asset_cache_mb) * 1024 * 1024 };
+    uint32_t mesh_asset_type = 0;
+    uint32_t texture_asset_type = 0;
+    AssetId model_asset = INVALID_ASSET;
+    AssetId texture_asset = INVALID_ASSET;
+    unordered_map<AssetId, GpuMesh> gpu_meshes;
+    unordered_map<AssetId, GpuTexture> gpu_textures;
+    VkCommandBuffer upload_command_buffer = VK_NULL_HANDLE;
+    vector<StagingBuffer> pending_staging_buffers;
+
     VkImage depth_image;
     VkDeviceMemory depth_image_memory;
     VkImageView depth_image_view;
 
     vector<VkSemaphore> image_semaphores;
     vector<VkSemaphore> render_semaphores;
-    vector<VkFence> in_flight_fences;
+    QueueTimeline graphics_timeline;
+    vector<GpuTimelinePoint> frame_timeline_points;
 
     void process();
     void start_vulkan();
@@ -143,37 +756,126 @@ private:
     VkPhysicalDevice get_physical_device();
     void get_logical_device();
     uint32_t get_graphics_queue_index();
+    bool has_instance_extension(const char* extension_name);
+    bool has_device_extension(const char* extension_name);
+    bool get_present_wait_support();
+    bool get_swapchain_maintenance_support();
+    bool get_gpu_trace_support();
+    void wait_for_presents(uint64_t timeout);
     void add_surface();
     void add_swap_chain();
+    void add_offscreen_targets();
     void recreate_swap_chain();
     void remove_swap_chain();
-    VkImageView add_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags);
+    bool is_presentation_done(const RetiredSwapChain& retired, bool wait);
+    void mark_image_acquired(uint32_t image_index);
+    void destroy_retired_swap_chains(bool wait = false);
+    void track_frame_time();
+    void print_resize_stats();
+    VkImageView add_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags,
+        uint32_t first_layer = 0, uint32_t layers = 1, uint32_t first_level = 0, uint32_t levels = 1);
     void add_image_views();
+    void add_view_layers(uint32_t view_count);
     VkSurfaceFormatKHR get_swap_surface_format();
     VkPresentModeKHR get_swap_present_mode();
     VkExtent2D get_swap_extend(VkSurfaceCapabilitiesKHR capabilities);
     void add_descriptor_set_layout();
+    void read_shaders();
     void add_graphics_pipeline();
     void add_render_pass();
     void add_framebuffers();
     void add_command_pool();
     void add_descriptor_pool();
     void add_descriptor_sets();
+    void add_material_descriptor_sets(GpuMesh& mesh);
     void add_command_buffers();
     void add_sync_objects();
+    VkFence add_fence();
+    void add_queue_timelines();
+    void add_timeline(QueueTimeline& timeline, uint32_t family_index);
+    GpuTimelinePoint submit_to_timeline(QueueTimeline& timeline, VkCommandBuffer buff,
+        const vector<SubmitWait>& waits, VkSemaphore binary_signal = VK_NULL_HANDLE);
+    GpuTimelinePoint last_submitted(const QueueTimeline& timeline);
+    bool is_gpu_work_done(GpuTimelinePoint point);
+    void wait_gpu_work(GpuTimelinePoint point);
+    void retire_resource(ResourceHandle handle);
+    void collect_retired_resources();
     void add_buffer(VkBuffer& buff, VkDeviceMemory& buff_memory, VkDeviceSize size,
-        VkBufferUsageFlags usage, VkMemoryPropertyFlags properties);
+        VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, MemoryCategory category, bool shared_with_compute = false);
+    void free_memory(VkDeviceMemory memory);
     void copy_buffer(VkBuffer from_buff, VkBuffer to_buff, VkDeviceSize size);
-    void load_model();
-    void add_vertex_buffer();
-    void add_indices_buffer();
+    shared_ptr<MeshData> decode_model(const string& path, const vector<uint8_t>& bytes);
+    void upload_buffer(const void* contents, VkDeviceSize size, VkBufferUsageFlags usage,
+        VkBuffer& buff, VkDeviceMemory& buff_memory, MemoryCategory category);
+    uint64_t create_mesh(AssetId asset, const MeshData& mesh_data);
+    void destroy_mesh(AssetId asset);
     void add_uniform_buffers();
+    void add_scene_transforms();
+    void add_instance_buffers();
+    void add_visible_instance_buffers();
+    void add_skinning_pipeline();
+    void add_skinning_resources();
+    void remove_skinning_resources();
+    void update_skin_poses(uint32_t frame, float time);
+    void record_skinning(VkCommandBuffer buff);
+    void record_skinned_draws(VkCommandBuffer buff, const Submesh& submesh);
+    void print_skinning_stats();
+    void add_particle_pipelines();
+    void add_particle_resources();
+    void remove_particle_resources();
+    void update_particles(uint32_t frame, float time);
+    void record_particle_simulation(VkCommandBuffer buff);
+    GpuTimelinePoint submit_particle_simulation();
+    void record_particles(VkCommandBuffer buff, uint32_t view_pass);
+    void print_particle_stats();
+    void add_light_buffers();
+    void add_light_culling_pipeline();
+    void add_light_culling_sets();
+    void remove_light_resources();
+    void update_lights(uint32_t frame, float time);
+    void record_light_culling(VkCommandBuffer buff);
+    uint32_t compare_light_lists(const vector<uint32_t>& counts, const vector<uint32_t>& indices);
+    void print_lighting_stats();
+    void add_shadow_render_pass();
+    void add_shadow_atlas();
+    void remove_shadow_resources();
+    void update_shadows(uint32_t frame);
+    void record_shadow_passes(VkCommandBuffer buff);
+    void print_shadow_stats();
+    void add_upscale_pass();
+    void add_upscale_pipeline();
+    void add_color_targets();
+    void retire_color_targets();
+    void remove_upscale_resources();
+    void update_render_scale();
+    void record_upscale_pass(VkCommandBuffer buff, uint32_t image_index);
+    void add_post_pipelines();
+    void add_post_targets();
+    void remove_post_resources();
+    void record_post_chain(VkCommandBuffer buff, uint32_t image_index);
+    void print_post_stats();
+    void add_transient_geometry();
+    void remove_transient_geometry();
+    void write_debug_bounds();
+    void record_debug_bounds(VkCommandBuffer buff);
+    void update_scene_transforms(uint32_t current_frame, float time);
+    void refresh_scene_bvh();
+    void cull_instances(uint32_t frame);
+    void pick(double cursor_x, double cursor_y);
+    void print_bvh_stats();
     void update_uniform_buffer(uint32_t current_frame);
+    void add_material_buffer(GpuMesh& mesh);
+    void build_draw_list();
+    void print_draw_stats();
     vector<char> get_shader_code(string filename);
     VkShaderModule get_shader_module(vector<char> shader_code);
     uint32_t get_graphics_family_index();
+    uint32_t get_compute_family_index();
     uint32_t get_present_family_index();
     uint32_t get_memory_type(uint32_t filter, VkMemoryPropertyFlags properties);
+    uint32_t get_memory_heap(uint32_t memory_type);
+    void add_memory_tracking();
+    void update_memory_budget();
 
     void add_depth_resources();
     VkFormat get_supported_format(const vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features);
@@ -182,51 +884,192 @@ private:
 
     VkCommandBuffer begin_single_time_commands();
     void end_single_time_commands(VkCommandBuffer command_buff);
-    void add_texture_image();
-    void add_texture_image_view();
+    void begin_upload_batch();
+    void flush_upload_batch();
+    void release_staging_buffer(VkBuffer buff, VkDeviceMemory buff_memory);
+    shared_ptr<TextureData> decode_texture(const string& path, const vector<uint8_t>& bytes);
+    uint64_t create_texture(AssetId asset, const TextureData& texture_data);
+    void destroy_texture(AssetId asset);
+    void add_asset_loaders();
+    void bind_scene_assets();
+    void run_batch();
+    bool bind_batch_job(const BatchJob& job, const BatchRequest& request);
+    void print_batch_stats();
     void add_image(uint32_t texture_width, uint32_t texture_height, VkFormat format, VkImageTiling tiling,
-        VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& image_memory);
+        VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& image_memory,
+        MemoryCategory category, uint32_t layers = 1, uint32_t mip_levels = 1, VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT);
     void add_texture_sampler();
     void change_image_layout(VkImage image, VkFormat format, VkImageLayout layout, VkImageLayout new_layout);
     void copy_buffer_to_image(VkBuffer buff, VkImage image, uint32_t width, uint32_t height);
     
     void record_command_buffer(VkCommandBuffer buff, uint32_t image_index);
+    void record_readback(VkCommandBuffer buff, uint32_t image_index);
+    void record_image_readback(VkCommandBuffer buff, uint32_t image_index, ReadbackSlot& slot);
+    void record_yuv_readback(VkCommandBuffer buff, uint32_t image_index, ReadbackSlot& slot);
     void draw_frame();
+    void present_frame(uint32_t image_index);
+    void add_readback_ring();
+    bool should_capture_frame();
+    int32_t acquire_readback_slot(VkDeviceSize size);
+    void release_readback_slot(ReadbackSlot* slot);
+    void wait_readback_slot();
+    void collect_readback(uint32_t frame);
+    void finish_capture();
+    void remove_readback_ring();
+    void add_stream_resources();
+    void remove_stream_resources();
+    bool should_close();
+
+    void add_timestamp_queries();
+    VkDescriptorSetLayout add_compute_set_layout(const vector<VkDescriptorType>& types);
+    void add_compute_pipeline(const vector<char>& code, VkDescriptorSetLayout set_layout, uint32_t push_constant_size,
+        VkPipelineLayout& pipeline_layout, VkPipeline& pipeline);
+    void add_yuv_pipeline();
+    void add_occlusion_pipelines();
+    void add_occlusion_buffers();
+    void add_depth_pyramid();
+    void remove_depth_pyramid();
+    void remove_occlusion_resources();
+    void write_indirect_commands(uint32_t frame);
+    void record_scene_pass(VkCommandBuffer buff, VkRenderPass pass, VkFramebuffer framebuffer, uint32_t view_pass,
+        DrawSource opaque_source, DrawSource transparent_source);
+    void record_cull_pass(VkCommandBuffer buff, uint32_t phase);
+    void record_depth_pyramid(VkCommandBuffer buff);
+    void collect_occlusion_stats(uint32_t frame);
+    void print_occlusion_stats();
+    double read_gpu_frame_time(uint32_t frame);
+    double read_gpu_interval(uint32_t first_query, uint32_t valid_bits);
+    int64_t timestamp_delta(uint64_t from, uint64_t to, uint32_t valid_bits);
+    bool read_gpu_timestamps(uint32_t first_query, array<uint64_t, 2>& timestamps);
+    void calibrate_gpu_clock();
+    void trace_gpu_frame(uint32_t frame);
+    void finish_benchmark();
     
     static void frame_buffer_resize_callback(GLFWwindow* window, int width, int height);
+    static void mouse_button_callback(GLFWwindow* window, int button, int action, int mods);
 
     void make_window();
 };
 
 void VulkanManager::start_vulkan()
 {
-    create_vulkan();
-    add_surface();
-    phys_device = get_physical_device();
-    get_logical_device();
-    add_swap_chain();
-    add_image_views();
-    add_render_pass();
-    add_descriptor_set_layout();
-    add_graphics_pipeline();
-    add_command_pool();
-    add_depth_resources();
-    add_framebuffers();
-    add_texture_image();
-    add_texture_image_view();
-    add_texture_sampler();
-    load_model();
-    add_vertex_buffer();
-    add_indices_buffer();
-    add_uniform_buffers();
-    add_descriptor_pool();
-    add_descriptor_sets();
-    add_command_buffers();
-    add_sync_objects();
+    TRACE_ZONE("start_vulkan");
+    TaskGraph startup;
+
+    if (!options.batch_manifest.empty() and !load_batch_manifest(options.batch_manifest, batch_jobs))
+        exit_code = EXIT_FAILURE;
+
+    add_asset_loaders();
+    model_asset = assets.request(mesh_asset_type, options.model_path, 1);
+    texture_asset = assets.request(texture_asset_type, options.texture_path, 0);
+
+    TaskId shaders = startup.add_task("read_shaders", TASK_ANY_THREAD, {}, [this]() { read_shaders(); });
+    TaskId device = startup.add_task("device", TASK_MAIN_THREAD, {}, [this]()
+        {
+            create_vulkan();
+            add_surface();
+            phys_device = get_physical_device();
+            get_logical_device();
+            add_memory_tracking();
+            add_queue_timelines();
+            resources.init(logical_device, [this](VkDeviceMemory memory) { free_memory(memory); });
+        });
+    TaskId swap_chain_task = startup.add_task("swap_chain", TASK_MAIN_THREAD, { device }, [this]()
+        {
+            add_swap_chain();
+            add_image_views();
+            add_render_pass();
+            if (options.shadow_cascades > 0)
+                add_shadow_render_pass();
+            if (dynamic_resolution)
+            {
+                resolution.init(options.gpu_budget_ms, static_cast<float>(options.min_render_scale), 1.0f);
+                frame_render_scales.assign(MAX_FRAMES_IN_FLIGHT, 1.0f);
+            }
+            if (raster_upscale)
+                add_upscale_pass();
+        });
+    TaskId set_layouts = startup.add_task("set_layouts", TASK_MAIN_THREAD, { device }, [this]() { add_descriptor_set_layout(); });
+    TaskId pipelines = startup.add_task("pipelines", TASK_ANY_THREAD, { swap_chain_task, set_layouts, shaders }, [this]()
+        {
+            // First: the particle draw pipeline is built on the layout made here.
+            if (options.particle_count > 0)
+                add_particle_pipelines();
+            add_graphics_pipeline();
+            if (streaming)
+                add_yuv_pipeline();
+            if (options.occlusion_culling)
+                add_occlusion_pipelines();
+            if (options.skinning)
+                add_skinning_pipeline();
+            if (options.light_count > 0)
+                add_light_culling_pipeline();
+            if (raster_upscale)
+                add_upscale_pipeline();
+            if (post_processing)
+                add_post_pipelines();
+        });
+    TaskId commands = startup.add_task("command_pool", TASK_MAIN_THREAD, { device }, [this]() { add_command_pool(); });
+    TaskId attachments = startup.add_task("attachments", TASK_MAIN_THREAD, { swap_chain_task, commands }, [this]()
+        {
+            add_depth_resources();
+            add_color_targets();
+            add_framebuffers();
+            add_shadow_atlas();
+        });
+    TaskId frame_resources = startup.add_task("frame_resources", TASK_MAIN_THREAD, { device }, [this]()
+        {
+            add_uniform_buffers();
+            add_scene_transforms();
+            add_instance_buffers();
+            add_transient_geometry();
+            add_light_buffers();
+        });
+    TaskId uploads = startup.add_task("uploads", TASK_MAIN_THREAD, { set_layouts, commands, attachments, frame_resources }, [this]()
+        {
+            assets.wait_all();
+            begin_upload_batch();
+            assets.update();
+            flush_upload_batch();
+            bind_scene_assets();
+            add_texture_sampler();
+        });
+    TaskId descriptors = startup.add_task("descriptors", TASK_MAIN_THREAD, { set_layouts, uploads }, [this]()
+        {
+            add_descriptor_pool();
+            add_descriptor_sets();
+        });
+    startup.add_task("frame_sync", TASK_MAIN_THREAD, { pipelines, descriptors }, [this]()
+        {
+            add_command_buffers();
+            add_sync_objects();
+            add_timestamp_queries();
+            if (streaming)
+                add_stream_resources();
+            if (options.occlusion_culling)
+            {
+                add_occlusion_buffers();
+                add_depth_pyramid();
+            }
+            if (options.skinning)
+                add_skinning_resources();
+            if (options.particle_count > 0)
+                add_particle_resources();
+            if (options.light_count > 0)
+                add_light_culling_sets();
+            add_readback_ring();
+        });
+
+    startup.run(options.serial_startup ? nullptr : &workers);
+    startup.print_timeline();
+
+    if (options.benchmark)
+        benchmark = make_unique<BenchmarkRunner>(options.warmup_frames, options.benchmark_frames);
 }
 
 void VulkanManager::create_vulkan()
 {
+    TRACE_ZONE("create_vulkan");
     VkApplicationInfo app_info = VulkanManager::paste_app_info();
     VkInstanceCreateInfo create_info = VulkanManager::paste_create_info(&app_info);
 
@@ -244,7 +1087,7 @@ VkApplicationInfo VulkanManager::paste_app_info()
     app_info.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
     app_info.pEngineName = "No Engine";
     app_info.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    app_info.apiVersion = VK_API_VERSION_1_0;
+    app_info.apiVersion = VK_API_VERSION_1_2;
 
     return app_info;
 }
@@ -258,10 +1101,20 @@ VkInstanceCreateInfo VulkanManager::paste_create_info(VkApplicationInfo* app_inf
     create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
     create_info.pApplicationInfo = app_info;
 
-    glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extensions_count);
+    glfw_extensions = options.headless ? nullptr : glfwGetRequiredInstanceExtensions(&glfw_extensions_count);
+    instance_extensions.assign(glfw_extensions, glfw_extensions + glfw_extensions_count);
+
+    // Needed by VK_EXT_swapchain_maintenance1, whose present fences tell when a retired swap chain is done presenting.
+    surface_maintenance_enabled = !options.headless and has_instance_extension(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME)
+        and has_instance_extension(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME);
+    if (surface_maintenance_enabled)
+    {
+        instance_extensions.push_back(VK_KHR_GET_SURFACE_CAPABILITIES_2_EXTENSION_NAME);
+        instance_extensions.push_back(VK_EXT_SURFACE_MAINTENANCE_1_EXTENSION_NAME);
+    }
 
-    create_info.enabledExtensionCount = (uint32_t) glfw_extensions_count;
-    create_info.ppEnabledExtensionNames = glfw_extensions;
+    create_info.enabledExtensionCount = (uint32_t) instance_extensions.size();
+    create_info.ppEnabledExtensionNames = instance_extensions.data();
 
     create_info.enabledLayerCount = 0;
 
@@ -284,11 +1137,34 @@ uint32_t VulkanManager::get_graphics_family_index()
     }
 }
 
+uint32_t VulkanManager::get_compute_family_index()
+{
+    uint32_t queue_family_count = 0;
+    vector<VkQueueFamilyProperties> families_property;
+
+    vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, nullptr);
+    families_property.resize(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, families_property.data());
+
+    // A compute family without graphics runs beside the graphics queue rather than behind it.
+    for (uint32_t family_index = 0; family_index < queue_family_count; family_index++)
+    {
+        VkQueueFlags flags = families_property[family_index].queueFlags;
+
+        if ((flags & VK_QUEUE_COMPUTE_BIT) and !(flags & VK_QUEUE_GRAPHICS_BIT))
+            return family_index;
+    }
+    return get_graphics_family_index();
+}
+
 uint32_t VulkanManager::get_present_family_index()
 {
     VkBool32 present_support;
     uint32_t queue_family_count = 0;
 
+    if (options.headless)
+        return get_graphics_family_index();
+
     vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, nullptr);
 
     for (int family_index = 0; family_index < queue_family_count; family_index++)
@@ -300,6 +1176,51 @@ uint32_t VulkanManager::get_present_family_index()
     return 0;
 }
 
+uint32_t VulkanManager::get_memory_heap(uint32_t memory_type)
+{
+    VkPhysicalDeviceMemoryProperties memory_properties;
+
+    vkGetPhysicalDeviceMemoryProperties(phys_device, &memory_properties);
+
+    return memory_properties.memoryTypes[memory_type].heapIndex;
+}
+
+void VulkanManager::add_memory_tracking()
+{
+    VkPhysicalDeviceMemoryProperties memory_properties;
+
+    vkGetPhysicalDeviceMemoryProperties(phys_device, &memory_properties);
+
+    memory_tracker.set_heaps(memory_properties);
+    memory_tracker.set_budget_fraction(options.memory_budget_fraction);
+    memory_tracker.set_pressure_handler([this](uint32_t heap, VkDeviceSize excess)
+        {
+            cout << "Memory heap " << heap << " over budget by " << excess / (1024 * 1024) << " MB!" << endl;
+            assets.trim(excess);
+        });
+    update_memory_budget();
+}
+
+void VulkanManager::update_memory_budget()
+{
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget_properties{};
+    VkPhysicalDeviceMemoryProperties2 memory_properties{};
+
+    if (memory_budget_supported)
+    {
+        budget_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+        memory_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+        memory_properties.pNext = &budget_properties;
+
+        vkGetPhysicalDeviceMemoryProperties2(phys_device, &memory_properties);
+
+        for (uint32_t heap = 0; heap < memory_properties.memoryProperties.memoryHeapCount; heap++)
+            memory_tracker.update_budget(heap, budget_properties.heapBudget[heap], budget_properties.heapUsage[heap]);
+    }
+
+    memory_tracker.check_pressure();
+}
+
 uint32_t VulkanManager::get_memory_type(uint32_t filter, VkMemoryPropertyFlags properties)
 {
     VkPhysicalDeviceMemoryProperties memory_properties;
@@ -323,7 +1244,12 @@ VkPhysicalDevice VulkanManager::get_physical_device()
     devices = new VkPhysicalDevice[device_count];
     vkEnumeratePhysicalDevices(vulkan_instance, &device_count, devices);
 
-    new_device = devices[0];
+    if (options.device_index >= device_count)
+    {
+        cout << "Physical device " << options.device_index << " not found, using device 0" << endl;
+        options.device_index = 0;
+    }
+    new_device = devices[options.device_index];
     
     delete[] devices;
     cout << "Getting physical device success!" << endl;
@@ -332,29 +1258,135 @@ VkPhysicalDevice VulkanManager::get_physical_device()
 
 void VulkanManager::get_logical_device()
 {
+    TRACE_ZONE("get_logical_device");
     float queue_priority = 1.0;
-    int queue_index_count = get_graphics_queue_index();
-
-    VkDeviceQueueCreateInfo logical_device_queue_create_info{};
-    VkDeviceQueueCreateInfo* queue_create_infos = new VkDeviceQueueCreateInfo[queue_index_count];
+    vector<uint32_t> queue_families;
+    vector<VkDeviceQueueCreateInfo> queue_create_infos;
 
     VkPhysicalDeviceFeatures device_features{};
     VkDeviceCreateInfo logical_device_create_info{};
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features{};
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features{};
+    VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT swapchain_maintenance_features{};
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_features{};
+    VkPhysicalDeviceMultiviewFeatures multiview_features{};
+    VkPhysicalDeviceMultiviewProperties multiview_properties{};
+    VkPhysicalDeviceProperties2 properties{};
+    VkPhysicalDeviceFeatures supported_features{};
+    VkPhysicalDeviceTimelineSemaphoreFeatures supported_timeline_features{};
+    VkPhysicalDeviceMultiviewFeatures supported_multiview_features{};
+    VkPhysicalDeviceFeatures2 supported_features2{};
+
+    vkGetPhysicalDeviceFeatures(phys_device, &supported_features);
+
+    // Every queue submission is ordered by timeline semaphores and the vertex shader reads gl_ViewIndex,
+    // so there is no path without either.
+    supported_timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    supported_multiview_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES;
+    supported_multiview_features.pNext = &supported_timeline_features;
+    supported_features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features2.pNext = &supported_multiview_features;
+    vkGetPhysicalDeviceFeatures2(phys_device, &supported_features2);
+    if (!supported_timeline_features.timelineSemaphore or !supported_multiview_features.multiview)
+    {
+        cout << "Device lacks " << (supported_timeline_features.timelineSemaphore ? "multiview" : "timelineSemaphore")
+            << ", which this renderer requires" << endl;
+        throw std::runtime_error("failed to create logical device!");
+    }
+    anisotropy_supported = supported_features.samplerAnisotropy == VK_TRUE;
+    device_features.samplerAnisotropy = supported_features.samplerAnisotropy;
+
+    // Culled draws start at their list's offset through the indirect command's firstInstance.
+    if (options.occlusion_culling and !supported_features.drawIndirectFirstInstance)
+    {
+        cout << "Device lacks drawIndirectFirstInstance, occlusion culling disabled" << endl;
+        options.occlusion_culling = false;
+    }
+    device_features.drawIndirectFirstInstance = options.occlusion_culling ? VK_TRUE : VK_FALSE;
+
+    if (options.headless)
+        device_extensions.clear();
+
+    memory_budget_supported = has_device_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+    if (memory_budget_supported)
+        device_extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+
+    gpu_trace_supported = !options.trace_output.empty() and get_gpu_trace_support();
+    if (gpu_trace_supported)
+        device_extensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+
+    timeline_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES;
+    timeline_features.timelineSemaphore = VK_TRUE;
+    logical_device_create_info.pNext = &timeline_features;
+
+    present_wait_supported = !options.headless and get_present_wait_support();
+    if (present_wait_supported)
+    {
+        present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+        present_id_features.presentId = VK_TRUE;
+        present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+        present_wait_features.pNext = &present_id_features;
+        present_wait_features.presentWait = VK_TRUE;
+
+        device_extensions.push_back(VK_KHR_PRESENT_ID_EXTENSION_NAME);
+        device_extensions.push_back(VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+        timeline_features.pNext = &present_wait_features;
+    }
+
+    swapchain_maintenance_supported = surface_maintenance_enabled and get_swapchain_maintenance_support();
+    if (swapchain_maintenance_supported)
+    {
+        swapchain_maintenance_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT;
+        swapchain_maintenance_features.pNext = timeline_features.pNext;
+        swapchain_maintenance_features.swapchainMaintenance1 = VK_TRUE;
+
+        device_extensions.push_back(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME);
+        timeline_features.pNext = &swapchain_maintenance_features;
+    }
+
+    // Multiview is core since 1.1; the vertex shader reads gl_ViewIndex even for a single view.
+    multiview_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_FEATURES;
+    multiview_features.pNext = timeline_features.pNext;
+    multiview_features.multiview = VK_TRUE;
+    timeline_features.pNext = &multiview_features;
+
+    multiview_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MULTIVIEW_PROPERTIES;
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &multiview_properties;
+    vkGetPhysicalDeviceProperties2(phys_device, &properties);
+
+    if (options.view_count > multiview_properties.maxMultiviewViewCount)
+    {
+        cout << "Device supports " << multiview_properties.maxMultiviewViewCount << " views, rendering that many" << endl;
+        options.view_count = multiview_properties.maxMultiviewViewCount;
+    }
+    multiview = options.view_count > 1 and !options.view_passes;
+    view_pass_count = options.view_passes ? options.view_count : 1;
 
-    device_features.samplerAnisotropy = VK_TRUE;
+    compute_family_index = get_compute_family_index();
+    async_compute = options.particle_count > 0 and options.async_compute and compute_family_index != get_graphics_family_index();
+    if (!async_compute)
+        compute_family_index = get_graphics_family_index();
 
-    for (int index = 0; index < queue_index_count; index++)
+    // One queue from each family in use; a family may serve graphics, compute and present alike.
+    queue_families = { get_graphics_family_index(), compute_family_index, get_present_family_index() };
+    for (uint32_t family_index : queue_families)
     {
-        logical_device_queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-        logical_device_queue_create_info.queueFamilyIndex = index;
-        logical_device_queue_create_info.queueCount = 1;
-        logical_device_queue_create_info.pQueuePriorities = &queue_priority;
-        queue_create_infos[index] = logical_device_queue_create_info;
+        VkDeviceQueueCreateInfo queue_create_info{};
+
+        if (any_of(queue_create_infos.begin(), queue_create_infos.end(),
+            [family_index](const VkDeviceQueueCreateInfo& info) { return info.queueFamilyIndex == family_index; }))
+            continue;
+        queue_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_create_info.queueFamilyIndex = family_index;
+        queue_create_info.queueCount = 1;
+        queue_create_info.pQueuePriorities = &queue_priority;
+        queue_create_infos.push_back(queue_create_info);
     }
 
     logical_device_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    logical_device_create_info.pQueueCreateInfos = queue_create_infos;
-    logical_device_create_info.queueCreateInfoCount = 1;
+    logical_device_create_info.pQueueCreateInfos = queue_create_infos.data();
+    logical_device_create_info.queueCreateInfoCount = static_cast<uint32_t>(queue_create_infos.size());
     logical_device_create_info.pEnabledFeatures = &device_features;
     logical_device_create_info.enabledExtensionCount = device_extensions.size();
     logical_device_create_info.ppEnabledExtensionNames = device_extensions.data();
@@ -364,7 +1396,129 @@ void VulkanManager::get_logical_device()
         throw std::runtime_error("failed to create logical device!");
     }
     cout << "Logical device making success!" << endl;
-    delete[] queue_create_infos;
+
+    if (present_wait_supported)
+        wait_for_present = reinterpret_cast<PFN_vkWaitForPresentKHR>(vkGetDeviceProcAddr(logical_device, "vkWaitForPresentKHR"));
+    present_wait_supported = wait_for_present != nullptr;
+
+    if (gpu_trace_supported)
+        get_calibrated_timestamps = reinterpret_cast<PFN_vkGetCalibratedTimestampsEXT>(vkGetDeviceProcAddr(logical_device, "vkGetCalibratedTimestampsEXT"));
+    gpu_trace_supported = get_calibrated_timestamps != nullptr;
+    if (!options.trace_output.empty() and !gpu_trace_supported)
+        cout << "Device can't calibrate its timestamps, the trace has CPU zones only" << endl;
+
+    frame_pacer.set_frame_rate_cap(options.frame_rate_cap);
+    frame_pacer.set_present_tracking(present_wait_supported);
+}
+
+bool VulkanManager::has_instance_extension(const char* extension_name)
+{
+    uint32_t extension_count = 0;
+    vector<VkExtensionProperties> extensions;
+
+    vkEnumerateInstanceExtensionProperties(nullptr, &extension_count, nullptr);
+    extensions.resize(extension_count);
+    vkEnumerateInstanceExtensionProperties(nullptr, &extension_count, extensions.data());
+
+    for (const VkExtensionProperties& extension : extensions)
+    {
+        if (strcmp(extension.extensionName, extension_name) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool VulkanManager::has_device_extension(const char* extension_name)
+{
+    uint32_t extension_count = 0;
+    vector<VkExtensionProperties> extensions;
+
+    vkEnumerateDeviceExtensionProperties(phys_device, nullptr, &extension_count, nullptr);
+    extensions.resize(extension_count);
+    vkEnumerateDeviceExtensionProperties(phys_device, nullptr, &extension_count, extensions.data());
+
+    for (const VkExtensionProperties& extension : extensions)
+    {
+        if (strcmp(extension.extensionName, extension_name) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool VulkanManager::get_present_wait_support()
+{
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features{};
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features{};
+    VkPhysicalDeviceFeatures2 features{};
+
+    if (!has_device_extension(VK_KHR_PRESENT_ID_EXTENSION_NAME) or !has_device_extension(VK_KHR_PRESENT_WAIT_EXTENSION_NAME))
+        return false;
+
+    present_id_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    present_wait_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    present_wait_features.pNext = &present_id_features;
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &present_wait_features;
+
+    vkGetPhysicalDeviceFeatures2(phys_device, &features);
+
+    return present_id_features.presentId and present_wait_features.presentWait;
+}
+
+bool VulkanManager::get_swapchain_maintenance_support()
+{
+    VkPhysicalDeviceSwapchainMaintenance1FeaturesEXT swapchain_maintenance_features{};
+    VkPhysicalDeviceFeatures2 features{};
+
+    if (!has_device_extension(VK_EXT_SWAPCHAIN_MAINTENANCE_1_EXTENSION_NAME))
+        return false;
+
+    swapchain_maintenance_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SWAPCHAIN_MAINTENANCE_1_FEATURES_EXT;
+    features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    features.pNext = &swapchain_maintenance_features;
+
+    vkGetPhysicalDeviceFeatures2(phys_device, &features);
+
+    return swapchain_maintenance_features.swapchainMaintenance1;
+}
+
+bool VulkanManager::get_gpu_trace_support()
+{
+    auto get_time_domains = reinterpret_cast<PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT>(
+        vkGetInstanceProcAddr(vulkan_instance, "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT"));
+    uint32_t domain_count = 0;
+    vector<VkTimeDomainEXT> domains;
+
+    if (!has_device_extension(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME) or !get_time_domains)
+        return false;
+
+    get_time_domains(phys_device, &domain_count, nullptr);
+    domains.resize(domain_count);
+    get_time_domains(phys_device, &domain_count, domains.data());
+
+    return find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_EXT) != domains.end();
+}
+
+void VulkanManager::wait_for_presents(uint64_t timeout)
+{
+    TRACE_ZONE("wait_for_presents");
+    uint64_t present_id;
+
+    if (!present_wait_supported)
+        return;
+
+    if (options.low_latency and last_present_id != 0)
+    {
+        if (wait_for_present(logical_device, swap_chain, last_present_id, timeout) == VK_SUCCESS)
+            frame_pacer.mark_presented(last_present_id);
+    }
+
+    while ((present_id = frame_pacer.oldest_pending_present()) != 0)
+    {
+        if (wait_for_present(logical_device, swap_chain, present_id, 0) != VK_SUCCESS)
+            break;
+        frame_pacer.mark_presented(present_id);
+    }
 }
 
 uint32_t VulkanManager::get_graphics_queue_index()
@@ -405,9 +1559,10 @@ VkPresentModeKHR VulkanManager::get_swap_present_mode()
 
     for (const VkPresentModeKHR& present_mode : available_present_modes)
     {
-        if (present_mode == VK_PRESENT_MODE_MAILBOX_KHR)
+        if (present_mode == options.present_mode)
             return present_mode;
     }
+    cout << "Requested present mode is not supported, using FIFO" << endl;
     return VK_PRESENT_MODE_FIFO_KHR;
 }
 
@@ -429,16 +1584,35 @@ VkExtent2D VulkanManager::get_swap_extend(VkSurfaceCapabilitiesKHR capabilities)
 
 void VulkanManager::add_swap_chain()
 {
+    if (options.headless)
+    {
+        capture_supported = !options.capture_directory.empty();
+        post_processing = options.post_processing;
+        raster_upscale = dynamic_resolution and !post_processing;
+        add_offscreen_targets();
+        return;
+    }
+
     VkSurfaceCapabilitiesKHR capabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(phys_device, surface, &capabilities);
+
+    capture_supported = !options.capture_directory.empty() and (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT);
+    if (!options.capture_directory.empty() and !capture_supported)
+        cout << "Swap chain images can't be copied, frame capture disabled" << endl;
+    post_processing = options.post_processing and (capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+    if (options.post_processing and !post_processing)
+        cout << "Swap chain images can't be blitted to, post-processing disabled" << endl;
+    raster_upscale = dynamic_resolution and !post_processing;
     uint32_t swap_chain_images_count = 0;
 
     VkSurfaceFormatKHR surface_format = get_swap_surface_format();
     VkPresentModeKHR present_mode = get_swap_present_mode();
     VkExtent2D extend = get_swap_extend(capabilities);
 
-    uint32_t image_count = capabilities.minImageCount + 1;
+    uint32_t image_count = options.swap_chain_images > 0 ? options.swap_chain_images : capabilities.minImageCount + 1;
 
+    if (image_count < capabilities.minImageCount)
+        image_count = capabilities.minImageCount;
     if (capabilities.maxImageCount > 0 and image_count > capabilities.maxImageCount)
         image_count = capabilities.maxImageCount;
 
@@ -458,6 +1632,10 @@ void VulkanManager::add_swap_chain()
     create_info.imageExtent = extend;
     create_info.imageArrayLayers = 1;
     create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    if (capture_supported)
+        create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    if (post_processing)
+        create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_DST_BIT;
     create_info.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
     create_info.queueFamilyIndexCount = queue_index_count;
     create_info.pQueueFamilyIndices = queue_indexes;
@@ -465,7 +1643,7 @@ void VulkanManager::add_swap_chain()
     create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     create_info.presentMode = present_mode;
     create_info.clipped = VK_TRUE;
-    create_info.oldSwapchain = VK_NULL_HANDLE;
+    create_info.oldSwapchain = swap_chain;
 
     if (vkCreateSwapchainKHR(logical_device, &create_info, nullptr, &swap_chain) != VK_SUCCESS)
         cout << "Error to create swapchain!" << endl;
@@ -473,6 +1651,8 @@ void VulkanManager::add_swap_chain()
     vkGetSwapchainImagesKHR(logical_device, swap_chain, &swap_chain_images_count, nullptr);
     swap_chain_images.resize(swap_chain_images_count);
     vkGetSwapchainImagesKHR(logical_device, swap_chain, &swap_chain_images_count, swap_chain_images.data());
+    swap_chain_images_acquired.assign(swap_chain_images_count, false);
+    swap_chain_images_acquired_count = 0;
 
     swap_chain_image_format = surface_format.format;
     swap_chain_extent = extend;
@@ -480,20 +1660,39 @@ void VulkanManager::add_swap_chain()
     delete[] queue_indexes;
 }
 
-VkImageView VulkanManager::add_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags)
+void VulkanManager::add_offscreen_targets()
+{
+    swap_chain_image_format = VK_FORMAT_R8G8B8A8_SRGB;
+    swap_chain_extent = { options.width, options.height };
+    swap_chain_images.resize(MAX_FRAMES_IN_FLIGHT);
+    offscreen_image_memory.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (size_t image_index = 0; image_index < swap_chain_images.size(); image_index++)
+    {
+        add_image(swap_chain_extent.width, swap_chain_extent.height, swap_chain_image_format, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | (streaming ? VK_IMAGE_USAGE_SAMPLED_BIT : 0)
+                | (post_processing ? VK_IMAGE_USAGE_TRANSFER_DST_BIT : 0),
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            swap_chain_images[image_index], offscreen_image_memory[image_index], MEMORY_ATTACHMENTS, options.view_count);
+    }
+    cout << "Creating offscreen targets success!" << endl;
+}
+
+VkImageView VulkanManager::add_image_view(VkImage image, VkFormat format, VkImageAspectFlags aspect_flags,
+    uint32_t first_layer, uint32_t layers, uint32_t first_level, uint32_t levels)
 {
     VkImageViewCreateInfo img_view_create_info{};
     VkImageView image_view;
 
     img_view_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     img_view_create_info.image = image;
-    img_view_create_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    img_view_create_info.viewType = layers > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
     img_view_create_info.format = format;
     img_view_create_info.subresourceRange.aspectMask = aspect_flags;
-    img_view_create_info.subresourceRange.baseMipLevel = 0;
-    img_view_create_info.subresourceRange.baseArrayLayer = 0;
-    img_view_create_info.subresourceRange.levelCount = 1;
-    img_view_create_info.subresourceRange.layerCount = 1;
+    img_view_create_info.subresourceRange.baseMipLevel = first_level;
+    img_view_create_info.subresourceRange.baseArrayLayer = first_layer;
+    img_view_create_info.subresourceRange.levelCount = levels;
+    img_view_create_info.subresourceRange.layerCount = layers;
 
     if (vkCreateImageView(logical_device, &img_view_create_info, nullptr, &image_view) != VK_SUCCESS)
     {
@@ -510,40 +1709,209 @@ void VulkanManager::add_image_views()
 
     for (int image_index = 0; image_index < swap_chain_image_views.size(); image_index++)
     {
-        swap_chain_image_views[image_index] = add_image_view(swap_chain_images[image_index], swap_chain_image_format, VK_IMAGE_ASPECT_COLOR_BIT);
+        swap_chain_image_views[image_index] = add_image_view(swap_chain_images[image_index], swap_chain_image_format,
+            VK_IMAGE_ASPECT_COLOR_BIT, 0, options.view_count);
+    }
+    if (view_pass_count > 1)
+    {
+        layer_image_views.clear();
+        for (VkImage image : swap_chain_images)
+            for (uint32_t layer = 0; layer < view_pass_count; layer++)
+                layer_image_views.push_back(add_image_view(image, swap_chain_image_format, VK_IMAGE_ASPECT_COLOR_BIT, layer));
     }
     cout << "Create image views success!" << endl;
 }
 
 void VulkanManager::recreate_swap_chain()
 {
-    vkDeviceWaitIdle(logical_device);
+    TRACE_ZONE("recreate_swap_chain");
+    auto recreate_start = chrono::steady_clock::now();
+    RetiredSwapChain retired{};
+    double recreate_ms;
+
+    retired.retired_after = last_submitted(graphics_timeline);
+    retired.swap_chain = swap_chain;
+    retired.framebuffers = swap_chain_framebuffers;
+    retired.framebuffers.insert(retired.framebuffers.end(), upscale_framebuffers.begin(), upscale_framebuffers.end());
+    retired.image_views = swap_chain_image_views;
+    retired.depth_image = depth_image;
+    retired.depth_image_memory = depth_image_memory;
+    retired.depth_image_view = depth_image_view;
+    retired.presents_before = presents_queued;
+    // The retired chain takes the fences of its pending presents; the frame slots get fresh ones.
+    for (size_t frame = 0; frame < present_fences.size(); frame++)
+    {
+        if (!present_fences_pending[frame])
+            continue;
+        retired.present_fences.push_back(present_fences[frame]);
+        present_fences[frame] = add_fence();
+        present_fences_pending[frame] = false;
+    }
+    retired_swap_chains.push_back(retired);
 
-    remove_swap_chain();
+    frame_pacer.discard_pending();
+    last_present_id = 0;
 
     add_swap_chain();
     add_image_views();
     add_depth_resources();
+    retire_color_targets();
+    add_color_targets();
     add_framebuffers();
+
+    // The pyramid follows the depth buffer's size, the frames in flight keep the retired one.
+    if (options.occlusion_culling)
+    {
+        remove_depth_pyramid();
+        add_depth_pyramid();
+    }
+
+    recreate_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - recreate_start).count();
+    resize_stats.recreations++;
+    resize_stats.frames_since_recreate = 0;
+    resize_stats.total_recreate_ms += recreate_ms;
+    resize_stats.max_recreate_ms = max(resize_stats.max_recreate_ms, recreate_ms);
 }
 
-void VulkanManager::remove_swap_chain()
+// The timeline only says the GPU finished rendering into the old images; the presentation engine may
+// still be reading them.
+bool VulkanManager::is_presentation_done(const RetiredSwapChain& retired, bool wait)
 {
-    for (VkFramebuffer framebuffer : swap_chain_framebuffers)
-        vkDestroyFramebuffer(logical_device, framebuffer, nullptr);
+    VkQueue present_queue;
+
+    if (swapchain_maintenance_supported)
+    {
+        if (wait and !retired.present_fences.empty())
+            vkWaitForFences(logical_device, static_cast<uint32_t>(retired.present_fences.size()), retired.present_fences.data(), VK_TRUE, UINT64_MAX);
+        for (VkFence fence : retired.present_fences)
+        {
+            if (vkGetFenceStatus(logical_device, fence) != VK_SUCCESS)
+                return false;
+        }
+        return true;
+    }
+
+    // Without present fences, the old chain is kept until the new one has handed out every image, or has
+    // presented a few times, by when the old images are no longer on screen. Only cleanup drains the queue.
+    if (wait)
+    {
+        vkGetDeviceQueue(logical_device, get_present_family_index(), 0, &present_queue);
+        vkQueueWaitIdle(present_queue);
+        return true;
+    }
+    return retired.successor_acquired or presents_queued > retired.presents_before + RETIRED_SWAP_CHAIN_PRESENTS;
+}
+
+void VulkanManager::mark_image_acquired(uint32_t image_index)
+{
+    if (swap_chain_images_acquired[image_index])
+        return;
+    swap_chain_images_acquired[image_index] = true;
+    swap_chain_images_acquired_count++;
+    if (swap_chain_images_acquired_count == swap_chain_images_acquired.size() and !retired_swap_chains.empty())
+        retired_swap_chains.back().successor_acquired = true;
+}
+
+void VulkanManager::destroy_retired_swap_chains(bool wait)
+{
+    size_t kept = 0;
+
+    for (RetiredSwapChain& retired : retired_swap_chains)
+    {
+        if (!is_gpu_work_done(retired.retired_after) or !is_presentation_done(retired, wait))
+        {
+            retired_swap_chains[kept++] = retired;
+            continue;
+        }
+
+        for (VkFramebuffer framebuffer : retired.framebuffers)
+            vkDestroyFramebuffer(logical_device, framebuffer, nullptr);
+
+        for (VkImageView image_view : retired.image_views)
+            vkDestroyImageView(logical_device, image_view, nullptr);
+
+        vkDestroyImageView(logical_device, retired.depth_image_view, nullptr);
+        vkDestroyImage(logical_device, retired.depth_image, nullptr);
+        free_memory(retired.depth_image_memory);
+        vkDestroySwapchainKHR(logical_device, retired.swap_chain, nullptr);
+        for (VkFence fence : retired.present_fences)
+            vkDestroyFence(logical_device, fence, nullptr);
+        if (!swapchain_maintenance_supported and !wait)
+        {
+            resize_stats.unfenced_releases++;
+            resize_stats.unfenced_release_in_frame = true;
+        }
+    }
+    retired_swap_chains.resize(kept);
+}
+
+void VulkanManager::track_frame_time()
+{
+    auto now = chrono::steady_clock::now();
+    double frame_ms = chrono::duration<double, milli>(now - last_frame_time).count();
+
+    if (last_frame_time.time_since_epoch().count() != 0)
+    {
+        if (resize_stats.frames_since_recreate < MAX_FRAMES_IN_FLIGHT * 8)
+            resize_stats.max_frame_ms_resizing = max(resize_stats.max_frame_ms_resizing, frame_ms);
+        else
+            resize_stats.max_frame_ms_steady = max(resize_stats.max_frame_ms_steady, frame_ms);
+        if (resize_stats.unfenced_release_in_frame)
+            resize_stats.max_frame_ms_unfenced_release = max(resize_stats.max_frame_ms_unfenced_release, frame_ms);
+    }
+    resize_stats.unfenced_release_in_frame = false;
+
+    if (resize_stats.frames_since_recreate != UINT32_MAX)
+        resize_stats.frames_since_recreate++;
+    last_frame_time = now;
+}
+
+void VulkanManager::print_resize_stats()
+{
+    if (resize_stats.recreations == 0)
+        return;
+
+    cout << "Swapchain recreations: " << resize_stats.recreations
+        << ", avg " << resize_stats.total_recreate_ms / resize_stats.recreations << " ms"
+        << ", max " << resize_stats.max_recreate_ms << " ms"
+        << ", worst frame while resizing " << resize_stats.max_frame_ms_resizing << " ms"
+        << " (steady " << resize_stats.max_frame_ms_steady << " ms)" << endl;
+    if (resize_stats.unfenced_releases > 0)
+        cout << "Retired swapchains released without present fences: " << resize_stats.unfenced_releases
+            << ", worst frame releasing one " << resize_stats.max_frame_ms_unfenced_release << " ms" << endl;
+}
+
+void VulkanManager::remove_swap_chain()
+{
+    for (VkFramebuffer framebuffer : swap_chain_framebuffers)
+        vkDestroyFramebuffer(logical_device, framebuffer, nullptr);
 
     for (VkImageView image_view : swap_chain_image_views)
         vkDestroyImageView(logical_device, image_view, nullptr);
 
+    for (VkImageView image_view : layer_image_views)
+        vkDestroyImageView(logical_device, image_view, nullptr);
+
+    if (options.headless)
+    {
+        for (size_t image_index = 0; image_index < swap_chain_images.size(); image_index++)
+        {
+            vkDestroyImage(logical_device, swap_chain_images[image_index], nullptr);
+            free_memory(offscreen_image_memory[image_index]);
+        }
+        return;
+    }
+
     vkDestroySwapchainKHR(logical_device, swap_chain, nullptr);
 }
 
 void VulkanManager::add_buffer(VkBuffer& buff, VkDeviceMemory& buff_memory, VkDeviceSize size,
-    VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
+    VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, MemoryCategory category, bool shared_with_compute)
 {
     VkBufferCreateInfo buffer_create_info{};
     VkMemoryRequirements memory_requirements{};
     VkMemoryAllocateInfo allocate_info{};
+    array<uint32_t, 2> queue_families{};
     void* data;
 
     buffer_create_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -551,6 +1919,15 @@ void VulkanManager::add_buffer(VkBuffer& buff, VkDeviceMemory& buff_memory, VkDe
     buffer_create_info.usage = usage;
     buffer_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+    // Buffers both queues use are concurrent, so nothing has to transfer ownership between them.
+    if (shared_with_compute and async_compute)
+    {
+        queue_families = { get_graphics_family_index(), compute_family_index };
+        buffer_create_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_create_info.queueFamilyIndexCount = static_cast<uint32_t>(queue_families.size());
+        buffer_create_info.pQueueFamilyIndices = queue_families.data();
+    }
+
     if (vkCreateBuffer(logical_device, &buffer_create_info, nullptr, &buff) != VK_SUCCESS)
     {
         cout << "Creating vertex buffer error!" << endl;
@@ -568,9 +1945,16 @@ void VulkanManager::add_buffer(VkBuffer& buff, VkDeviceMemory& buff_memory, VkDe
         cout << "Allocating vertex buffer memory error!" << endl;
         return;
     }
+    memory_tracker.on_allocate(buff_memory, allocate_info.allocationSize, get_memory_heap(allocate_info.memoryTypeIndex), category);
     vkBindBufferMemory(logical_device, buff, buff_memory, 0);
 }
 
+void VulkanManager::free_memory(VkDeviceMemory memory)
+{
+    memory_tracker.on_free(memory);
+    vkFreeMemory(logical_device, memory, nullptr);
+}
+
 void VulkanManager::copy_buffer(VkBuffer from_buff, VkBuffer to_buff, VkDeviceSize size)
 {
     VkBufferCopy copy_region{};
@@ -584,83 +1968,233 @@ void VulkanManager::copy_buffer(VkBuffer from_buff, VkBuffer to_buff, VkDeviceSi
     end_single_time_commands(command_buff);
 }
 
-void VulkanManager::load_model()
+shared_ptr<MeshData> VulkanManager::decode_model(const string& path, const vector<uint8_t>& bytes)
 {
+    TRACE_ZONE("decode_model");
     tinyobj::attrib_t attrib;
     vector<tinyobj::shape_t> shapes;
-    vector<tinyobj::material_t> materials;
+    vector<tinyobj::material_t> obj_materials;
     string warn, err;
-
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, model_path.c_str()))
+    uint32_t default_material;
+    istringstream stream(string(bytes.begin(), bytes.end()));
+    tinyobj::MaterialFileReader material_reader(path.substr(0, path.find_last_of("/\\") + 1));
+    shared_ptr<MeshData> mesh_data = make_shared<MeshData>();
+    MeshStreams streams;
+    MeshAttributeSettings attribute_settings;
+    MeshAttributeStats attribute_stats;
+
+    if (!tinyobj::LoadObj(&attrib, &shapes, &obj_materials, &warn, &err, &stream, &material_reader))
+    {
         cout << warn + err;
-    for (const auto& shape : shapes) {
-        for (const auto& index : shape.mesh.indices) {
-            Vertex vertex{};
+        return nullptr;
+    }
 
-            vertex.position = 
-            {
-                attrib.vertices[3 * index.vertex_index + 0],
-                attrib.vertices[3 * index.vertex_index + 1],
-                attrib.vertices[3 * index.vertex_index + 2]
-            };
+    for (const tinyobj::material_t& obj_material : obj_materials)
+    {
+        Material material{};
+
+        material.diffuse = { obj_material.diffuse[0], obj_material.diffuse[1], obj_material.diffuse[2] };
+        material.specular = { obj_material.specular[0], obj_material.specular[1], obj_material.specular[2] };
+        material.shininess = obj_material.shininess;
+        material.dissolve = obj_material.dissolve;
+        material.textured = !obj_material.diffuse_texname.empty();
 
-            vertex.tex_coord = {
-                attrib.texcoords[2 * index.texcoord_index + 0],
-                attrib.texcoords[2 * index.texcoord_index + 1]
-            };
+        mesh_data->materials.push_back(material);
+    }
+
+    default_material = static_cast<uint32_t>(mesh_data->materials.size());
+    mesh_data->materials.push_back({ { 1.0f, 1.0f, 1.0f }, { 0.0f, 0.0f, 0.0f }, 0.0f, 1.0f, true });
+
+    for (uint32_t shape_index = 0; shape_index < shapes.size(); shape_index++)
+    {
+        const tinyobj::mesh_t& mesh = shapes[shape_index].mesh;
+        map<int, vector<size_t>> faces_by_material;
 
-            vertex.color = { 1.0f, 1.0f, 1.0f };
+        for (size_t face = 0; face < mesh.material_ids.size(); face++)
+            faces_by_material[mesh.material_ids[face]].push_back(face);
 
-            verticles.push_back(vertex);
-            indices.push_back(indices.size());
+        for (const auto& [material_id, faces] : faces_by_material)
+        {
+            Submesh submesh{};
+            glm::vec3 bounds_min(FLT_MAX);
+            glm::vec3 bounds_max(-FLT_MAX);
+
+            submesh.first_index = static_cast<uint32_t>(mesh_data->indices.size());
+            submesh.material = material_id < 0 ? default_material : static_cast<uint32_t>(material_id);
+            submesh.mesh = shape_index;
+
+            for (size_t face : faces)
+            {
+                Vertex corners[3]{};
+                bool has_normals = true;
+
+                for (size_t corner = 0; corner < 3; corner++)
+                {
+                    const tinyobj::index_t& index = mesh.indices[3 * face + corner];
+                    Vertex& vertex = corners[corner];
+
+                    vertex.position =
+                    {
+                        attrib.vertices[3 * index.vertex_index + 0],
+                        attrib.vertices[3 * index.vertex_index + 1],
+                        attrib.vertices[3 * index.vertex_index + 2]
+                    };
+
+                    vertex.tex_coord = {
+                        attrib.texcoords[2 * index.texcoord_index + 0],
+                        attrib.texcoords[2 * index.texcoord_index + 1]
+                    };
+
+                    vertex.color = { 1.0f, 1.0f, 1.0f };
+
+                    if (index.normal_index >= 0)
+                    {
+                        vertex.normal =
+                        {
+                            attrib.normals[3 * index.normal_index + 0],
+                            attrib.normals[3 * index.normal_index + 1],
+                            attrib.normals[3 * index.normal_index + 2]
+                        };
+                    }
+                    else
+                        has_normals = false;
+
+                    streams.positions.push_back(vertex.position);
+                    streams.tex_coords.push_back(vertex.tex_coord);
+                    streams.normals.push_back(vertex.normal);
+
+                    bounds_min = glm::min(bounds_min, glm::vec3(vertex.position));
+                    bounds_max = glm::max(bounds_max, glm::vec3(vertex.position));
+                }
+
+                streams.missing_normals.push_back(has_normals ? 0 : 1);
+                for (const Vertex& vertex : corners)
+                {
+                    mesh_data->vertices.push_back(vertex);
+                    mesh_data->indices.push_back(mesh_data->indices.size());
+                }
+            }
+
+            submesh.index_count = static_cast<uint32_t>(mesh_data->indices.size()) - submesh.first_index;
+            submesh.center = (bounds_min + bounds_max) * 0.5f;
+            mesh_data->submeshes.push_back(submesh);
         }
     }
+
+    // Faces without normals in the file are smoothed up to the crease angle; every corner gets a tangent.
+    attribute_settings.crease_angle = static_cast<float>(options.crease_angle);
+    attribute_settings.weighting = options.area_weighted_normals ? NORMAL_WEIGHT_AREA : NORMAL_WEIGHT_ANGLE;
+    attribute_stats = generate_mesh_attributes(streams, attribute_settings, workers);
+    for (size_t vertex = 0; vertex < mesh_data->vertices.size(); vertex++)
+    {
+        mesh_data->vertices[vertex].normal = streams.normals[vertex];
+        mesh_data->vertices[vertex].tangent = streams.tangents[vertex];
+    }
+
+    // Picking rays are tested against the triangles themselves, in the mesh's own space.
+    mesh_data->bvh = make_shared<TriangleBvh>();
+    mesh_data->bvh->build(streams.positions, mesh_data->indices);
+
+    cout << "Loaded " << path << ": " << mesh_data->submeshes.size() << " submeshes with " << mesh_data->materials.size() << " materials, "
+        << attribute_stats.generated_normals << " normals generated, " << mesh_data->bvh->node_count() << " BVH nodes" << endl;
+
+    return mesh_data;
 }
 
-void VulkanManager::add_vertex_buffer()
+void VulkanManager::upload_buffer(const void* contents, VkDeviceSize size, VkBufferUsageFlags usage,
+    VkBuffer& buff, VkDeviceMemory& buff_memory, MemoryCategory category)
 {
-    VkDeviceSize size = sizeof(verticles[0]) * verticles.size();
     VkBuffer staging_buffer{};
     VkDeviceMemory staging_buffer_memory{};
     void* data;
     
     add_buffer(staging_buffer, staging_buffer_memory, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_STAGING);
 
     vkMapMemory(logical_device, staging_buffer_memory, 0, size, 0, &data);
-    memcpy(data, verticles.data(), (size_t)size);
+    memcpy(data, contents, (size_t)size);
     vkUnmapMemory(logical_device, staging_buffer_memory);
 
-    add_buffer(vertex_buffer, vertex_buffer_memory, size,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    add_buffer(buff, buff_memory, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, category);
 
-    copy_buffer(staging_buffer, vertex_buffer, size);
-
-    vkDestroyBuffer(logical_device, staging_buffer, nullptr);
-    vkFreeMemory(logical_device, staging_buffer_memory, nullptr);
+    copy_buffer(staging_buffer, buff, size);
+    release_staging_buffer(staging_buffer, staging_buffer_memory);
 }
 
-void VulkanManager::add_indices_buffer()
+uint64_t VulkanManager::create_mesh(AssetId asset, const MeshData& mesh_data)
 {
-    VkDeviceSize size = sizeof(indices[0]) * indices.size();
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
-    void* data;
+    TRACE_ZONE("create_mesh");
+    GpuMesh& mesh = gpu_meshes[asset];
+    VkDeviceSize vertex_size = sizeof(mesh_data.vertices[0]) * mesh_data.vertices.size();
+    VkDeviceSize index_size = sizeof(mesh_data.indices[0]) * mesh_data.indices.size();
+    VkDeviceSize skin_size = 0;
+    VkBuffer buff;
+    VkDeviceMemory buff_memory;
+
+    // Skinning reads the rest pose as a storage buffer.
+    upload_buffer(mesh_data.vertices.data(), vertex_size,
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | (options.skinning ? VK_BUFFER_USAGE_STORAGE_BUFFER_BIT : 0),
+        buff, buff_memory, MEMORY_MESHES);
+    mesh.vertex_buffer = resources.add_buffer(buff, buff_memory);
+    upload_buffer(mesh_data.indices.data(), index_size, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+        buff, buff_memory, MEMORY_MESHES);
+    mesh.index_buffer = resources.add_buffer(buff, buff_memory);
+    mesh.materials = mesh_data.materials;
+    mesh.submeshes = mesh_data.submeshes;
+    mesh.vertex_count = static_cast<uint32_t>(mesh_data.vertices.size());
+    if (options.skinning)
+    {
+        vector<glm::vec3> positions(mesh_data.vertices.size());
+
+        for (size_t vertex = 0; vertex < positions.size(); vertex++)
+            positions[vertex] = mesh_data.vertices[vertex].position;
+        mesh.skin = build_chain_skin(positions, options.skin_joints);
+        skin_size = sizeof(SkinVertex) * mesh.skin.vertices.size() + sizeof(glm::vec4) * mesh.skin.morph_deltas.size();
+
+        upload_buffer(mesh.skin.vertices.data(), sizeof(SkinVertex) * mesh.skin.vertices.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            buff, buff_memory, MEMORY_MESHES);
+        mesh.skin_buffer = resources.add_buffer(buff, buff_memory);
+        upload_buffer(mesh.skin.morph_deltas.data(), sizeof(glm::vec4) * mesh.skin.morph_deltas.size(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            buff, buff_memory, MEMORY_MESHES);
+        mesh.morph_buffer = resources.add_buffer(buff, buff_memory);
+
+        // Weights and deltas live on the GPU now, pose sampling only needs the chain.
+        mesh.skin.vertices = {};
+        mesh.skin.morph_deltas = {};
+    }
+    add_material_buffer(mesh);
+    add_material_descriptor_sets(mesh);
 
-    add_buffer(staging_buffer, staging_buffer_memory, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    glm::vec3 bounds_min(FLT_MAX);
+    glm::vec3 bounds_max(-FLT_MAX);
+    for (const Vertex& vertex : mesh_data.vertices)
+    {
+        bounds_min = glm::min(bounds_min, glm::vec3(vertex.position));
+        bounds_max = glm::max(bounds_max, glm::vec3(vertex.position));
+    }
+    if (!mesh_data.vertices.empty())
+    {
+        mesh.center = (bounds_min + bounds_max) * 0.5f;
+        mesh.radius = max(glm::length(bounds_max - mesh.center), 0.0001f);
+    }
+    mesh.bvh = mesh_data.bvh;
 
-    vkMapMemory(logical_device, staging_buffer_memory, 0, size, 0, &data);
-    memcpy(data, indices.data(), (size_t)size);
-    vkUnmapMemory(logical_device, staging_buffer_memory);
+    return vertex_size + index_size + skin_size + material_stride * mesh.materials.size();
+}
 
-    add_buffer(index_buffer, index_buffer_memory, size,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+void VulkanManager::destroy_mesh(AssetId asset)
+{
+    GpuMesh& mesh = gpu_meshes[asset];
 
-    copy_buffer(staging_buffer, index_buffer, size);
+    // Frames already submitted may still draw the mesh, so it is only retired here.
+    retire_resource(mesh.index_buffer);
+    retire_resource(mesh.vertex_buffer);
+    retire_resource(mesh.material_buffer);
+    retire_resource(mesh.material_pool);
+    retire_resource(mesh.skin_buffer);
+    retire_resource(mesh.morph_buffer);
 
-    vkDestroyBuffer(logical_device, staging_buffer, nullptr);
-    vkFreeMemory(logical_device, staging_buffer_memory, nullptr);
+    gpu_meshes.erase(asset);
 }
 
 void VulkanManager::add_uniform_buffers()
@@ -670,887 +2204,5123 @@ void VulkanManager::add_uniform_buffers()
     uniform_buffers.resize(MAX_FRAMES_IN_FLIGHT);
     uniform_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
     uniform_buffers_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    view_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    view_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    view_buffers_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    shadow_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    shadow_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    shadow_buffers_mapped.resize(MAX_FRAMES_IN_FLIGHT);
 
     for (size_t buffer_index = 0; buffer_index < MAX_FRAMES_IN_FLIGHT; buffer_index++)
     {
         add_buffer(uniform_buffers[buffer_index], uniform_buffers_memory[buffer_index],
-            size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+            size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_UNIFORMS);
         vkMapMemory(logical_device, uniform_buffers_memory[buffer_index], 0, size, 0, &uniform_buffers_mapped[buffer_index]);
+
+        add_buffer(view_buffers[buffer_index], view_buffers_memory[buffer_index], sizeof(ViewBufferObject),
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_UNIFORMS);
+        vkMapMemory(logical_device, view_buffers_memory[buffer_index], 0, sizeof(ViewBufferObject), 0, &view_buffers_mapped[buffer_index]);
+
+        add_buffer(shadow_buffers[buffer_index], shadow_buffers_memory[buffer_index], sizeof(ShadowBufferObject),
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_UNIFORMS);
+        vkMapMemory(logical_device, shadow_buffers_memory[buffer_index], 0, sizeof(ShadowBufferObject), 0, &shadow_buffers_mapped[buffer_index]);
     }
 }
 
-void VulkanManager::update_uniform_buffer(uint32_t current_frame)
+void VulkanManager::add_scene_transforms()
 {
-    static auto start_time = chrono::high_resolution_clock::now();
-
-    UniformBufferObject ubo{};
-    auto current_time = chrono::high_resolution_clock::now();
-    float time = chrono::duration<float, chrono::seconds::period>(current_time - start_time).count();
+    const float spacing = 1.5f;
+    uint32_t columns = static_cast<uint32_t>(ceil(sqrt(static_cast<float>(options.instance_count))));
 
-    ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-    ubo.proj = glm::perspective(glm::radians(45.0f), (float) swap_chain_extent.width / swap_chain_extent.height, 0.1f, 10.0f);
+    scene_transforms.reserve(options.instance_count);
+    uint32_t root = scene_transforms.add_node(TransformStore::NO_PARENT, glm::vec3(0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f));
 
-    ubo.proj[1][1] *= -1;
+    for (uint32_t instance = 1; instance < options.instance_count; instance++)
+    {
+        glm::vec3 offset((instance % columns) * spacing, (instance / columns) * spacing, 0.0f);
 
-    memcpy(uniform_buffers_mapped[current_frame], &ubo, sizeof(ubo));
+        scene_transforms.add_node(static_cast<int32_t>(root), offset, glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(0.5f));
+    }
 }
 
-void VulkanManager::add_descriptor_set_layout()
+void VulkanManager::add_instance_buffers()
 {
-    VkDescriptorSetLayoutBinding ubo_layout_binding{};
-    VkDescriptorSetLayoutBinding sampler_layout_binding{};
-    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+    VkDeviceSize size = sizeof(glm::mat4) * scene_transforms.size();
 
-    ubo_layout_binding.binding = 0;
-    ubo_layout_binding.descriptorCount = 1;
-    ubo_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    ubo_layout_binding.pImmutableSamplers = nullptr;
-    ubo_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    instance_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    instance_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    instance_buffers_mapped.resize(MAX_FRAMES_IN_FLIGHT);
 
-    sampler_layout_binding.binding = 1;
-    sampler_layout_binding.descriptorCount = 1;
-    sampler_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    sampler_layout_binding.pImmutableSamplers = nullptr;
-    sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    for (size_t buffer_index = 0; buffer_index < MAX_FRAMES_IN_FLIGHT; buffer_index++)
+    {
+        add_buffer(instance_buffers[buffer_index], instance_buffers_memory[buffer_index],
+            size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_UNIFORMS);
+        vkMapMemory(logical_device, instance_buffers_memory[buffer_index], 0, size, 0, &instance_buffers_mapped[buffer_index]);
+    }
 
-    array<VkDescriptorSetLayoutBinding, 2> bindings = { ubo_layout_binding, sampler_layout_binding };
+    add_visible_instance_buffers();
+}
 
-    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layout_create_info.bindingCount = static_cast<uint32_t>(bindings.size());
-    layout_create_info.pBindings = bindings.data();
+void VulkanManager::add_visible_instance_buffers()
+{
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
+    VkDeviceSize size = sizeof(uint32_t) * instance_count * (options.occlusion_culling ? CULL_LIST_COUNT : 1);
 
-    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &descriptor_set_layout) != VK_SUCCESS)
+    visible_instance_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    visible_instance_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    visible_instances_mapped.assign(MAX_FRAMES_IN_FLIGHT, nullptr);
+    drawn_instance_counts.assign(MAX_FRAMES_IN_FLIGHT, instance_count);
+
+    // The vertex shader always reads instances through this list; without culling it is the identity.
+    // BVH culling rewrites it every frame, so it stays mapped.
+    for (size_t buffer_index = 0; buffer_index < MAX_FRAMES_IN_FLIGHT; buffer_index++)
     {
-        cout << "Creating descriptor set layout error!" << endl;
-        return;
+        uint32_t* data;
+
+        if (options.occlusion_culling)
+        {
+            add_buffer(visible_instance_buffers[buffer_index], visible_instance_buffers_memory[buffer_index],
+                size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_CULLING);
+            continue;
+        }
+
+        add_buffer(visible_instance_buffers[buffer_index], visible_instance_buffers_memory[buffer_index],
+            size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_CULLING);
+        vkMapMemory(logical_device, visible_instance_buffers_memory[buffer_index], 0, size, 0, reinterpret_cast<void**>(&data));
+        for (uint32_t instance = 0; instance < instance_count; instance++)
+            data[instance] = instance;
+        if (options.bvh_culling)
+            visible_instances_mapped[buffer_index] = data;
+        else
+            vkUnmapMemory(logical_device, visible_instance_buffers_memory[buffer_index]);
     }
 }
 
-void VulkanManager::add_descriptor_pool()
+void VulkanManager::add_skinning_pipeline()
 {
-    array<VkDescriptorPoolSize, 2> sizes{};
+    skin_set_layout = add_compute_set_layout(vector<VkDescriptorType>(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER));
+    add_compute_pipeline(get_shader_code("Shaders/skin.spv"), skin_set_layout, 3 * sizeof(uint32_t), skin_pipeline_layout, skin_pipeline);
+}
+
+void VulkanManager::add_skinning_resources()
+{
+    VkDescriptorPoolSize pool_size{};
     VkDescriptorPoolCreateInfo pool_create_info{};
+    vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, skin_set_layout);
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkDeviceSize palette_size;
+    VkDeviceSize morph_weight_size;
+    VkDeviceSize skinned_size;
+
+    // Instances share the poses, so thousands of them cost no more skinning than skin_poses would.
+    skin_pose_count = max(1u, min(options.skin_poses, static_cast<uint32_t>(scene_transforms.size())));
+    palette_size = sizeof(glm::mat4) * skin_pose_count * scene_skin.joint_count;
+    morph_weight_size = sizeof(float) * skin_pose_count * max(scene_skin.morph_target_count, 1u);
+    skinned_size = sizeof(Vertex) * static_cast<VkDeviceSize>(skinned_vertex_count) * skin_pose_count;
+
+    skin_palette_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    skin_palette_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    skin_palettes_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    morph_weight_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    morph_weight_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    morph_weights_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    skinned_vertex_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    skinned_vertex_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        add_buffer(skin_palette_buffers[frame], skin_palette_buffers_memory[frame], palette_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_SKINNING);
+        vkMapMemory(logical_device, skin_palette_buffers_memory[frame], 0, palette_size, 0, reinterpret_cast<void**>(&skin_palettes_mapped[frame]));
 
-    sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    sizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
-    sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    sizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        add_buffer(morph_weight_buffers[frame], morph_weight_buffers_memory[frame], morph_weight_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_SKINNING);
+        vkMapMemory(logical_device, morph_weight_buffers_memory[frame], 0, morph_weight_size, 0, reinterpret_cast<void**>(&morph_weights_mapped[frame]));
 
-    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_create_info.poolSizeCount = static_cast<uint32_t>(sizes.size());
-    pool_create_info.pPoolSizes = sizes.data();
-    pool_create_info.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+        add_buffer(skinned_vertex_buffers[frame], skinned_vertex_buffers_memory[frame], skinned_size,
+            VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_SKINNING);
+    }
 
-    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &descriptor_pool) != VK_SUCCESS)
-        cout << "Creating descriptors pool error!" << endl;
-}
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = 6 * MAX_FRAMES_IN_FLIGHT;
 
-void VulkanManager::add_descriptor_sets()
-{
-    vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptor_set_layout);
-    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = 1;
+    pool_create_info.pPoolSizes = &pool_size;
+    pool_create_info.maxSets = MAX_FRAMES_IN_FLIGHT;
 
-    descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &skin_descriptor_pool) != VK_SUCCESS)
+        cout << "Creating skinning descriptor pool error!" << endl;
+
+    skin_descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
 
     descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptor_set_alloc_info.descriptorPool = descriptor_pool;
-    descriptor_set_alloc_info.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    descriptor_set_alloc_info.descriptorPool = skin_descriptor_pool;
+    descriptor_set_alloc_info.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
     descriptor_set_alloc_info.pSetLayouts = layouts.data();
 
-    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, descriptor_sets.data()) != VK_SUCCESS)
-        cout << "Allocating descriptor sets error!" << endl;
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, skin_descriptor_sets.data()) != VK_SUCCESS)
+        cout << "Allocating skinning descriptor sets error!" << endl;
 
-    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
     {
-        VkDescriptorBufferInfo buffer_info{};
-        VkDescriptorImageInfo image_info{};
-        array<VkWriteDescriptorSet, 2> descriptor_writes{};
-
-        buffer_info.buffer = uniform_buffers[i];
-        buffer_info.offset = 0;
-        buffer_info.range = sizeof(UniformBufferObject);
-
-        image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        image_info.imageView = texture_image_view;
-        image_info.sampler = texture_sampler;
+        array<VkDescriptorBufferInfo, 6> buffer_infos{};
+        array<VkWriteDescriptorSet, 6> descriptor_writes{};
+        array<VkBuffer, 6> buffers = { vertex_buffer, skin_weight_buffer, skin_palette_buffers[frame],
+            morph_target_buffer, morph_weight_buffers[frame], skinned_vertex_buffers[frame] };
 
-        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptor_writes[0].dstSet = descriptor_sets[i];
-        descriptor_writes[0].dstBinding = 0;
-        descriptor_writes[0].dstArrayElement = 0;
-        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        descriptor_writes[0].descriptorCount = 1;
-        descriptor_writes[0].pBufferInfo = &buffer_info;
-        descriptor_writes[0].pImageInfo = nullptr;
+        for (uint32_t binding = 0; binding < descriptor_writes.size(); binding++)
+        {
+            buffer_infos[binding].buffer = buffers[binding];
+            buffer_infos[binding].offset = 0;
+            buffer_infos[binding].range = VK_WHOLE_SIZE;
+
+            descriptor_writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptor_writes[binding].dstSet = skin_descriptor_sets[frame];
+            descriptor_writes[binding].dstBinding = binding;
+            descriptor_writes[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptor_writes[binding].descriptorCount = 1;
+            descriptor_writes[binding].pBufferInfo = &buffer_infos[binding];
+        }
 
-        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptor_writes[1].dstSet = descriptor_sets[i];
-        descriptor_writes[1].dstBinding = 1;
-        descriptor_writes[1].dstArrayElement = 0;
-        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        descriptor_writes[1].descriptorCount = 1;
-        descriptor_writes[1].pImageInfo = &image_info;
-        
         vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
             descriptor_writes.data(), 0, nullptr);
     }
+
+    cout << "Skinning " << skinned_vertex_count << " vertices in " << skin_pose_count << " poses of "
+        << scene_skin.joint_count << " joints" << endl;
 }
 
-void VulkanManager::add_graphics_pipeline()
+void VulkanManager::remove_skinning_resources()
 {
-    vector<VkDynamicState> dynamic_states = 
+    if (!options.skinning)
+        return;
+
+    for (size_t frame = 0; frame < skin_palette_buffers.size(); frame++)
     {
-        VK_DYNAMIC_STATE_VIEWPORT,
-        VK_DYNAMIC_STATE_SCISSOR
-    };
-    VkShaderModule vert_shader_module;
-    VkShaderModule frag_shader_module;
+        vkDestroyBuffer(logical_device, skin_palette_buffers[frame], nullptr);
+        free_memory(skin_palette_buffers_memory[frame]);
+        vkDestroyBuffer(logical_device, morph_weight_buffers[frame], nullptr);
+        free_memory(morph_weight_buffers_memory[frame]);
+        vkDestroyBuffer(logical_device, skinned_vertex_buffers[frame], nullptr);
+        free_memory(skinned_vertex_buffers_memory[frame]);
+    }
+    vkDestroyDescriptorPool(logical_device, skin_descriptor_pool, nullptr);
+    vkDestroyPipeline(logical_device, skin_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, skin_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, skin_set_layout, nullptr);
+}
 
-    VkPipelineDynamicStateCreateInfo dynamic_states_create_info{};
-    VkPipelineVertexInputStateCreateInfo vertex_input_create_info{};
-    VkVertexInputBindingDescription vertex_binding = Vertex::get_binding_description();
-    array<VkVertexInputAttributeDescription, 3> vertex_attributes = Vertex::get_attribute_descriptions();
-    VkPipelineInputAssemblyStateCreateInfo input_assembly_create_info{};
-    VkPipelineViewportStateCreateInfo viewport_state{};
-    VkPipelineRasterizationStateCreateInfo rasterizer_create_info{};
-    VkPipelineMultisampleStateCreateInfo multisampling_create_info{};
-    VkPipelineColorBlendAttachmentState color_blend_attachment{};
-    VkPipelineColorBlendStateCreateInfo color_blending_create_info{};
-    VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
-    VkPipelineShaderStageCreateInfo vert_shader_stage_create_info{};
-    VkPipelineShaderStageCreateInfo frag_shader_stage_create_info{};
-    VkPipelineShaderStageCreateInfo shader_stages_create_infos[2];
-    VkGraphicsPipelineCreateInfo pipeline_create_info{};
-    VkPipelineDepthStencilStateCreateInfo depth_stencil_create_info{};
+void VulkanManager::update_skin_poses(uint32_t frame, float time)
+{
+    glm::mat4* palettes;
+    float* morph_weights;
+    auto sample_start = chrono::steady_clock::now();
 
-    dynamic_states_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-    dynamic_states_create_info.dynamicStateCount = static_cast<uint32_t>(dynamic_states.size());
-    dynamic_states_create_info.pDynamicStates = dynamic_states.data();
+    if (!options.skinning or skin_palettes_mapped.empty())
+        return;
 
-    vertex_input_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_create_info.vertexBindingDescriptionCount = 1;
-    vertex_input_create_info.pVertexBindingDescriptions = &vertex_binding;
-    vertex_input_create_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertex_attributes.size());
-    vertex_input_create_info.pVertexAttributeDescriptions = vertex_attributes.data();
+    palettes = skin_palettes_mapped[frame];
+    morph_weights = morph_weights_mapped[frame];
 
-    input_assembly_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-    input_assembly_create_info.primitiveRestartEnable = VK_FALSE;
+    // Chunks are a multiple of four poses so every SIMD block stays full.
+    workers.parallel_for(skin_pose_count, 16, [this, time, palettes, morph_weights](uint32_t begin, uint32_t end)
+        {
+            sample_skin_poses(scene_skin, time, begin, end, palettes, morph_weights);
+        });
 
-    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-    viewport_state.viewportCount = 1;
-    viewport_state.scissorCount = 1;
+    skin_sample_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - sample_start).count();
+    skin_samples++;
+}
 
-    rasterizer_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-    rasterizer_create_info.depthClampEnable = VK_FALSE;
-    rasterizer_create_info.rasterizerDiscardEnable = VK_FALSE;
-    rasterizer_create_info.polygonMode = VK_POLYGON_MODE_FILL;
-    rasterizer_create_info.lineWidth = 1.0;
-    rasterizer_create_info.cullMode = VK_CULL_MODE_BACK_BIT;
-    rasterizer_create_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-    rasterizer_create_info.depthBiasEnable = VK_FALSE;
-    rasterizer_create_info.depthBiasConstantFactor = 0.0;
-    rasterizer_create_info.depthBiasClamp = 0.0;
-    rasterizer_create_info.depthBiasSlopeFactor = 0.0;
+void VulkanManager::record_skinning(VkCommandBuffer buff)
+{
+    uint32_t params[3] = { skinned_vertex_count, scene_skin.joint_count, scene_skin.morph_target_count };
+    VkMemoryBarrier barrier{};
 
-    multisampling_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-    multisampling_create_info.sampleShadingEnable = VK_FALSE;
-    multisampling_create_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-    multisampling_create_info.minSampleShading = 1.0;
-    multisampling_create_info.pSampleMask = nullptr;
-    multisampling_create_info.alphaToCoverageEnable = VK_FALSE;
-    multisampling_create_info.alphaToOneEnable = VK_FALSE;
+    if (!options.skinning)
+        return;
 
-    color_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-    color_blend_attachment.blendEnable = VK_FALSE;
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, skin_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, skin_pipeline_layout, 0, 1, &skin_descriptor_sets[current_frame], 0, nullptr);
+    vkCmdPushConstants(buff, skin_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), params);
+    vkCmdDispatch(buff, (skinned_vertex_count + 63) / 64, skin_pose_count, 1);
+
+    // Skinned once per frame: every scene pass and view below reads the same vertices.
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
 
-    color_blending_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-    color_blending_create_info.logicOpEnable = VK_FALSE;
-    color_blending_create_info.logicOp = VK_LOGIC_OP_COPY;
-    color_blending_create_info.attachmentCount = 1;
-    color_blending_create_info.pAttachments = &color_blend_attachment;
-    color_blending_create_info.blendConstants[0] = 0.0;
-    color_blending_create_info.blendConstants[1] = 0.0;
-    color_blending_create_info.blendConstants[2] = 0.0;
-    color_blending_create_info.blendConstants[3] = 0.0;
+void VulkanManager::record_skinned_draws(VkCommandBuffer buff, const Submesh& submesh)
+{
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
+
+    // Each pose draws a contiguous range of instances from its own slice of the skinned buffer.
+    for (uint32_t pose = 0; pose < skin_pose_count; pose++)
+    {
+        uint32_t first_instance = instance_count * pose / skin_pose_count;
+        uint32_t end_instance = instance_count * (pose + 1) / skin_pose_count;
+
+        if (first_instance == end_instance)
+            continue;
+
+        vkCmdDrawIndexed(buff, submesh.index_count, end_instance - first_instance, submesh.first_index,
+            static_cast<int32_t>(pose * skinned_vertex_count), first_instance);
+        draw_stats.draws++;
+    }
+}
+
+void VulkanManager::print_skinning_stats()
+{
+    if (!options.skinning or skin_samples == 0)
+        return;
+
+    cout << "Skinning: " << skin_pose_count << " poses x " << scene_skin.joint_count << " joints, "
+        << skinned_vertex_count * static_cast<uint64_t>(skin_pose_count) << " vertices per frame, pose sampling "
+        << skin_sample_ms / skin_samples << " ms on " << workers.size() + 1 << " threads" << endl;
+}
+
+void VulkanManager::add_particle_pipelines()
+{
+    array<VkDescriptorSetLayoutBinding, 4> bindings{};
+    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+    VkPushConstantRange view_push_constant{};
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+
+    particle_set_layout = add_compute_set_layout(vector<VkDescriptorType>(6, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER));
+    add_compute_pipeline(get_shader_code("Shaders/particles.spv"), particle_set_layout, sizeof(ParticleParams),
+        particle_compute_layout, particle_compute_pipeline);
+
+    // The draw reads the camera, the view matrices, the particles and the alive list, all from the vertex shader.
+    for (uint32_t binding = 0; binding < bindings.size(); binding++)
+    {
+        bindings[binding].binding = binding;
+        bindings[binding].descriptorCount = 1;
+        bindings[binding].descriptorType = binding < 2 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[binding].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    }
+
+    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_create_info.bindingCount = static_cast<uint32_t>(bindings.size());
+    layout_create_info.pBindings = bindings.data();
+
+    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &particle_draw_set_layout) != VK_SUCCESS)
+        cout << "Creating particle set layout error!" << endl;
+
+    view_push_constant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    view_push_constant.offset = 0;
+    view_push_constant.size = sizeof(uint32_t);
 
     pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipeline_layout_create_info.setLayoutCount = 1;
-    pipeline_layout_create_info.pSetLayouts = &descriptor_set_layout;
-    pipeline_layout_create_info.pushConstantRangeCount = 0;
-    pipeline_layout_create_info.pPushConstantRanges = nullptr;
+    pipeline_layout_create_info.pSetLayouts = &particle_draw_set_layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &view_push_constant;
 
-    auto vert_shader_code = get_shader_code("Shaders/vert.spv");
-    auto frag_shader_code = get_shader_code("Shaders/frag.spv");
+    if (vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, nullptr, &particle_pipeline_layout) != VK_SUCCESS)
+        cout << "Creating particle pipeline layout error!" << endl;
+}
 
-    vert_shader_module = get_shader_module(vert_shader_code);
-    frag_shader_module = get_shader_module(frag_shader_code);
+void VulkanManager::add_particle_resources()
+{
+    uint32_t capacity = options.particle_count;
+    VkDeviceSize particle_size = sizeof(glm::vec4) * 2 * static_cast<VkDeviceSize>(capacity);
+    VkDeviceSize list_size = sizeof(uint32_t) * static_cast<VkDeviceSize>(capacity);
+    ParticleCounters counters{};
+    VkBuffer staging_buffer;
+    VkDeviceMemory staging_buffer_memory;
+    VkCommandBuffer command_buff;
+    array<VkBufferCopy, 2> copy_regions{};
+    uint32_t* data;
+    array<VkDescriptorPoolSize, 2> pool_sizes{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, particle_set_layout);
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkCommandBufferAllocateInfo command_buffer_allocate_info{};
 
-    vert_shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vert_shader_stage_create_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vert_shader_stage_create_info.module = vert_shader_module;
-    vert_shader_stage_create_info.pName = "main";
+    particle_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    particle_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    alive_list_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    alive_list_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
 
-    frag_shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    frag_shader_stage_create_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    frag_shader_stage_create_info.module = frag_shader_module;
-    frag_shader_stage_create_info.pName = "main";
-    
-    shader_stages_create_infos[0] = vert_shader_stage_create_info;
-    shader_stages_create_infos[1] = frag_shader_stage_create_info;
+    // Each frame slot has its own particles and alive list: the simulation reads the other slot's
+    // while that frame may still be drawing it, and writes a slot whose frame has finished.
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        add_buffer(particle_buffers[frame], particle_buffers_memory[frame], particle_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_PARTICLES, true);
+        add_buffer(alive_list_buffers[frame], alive_list_buffers_memory[frame], list_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_PARTICLES, true);
+    }
+    add_buffer(dead_list_buffer, dead_list_buffer_memory, list_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_PARTICLES, true);
+    add_buffer(particle_counter_buffer, particle_counter_buffer_memory, sizeof(ParticleCounters),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_PARTICLES, true);
+
+    // Every particle starts dead: the dead list holds every index and no slot has live ones.
+    counters.dead_count = capacity;
+    for (VkDrawIndirectCommand& draw : counters.draws)
+        draw.vertexCount = 6;
+
+    add_buffer(staging_buffer, staging_buffer_memory, list_size + sizeof(counters), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_STAGING);
+    vkMapMemory(logical_device, staging_buffer_memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&data));
+    for (uint32_t index = 0; index < capacity; index++)
+        data[index] = index;
+    memcpy(data + capacity, &counters, sizeof(counters));
+    vkUnmapMemory(logical_device, staging_buffer_memory);
 
-    if (vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, nullptr, &pipeline_layout) != VK_SUCCESS)
-        cout << "Creating pipeline layout error!" << endl;
+    copy_regions[0].size = list_size;
+    copy_regions[1].srcOffset = list_size;
+    copy_regions[1].size = sizeof(counters);
 
-    depth_stencil_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-    depth_stencil_create_info.depthTestEnable = VK_TRUE;
-    depth_stencil_create_info.depthWriteEnable = VK_TRUE;
-    depth_stencil_create_info.depthCompareOp = VK_COMPARE_OP_LESS;
-    depth_stencil_create_info.depthBoundsTestEnable = VK_FALSE;
-    depth_stencil_create_info.minDepthBounds = 0.0;
-    depth_stencil_create_info.maxDepthBounds = 1.0;
-    depth_stencil_create_info.stencilTestEnable = VK_FALSE;
-    depth_stencil_create_info.front = {};
-    depth_stencil_create_info.back = {};
+    command_buff = begin_single_time_commands();
+    vkCmdCopyBuffer(command_buff, staging_buffer, dead_list_buffer, 1, &copy_regions[0]);
+    vkCmdCopyBuffer(command_buff, staging_buffer, particle_counter_buffer, 1, &copy_regions[1]);
+    end_single_time_commands(command_buff);
+    release_staging_buffer(staging_buffer, staging_buffer_memory);
 
-    pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-    pipeline_create_info.stageCount = 2;
-    pipeline_create_info.pStages = shader_stages_create_infos;
-    pipeline_create_info.pVertexInputState = &vertex_input_create_info;
-    pipeline_create_info.pInputAssemblyState = &input_assembly_create_info;
-    pipeline_create_info.pViewportState = &viewport_state;
-    pipeline_create_info.pRasterizationState = &rasterizer_create_info;
-    pipeline_create_info.pMultisampleState = &multisampling_create_info;
-    pipeline_create_info.pDepthStencilState = nullptr;
-    pipeline_create_info.pColorBlendState = &color_blending_create_info;
-    pipeline_create_info.pDynamicState = &dynamic_states_create_info;
-    pipeline_create_info.layout = pipeline_layout;
-    pipeline_create_info.renderPass = render_pass;
-    pipeline_create_info.subpass = 0;
-    pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
-    pipeline_create_info.basePipelineIndex = -1;
-    pipeline_create_info.pDepthStencilState = &depth_stencil_create_info;
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[0].descriptorCount = 8 * MAX_FRAMES_IN_FLIGHT;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_sizes[1].descriptorCount = 2 * MAX_FRAMES_IN_FLIGHT;
 
-    if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline) != VK_SUCCESS)
-        cout << "Creating pipeline error!" << endl;
-    else
-        cout << "Creating pipeline success!" << endl;
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+    pool_create_info.pPoolSizes = pool_sizes.data();
+    pool_create_info.maxSets = 2 * MAX_FRAMES_IN_FLIGHT;
 
-    vkDestroyShaderModule(logical_device, vert_shader_module, nullptr);
-    vkDestroyShaderModule(logical_device, frag_shader_module, nullptr);
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &particle_descriptor_pool) != VK_SUCCESS)
+        cout << "Creating particle descriptor pool error!" << endl;
+
+    particle_compute_sets.resize(MAX_FRAMES_IN_FLIGHT);
+    particle_draw_sets.resize(MAX_FRAMES_IN_FLIGHT);
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = particle_descriptor_pool;
+    descriptor_set_alloc_info.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+    descriptor_set_alloc_info.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, particle_compute_sets.data()) != VK_SUCCESS)
+        cout << "Allocating particle descriptor sets error!" << endl;
+
+    layouts.assign(MAX_FRAMES_IN_FLIGHT, particle_draw_set_layout);
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, particle_draw_sets.data()) != VK_SUCCESS)
+        cout << "Allocating particle descriptor sets error!" << endl;
+
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        size_t previous = (frame + MAX_FRAMES_IN_FLIGHT - 1) % MAX_FRAMES_IN_FLIGHT;
+        array<VkBuffer, 10> buffers = { particle_counter_buffer, particle_buffers[previous], particle_buffers[frame],
+            alive_list_buffers[previous], alive_list_buffers[frame], dead_list_buffer,
+            uniform_buffers[frame], view_buffers[frame], particle_buffers[frame], alive_list_buffers[frame] };
+        array<VkDescriptorBufferInfo, 10> buffer_infos{};
+        array<VkWriteDescriptorSet, 10> descriptor_writes{};
+
+        for (uint32_t write = 0; write < descriptor_writes.size(); write++)
+        {
+            bool compute = write < 6;
+
+            buffer_infos[write].buffer = buffers[write];
+            buffer_infos[write].offset = 0;
+            buffer_infos[write].range = VK_WHOLE_SIZE;
+
+            descriptor_writes[write].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptor_writes[write].dstSet = compute ? particle_compute_sets[frame] : particle_draw_sets[frame];
+            descriptor_writes[write].dstBinding = compute ? write : write - 6;
+            descriptor_writes[write].descriptorType = compute or write >= 8 ? VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            descriptor_writes[write].descriptorCount = 1;
+            descriptor_writes[write].pBufferInfo = &buffer_infos[write];
+        }
+
+        vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
+            descriptor_writes.data(), 0, nullptr);
+    }
+
+    if (async_compute)
+    {
+        compute_command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+        command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        command_buffer_allocate_info.commandPool = compute_command_pool;
+        command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        command_buffer_allocate_info.commandBufferCount = static_cast<uint32_t>(compute_command_buffers.size());
+
+        if (vkAllocateCommandBuffers(logical_device, &command_buffer_allocate_info, compute_command_buffers.data()) != VK_SUCCESS)
+            cout << "Creating compute command buffer error!" << endl;
+    }
+
+    particle_params.emitter = glm::vec4(0.0f, 0.0f, 0.0f, 0.35f);
+    particle_params.gravity = glm::vec4(0.0f, 0.0f, -2.0f, 0.0f);
+    particle_params.lifetime = 3.0f;
+    particle_params.speed = 2.0f;
+    particle_params.floor_height = -1.0f;
 }
 
-vector<char> VulkanManager::get_shader_code(string filename)
+void VulkanManager::remove_particle_resources()
 {
-    ifstream file(filename, ios::ate | ios::binary);
+    if (options.particle_count == 0)
+        return;
 
-    size_t file_size = (size_t)file.tellg();
-    vector<char> code_array(file_size);
-    file.seekg(0);
-    file.read(code_array.data(), file_size);
+    for (size_t frame = 0; frame < particle_buffers.size(); frame++)
+    {
+        vkDestroyBuffer(logical_device, particle_buffers[frame], nullptr);
+        free_memory(particle_buffers_memory[frame]);
+        vkDestroyBuffer(logical_device, alive_list_buffers[frame], nullptr);
+        free_memory(alive_list_buffers_memory[frame]);
+    }
+    vkDestroyBuffer(logical_device, dead_list_buffer, nullptr);
+    free_memory(dead_list_buffer_memory);
+    vkDestroyBuffer(logical_device, particle_counter_buffer, nullptr);
+    free_memory(particle_counter_buffer_memory);
+
+    vkDestroyDescriptorPool(logical_device, particle_descriptor_pool, nullptr);
+    vkDestroyPipeline(logical_device, particle_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, particle_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, particle_draw_set_layout, nullptr);
+    vkDestroyPipeline(logical_device, particle_compute_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, particle_compute_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, particle_set_layout, nullptr);
+}
 
-    file.close();
+void VulkanManager::update_particles(uint32_t frame, float time)
+{
+    float delta_time = glm::clamp(time - particle_time, 0.0f, 0.1f);
 
-    return code_array;
+    if (options.particle_count == 0)
+        return;
+
+    // Emitting at the rate that refills the pool over one average lifetime; the carry keeps the rate exact.
+    particle_time = time;
+    particle_emit_carry += options.particle_count / (0.75 * particle_params.lifetime) * delta_time;
+    particle_params.emit_request = static_cast<uint32_t>(particle_emit_carry);
+    particle_emit_carry -= particle_params.emit_request;
+
+    particle_params.gravity.w = delta_time;
+    particle_params.slot = frame;
+    particle_params.previous_slot = (frame + MAX_FRAMES_IN_FLIGHT - 1) % MAX_FRAMES_IN_FLIGHT;
+    particle_params.seed = static_cast<uint32_t>(frames_drawn);
 }
 
-VkShaderModule VulkanManager::get_shader_module(vector<char> shader_code)
+void VulkanManager::record_particle_simulation(VkCommandBuffer buff)
 {
-    VkShaderModule shader_module;
-    VkShaderModuleCreateInfo module_create_info{};
-    module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    module_create_info.codeSize = shader_code.size();
-    module_create_info.pCode = reinterpret_cast<const uint32_t*>(shader_code.data());
+    VkMemoryBarrier barrier{};
+    uint32_t particle_query = 2 * (2 * MAX_FRAMES_IN_FLIGHT + current_frame);
 
-    if (vkCreateShaderModule(logical_device, &module_create_info, nullptr, &shader_module) != VK_SUCCESS)
+    // As for the post chain, earlier work is drained first so the interval is the simulation alone.
+    if (particle_timestamps)
     {
-        cout << "Getting shader module error!" << endl;
-        return shader_module;
+        vkCmdResetQueryPool(buff, timestamp_pool, particle_query, 2);
+        vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0, 0, nullptr, 0, nullptr, 0, nullptr);
+        vkCmdWriteTimestamp(buff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, particle_query);
     }
 
-    return shader_module;
+    // Last frame's simulation wrote the state read here, and its indirect dispatches read the arguments rewritten here.
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, particle_compute_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, particle_compute_layout, 0, 1, &particle_compute_sets[current_frame], 0, nullptr);
+
+    particle_params.stage = PARTICLE_PREPARE;
+    vkCmdPushConstants(buff, particle_compute_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(particle_params), &particle_params);
+    vkCmdDispatch(buff, 1, 1, 1);
+
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    particle_params.stage = PARTICLE_SIMULATE;
+    vkCmdPushConstants(buff, particle_compute_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(particle_params), &particle_params);
+    vkCmdDispatchIndirect(buff, particle_counter_buffer, offsetof(ParticleCounters, simulate));
+
+    // Emission pops the dead list only after this frame's deaths were pushed onto it.
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    particle_params.stage = PARTICLE_EMIT;
+    vkCmdPushConstants(buff, particle_compute_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(particle_params), &particle_params);
+    vkCmdDispatchIndirect(buff, particle_counter_buffer, offsetof(ParticleCounters, emit));
+
+    if (particle_timestamps)
+        vkCmdWriteTimestamp(buff, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, particle_query + 1);
+
+    if (async_compute)
+        return;
+
+    // On one queue the draw waits for the simulation here; across queues the frame's semaphore wait does it.
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
 }
 
-void VulkanManager::add_render_pass()
+GpuTimelinePoint VulkanManager::submit_particle_simulation()
 {
-    VkAttachmentDescription color_attachment{};
-    VkAttachmentReference attachment_reference{};
-    VkAttachmentDescription depth_attachment{};
-    VkAttachmentReference depth_attachment_reference{};
-    VkSubpassDescription subpass_description{};
-    VkRenderPassCreateInfo render_pass_create_info{};
-    VkSubpassDependency subpass_dependency{};
+    VkCommandBuffer buff = compute_command_buffers[current_frame];
+    VkCommandBufferBeginInfo begin_info{};
 
-    color_attachment.format = swap_chain_image_format;
-    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
-    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-    attachment_reference.attachment = 0;
-    attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    vkResetCommandBuffer(buff, 0);
+    if (vkBeginCommandBuffer(buff, &begin_info) != VK_SUCCESS)
+        cout << "Begin recording particle simulation error!" << endl;
+    record_particle_simulation(buff);
+    if (vkEndCommandBuffer(buff) != VK_SUCCESS)
+        cout << "Recording particle simulation error!" << endl;
 
-    depth_attachment.format = find_depth_format();
-    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
-    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
-    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    return submit_to_timeline(compute_timeline, buff, {});
+}
 
-    depth_attachment_reference.attachment = 1;
-    depth_attachment_reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+void VulkanManager::record_particles(VkCommandBuffer buff, uint32_t view_pass)
+{
+    if (options.particle_count == 0)
+        return;
 
-    array<VkAttachmentDescription, 2> attachments = { color_attachment, depth_attachment };
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, particle_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, particle_pipeline_layout, 0, 1, &particle_draw_sets[current_frame], 0, nullptr);
+    vkCmdPushConstants(buff, particle_pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(view_pass), &view_pass);
+    vkCmdDrawIndirect(buff, particle_counter_buffer, offsetof(ParticleCounters, draws) + current_frame * sizeof(VkDrawIndirectCommand),
+        1, sizeof(VkDrawIndirectCommand));
+    draw_stats.draws++;
+}
 
-    subpass_description.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
-    subpass_description.colorAttachmentCount = 1;
-    subpass_description.pColorAttachments = &attachment_reference;
-    subpass_description.pDepthStencilAttachment = &depth_attachment_reference;
+void VulkanManager::print_particle_stats()
+{
+    if (options.particle_count == 0)
+        return;
 
-    subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    subpass_dependency.dstSubpass = 0;
-    subpass_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    subpass_dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-    subpass_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
-    subpass_dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    cout << "Particles: " << options.particle_count << " simulated on the "
+        << (async_compute ? "async compute queue (family " + to_string(compute_family_index) + ")" : string("graphics queue"))
+        << ", drawn indirectly";
+    if (particle_timestamps)
+        cout << ", simulate and emit " << (particle_frames_timed > 0 ? particle_gpu_ms / particle_frames_timed : 0.0)
+            << " ms GPU per frame over " << particle_frames_timed << " frames";
+    cout << endl;
+}
 
-    render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_create_info.attachmentCount = static_cast<uint32_t>(attachments.size());
-    render_pass_create_info.pAttachments = attachments.data();
-    render_pass_create_info.subpassCount = 1;
-    render_pass_create_info.pSubpasses = &subpass_description;
-    render_pass_create_info.dependencyCount = 1;
-    render_pass_create_info.pDependencies = &subpass_dependency;
+void VulkanManager::add_light_buffers()
+{
+    const float spacing = 1.5f;
+    uint32_t columns = static_cast<uint32_t>(ceil(sqrt(static_cast<float>(options.instance_count))));
+    float extent = 1.0f + (columns - 1) * spacing;
+    VkDeviceSize light_size = sizeof(GpuLight) * static_cast<VkDeviceSize>(max(options.light_count, 1u));
+    VkDeviceSize grid_size = options.light_count > 0
+        ? sizeof(uint32_t) * static_cast<VkDeviceSize>(light_grid.cluster_count()) * (1 + MAX_LIGHTS_PER_CLUSTER) : sizeof(uint32_t);
+
+    lighting_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    lighting_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    lighting_buffers_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    light_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    light_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    lights_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    light_grid_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    light_grid_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+
+    // The scene shader always binds these; without lights they stay minimal and it skips the loop.
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        add_buffer(lighting_buffers[frame], lighting_buffers_memory[frame], sizeof(LightingBufferObject),
+            VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_UNIFORMS);
+        vkMapMemory(logical_device, lighting_buffers_memory[frame], 0, sizeof(LightingBufferObject), 0, &lighting_buffers_mapped[frame]);
+
+        add_buffer(light_buffers[frame], light_buffers_memory[frame], light_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_LIGHTS);
+        vkMapMemory(logical_device, light_buffers_memory[frame], 0, light_size, 0, reinterpret_cast<void**>(&lights_mapped[frame]));
+
+        add_buffer(light_grid_buffers[frame], light_grid_buffers_memory[frame], grid_size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_LIGHTS);
+    }
+
+    // With --scale-light-range each light covers the same share of the scene volume whatever the count;
+    // otherwise ranges are fixed and lights per cluster grow with the count.
+    light_range = 0.75f * extent;
+    if (options.scale_light_range)
+        light_range /= cbrt(max(options.light_count, 16u) / 16.0f);
+    light_grid.near_plane = near_plane;
+    light_grid.far_plane = far_plane;
+    base_lights = make_light_field(options.light_count, glm::vec3(-extent), glm::vec3(extent), light_range);
+}
+
+void VulkanManager::add_light_culling_pipeline()
+{
+    light_cull_set_layout = add_compute_set_layout({ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER });
+    add_compute_pipeline(get_shader_code("Shaders/light_cull.spv"), light_cull_set_layout, sizeof(uint32_t),
+        light_cull_layout, light_cull_pipeline);
+}
+
+void VulkanManager::add_light_culling_sets()
+{
+    array<VkDescriptorPoolSize, 2> pool_sizes{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, light_cull_set_layout);
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_sizes[0].descriptorCount = MAX_FRAMES_IN_FLIGHT;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[1].descriptorCount = 2 * MAX_FRAMES_IN_FLIGHT;
+
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+    pool_create_info.pPoolSizes = pool_sizes.data();
+    pool_create_info.maxSets = MAX_FRAMES_IN_FLIGHT;
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &light_descriptor_pool) != VK_SUCCESS)
+        cout << "Creating light descriptor pool error!" << endl;
+
+    light_cull_sets.resize(MAX_FRAMES_IN_FLIGHT);
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = light_descriptor_pool;
+    descriptor_set_alloc_info.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+    descriptor_set_alloc_info.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, light_cull_sets.data()) != VK_SUCCESS)
+        cout << "Allocating light descriptor sets error!" << endl;
+
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        array<VkBuffer, 3> buffers = { lighting_buffers[frame], light_buffers[frame], light_grid_buffers[frame] };
+        array<VkDescriptorBufferInfo, 3> buffer_infos{};
+        array<VkWriteDescriptorSet, 3> descriptor_writes{};
+
+        for (uint32_t binding = 0; binding < descriptor_writes.size(); binding++)
+        {
+            buffer_infos[binding].buffer = buffers[binding];
+            buffer_infos[binding].offset = 0;
+            buffer_infos[binding].range = VK_WHOLE_SIZE;
+
+            descriptor_writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptor_writes[binding].dstSet = light_cull_sets[frame];
+            descriptor_writes[binding].dstBinding = binding;
+            descriptor_writes[binding].descriptorType = binding == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptor_writes[binding].descriptorCount = 1;
+            descriptor_writes[binding].pBufferInfo = &buffer_infos[binding];
+        }
+
+        vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
+            descriptor_writes.data(), 0, nullptr);
+    }
+}
+
+void VulkanManager::remove_light_resources()
+{
+    for (size_t frame = 0; frame < lighting_buffers.size(); frame++)
+    {
+        vkDestroyBuffer(logical_device, lighting_buffers[frame], nullptr);
+        free_memory(lighting_buffers_memory[frame]);
+        vkDestroyBuffer(logical_device, light_buffers[frame], nullptr);
+        free_memory(light_buffers_memory[frame]);
+        vkDestroyBuffer(logical_device, light_grid_buffers[frame], nullptr);
+        free_memory(light_grid_buffers_memory[frame]);
+    }
+
+    if (options.light_count == 0)
+        return;
+
+    vkDestroyDescriptorPool(logical_device, light_descriptor_pool, nullptr);
+    vkDestroyPipeline(logical_device, light_cull_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, light_cull_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, light_cull_set_layout, nullptr);
+}
+
+void VulkanManager::update_lights(uint32_t frame, float time)
+{
+    LightingBufferObject lighting{};
+    GpuLight* lights = lights_mapped[frame];
+
+    lighting.view = frame_ubo.view;
+    lighting.inverse_proj = glm::inverse(frame_ubo.proj);
+    lighting.camera_position = glm::inverse(frame_ubo.view)[3];
+    lighting.ambient = glm::vec4(0.05f, 0.05f, 0.05f, 0.0f);
+    lighting.grid = glm::uvec4(light_grid.tiles_x, light_grid.tiles_y, light_grid.slices, options.light_count);
+    lighting.depth = glm::vec4(light_grid.near_plane, light_grid.far_plane, light_grid.slices / log(light_grid.far_plane / light_grid.near_plane), 0.0f);
+    lighting.screen = glm::vec4(render_extent.width, render_extent.height, 0.0f, 0.0f);
+
+    memcpy(lighting_buffers_mapped[frame], &lighting, sizeof(lighting));
+    if (options.light_count == 0)
+        return;
+
+    workers.parallel_for(options.light_count, 1024, [this, time, lights](uint32_t begin, uint32_t end)
+        {
+            animate_lights(base_lights, time, begin, end, lights);
+        });
+}
+
+void VulkanManager::record_light_culling(VkCommandBuffer buff)
+{
+    uint32_t cluster_count = light_grid.cluster_count();
+    VkMemoryBarrier barrier{};
+
+    if (options.light_count == 0)
+        return;
+
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, light_cull_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, light_cull_layout, 0, 1, &light_cull_sets[current_frame], 0, nullptr);
+    vkCmdPushConstants(buff, light_cull_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(cluster_count), &cluster_count);
+    vkCmdDispatch(buff, (cluster_count + 63) / 64, 1, 1);
+
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+// Runs light_cull.comp once more over the current frame slot's inputs and counts the clusters whose
+// lists differ from the CPU reference built from the same inputs.
+uint32_t VulkanManager::compare_light_lists(const vector<uint32_t>& counts, const vector<uint32_t>& indices)
+{
+    uint32_t cluster_count = light_grid.cluster_count();
+    VkDeviceSize grid_size = sizeof(uint32_t) * static_cast<VkDeviceSize>(cluster_count) * (1 + MAX_LIGHTS_PER_CLUSTER);
+    VkBuffer readback_buffer;
+    VkDeviceMemory readback_memory;
+    uint32_t* grid;
+    VkCommandBuffer command_buff;
+    VkMemoryBarrier barrier{};
+    VkBufferCopy copy_region{};
+    uint32_t mismatches = 0;
+
+    add_buffer(readback_buffer, readback_memory, grid_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_READBACK);
+
+    command_buff = begin_single_time_commands();
+    record_light_culling(command_buff);
+
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(command_buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    copy_region.size = grid_size;
+    vkCmdCopyBuffer(command_buff, light_grid_buffers[current_frame], readback_buffer, 1, &copy_region);
+    end_single_time_commands(command_buff);
+
+    vkMapMemory(logical_device, readback_memory, 0, grid_size, 0, reinterpret_cast<void**>(&grid));
+    for (uint32_t cluster = 0; cluster < cluster_count; cluster++)
+    {
+        const uint32_t* gpu_indices = grid + cluster_count + static_cast<size_t>(cluster) * MAX_LIGHTS_PER_CLUSTER;
+        const uint32_t* cpu_indices = indices.data() + static_cast<size_t>(cluster) * MAX_LIGHTS_PER_CLUSTER;
+
+        if (grid[cluster] != counts[cluster] or !equal(cpu_indices, cpu_indices + counts[cluster], gpu_indices))
+            mismatches++;
+    }
+    vkUnmapMemory(logical_device, readback_memory);
+
+    vkDestroyBuffer(logical_device, readback_buffer, nullptr);
+    free_memory(readback_memory);
+    return mismatches;
+}
+
+void VulkanManager::print_lighting_stats()
+{
+    LightingBufferObject lighting{};
+    vector<uint32_t> counts;
+    vector<uint32_t> indices;
+    uint32_t lit_clusters = 0;
+    uint32_t full_clusters = 0;
+    uint32_t max_lights = 0;
+    uint64_t total_lights = 0;
+    uint32_t mismatches;
+
+    if (options.light_count == 0)
+        return;
+
+    // The CPU reference over exactly the lights and camera the current slot holds, which the GPU culls again below.
+    memcpy(&lighting, lighting_buffers_mapped[current_frame], sizeof(lighting));
+    vector<GpuLight> lights(lights_mapped[current_frame], lights_mapped[current_frame] + options.light_count);
+    assign_lights(light_grid, lighting.view, lighting.inverse_proj, lights, MAX_LIGHTS_PER_CLUSTER, counts, indices);
+    mismatches = compare_light_lists(counts, indices);
+
+    for (uint32_t count : counts)
+    {
+        lit_clusters += count > 0 ? 1 : 0;
+        full_clusters += count == MAX_LIGHTS_PER_CLUSTER ? 1 : 0;
+        max_lights = max(max_lights, count);
+        total_lights += count;
+    }
+
+    cout << "Lights: " << options.light_count << " of range " << light_range << " in " << light_grid.tiles_x << "x" << light_grid.tiles_y << "x" << light_grid.slices
+        << " clusters, " << lit_clusters << " lit, " << (lit_clusters > 0 ? static_cast<double>(total_lights) / lit_clusters : 0.0)
+        << " lights per lit cluster (max " << max_lights << ", " << full_clusters << " full), "
+        << mismatches << " clusters differ between light_cull.comp and the CPU reference" << endl;
+}
+
+void VulkanManager::add_shadow_render_pass()
+{
+    VkAttachmentDescription depth_attachment{};
+    VkAttachmentReference depth_attachment_reference{};
+    VkSubpassDescription subpass_description{};
+    array<VkSubpassDependency, 2> subpass_dependencies{};
+    VkRenderPassCreateInfo render_pass_create_info{};
+
+    depth_attachment.format = find_depth_format();
+    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+    depth_attachment_reference.attachment = 0;
+    depth_attachment_reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    subpass_description.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass_description.colorAttachmentCount = 0;
+    subpass_description.pDepthStencilAttachment = &depth_attachment_reference;
+
+    // The previous frame's scene pass may still be sampling the layer this pass clears.
+    subpass_dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependencies[0].dstSubpass = 0;
+    subpass_dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpass_dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subpass_dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    subpass_dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    subpass_dependencies[1].srcSubpass = 0;
+    subpass_dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subpass_dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpass_dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    subpass_dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_create_info.attachmentCount = 1;
+    render_pass_create_info.pAttachments = &depth_attachment;
+    render_pass_create_info.subpassCount = 1;
+    render_pass_create_info.pSubpasses = &subpass_description;
+    render_pass_create_info.dependencyCount = static_cast<uint32_t>(subpass_dependencies.size());
+    render_pass_create_info.pDependencies = subpass_dependencies.data();
+
+    if (vkCreateRenderPass(logical_device, &render_pass_create_info, nullptr, &shadow_render_pass) != VK_SUCCESS)
+        cout << "Creating shadow render pass error!" << endl;
+}
+
+void VulkanManager::add_shadow_atlas()
+{
+    VkFormat depth_format = find_depth_format();
+    uint32_t map_size = options.shadow_cascades > 0 ? options.shadow_map_size : 1;
+    // The scene shader always samples the atlas; without shadows it is a placeholder that is never read.
+    uint32_t layers = max(options.shadow_cascades, 2u);
+    VkImageAspectFlags aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+    VkSamplerCreateInfo sampler_create_info{};
+    VkImageMemoryBarrier barrier{};
+    VkCommandBuffer command_buff;
+
+    if (has_stencil_component(depth_format))
+        aspect |= VK_IMAGE_ASPECT_STENCIL_BIT;
+
+    shadow_cascades.init(options.shadow_cascades, map_size, glm::vec3(-0.4f, -0.3f, -1.0f));
+    add_image(map_size, map_size, depth_format, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        shadow_atlas, shadow_atlas_memory, MEMORY_ATTACHMENTS, layers);
+    shadow_atlas_view = add_image_view(shadow_atlas, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, 0, layers);
+
+    // Cached cascades are sampled in frames that never render them, so every layer starts readable.
+    command_buff = begin_single_time_commands();
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = shadow_atlas;
+    barrier.subresourceRange.aspectMask = aspect;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = layers;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(command_buff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+    end_single_time_commands(command_buff);
+
+    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_create_info.magFilter = VK_FILTER_LINEAR;
+    sampler_create_info.minFilter = VK_FILTER_LINEAR;
+    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER;
+    sampler_create_info.anisotropyEnable = VK_FALSE;
+    sampler_create_info.maxAnisotropy = 1.0f;
+    sampler_create_info.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE;
+    sampler_create_info.unnormalizedCoordinates = VK_FALSE;
+    sampler_create_info.compareEnable = VK_TRUE;
+    sampler_create_info.compareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_create_info.mipLodBias = 0.0;
+    sampler_create_info.minLod = 0.0;
+    sampler_create_info.maxLod = 0.0;
+
+    if (vkCreateSampler(logical_device, &sampler_create_info, nullptr, &shadow_sampler) != VK_SUCCESS)
+        cout << "Adding shadow sampler error!" << endl;
+
+    if (options.shadow_cascades == 0)
+        return;
+
+    shadow_layer_views.resize(shadow_cascades.count());
+    shadow_framebuffers.resize(shadow_cascades.count());
+    for (uint32_t cascade = 0; cascade < shadow_cascades.count(); cascade++)
+    {
+        VkFramebufferCreateInfo frame_buffer_create_info{};
+
+        shadow_layer_views[cascade] = add_image_view(shadow_atlas, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, cascade);
+
+        frame_buffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        frame_buffer_create_info.renderPass = shadow_render_pass;
+        frame_buffer_create_info.attachmentCount = 1;
+        frame_buffer_create_info.pAttachments = &shadow_layer_views[cascade];
+        frame_buffer_create_info.width = map_size;
+        frame_buffer_create_info.height = map_size;
+        frame_buffer_create_info.layers = 1;
+
+        if (vkCreateFramebuffer(logical_device, &frame_buffer_create_info, nullptr, &shadow_framebuffers[cascade]) != VK_SUCCESS)
+        {
+            cout << "Creating shadow framebuffer error!" << endl;
+            return;
+        }
+    }
+}
+
+void VulkanManager::remove_shadow_resources()
+{
+    for (VkFramebuffer framebuffer : shadow_framebuffers)
+        vkDestroyFramebuffer(logical_device, framebuffer, nullptr);
+    for (VkImageView layer_view : shadow_layer_views)
+        vkDestroyImageView(logical_device, layer_view, nullptr);
+    shadow_framebuffers.clear();
+    shadow_layer_views.clear();
+
+    vkDestroySampler(logical_device, shadow_sampler, nullptr);
+    vkDestroyImageView(logical_device, shadow_atlas_view, nullptr);
+    vkDestroyImage(logical_device, shadow_atlas, nullptr);
+    free_memory(shadow_atlas_memory);
+
+    if (options.shadow_cascades == 0)
+        return;
+
+    vkDestroyPipeline(logical_device, shadow_pipeline, nullptr);
+    vkDestroyRenderPass(logical_device, shadow_render_pass, nullptr);
+}
+
+void VulkanManager::update_shadows(uint32_t frame)
+{
+    ShadowBufferObject shadow{};
+
+    shadow.light = glm::vec4(shadow_cascades.direction(), static_cast<float>(shadow_cascades.count()));
+    if (options.shadow_cascades > 0)
+    {
+        shadow_casters.resize(scene_transforms.size());
+        for (uint32_t instance = 0; instance < scene_transforms.size(); instance++)
+            shadow_casters[instance] = frame_ubo.model * scene_transforms.world(instance);
+
+        // Skinned poses deform without their transforms changing, so nothing can be cached then.
+        shadow_cascades.update(frame_ubo.view, glm::radians(45.0f), (float) swap_chain_extent.width / swap_chain_extent.height,
+            near_plane, far_plane, shadow_casters, mesh_center, mesh_radius, options.skinning);
+
+        for (uint32_t cascade = 0; cascade < shadow_cascades.count(); cascade++)
+        {
+            shadow.cascades[cascade] = shadow_cascades.cascade(cascade).view_proj;
+            shadow.splits[cascade] = shadow_cascades.cascade(cascade).split_depth;
+            shadow.texel_sizes[cascade] = shadow_cascades.cascade(cascade).texel_size;
+        }
+    }
+
+    memcpy(shadow_buffers_mapped[frame], &shadow, sizeof(shadow));
+}
+
+void VulkanManager::record_shadow_passes(VkCommandBuffer buff)
+{
+    uint32_t map_size = options.shadow_map_size;
+    VkViewport viewport{};
+    VkRect2D scissors{};
+    VkBuffer vertex_buffers[] = { options.skinning ? skinned_vertex_buffers[current_frame] : vertex_buffer };
+    VkDeviceSize offsets[] = { 0 };
+    VkClearValue clear_value{};
+
+    if (options.shadow_cascades == 0)
+        return;
+
+    clear_value.depthStencil = { 1.0f, 0 };
+
+    viewport.x = 0.0;
+    viewport.y = 0.0;
+    viewport.width = static_cast<float>(map_size);
+    viewport.height = static_cast<float>(map_size);
+    viewport.minDepth = 0.0;
+    viewport.maxDepth = 1.0;
+
+    scissors.offset = { 0, 0 };
+    scissors.extent = { map_size, map_size };
+
+    for (uint32_t cascade = 0; cascade < shadow_cascades.count(); cascade++)
+    {
+        VkRenderPassBeginInfo render_pass_info{};
+        uint64_t draws_before = draw_stats.draws;
+
+        // A cached layer still holds what an earlier frame rendered for the same box and casters.
+        if (!shadow_cascades.cascade(cascade).dirty)
+        {
+            shadow_draws_saved += options.skinning ? skin_pose_count * draw_list.opaque.size() : draw_list.opaque.size();
+            continue;
+        }
+
+        render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+        render_pass_info.renderPass = shadow_render_pass;
+        render_pass_info.framebuffer = shadow_framebuffers[cascade];
+        render_pass_info.renderArea.offset = { 0, 0 };
+        render_pass_info.renderArea.extent = scissors.extent;
+        render_pass_info.clearValueCount = 1;
+        render_pass_info.pClearValues = &clear_value;
+
+        vkCmdBeginRenderPass(buff, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+        vkCmdSetViewport(buff, 0, 1, &viewport);
+        vkCmdSetScissor(buff, 0, 1, &scissors);
+        vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, shadow_pipeline);
+        vkCmdBindVertexBuffers(buff, 0, 1, vertex_buffers, offsets);
+        vkCmdBindIndexBuffer(buff, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+        vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout,
+            0, 1, &descriptor_sets[current_frame], 0, nullptr);
+        vkCmdPushConstants(buff, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(cascade), &cascade);
+
+        // Only opaque geometry casts; the camera's culling does not apply to the light's view.
+        for (const DrawItem& item : draw_list.opaque)
+        {
+            const Submesh& submesh = submeshes[item.submesh];
+
+            if (options.skinning)
+            {
+                record_skinned_draws(buff, submesh);
+                continue;
+            }
+            vkCmdDrawIndexed(buff, submesh.index_count, static_cast<uint32_t>(scene_transforms.size()), submesh.first_index, 0, 0);
+            draw_stats.draws++;
+        }
+        vkCmdEndRenderPass(buff);
+        // Reported on their own, the scene's bind statistics only cover the camera passes.
+        shadow_draws += draw_stats.draws - draws_before;
+        draw_stats.draws = draws_before;
+    }
+}
+
+void VulkanManager::print_shadow_stats()
+{
+    const ShadowStats& stats = shadow_cascades.stats();
+    uint64_t passes = stats.rendered + stats.cached;
+
+    if (options.shadow_cascades == 0)
+        return;
+
+    cout << "Shadows: " << shadow_cascades.count() << " cascades of " << options.shadow_map_size << "x" << options.shadow_map_size
+        << ", " << stats.rendered << " passes rendered, " << stats.cached << " cached ("
+        << (passes > 0 ? 100.0 * stats.cached / passes : 0.0) << "%), " << shadow_draws << " draws, "
+        << shadow_draws_saved << " saved by caching" << endl;
+}
+
+void VulkanManager::add_upscale_pass()
+{
+    VkAttachmentDescription color_attachment{};
+    VkAttachmentReference attachment_reference{};
+    VkSubpassDescription subpass_description{};
+    VkSubpassDependency subpass_dependency{};
+    VkRenderPassCreateInfo render_pass_create_info{};
+    VkDescriptorSetLayoutBinding image_binding{};
+    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+    VkSamplerCreateInfo sampler_create_info{};
+
+    // Every pixel is written by the fullscreen triangle, so the old contents are never loaded.
+    color_attachment.format = swap_chain_image_format;
+    color_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    color_attachment.finalLayout = options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    attachment_reference.attachment = 0;
+    attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    subpass_description.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass_description.colorAttachmentCount = 1;
+    subpass_description.pColorAttachments = &attachment_reference;
+
+    subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependency.dstSubpass = 0;
+    subpass_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    subpass_dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    subpass_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpass_dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_SHADER_READ_BIT;
+
+    render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_create_info.attachmentCount = 1;
+    render_pass_create_info.pAttachments = &color_attachment;
+    render_pass_create_info.subpassCount = 1;
+    render_pass_create_info.pSubpasses = &subpass_description;
+    render_pass_create_info.dependencyCount = 1;
+    render_pass_create_info.pDependencies = &subpass_dependency;
+
+    if (vkCreateRenderPass(logical_device, &render_pass_create_info, nullptr, &upscale_render_pass) != VK_SUCCESS)
+        cout << "Creating upscale render pass error!" << endl;
+
+    image_binding.binding = 0;
+    image_binding.descriptorCount = 1;
+    image_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    image_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_create_info.bindingCount = 1;
+    layout_create_info.pBindings = &image_binding;
+
+    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &upscale_set_layout) != VK_SUCCESS)
+        cout << "Creating upscale set layout error!" << endl;
+
+    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_create_info.magFilter = VK_FILTER_LINEAR;
+    sampler_create_info.minFilter = VK_FILTER_LINEAR;
+    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.anisotropyEnable = VK_FALSE;
+    sampler_create_info.maxAnisotropy = 1.0f;
+    sampler_create_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+    sampler_create_info.unnormalizedCoordinates = VK_FALSE;
+    sampler_create_info.compareEnable = VK_FALSE;
+    sampler_create_info.compareOp = VK_COMPARE_OP_ALWAYS;
+    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_create_info.mipLodBias = 0.0;
+    sampler_create_info.minLod = 0.0;
+    sampler_create_info.maxLod = 0.0;
+
+    if (vkCreateSampler(logical_device, &sampler_create_info, nullptr, &upscale_sampler) != VK_SUCCESS)
+        cout << "Adding upscale sampler error!" << endl;
+}
+
+void VulkanManager::add_upscale_pipeline()
+{
+    vector<VkDynamicState> dynamic_states = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+    VkShaderModule vert_shader_module = get_shader_module(upscale_vert_shader_code);
+    VkShaderModule frag_shader_module = get_shader_module(upscale_frag_shader_code);
+    array<VkPipelineShaderStageCreateInfo, 2> shader_stages{};
+    VkPipelineDynamicStateCreateInfo dynamic_states_create_info{};
+    VkPipelineVertexInputStateCreateInfo vertex_input_create_info{};
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_create_info{};
+    VkPipelineViewportStateCreateInfo viewport_state{};
+    VkPipelineRasterizationStateCreateInfo rasterizer_create_info{};
+    VkPipelineMultisampleStateCreateInfo multisampling_create_info{};
+    VkPipelineColorBlendAttachmentState color_blend_attachment{};
+    VkPipelineColorBlendStateCreateInfo color_blending_create_info{};
+    VkPushConstantRange push_constant_range{};
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+    VkGraphicsPipelineCreateInfo pipeline_create_info{};
+
+    shader_stages[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shader_stages[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
+    shader_stages[0].module = vert_shader_module;
+    shader_stages[0].pName = "main";
+    shader_stages[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shader_stages[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    shader_stages[1].module = frag_shader_module;
+    shader_stages[1].pName = "main";
+
+    dynamic_states_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_states_create_info.dynamicStateCount = static_cast<uint32_t>(dynamic_states.size());
+    dynamic_states_create_info.pDynamicStates = dynamic_states.data();
+
+    // The fullscreen triangle comes from the vertex index.
+    vertex_input_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+
+    input_assembly_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state.viewportCount = 1;
+    viewport_state.scissorCount = 1;
+
+    rasterizer_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer_create_info.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer_create_info.lineWidth = 1.0;
+    rasterizer_create_info.cullMode = VK_CULL_MODE_NONE;
+    rasterizer_create_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+
+    multisampling_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling_create_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+    multisampling_create_info.minSampleShading = 1.0;
+
+    color_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    color_blend_attachment.blendEnable = VK_FALSE;
+
+    color_blending_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blending_create_info.attachmentCount = 1;
+    color_blending_create_info.pAttachments = &color_blend_attachment;
+
+    push_constant_range.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(UpscaleConstants);
+
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &upscale_set_layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, nullptr, &upscale_pipeline_layout) != VK_SUCCESS)
+        cout << "Creating upscale pipeline layout error!" << endl;
+
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_create_info.stageCount = static_cast<uint32_t>(shader_stages.size());
+    pipeline_create_info.pStages = shader_stages.data();
+    pipeline_create_info.pVertexInputState = &vertex_input_create_info;
+    pipeline_create_info.pInputAssemblyState = &input_assembly_create_info;
+    pipeline_create_info.pViewportState = &viewport_state;
+    pipeline_create_info.pRasterizationState = &rasterizer_create_info;
+    pipeline_create_info.pMultisampleState = &multisampling_create_info;
+    pipeline_create_info.pColorBlendState = &color_blending_create_info;
+    pipeline_create_info.pDynamicState = &dynamic_states_create_info;
+    pipeline_create_info.layout = upscale_pipeline_layout;
+    pipeline_create_info.renderPass = upscale_render_pass;
+    pipeline_create_info.subpass = 0;
+    pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_create_info.basePipelineIndex = -1;
+
+    if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &upscale_pipeline) != VK_SUCCESS)
+        cout << "Creating upscale pipeline error!" << endl;
+
+    vkDestroyShaderModule(logical_device, vert_shader_module, nullptr);
+    vkDestroyShaderModule(logical_device, frag_shader_module, nullptr);
+}
+
+void VulkanManager::add_color_targets()
+{
+    VkFormat scene_format = post_processing ? POST_HDR_FORMAT : swap_chain_image_format;
+    VkImageUsageFlags scene_usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    VkDescriptorPoolSize pool_size{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkDescriptorPool upscale_pool;
+    VkDescriptorImageInfo image_info{};
+    VkWriteDescriptorSet descriptor_write{};
+
+    // The samples are resolved inside the scene pass and never stored.
+    if (msaa_samples > 1)
+    {
+        add_image(swap_chain_extent.width, swap_chain_extent.height, scene_format, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSIENT_ATTACHMENT_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            msaa_color_image, msaa_color_memory, MEMORY_ATTACHMENTS, 1, 1, msaa_samples);
+        msaa_color_view = add_image_view(msaa_color_image, scene_format, VK_IMAGE_ASPECT_COLOR_BIT);
+
+        color_target_resources.push_back(resources.add_image_view(msaa_color_view));
+        color_target_resources.push_back(resources.add_image(msaa_color_image, msaa_color_memory));
+    }
+
+    if (!raster_upscale and !post_processing)
+        return;
+
+    if (raster_upscale)
+        scene_usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+    else
+        scene_usage |= VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+
+    // Allocated at the full output size once; the render scale only moves the viewport inside it.
+    add_image(swap_chain_extent.width, swap_chain_extent.height, scene_format, VK_IMAGE_TILING_OPTIMAL,
+        scene_usage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scene_color_image, scene_color_memory, MEMORY_ATTACHMENTS);
+    scene_color_view = add_image_view(scene_color_image, scene_format, VK_IMAGE_ASPECT_COLOR_BIT);
+
+    color_target_resources.push_back(resources.add_image_view(scene_color_view));
+    color_target_resources.push_back(resources.add_image(scene_color_image, scene_color_memory));
+
+    if (post_processing)
+    {
+        add_post_targets();
+        return;
+    }
+
+    pool_size.type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_size.descriptorCount = 1;
+
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = 1;
+    pool_create_info.pPoolSizes = &pool_size;
+    pool_create_info.maxSets = 1;
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &upscale_pool) != VK_SUCCESS)
+        cout << "Creating upscale descriptor pool error!" << endl;
+
+    color_target_resources.push_back(resources.add_descriptor_pool(upscale_pool));
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = upscale_pool;
+    descriptor_set_alloc_info.descriptorSetCount = 1;
+    descriptor_set_alloc_info.pSetLayouts = &upscale_set_layout;
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, &upscale_descriptor_set) != VK_SUCCESS)
+        cout << "Allocating upscale descriptor set error!" << endl;
+
+    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    image_info.imageView = scene_color_view;
+    image_info.sampler = upscale_sampler;
+
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.dstSet = upscale_descriptor_set;
+    descriptor_write.dstBinding = 0;
+    descriptor_write.dstArrayElement = 0;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.pImageInfo = &image_info;
+
+    vkUpdateDescriptorSets(logical_device, 1, &descriptor_write, 0, nullptr);
+
+    upscale_framebuffers.resize(swap_chain_image_views.size());
+    for (size_t i = 0; i < upscale_framebuffers.size(); i++)
+    {
+        VkFramebufferCreateInfo frame_buffer_create_info{};
+
+        frame_buffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        frame_buffer_create_info.renderPass = upscale_render_pass;
+        frame_buffer_create_info.attachmentCount = 1;
+        frame_buffer_create_info.pAttachments = &swap_chain_image_views[i];
+        frame_buffer_create_info.width = swap_chain_extent.width;
+        frame_buffer_create_info.height = swap_chain_extent.height;
+        frame_buffer_create_info.layers = 1;
+
+        if (vkCreateFramebuffer(logical_device, &frame_buffer_create_info, nullptr, &upscale_framebuffers[i]) != VK_SUCCESS)
+        {
+            cout << "Creating upscale framebuffer error!" << endl;
+            return;
+        }
+    }
+}
+
+void VulkanManager::retire_color_targets()
+{
+    for (ResourceHandle handle : color_target_resources)
+        retire_resource(handle);
+    color_target_resources.clear();
+}
+
+void VulkanManager::remove_upscale_resources()
+{
+    if (!raster_upscale)
+        return;
+
+    for (VkFramebuffer framebuffer : upscale_framebuffers)
+        vkDestroyFramebuffer(logical_device, framebuffer, nullptr);
+    upscale_framebuffers.clear();
+
+    vkDestroyPipeline(logical_device, upscale_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, upscale_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, upscale_set_layout, nullptr);
+    vkDestroySampler(logical_device, upscale_sampler, nullptr);
+    vkDestroyRenderPass(logical_device, upscale_render_pass, nullptr);
+}
+
+void VulkanManager::update_render_scale()
+{
+    float scale = 1.0f;
+
+    // The time just read belongs to the frame this slot recorded last, at the scale it used then.
+    if (dynamic_resolution)
+    {
+        scale = resolution.update(last_gpu_frame_ms, frame_render_scales[current_frame]);
+        frame_render_scales[current_frame] = scale;
+    }
+
+    render_extent.width = max(1u, static_cast<uint32_t>(swap_chain_extent.width * scale));
+    render_extent.height = max(1u, static_cast<uint32_t>(swap_chain_extent.height * scale));
+}
+
+void VulkanManager::record_upscale_pass(VkCommandBuffer buff, uint32_t image_index)
+{
+    VkViewport viewport{};
+    VkRect2D scissors{};
+    VkRenderPassBeginInfo render_pass_info{};
+    UpscaleConstants constants{};
+
+    constants.scale = glm::vec2(static_cast<float>(render_extent.width) / swap_chain_extent.width,
+        static_cast<float>(render_extent.height) / swap_chain_extent.height);
+    constants.source_size = glm::vec2(swap_chain_extent.width, swap_chain_extent.height);
+    constants.edge_aware = options.edge_aware_upscale ? 1 : 0;
+
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = upscale_render_pass;
+    render_pass_info.framebuffer = upscale_framebuffers[image_index];
+    render_pass_info.renderArea.offset = { 0, 0 };
+    render_pass_info.renderArea.extent = swap_chain_extent;
+
+    viewport.x = 0.0;
+    viewport.y = 0.0;
+    viewport.width = static_cast<float>(swap_chain_extent.width);
+    viewport.height = static_cast<float>(swap_chain_extent.height);
+    viewport.minDepth = 0.0;
+    viewport.maxDepth = 1.0;
+
+    scissors.offset = { 0, 0 };
+    scissors.extent = swap_chain_extent;
+
+    vkCmdBeginRenderPass(buff, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdSetViewport(buff, 0, 1, &viewport);
+    vkCmdSetScissor(buff, 0, 1, &scissors);
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, upscale_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, upscale_pipeline_layout, 0, 1, &upscale_descriptor_set, 0, nullptr);
+    vkCmdPushConstants(buff, upscale_pipeline_layout, VK_SHADER_STAGE_FRAGMENT_BIT, 0, sizeof(constants), &constants);
+    vkCmdDraw(buff, 3, 1, 0, 0);
+    vkCmdEndRenderPass(buff);
+}
+
+void VulkanManager::add_post_pipelines()
+{
+    array<const char*, POST_PASS_COUNT> shader_paths = { "Shaders/post_tonemap.spv", "Shaders/post_fxaa.spv", "Shaders/post_sharpen.spv" };
+
+    post_set_layout = add_compute_set_layout({ VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE });
+    // Loaded here rather than in read_shaders: the surface decides whether post-processing stays enabled.
+    for (uint32_t pass = 0; pass < POST_PASS_COUNT; pass++)
+    {
+        if (pass == POST_FXAA and !options.fxaa)
+            continue;
+        add_compute_pipeline(get_shader_code(shader_paths[pass]), post_set_layout, sizeof(PostConstants),
+            post_pipeline_layouts[pass], post_pipelines[pass]);
+    }
+}
+
+void VulkanManager::add_post_targets()
+{
+    VkDescriptorPoolSize pool_size{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkDescriptorPool post_pool;
+    array<VkDescriptorSetLayout, POST_PASS_COUNT> set_layouts;
+    array<VkDescriptorImageInfo, 2 * POST_PASS_COUNT> image_infos{};
+    array<VkWriteDescriptorSet, 2 * POST_PASS_COUNT> descriptor_writes{};
+
+    for (size_t image_index = 0; image_index < post_images.size(); image_index++)
+    {
+        add_image(swap_chain_extent.width, swap_chain_extent.height, VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_TILING_OPTIMAL,
+            VK_IMAGE_USAGE_STORAGE_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            post_images[image_index], post_image_memory[image_index], MEMORY_ATTACHMENTS);
+        post_image_views[image_index] = add_image_view(post_images[image_index], VK_FORMAT_R8G8B8A8_UNORM, VK_IMAGE_ASPECT_COLOR_BIT);
+
+        color_target_resources.push_back(resources.add_image_view(post_image_views[image_index]));
+        color_target_resources.push_back(resources.add_image(post_images[image_index], post_image_memory[image_index]));
+    }
+
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    pool_size.descriptorCount = 2 * POST_PASS_COUNT;
+
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = 1;
+    pool_create_info.pPoolSizes = &pool_size;
+    pool_create_info.maxSets = POST_PASS_COUNT;
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &post_pool) != VK_SUCCESS)
+        cout << "Creating post descriptor pool error!" << endl;
+
+    color_target_resources.push_back(resources.add_descriptor_pool(post_pool));
+
+    set_layouts.fill(post_set_layout);
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = post_pool;
+    descriptor_set_alloc_info.descriptorSetCount = POST_PASS_COUNT;
+    descriptor_set_alloc_info.pSetLayouts = set_layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, post_descriptor_sets.data()) != VK_SUCCESS)
+        cout << "Allocating post descriptor sets error!" << endl;
+
+    // Source and destination of each pass. Without FXAA, sharpen reads the tonemapped image directly.
+    image_infos[0].imageView = scene_color_view;
+    image_infos[1].imageView = post_image_views[0];
+    image_infos[2].imageView = post_image_views[0];
+    image_infos[3].imageView = post_image_views[1];
+    image_infos[4].imageView = post_image_views[options.fxaa ? 1 : 0];
+    image_infos[5].imageView = scene_color_view;
+
+    for (uint32_t write = 0; write < descriptor_writes.size(); write++)
+    {
+        image_infos[write].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+        descriptor_writes[write].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[write].dstSet = post_descriptor_sets[write / 2];
+        descriptor_writes[write].dstBinding = write % 2;
+        descriptor_writes[write].dstArrayElement = 0;
+        descriptor_writes[write].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptor_writes[write].descriptorCount = 1;
+        descriptor_writes[write].pImageInfo = &image_infos[write];
+    }
+
+    vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()), descriptor_writes.data(), 0, nullptr);
+}
+
+void VulkanManager::remove_post_resources()
+{
+    if (!post_processing)
+        return;
+
+    for (uint32_t pass = 0; pass < POST_PASS_COUNT; pass++)
+    {
+        vkDestroyPipeline(logical_device, post_pipelines[pass], nullptr);
+        vkDestroyPipelineLayout(logical_device, post_pipeline_layouts[pass], nullptr);
+    }
+    vkDestroyDescriptorSetLayout(logical_device, post_set_layout, nullptr);
+}
+
+void VulkanManager::record_post_chain(VkCommandBuffer buff, uint32_t image_index)
+{
+    PostConstants constants{};
+    array<VkImageMemoryBarrier, 2> post_barriers{};
+    VkMemoryBarrier pass_barrier{};
+    array<VkImageMemoryBarrier, 2> blit_barriers{};
+    VkImageMemoryBarrier output_barrier{};
+    VkMemoryBarrier next_frame_barrier{};
+    VkImageBlit blit{};
+    uint32_t post_query = 2 * (MAX_FRAMES_IN_FLIGHT + current_frame);
+
+    constants.extent = glm::uvec2(render_extent.width, render_extent.height);
+    constants.sharpen = static_cast<float>(options.sharpen);
+    constants.linear_output = swap_chain_image_format == VK_FORMAT_B8G8R8A8_SRGB or swap_chain_image_format == VK_FORMAT_R8G8B8A8_SRGB ? 1 : 0;
+
+    // The scene work is drained before the start stamp, so the interval is the chain alone. The chain
+    // waits for the scene's output anyway, so the extra barrier costs little.
+    if (timestamps_supported)
+    {
+        vkCmdResetQueryPool(buff, timestamp_pool, post_query, 2);
+        vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0, 0, nullptr, 0, nullptr, 0, nullptr);
+        vkCmdWriteTimestamp(buff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, post_query);
+    }
+
+    // Every texel of the 8-bit images is rewritten each frame, so their old contents are discarded.
+    for (size_t image_index = 0; image_index < post_barriers.size(); image_index++)
+    {
+        post_barriers[image_index].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        post_barriers[image_index].srcAccessMask = 0;
+        post_barriers[image_index].dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        post_barriers[image_index].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        post_barriers[image_index].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        post_barriers[image_index].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        post_barriers[image_index].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        post_barriers[image_index].image = post_images[image_index];
+        post_barriers[image_index].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    }
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(post_barriers.size()), post_barriers.data());
+
+    pass_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    pass_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    pass_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    for (uint32_t pass = 0; pass < POST_PASS_COUNT; pass++)
+    {
+        if (pass == POST_FXAA and !options.fxaa)
+            continue;
+        if (pass > 0)
+            vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0, 1, &pass_barrier, 0, nullptr, 0, nullptr);
+
+        vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, post_pipelines[pass]);
+        vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, post_pipeline_layouts[pass], 0, 1, &post_descriptor_sets[pass], 0, nullptr);
+        vkCmdPushConstants(buff, post_pipeline_layouts[pass], VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+        vkCmdDispatch(buff, (render_extent.width + 15) / 16, (render_extent.height + 15) / 16, 1);
+    }
+
+    // The blit stretches the rendered region over the swap chain image, which is also the upscale under dynamic resolution.
+    blit_barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    blit_barriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    blit_barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    blit_barriers[0].oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+    blit_barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    blit_barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    blit_barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    blit_barriers[0].image = scene_color_image;
+    blit_barriers[0].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+    blit_barriers[1] = blit_barriers[0];
+    blit_barriers[1].srcAccessMask = 0;
+    blit_barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    blit_barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    blit_barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    blit_barriers[1].image = swap_chain_images[image_index];
+
+    // Colour attachment output is where the acquire semaphore is waited on.
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, static_cast<uint32_t>(blit_barriers.size()), blit_barriers.data());
+
+    blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    blit.srcOffsets[1] = { static_cast<int32_t>(render_extent.width), static_cast<int32_t>(render_extent.height), 1 };
+    blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    blit.dstOffsets[1] = { static_cast<int32_t>(swap_chain_extent.width), static_cast<int32_t>(swap_chain_extent.height), 1 };
+
+    vkCmdBlitImage(buff, scene_color_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, swap_chain_images[image_index],
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+    output_barrier = blit_barriers[1];
+    output_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    output_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    output_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    output_barrier.newLayout = options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    // The next frame's scene pass renders into the target this chain read and wrote last.
+    next_frame_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    next_frame_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    next_frame_barrier.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, 0, 1, &next_frame_barrier, 0, nullptr, 1, &output_barrier);
+
+    if (timestamps_supported)
+        vkCmdWriteTimestamp(buff, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, post_query + 1);
+}
+
+void VulkanManager::print_post_stats()
+{
+    if (!post_processing)
+        return;
+
+    cout << "Post-processing: tonemap" << (options.fxaa ? ", FXAA" : "") << ", sharpen " << options.sharpen << ", "
+        << (post_frames_timed > 0 ? post_gpu_ms / post_frames_timed : 0.0) << " ms GPU per frame over " << post_frames_timed << " frames" << endl;
+}
+
+void VulkanManager::add_transient_geometry()
+{
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkDeviceSize region_size = static_cast<VkDeviceSize>(options.transient_geometry_kb) * 1024;
+    void* data;
+
+    // With resizable BAR the whole of VRAM is host visible; the plain 256 MB window is left to the driver.
+    vkGetPhysicalDeviceMemoryProperties(phys_device, &memory_properties);
+    for (uint32_t type = 0; type < memory_properties.memoryTypeCount; type++)
+    {
+        VkMemoryPropertyFlags rebar = properties | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+        const VkMemoryType& memory_type = memory_properties.memoryTypes[type];
+
+        if ((memory_type.propertyFlags & rebar) == rebar and memory_properties.memoryHeaps[memory_type.heapIndex].size > 256ull * 1024 * 1024)
+        {
+            properties = rebar;
+            break;
+        }
+    }
+
+    add_buffer(transient_buffer, transient_buffer_memory, region_size * MAX_FRAMES_IN_FLIGHT,
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, properties, MEMORY_TRANSIENT);
+    vkMapMemory(logical_device, transient_buffer_memory, 0, VK_WHOLE_SIZE, 0, &data);
+    transient_geometry.init(static_cast<uint8_t*>(data), region_size, MAX_FRAMES_IN_FLIGHT);
+
+    cout << "Transient geometry ring: " << options.transient_geometry_kb << " KB per frame in "
+        << (properties & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ? "device local" : "host") << " memory" << endl;
+}
+
+void VulkanManager::remove_transient_geometry()
+{
+    vkDestroyBuffer(logical_device, transient_buffer, nullptr);
+    free_memory(transient_buffer_memory);
+    if (debug_line_pipeline != VK_NULL_HANDLE)
+        vkDestroyPipeline(logical_device, debug_line_pipeline, nullptr);
+}
+
+void VulkanManager::write_debug_bounds()
+{
+    static const uint32_t box_edges[24] = { 0, 1, 1, 3, 3, 2, 2, 0, 4, 5, 5, 7, 7, 6, 6, 4, 0, 4, 1, 5, 2, 6, 3, 7 };
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
+    Vertex* vertices;
+    uint32_t* indices;
+
+    // The cube around each instance's bounding sphere, in world space so the lines need no instance data.
+    debug_index_count = 0;
+    if (!options.debug_bounds
+        or !transient_geometry.allocate(8 * sizeof(Vertex) * instance_count, sizeof(float), debug_vertices)
+        or !transient_geometry.allocate(24 * sizeof(uint32_t) * instance_count, sizeof(uint32_t), debug_indices))
+        return;
+
+    vertices = static_cast<Vertex*>(debug_vertices.data);
+    indices = static_cast<uint32_t*>(debug_indices.data);
+
+    for (uint32_t instance = 0; instance < instance_count; instance++)
+    {
+        glm::mat4 model = frame_ubo.model * scene_transforms.world(instance);
+
+        for (uint32_t corner = 0; corner < 8; corner++)
+        {
+            glm::vec3 offset((corner & 1) ? 1.0f : -1.0f, (corner & 2) ? 1.0f : -1.0f, (corner & 4) ? 1.0f : -1.0f);
+            Vertex& vertex = vertices[instance * 8 + corner];
+
+            vertex.position = glm::vec3(model * glm::vec4(mesh_center + mesh_radius * offset, 1.0f));
+            vertex.color = glm::vec3(0.2f, 1.0f, 0.2f);
+            vertex.tex_coord = glm::vec2(0.0f);
+            vertex.normal = glm::vec3(0.0f);
+            vertex.tangent = glm::vec4(0.0f);
+        }
+        for (uint32_t edge = 0; edge < 24; edge++)
+            indices[instance * 24 + edge] = instance * 8 + box_edges[edge];
+    }
+    debug_index_count = 24 * instance_count;
+}
+
+void VulkanManager::record_debug_bounds(VkCommandBuffer buff)
+{
+    if (debug_index_count == 0)
+        return;
+
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, debug_line_pipeline);
+    vkCmdBindVertexBuffers(buff, 0, 1, &transient_buffer, &debug_vertices.offset);
+    vkCmdBindIndexBuffer(buff, transient_buffer, debug_indices.offset, VK_INDEX_TYPE_UINT32);
+    vkCmdDrawIndexed(buff, debug_index_count, 1, 0, 0, 0);
+}
+
+void VulkanManager::update_scene_transforms(uint32_t current_frame, float time)
+{
+    TRACE_ZONE("update_scene_transforms");
+    for (uint32_t instance = 1; instance < scene_transforms.size(); instance++)
+        scene_transforms.set_rotation(instance, glm::angleAxis(time * (0.5f + 0.1f * (instance % 7)), glm::vec3(0.0f, 0.0f, 1.0f)));
+
+    scene_transforms.update(static_cast<glm::mat4*>(instance_buffers_mapped[current_frame]));
+    if (options.bvh_culling)
+        cull_instances(current_frame);
+}
+
+void VulkanManager::refresh_scene_bvh()
+{
+    TRACE_ZONE("refresh_scene_bvh");
+    const float max_degradation = 2.0f;
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
+
+    // Every instance shares the mesh's bounding sphere, which rotations leave in place.
+    instance_boxes.resize(instance_count);
+    workers.parallel_for(instance_count, 4096, [this](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t instance = begin; instance < end; instance++)
+            {
+                const glm::mat4& world = scene_transforms.world(instance);
+                float scale = max(glm::length(glm::vec3(world[0])), max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+                glm::vec3 center = glm::vec3(world * glm::vec4(mesh_center, 1.0f));
+
+                instance_boxes[instance].min = center - glm::vec3(mesh_radius * scale);
+                instance_boxes[instance].max = center + glm::vec3(mesh_radius * scale);
+            }
+        });
+
+    // Refits keep the built topology; once instances have drifted far from it, or the mesh changed, rebuild.
+    if (!scene_bvh_stale and scene_bvh.object_count() == instance_count)
+    {
+        for (uint32_t instance = 0; instance < instance_count; instance++)
+            scene_bvh.update(instance, instance_boxes[instance]);
+        scene_bvh.refit();
+        if (scene_bvh.degradation() <= max_degradation)
+            return;
+    }
+
+    scene_bvh.build(instance_boxes);
+    scene_bvh_stale = false;
+    bvh_builds++;
+}
+
+void VulkanManager::cull_instances(uint32_t frame)
+{
+    TRACE_ZONE("cull_instances");
+    auto start = chrono::steady_clock::now();
+    // Instance matrices map into the space ubo.model maps from, so the planes go there too.
+    Frustum frustum = frustum_from_matrix(frame_ubo.proj * frame_ubo.view * frame_ubo.model);
+
+    refresh_scene_bvh();
+    visible_instances.clear();
+    scene_bvh.cull(frustum, visible_instances);
+    copy(visible_instances.begin(), visible_instances.end(), visible_instances_mapped[frame]);
+    drawn_instance_counts[frame] = static_cast<uint32_t>(visible_instances.size());
+
+    bvh_frames++;
+    bvh_visible += visible_instances.size();
+    bvh_cull_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+void VulkanManager::pick(double cursor_x, double cursor_y)
+{
+    int window_width, window_height;
+    glm::mat4 inverse_clip = glm::inverse(frame_ubo.proj * frame_ubo.view * frame_ubo.model);
+    glm::vec2 ndc;
+    glm::vec4 near_point;
+    glm::vec4 far_point;
+    Ray ray;
+    TriangleHit triangle_hit;
+    uint32_t instance;
+    float t;
+
+    glfwGetWindowSize(window, &window_width, &window_height);
+    if (!scene_mesh_bvh or window_width == 0 or window_height == 0)
+        return;
+
+    // Vulkan's clip space has y pointing down, like the cursor. The ray runs from the near plane (t = 0) to the far plane (t = 1).
+    ndc = glm::vec2(static_cast<float>(2.0 * cursor_x / window_width - 1.0), static_cast<float>(2.0 * cursor_y / window_height - 1.0));
+    near_point = inverse_clip * glm::vec4(ndc, 0.0f, 1.0f);
+    far_point = inverse_clip * glm::vec4(ndc, 1.0f, 1.0f);
+    ray.origin = glm::vec3(near_point) / near_point.w;
+    ray.direction = glm::vec3(far_point) / far_point.w - ray.origin;
+    ray.t_max = 1.0f;
+
+    if (!options.bvh_culling)
+        refresh_scene_bvh();
+
+    // Instance boxes only find candidates; the triangle BVH answers in mesh space. Affine transforms keep
+    // distances along the ray proportional, so t carries over. Skinned instances are picked in the rest pose.
+    auto hit_instance = [&](uint32_t candidate, const Ray& candidate_ray)
+        {
+            glm::mat4 to_mesh = glm::inverse(scene_transforms.world(candidate));
+            Ray mesh_ray;
+            TriangleHit hit;
+
+            mesh_ray.origin = glm::vec3(to_mesh * glm::vec4(candidate_ray.origin, 1.0f));
+            mesh_ray.direction = glm::vec3(to_mesh * glm::vec4(candidate_ray.direction, 0.0f));
+            mesh_ray.t_max = candidate_ray.t_max;
+            if (!scene_mesh_bvh->intersect(mesh_ray, hit))
+                return -1.0f;
+
+            // Only hits closer than the best so far come back, so the last one is the closest.
+            triangle_hit = hit;
+            return hit.t;
+        };
+
+    if (!scene_bvh.intersect(ray, hit_instance, instance, t))
+    {
+        cout << "Picked nothing" << endl;
+        return;
+    }
+
+    for (uint32_t submesh_index = 0; submesh_index < submeshes.size(); submesh_index++)
+    {
+        const Submesh& submesh = submeshes[submesh_index];
+
+        if (3 * triangle_hit.triangle >= submesh.first_index and 3 * triangle_hit.triangle < submesh.first_index + submesh.index_count)
+        {
+            glm::vec3 point = ray.origin + ray.direction * t;
+
+            cout << "Picked instance " << instance << ", submesh " << submesh_index << ", triangle " << triangle_hit.triangle
+                << " at (" << point.x << ", " << point.y << ", " << point.z << ")" << endl;
+            break;
+        }
+    }
+}
+
+void VulkanManager::print_bvh_stats()
+{
+    if (!options.bvh_culling or bvh_frames == 0)
+        return;
+
+    cout << "BVH culling: " << bvh_visible / bvh_frames << " of " << scene_transforms.size() << " instances visible on average, "
+        << bvh_cull_ms / bvh_frames << " ms per frame, " << scene_bvh.node_count() << " nodes, " << bvh_builds << " builds" << endl;
+}
+
+void VulkanManager::update_uniform_buffer(uint32_t current_frame)
+{
+    TRACE_ZONE("update_uniform_buffer");
+    static auto start_time = chrono::high_resolution_clock::now();
+
+    UniformBufferObject ubo{};
+    ViewBufferObject views{};
+    auto current_time = chrono::high_resolution_clock::now();
+    float time = chrono::duration<float, chrono::seconds::period>(current_time - start_time).count();
+
+    if (benchmark)
+    {
+        ubo.model = benchmark->model_matrix();
+        ubo.view = benchmark->view_matrix();
+    }
+    else if (batch_camera)
+    {
+        ubo.model = batch_model;
+        ubo.view = batch_view;
+    }
+    else
+    {
+        ubo.model = glm::rotate(glm::mat4(1.0f), time * glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+        ubo.view = glm::lookAt(glm::vec3(2.0f, 2.0f, 2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    }
+    ubo.proj = glm::perspective(glm::radians(45.0f), (float) swap_chain_extent.width / swap_chain_extent.height, near_plane, far_plane);
+
+    ubo.proj[1][1] *= -1;
+
+    memcpy(uniform_buffers_mapped[current_frame], &ubo, sizeof(ubo));
+    frame_ubo = ubo;
+
+    // Extra views orbit the scene around the up axis, evenly spaced.
+    for (uint32_t view = 0; view < options.view_count; view++)
+    {
+        float angle = glm::radians(360.0f) * view / options.view_count;
+
+        views.view_proj[view] = ubo.proj * ubo.view * glm::rotate(glm::mat4(1.0f), angle, glm::vec3(0.0f, 0.0f, 1.0f));
+    }
+    memcpy(view_buffers_mapped[current_frame], &views, sizeof(views));
+
+    update_scene_transforms(current_frame, benchmark ? benchmark->scene_time() : time);
+    update_skin_poses(current_frame, benchmark ? benchmark->scene_time() : time);
+    update_particles(current_frame, benchmark ? benchmark->scene_time() : time);
+    update_lights(current_frame, benchmark ? benchmark->scene_time() : time);
+    update_shadows(current_frame);
+}
+
+void VulkanManager::add_material_buffer(GpuMesh& mesh)
+{
+    VkPhysicalDeviceProperties properties{};
+    VkDeviceSize alignment;
+    VkDeviceSize size;
+    VkBuffer buff;
+    VkDeviceMemory buff_memory;
+    char* data;
+
+    vkGetPhysicalDeviceProperties(phys_device, &properties);
+    alignment = properties.limits.minUniformBufferOffsetAlignment;
+    material_stride = (sizeof(MaterialBufferObject) + alignment - 1) & ~(alignment - 1);
+    size = material_stride * mesh.materials.size();
+
+    add_buffer(buff, buff_memory, size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_UNIFORMS);
+    mesh.material_buffer = resources.add_buffer(buff, buff_memory);
+
+    vkMapMemory(logical_device, buff_memory, 0, size, 0, reinterpret_cast<void**>(&data));
+    for (size_t material_index = 0; material_index < mesh.materials.size(); material_index++)
+    {
+        const Material& material = mesh.materials[material_index];
+        MaterialBufferObject mbo{};
+
+        mbo.diffuse = glm::vec4(material.diffuse, material.dissolve);
+        mbo.specular = glm::vec4(material.specular, material.shininess);
+        mbo.params = glm::vec4(material.textured ? 1.0f : 0.0f, 0.0f, 0.0f, 0.0f);
+
+        memcpy(data + material_index * material_stride, &mbo, sizeof(mbo));
+    }
+    vkUnmapMemory(logical_device, buff_memory);
+}
+
+void VulkanManager::build_draw_list()
+{
+    TRACE_ZONE("build_draw_list");
+    glm::mat4 view_model = frame_ubo.view * frame_ubo.model;
+
+    draw_list.clear();
+
+    for (uint32_t submesh_index = 0; submesh_index < submeshes.size(); submesh_index++)
+    {
+        const Submesh& submesh = submeshes[submesh_index];
+        float depth = -(view_model * glm::vec4(submesh.center, 1.0f)).z;
+
+        if (materials[submesh.material].dissolve < 1.0f)
+            draw_list.transparent.push_back({ make_transparent_key(PIPELINE_TRANSPARENT, submesh.material, submesh.mesh, depth, far_plane), submesh_index });
+        else
+            draw_list.opaque.push_back({ make_opaque_key(PIPELINE_OPAQUE, submesh.material, submesh.mesh, depth, far_plane), submesh_index });
+    }
+
+    draw_list.sort();
+}
+
+void VulkanManager::print_draw_stats()
+{
+    cout << "Draws: " << draw_stats.draws
+        << ", pipeline binds: " << draw_stats.pipeline_binds << " (" << draw_stats.pipeline_binds_avoided() << " avoided)"
+        << ", material binds: " << draw_stats.material_binds << " (" << draw_stats.material_binds_avoided() << " avoided)" << endl;
+}
+
+void VulkanManager::add_descriptor_set_layout()
+{
+    VkDescriptorSetLayoutBinding ubo_layout_binding{};
+    VkDescriptorSetLayoutBinding sampler_layout_binding{};
+    VkDescriptorSetLayoutBinding instance_layout_binding{};
+    VkDescriptorSetLayoutBinding view_layout_binding{};
+    VkDescriptorSetLayoutBinding visible_layout_binding{};
+    VkDescriptorSetLayoutBinding lighting_layout_binding{};
+    VkDescriptorSetLayoutBinding light_layout_binding{};
+    VkDescriptorSetLayoutBinding light_grid_layout_binding{};
+    VkDescriptorSetLayoutBinding shadow_layout_binding{};
+    VkDescriptorSetLayoutBinding shadow_map_layout_binding{};
+    VkDescriptorSetLayoutBinding material_layout_binding{};
+    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+
+    ubo_layout_binding.binding = 0;
+    ubo_layout_binding.descriptorCount = 1;
+    ubo_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    ubo_layout_binding.pImmutableSamplers = nullptr;
+    ubo_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    sampler_layout_binding.binding = 1;
+    sampler_layout_binding.descriptorCount = 1;
+    sampler_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    sampler_layout_binding.pImmutableSamplers = nullptr;
+    sampler_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    instance_layout_binding.binding = 2;
+    instance_layout_binding.descriptorCount = 1;
+    instance_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    instance_layout_binding.pImmutableSamplers = nullptr;
+    instance_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    view_layout_binding.binding = 3;
+    view_layout_binding.descriptorCount = 1;
+    view_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    view_layout_binding.pImmutableSamplers = nullptr;
+    view_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    visible_layout_binding.binding = 4;
+    visible_layout_binding.descriptorCount = 1;
+    visible_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    visible_layout_binding.pImmutableSamplers = nullptr;
+    visible_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+    lighting_layout_binding.binding = 5;
+    lighting_layout_binding.descriptorCount = 1;
+    lighting_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    lighting_layout_binding.pImmutableSamplers = nullptr;
+    lighting_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    light_layout_binding.binding = 6;
+    light_layout_binding.descriptorCount = 1;
+    light_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    light_layout_binding.pImmutableSamplers = nullptr;
+    light_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    light_grid_layout_binding.binding = 7;
+    light_grid_layout_binding.descriptorCount = 1;
+    light_grid_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    light_grid_layout_binding.pImmutableSamplers = nullptr;
+    light_grid_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    shadow_layout_binding.binding = 8;
+    shadow_layout_binding.descriptorCount = 1;
+    shadow_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    shadow_layout_binding.pImmutableSamplers = nullptr;
+    shadow_layout_binding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    shadow_map_layout_binding.binding = 9;
+    shadow_map_layout_binding.descriptorCount = 1;
+    shadow_map_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    shadow_map_layout_binding.pImmutableSamplers = nullptr;
+    shadow_map_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    array<VkDescriptorSetLayoutBinding, 10> bindings = { ubo_layout_binding, sampler_layout_binding, instance_layout_binding,
+        view_layout_binding, visible_layout_binding, lighting_layout_binding, light_layout_binding, light_grid_layout_binding,
+        shadow_layout_binding, shadow_map_layout_binding };
+
+    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_create_info.bindingCount = static_cast<uint32_t>(bindings.size());
+    layout_create_info.pBindings = bindings.data();
+
+    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &descriptor_set_layout) != VK_SUCCESS)
+    {
+        cout << "Creating descriptor set layout error!" << endl;
+        return;
+    }
+
+    material_layout_binding.binding = 0;
+    material_layout_binding.descriptorCount = 1;
+    material_layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    material_layout_binding.pImmutableSamplers = nullptr;
+    material_layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+
+    layout_create_info.bindingCount = 1;
+    layout_create_info.pBindings = &material_layout_binding;
+
+    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &material_set_layout) != VK_SUCCESS)
+        cout << "Creating material set layout error!" << endl;
+}
+
+void VulkanManager::add_descriptor_pool()
+{
+    array<VkDescriptorPoolSize, 3> sizes{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+
+    sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    sizes[0].descriptorCount = static_cast<uint32_t>(4 * MAX_FRAMES_IN_FLIGHT);
+    sizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    sizes[1].descriptorCount = static_cast<uint32_t>(2 * MAX_FRAMES_IN_FLIGHT);
+    sizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    sizes[2].descriptorCount = static_cast<uint32_t>(4 * MAX_FRAMES_IN_FLIGHT);
+
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = static_cast<uint32_t>(sizes.size());
+    pool_create_info.pPoolSizes = sizes.data();
+    pool_create_info.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &descriptor_pool) != VK_SUCCESS)
+        cout << "Creating descriptors pool error!" << endl;
+}
+
+void VulkanManager::add_descriptor_sets()
+{
+    vector<VkDescriptorSetLayout> layouts(MAX_FRAMES_IN_FLIGHT, descriptor_set_layout);
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+
+    descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = descriptor_pool;
+    descriptor_set_alloc_info.descriptorSetCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT);
+    descriptor_set_alloc_info.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, descriptor_sets.data()) != VK_SUCCESS)
+        cout << "Allocating descriptor sets error!" << endl;
+
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+    {
+        VkDescriptorBufferInfo buffer_info{};
+        VkDescriptorBufferInfo instance_info{};
+        VkDescriptorBufferInfo view_info{};
+        VkDescriptorBufferInfo visible_info{};
+        VkDescriptorBufferInfo lighting_info{};
+        VkDescriptorBufferInfo light_info{};
+        VkDescriptorBufferInfo light_grid_info{};
+        VkDescriptorBufferInfo shadow_info{};
+        VkDescriptorImageInfo image_info{};
+        VkDescriptorImageInfo shadow_map_info{};
+        array<VkWriteDescriptorSet, 10> descriptor_writes{};
+
+        buffer_info.buffer = uniform_buffers[i];
+        buffer_info.offset = 0;
+        buffer_info.range = sizeof(UniformBufferObject);
+
+        instance_info.buffer = instance_buffers[i];
+        instance_info.offset = 0;
+        instance_info.range = VK_WHOLE_SIZE;
+
+        view_info.buffer = view_buffers[i];
+        view_info.offset = 0;
+        view_info.range = sizeof(ViewBufferObject);
+
+        visible_info.buffer = visible_instance_buffers[i];
+        visible_info.offset = 0;
+        visible_info.range = VK_WHOLE_SIZE;
+
+        lighting_info.buffer = lighting_buffers[i];
+        lighting_info.offset = 0;
+        lighting_info.range = sizeof(LightingBufferObject);
+
+        light_info.buffer = light_buffers[i];
+        light_info.offset = 0;
+        light_info.range = VK_WHOLE_SIZE;
+
+        light_grid_info.buffer = light_grid_buffers[i];
+        light_grid_info.offset = 0;
+        light_grid_info.range = VK_WHOLE_SIZE;
+
+        shadow_info.buffer = shadow_buffers[i];
+        shadow_info.offset = 0;
+        shadow_info.range = sizeof(ShadowBufferObject);
+
+        image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        image_info.imageView = texture_image_view;
+        image_info.sampler = texture_sampler;
+
+        shadow_map_info.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+        shadow_map_info.imageView = shadow_atlas_view;
+        shadow_map_info.sampler = shadow_sampler;
+
+        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[0].dstSet = descriptor_sets[i];
+        descriptor_writes[0].dstBinding = 0;
+        descriptor_writes[0].dstArrayElement = 0;
+        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_writes[0].descriptorCount = 1;
+        descriptor_writes[0].pBufferInfo = &buffer_info;
+        descriptor_writes[0].pImageInfo = nullptr;
+
+        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[1].dstSet = descriptor_sets[i];
+        descriptor_writes[1].dstBinding = 1;
+        descriptor_writes[1].dstArrayElement = 0;
+        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[1].descriptorCount = 1;
+        descriptor_writes[1].pImageInfo = &image_info;
+
+        descriptor_writes[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[2].dstSet = descriptor_sets[i];
+        descriptor_writes[2].dstBinding = 2;
+        descriptor_writes[2].dstArrayElement = 0;
+        descriptor_writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptor_writes[2].descriptorCount = 1;
+        descriptor_writes[2].pBufferInfo = &instance_info;
+
+        descriptor_writes[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[3].dstSet = descriptor_sets[i];
+        descriptor_writes[3].dstBinding = 3;
+        descriptor_writes[3].dstArrayElement = 0;
+        descriptor_writes[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_writes[3].descriptorCount = 1;
+        descriptor_writes[3].pBufferInfo = &view_info;
+
+        descriptor_writes[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[4].dstSet = descriptor_sets[i];
+        descriptor_writes[4].dstBinding = 4;
+        descriptor_writes[4].dstArrayElement = 0;
+        descriptor_writes[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptor_writes[4].descriptorCount = 1;
+        descriptor_writes[4].pBufferInfo = &visible_info;
+
+        descriptor_writes[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[5].dstSet = descriptor_sets[i];
+        descriptor_writes[5].dstBinding = 5;
+        descriptor_writes[5].dstArrayElement = 0;
+        descriptor_writes[5].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_writes[5].descriptorCount = 1;
+        descriptor_writes[5].pBufferInfo = &lighting_info;
+
+        descriptor_writes[6].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[6].dstSet = descriptor_sets[i];
+        descriptor_writes[6].dstBinding = 6;
+        descriptor_writes[6].dstArrayElement = 0;
+        descriptor_writes[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptor_writes[6].descriptorCount = 1;
+        descriptor_writes[6].pBufferInfo = &light_info;
+
+        descriptor_writes[7].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[7].dstSet = descriptor_sets[i];
+        descriptor_writes[7].dstBinding = 7;
+        descriptor_writes[7].dstArrayElement = 0;
+        descriptor_writes[7].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptor_writes[7].descriptorCount = 1;
+        descriptor_writes[7].pBufferInfo = &light_grid_info;
+
+        descriptor_writes[8].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[8].dstSet = descriptor_sets[i];
+        descriptor_writes[8].dstBinding = 8;
+        descriptor_writes[8].dstArrayElement = 0;
+        descriptor_writes[8].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_writes[8].descriptorCount = 1;
+        descriptor_writes[8].pBufferInfo = &shadow_info;
+
+        descriptor_writes[9].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[9].dstSet = descriptor_sets[i];
+        descriptor_writes[9].dstBinding = 9;
+        descriptor_writes[9].dstArrayElement = 0;
+        descriptor_writes[9].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[9].descriptorCount = 1;
+        descriptor_writes[9].pImageInfo = &shadow_map_info;
+
+        vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
+            descriptor_writes.data(), 0, nullptr);
+    }
+}
+
+void VulkanManager::add_material_descriptor_sets(GpuMesh& mesh)
+{
+    uint32_t material_count = static_cast<uint32_t>(mesh.materials.size());
+    vector<VkDescriptorSetLayout> layouts(material_count, material_set_layout);
+    VkDescriptorPoolSize pool_size{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkDescriptorPool material_pool;
+
+    pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    pool_size.descriptorCount = material_count;
+
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = 1;
+    pool_create_info.pPoolSizes = &pool_size;
+    pool_create_info.maxSets = material_count;
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &material_pool) != VK_SUCCESS)
+        cout << "Creating material descriptor pool error!" << endl;
+    mesh.material_pool = resources.add_descriptor_pool(material_pool);
+
+    mesh.material_sets.resize(material_count);
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = material_pool;
+    descriptor_set_alloc_info.descriptorSetCount = material_count;
+    descriptor_set_alloc_info.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, mesh.material_sets.data()) != VK_SUCCESS)
+        cout << "Allocating material descriptor sets error!" << endl;
+
+    for (size_t material_index = 0; material_index < material_count; material_index++)
+    {
+        VkDescriptorBufferInfo buffer_info{};
+        VkWriteDescriptorSet descriptor_write{};
+
+        buffer_info.buffer = resources.buffer(mesh.material_buffer);
+        buffer_info.offset = material_index * material_stride;
+        buffer_info.range = sizeof(MaterialBufferObject);
+
+        descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_write.dstSet = mesh.material_sets[material_index];
+        descriptor_write.dstBinding = 0;
+        descriptor_write.dstArrayElement = 0;
+        descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptor_write.descriptorCount = 1;
+        descriptor_write.pBufferInfo = &buffer_info;
+
+        vkUpdateDescriptorSets(logical_device, 1, &descriptor_write, 0, nullptr);
+    }
+}
+
+void VulkanManager::add_graphics_pipeline()
+{
+    TRACE_ZONE("add_graphics_pipeline");
+    vector<VkDynamicState> dynamic_states = 
+    {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
+    };
+    VkShaderModule vert_shader_module;
+    VkShaderModule frag_shader_module;
+
+    VkPipelineDynamicStateCreateInfo dynamic_states_create_info{};
+    VkPipelineVertexInputStateCreateInfo vertex_input_create_info{};
+    VkVertexInputBindingDescription vertex_binding = Vertex::get_binding_description();
+    array<VkVertexInputAttributeDescription, 5> vertex_attributes = Vertex::get_attribute_descriptions();
+    VkPipelineInputAssemblyStateCreateInfo input_assembly_create_info{};
+    VkPipelineViewportStateCreateInfo viewport_state{};
+    VkPipelineRasterizationStateCreateInfo rasterizer_create_info{};
+    VkPipelineMultisampleStateCreateInfo multisampling_create_info{};
+    VkPipelineColorBlendAttachmentState color_blend_attachment{};
+    VkPipelineColorBlendStateCreateInfo color_blending_create_info{};
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+    VkPipelineShaderStageCreateInfo vert_shader_stage_create_info{};
+    VkPipelineShaderStageCreateInfo frag_shader_stage_create_info{};
+    VkPipelineShaderStageCreateInfo shader_stages_create_infos[2];
+    VkGraphicsPipelineCreateInfo pipeline_create_info{};
+    VkPipelineDepthStencilStateCreateInfo depth_stencil_create_info{};
+    array<VkDescriptorSetLayout, 2> set_layouts = { descriptor_set_layout, material_set_layout };
+    VkPushConstantRange view_push_constant{};
+
+    view_push_constant.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    view_push_constant.offset = 0;
+    view_push_constant.size = sizeof(uint32_t);
+
+    dynamic_states_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamic_states_create_info.dynamicStateCount = static_cast<uint32_t>(dynamic_states.size());
+    dynamic_states_create_info.pDynamicStates = dynamic_states.data();
+
+    vertex_input_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertex_input_create_info.vertexBindingDescriptionCount = 1;
+    vertex_input_create_info.pVertexBindingDescriptions = &vertex_binding;
+    vertex_input_create_info.vertexAttributeDescriptionCount = static_cast<uint32_t>(vertex_attributes.size());
+    vertex_input_create_info.pVertexAttributeDescriptions = vertex_attributes.data();
+
+    input_assembly_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    input_assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    input_assembly_create_info.primitiveRestartEnable = VK_FALSE;
+
+    viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+    viewport_state.viewportCount = 1;
+    viewport_state.scissorCount = 1;
+
+    rasterizer_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer_create_info.depthClampEnable = VK_FALSE;
+    rasterizer_create_info.rasterizerDiscardEnable = VK_FALSE;
+    rasterizer_create_info.polygonMode = VK_POLYGON_MODE_FILL;
+    rasterizer_create_info.lineWidth = 1.0;
+    rasterizer_create_info.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer_create_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+    rasterizer_create_info.depthBiasEnable = VK_FALSE;
+    rasterizer_create_info.depthBiasConstantFactor = 0.0;
+    rasterizer_create_info.depthBiasClamp = 0.0;
+    rasterizer_create_info.depthBiasSlopeFactor = 0.0;
+
+    multisampling_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling_create_info.sampleShadingEnable = VK_FALSE;
+    multisampling_create_info.rasterizationSamples = msaa_samples;
+    multisampling_create_info.minSampleShading = 1.0;
+    multisampling_create_info.pSampleMask = nullptr;
+    multisampling_create_info.alphaToCoverageEnable = VK_FALSE;
+    multisampling_create_info.alphaToOneEnable = VK_FALSE;
+
+    color_blend_attachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
+    color_blend_attachment.blendEnable = VK_FALSE;
+
+    color_blending_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    color_blending_create_info.logicOpEnable = VK_FALSE;
+    color_blending_create_info.logicOp = VK_LOGIC_OP_COPY;
+    color_blending_create_info.attachmentCount = 1;
+    color_blending_create_info.pAttachments = &color_blend_attachment;
+    color_blending_create_info.blendConstants[0] = 0.0;
+    color_blending_create_info.blendConstants[1] = 0.0;
+    color_blending_create_info.blendConstants[2] = 0.0;
+    color_blending_create_info.blendConstants[3] = 0.0;
+
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.setLayoutCount = static_cast<uint32_t>(set_layouts.size());
+    pipeline_layout_create_info.pSetLayouts = set_layouts.data();
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &view_push_constant;
+
+    vert_shader_module = get_shader_module(vert_shader_code);
+    frag_shader_module = get_shader_module(frag_shader_code);
+
+    vert_shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vert_shader_stage_create_info.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vert_shader_stage_create_info.module = vert_shader_module;
+    vert_shader_stage_create_info.pName = "main";
+
+    frag_shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    frag_shader_stage_create_info.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    frag_shader_stage_create_info.module = frag_shader_module;
+    frag_shader_stage_create_info.pName = "main";
+    
+    shader_stages_create_infos[0] = vert_shader_stage_create_info;
+    shader_stages_create_infos[1] = frag_shader_stage_create_info;
+
+    if (vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, nullptr, &pipeline_layout) != VK_SUCCESS)
+        cout << "Creating pipeline layout error!" << endl;
+
+    depth_stencil_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil_create_info.depthTestEnable = VK_TRUE;
+    depth_stencil_create_info.depthWriteEnable = VK_TRUE;
+    depth_stencil_create_info.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil_create_info.depthBoundsTestEnable = VK_FALSE;
+    depth_stencil_create_info.minDepthBounds = 0.0;
+    depth_stencil_create_info.maxDepthBounds = 1.0;
+    depth_stencil_create_info.stencilTestEnable = VK_FALSE;
+    depth_stencil_create_info.front = {};
+    depth_stencil_create_info.back = {};
+
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipeline_create_info.stageCount = 2;
+    pipeline_create_info.pStages = shader_stages_create_infos;
+    pipeline_create_info.pVertexInputState = &vertex_input_create_info;
+    pipeline_create_info.pInputAssemblyState = &input_assembly_create_info;
+    pipeline_create_info.pViewportState = &viewport_state;
+    pipeline_create_info.pRasterizationState = &rasterizer_create_info;
+    pipeline_create_info.pMultisampleState = &multisampling_create_info;
+    pipeline_create_info.pDepthStencilState = nullptr;
+    pipeline_create_info.pColorBlendState = &color_blending_create_info;
+    pipeline_create_info.pDynamicState = &dynamic_states_create_info;
+    pipeline_create_info.layout = pipeline_layout;
+    pipeline_create_info.renderPass = render_pass;
+    pipeline_create_info.subpass = 0;
+    pipeline_create_info.basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_create_info.basePipelineIndex = -1;
+    pipeline_create_info.pDepthStencilState = &depth_stencil_create_info;
+
+    if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline) != VK_SUCCESS)
+        cout << "Creating pipeline error!" << endl;
+    else
+        cout << "Creating pipeline success!" << endl;
+
+    color_blend_attachment.blendEnable = VK_TRUE;
+    color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+    color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+    color_blend_attachment.colorBlendOp = VK_BLEND_OP_ADD;
+    color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+    color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+    color_blend_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
+    depth_stencil_create_info.depthWriteEnable = VK_FALSE;
+
+    if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &transparent_pipeline) != VK_SUCCESS)
+        cout << "Creating transparent pipeline error!" << endl;
+
+    vkDestroyShaderModule(logical_device, vert_shader_module, nullptr);
+    vkDestroyShaderModule(logical_device, frag_shader_module, nullptr);
+
+    if (options.debug_bounds)
+    {
+        vert_shader_module = get_shader_module(debug_vert_shader_code);
+        frag_shader_module = get_shader_module(debug_frag_shader_code);
+        shader_stages_create_infos[0].module = vert_shader_module;
+        shader_stages_create_infos[1].module = frag_shader_module;
+        input_assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+        rasterizer_create_info.cullMode = VK_CULL_MODE_NONE;
+        color_blend_attachment.blendEnable = VK_FALSE;
+
+        if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &debug_line_pipeline) != VK_SUCCESS)
+            cout << "Creating debug line pipeline error!" << endl;
+
+        vkDestroyShaderModule(logical_device, vert_shader_module, nullptr);
+        vkDestroyShaderModule(logical_device, frag_shader_module, nullptr);
+    }
+
+    if (options.particle_count > 0)
+    {
+        // Quads come from the vertex index, so there are no vertex attributes. Additive blending needs no sorting.
+        vert_shader_module = get_shader_module(particle_vert_shader_code);
+        frag_shader_module = get_shader_module(particle_frag_shader_code);
+        shader_stages_create_infos[0].module = vert_shader_module;
+        shader_stages_create_infos[1].module = frag_shader_module;
+        vertex_input_create_info.vertexBindingDescriptionCount = 0;
+        vertex_input_create_info.vertexAttributeDescriptionCount = 0;
+        input_assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+        rasterizer_create_info.cullMode = VK_CULL_MODE_NONE;
+        color_blend_attachment.blendEnable = VK_TRUE;
+        color_blend_attachment.srcColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        color_blend_attachment.dstColorBlendFactor = VK_BLEND_FACTOR_ONE;
+        color_blend_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+        color_blend_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+        pipeline_create_info.layout = particle_pipeline_layout;
+
+        if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &particle_pipeline) != VK_SUCCESS)
+            cout << "Creating particle pipeline error!" << endl;
+
+        vkDestroyShaderModule(logical_device, vert_shader_module, nullptr);
+        vkDestroyShaderModule(logical_device, frag_shader_module, nullptr);
+    }
+
+    if (options.shadow_cascades > 0)
+    {
+        // Depth only: positions in, no fragment stage. Both faces cast, the bias keeps lit surfaces off their own shadow.
+        VkVertexInputAttributeDescription position_attribute = vertex_attributes[0];
+
+        vert_shader_module = get_shader_module(shadow_vert_shader_code);
+        shader_stages_create_infos[0].module = vert_shader_module;
+        pipeline_create_info.stageCount = 1;
+        vertex_input_create_info.vertexBindingDescriptionCount = 1;
+        vertex_input_create_info.vertexAttributeDescriptionCount = 1;
+        vertex_input_create_info.pVertexAttributeDescriptions = &position_attribute;
+        input_assembly_create_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+        rasterizer_create_info.cullMode = VK_CULL_MODE_NONE;
+        rasterizer_create_info.depthBiasEnable = VK_TRUE;
+        rasterizer_create_info.depthBiasConstantFactor = 1.25f;
+        rasterizer_create_info.depthBiasSlopeFactor = 1.75f;
+        depth_stencil_create_info.depthWriteEnable = VK_TRUE;
+        multisampling_create_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+        color_blending_create_info.attachmentCount = 0;
+        pipeline_create_info.layout = pipeline_layout;
+        pipeline_create_info.renderPass = shadow_render_pass;
+
+        if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &shadow_pipeline) != VK_SUCCESS)
+            cout << "Creating shadow pipeline error!" << endl;
+
+        vkDestroyShaderModule(logical_device, vert_shader_module, nullptr);
+    }
+}
+
+void VulkanManager::read_shaders()
+{
+    TRACE_ZONE("read_shaders");
+    vert_shader_code = get_shader_code("Shaders/vert.spv");
+    frag_shader_code = get_shader_code("Shaders/frag.spv");
+    if (streaming)
+        yuv_shader_code = get_shader_code("Shaders/yuv.spv");
+    if (options.debug_bounds)
+    {
+        debug_vert_shader_code = get_shader_code("Shaders/debug_lines_vert.spv");
+        debug_frag_shader_code = get_shader_code("Shaders/debug_lines_frag.spv");
+    }
+    if (options.particle_count > 0)
+    {
+        particle_vert_shader_code = get_shader_code("Shaders/particle_vert.spv");
+        particle_frag_shader_code = get_shader_code("Shaders/particle_frag.spv");
+    }
+    if (options.shadow_cascades > 0)
+        shadow_vert_shader_code = get_shader_code("Shaders/shadow_vert.spv");
+    if (dynamic_resolution)
+    {
+        upscale_vert_shader_code = get_shader_code("Shaders/upscale_vert.spv");
+        upscale_frag_shader_code = get_shader_code("Shaders/upscale_frag.spv");
+    }
+}
+
+vector<char> VulkanManager::get_shader_code(string filename)
+{
+    ifstream file(filename, ios::ate | ios::binary);
+
+    size_t file_size = (size_t)file.tellg();
+    vector<char> code_array(file_size);
+    file.seekg(0);
+    file.read(code_array.data(), file_size);
+
+    file.close();
+
+    return code_array;
+}
+
+VkShaderModule VulkanManager::get_shader_module(vector<char> shader_code)
+{
+    VkShaderModule shader_module;
+    VkShaderModuleCreateInfo module_create_info{};
+    module_create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    module_create_info.codeSize = shader_code.size();
+    module_create_info.pCode = reinterpret_cast<const uint32_t*>(shader_code.data());
+
+    if (vkCreateShaderModule(logical_device, &module_create_info, nullptr, &shader_module) != VK_SUCCESS)
+    {
+        cout << "Getting shader module error!" << endl;
+        return shader_module;
+    }
+
+    return shader_module;
+}
+
+void VulkanManager::add_render_pass()
+{
+    VkAttachmentDescription color_attachment{};
+    VkAttachmentReference attachment_reference{};
+    VkAttachmentDescription depth_attachment{};
+    VkAttachmentReference depth_attachment_reference{};
+    VkAttachmentDescription resolve_attachment{};
+    VkAttachmentReference resolve_attachment_reference{};
+    VkPhysicalDeviceProperties properties{};
+    VkSampleCountFlags supported_samples;
+    VkSubpassDescription subpass_description{};
+    VkRenderPassCreateInfo render_pass_create_info{};
+    VkSubpassDependency subpass_dependency{};
+    VkSubpassDependency sampled_dependency{};
+    array<VkSubpassDependency, 2> scene_dependencies{};
+    VkRenderPassMultiviewCreateInfo multiview_create_info{};
+    uint32_t view_mask = (1u << options.view_count) - 1;
+    VkImageLayout target_layout = options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+    // The largest count up to the requested one that both colour and depth framebuffers support.
+    vkGetPhysicalDeviceProperties(phys_device, &properties);
+    supported_samples = properties.limits.framebufferColorSampleCounts & properties.limits.framebufferDepthSampleCounts;
+    msaa_samples = VK_SAMPLE_COUNT_1_BIT;
+    for (uint32_t samples = 2; samples <= options.msaa_samples and samples <= VK_SAMPLE_COUNT_64_BIT; samples *= 2)
+        if (supported_samples & samples)
+            msaa_samples = static_cast<VkSampleCountFlagBits>(samples);
+    if (static_cast<uint32_t>(msaa_samples) != options.msaa_samples)
+        cout << "MSAA " << options.msaa_samples << "x is not supported, using " << msaa_samples << "x" << endl;
+
+    if (raster_upscale)
+        target_layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    else if (post_processing)
+        target_layout = VK_IMAGE_LAYOUT_GENERAL;
+
+    color_attachment.format = post_processing ? POST_HDR_FORMAT : swap_chain_image_format;
+    color_attachment.samples = msaa_samples;
+    color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    color_attachment.storeOp = msaa_samples > 1 ? VK_ATTACHMENT_STORE_OP_DONT_CARE : VK_ATTACHMENT_STORE_OP_STORE;
+    color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    color_attachment.finalLayout = msaa_samples > 1 ? VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL : target_layout;
+
+    attachment_reference.attachment = 0;
+    attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    // Only the resolved single-sample image outlives the pass.
+    resolve_attachment = color_attachment;
+    resolve_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    resolve_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    resolve_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+    resolve_attachment.finalLayout = target_layout;
+
+    resolve_attachment_reference.attachment = 2;
+    resolve_attachment_reference.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    depth_attachment.format = find_depth_format();
+    depth_attachment.samples = msaa_samples;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = options.capture_depth or options.occlusion_culling ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    depth_attachment_reference.attachment = 1;
+    depth_attachment_reference.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    vector<VkAttachmentDescription> attachments = { color_attachment, depth_attachment };
+
+    subpass_description.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+    subpass_description.colorAttachmentCount = 1;
+    subpass_description.pColorAttachments = &attachment_reference;
+    subpass_description.pDepthStencilAttachment = &depth_attachment_reference;
+    if (msaa_samples > 1)
+    {
+        attachments.push_back(resolve_attachment);
+        subpass_description.pResolveAttachments = &resolve_attachment_reference;
+    }
+
+    subpass_dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+    subpass_dependency.dstSubpass = 0;
+    subpass_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+    subpass_dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    subpass_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    subpass_dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    render_pass_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+    render_pass_create_info.attachmentCount = static_cast<uint32_t>(attachments.size());
+    render_pass_create_info.pAttachments = attachments.data();
+    render_pass_create_info.subpassCount = 1;
+    render_pass_create_info.pSubpasses = &subpass_description;
+    render_pass_create_info.dependencyCount = 1;
+    render_pass_create_info.pDependencies = &subpass_dependency;
+
+    // The scene target is read by the upscale pass or the post chain right after, including its transition to the read layout.
+    if (raster_upscale or post_processing)
+    {
+        sampled_dependency.srcSubpass = 0;
+        sampled_dependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+        sampled_dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+        sampled_dependency.dstStageMask = post_processing ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+        sampled_dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+        sampled_dependency.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        scene_dependencies = { subpass_dependency, sampled_dependency };
+        render_pass_create_info.dependencyCount = static_cast<uint32_t>(scene_dependencies.size());
+        render_pass_create_info.pDependencies = scene_dependencies.data();
+    }
+
+    if (multiview)
+    {
+        multiview_create_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_MULTIVIEW_CREATE_INFO;
+        multiview_create_info.subpassCount = 1;
+        multiview_create_info.pViewMasks = &view_mask;
+        multiview_create_info.correlationMaskCount = 1;
+        multiview_create_info.pCorrelationMasks = &view_mask;
+        render_pass_create_info.pNext = &multiview_create_info;
+    }
+
+    if (vkCreateRenderPass(logical_device, &render_pass_create_info, nullptr, &render_pass) != VK_SUCCESS)
+    {
+        cout << "Creating render pass error!" << endl;
+        return;
+    }
+    cout << "Creating render pass success!" << endl;
+
+    if (!options.occlusion_culling)
+        return;
+
+    // The late pass adds newly visible objects on top of the early pass, after the pyramid build read its depth.
+    attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    attachments[0].initialLayout = color_attachment.finalLayout;
+    attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+    attachments[1].storeOp = options.capture_depth ? VK_ATTACHMENT_STORE_OP_STORE : VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+
+    subpass_dependency.srcStageMask |= VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    subpass_dependency.dstAccessMask |= VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT;
+
+    if (vkCreateRenderPass(logical_device, &render_pass_create_info, nullptr, &late_render_pass) != VK_SUCCESS)
+        cout << "Creating late render pass error!" << endl;
+}
+
+void VulkanManager::add_framebuffers()
+{
+    swap_chain_framebuffers.resize(swap_chain_image_views.size() * view_pass_count);
+
+    // Separate view passes get one framebuffer per image layer, multiview renders all layers through one.
+    for (size_t i = 0; i < swap_chain_framebuffers.size(); i++)
+    {
+        VkFramebufferCreateInfo frame_buffer_create_info{};
+        vector<VkImageView> attachments;
+
+        if (view_pass_count > 1)
+            attachments = { layer_image_views[i], depth_layer_views[i % view_pass_count] };
+        else if (raster_upscale or post_processing)
+            attachments = { scene_color_view, depth_image_view };
+        else
+            attachments = { swap_chain_image_views[i], depth_image_view };
+        // The target moves to the resolve slot behind the multisampled colour.
+        if (msaa_samples > 1)
+            attachments = { msaa_color_view, depth_image_view, attachments[0] };
+
+        frame_buffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+        frame_buffer_create_info.renderPass = render_pass;
+        frame_buffer_create_info.attachmentCount = static_cast<uint32_t>(attachments.size());
+        frame_buffer_create_info.pAttachments = attachments.data();
+        frame_buffer_create_info.width = swap_chain_extent.width;
+        frame_buffer_create_info.height = swap_chain_extent.height;
+        frame_buffer_create_info.layers = 1;
+
+        if (vkCreateFramebuffer(logical_device, &frame_buffer_create_info, nullptr, &swap_chain_framebuffers[i]) != VK_SUCCESS)
+        {
+            cout << "Creating framebuffer error!" << endl;
+            return;
+        }
+    }
+}
+
+VkFormat VulkanManager::get_supported_format(const vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features)
+{
+    for (VkFormat format : candidates)
+    {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(phys_device, format, &properties);
+
+        if (tiling == VK_IMAGE_TILING_LINEAR && (properties.linearTilingFeatures & features) == features)
+            return format;
+        else if (tiling == VK_IMAGE_TILING_OPTIMAL && (properties.optimalTilingFeatures & features) == features)
+            return format;
+    }
+}
+
+bool VulkanManager::has_stencil_component(VkFormat format)
+{
+    return format == VK_FORMAT_D32_SFLOAT_S8_UINT or format == VK_FORMAT_D24_UNORM_S8_UINT;
+}
+
+VkFormat VulkanManager::find_depth_format()
+{
+    VkFormatFeatureFlags features = VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT;
+
+    if (options.occlusion_culling)
+        features |= VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT;
+
+    return get_supported_format({ VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
+        VK_IMAGE_TILING_OPTIMAL, features);
+}
+
+void VulkanManager::add_depth_resources()
+{
+    VkFormat depth_format = find_depth_format();
+
+    VkImageUsageFlags usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+
+    if (capture_supported and options.capture_depth)
+        usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    if (options.occlusion_culling)
+        usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+
+    add_image(swap_chain_extent.width, swap_chain_extent.height, depth_format, VK_IMAGE_TILING_OPTIMAL, usage,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image, depth_image_memory, MEMORY_ATTACHMENTS, options.view_count, 1, msaa_samples);
+    depth_image_view = add_image_view(depth_image, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, 0, options.view_count);
+
+    for (uint32_t layer = 0; view_pass_count > 1 and layer < view_pass_count; layer++)
+        depth_layer_views.push_back(add_image_view(depth_image, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT, layer));
+}
+
+void VulkanManager::add_texture_sampler()
+{
+    VkSamplerCreateInfo sampler_create_info{};
+    VkPhysicalDeviceProperties properties{};
+
+    vkGetPhysicalDeviceProperties(phys_device, &properties);
+
+    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_create_info.magFilter = VK_FILTER_LINEAR;
+    sampler_create_info.minFilter = VK_FILTER_LINEAR;
+    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_create_info.anisotropyEnable = anisotropy_supported ? VK_TRUE : VK_FALSE;
+    sampler_create_info.maxAnisotropy = anisotropy_supported ? properties.limits.maxSamplerAnisotropy : 1.0f;
+    sampler_create_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+    sampler_create_info.unnormalizedCoordinates = VK_FALSE;
+    sampler_create_info.compareEnable = VK_FALSE;
+    sampler_create_info.compareOp = VK_COMPARE_OP_ALWAYS;
+    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    sampler_create_info.mipLodBias = 0.0;
+    sampler_create_info.minLod = 0.0;
+    sampler_create_info.maxLod = 0.0;
+
+    if (vkCreateSampler(logical_device, &sampler_create_info, nullptr, &texture_sampler) != VK_SUCCESS)
+    {
+        cout << "Adding texture sampler error!" << endl;
+        return;
+    }
+
+    cout << "Adding texture sampler success!" << endl;
+}
+
+void VulkanManager::add_image(uint32_t texture_width, uint32_t texture_height, VkFormat format, VkImageTiling tiling,
+    VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& image_memory,
+    MemoryCategory category, uint32_t layers, uint32_t mip_levels, VkSampleCountFlagBits samples)
+{
+    VkImageCreateInfo image_create_info{};
+    VkMemoryRequirements memory_requirements{};
+    VkMemoryAllocateInfo texture_image_memory_alloc_info{};
+
+    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_create_info.imageType = VK_IMAGE_TYPE_2D;
+    image_create_info.extent.width = texture_width;
+    image_create_info.extent.height = texture_height;
+    image_create_info.extent.depth = 1;
+    image_create_info.mipLevels = mip_levels;
+    image_create_info.arrayLayers = layers;
+    image_create_info.format = format;
+    image_create_info.tiling = tiling;
+    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    image_create_info.usage = usage;
+    image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_create_info.samples = samples;
+
+    if (vkCreateImage(logical_device, &image_create_info, nullptr, &image) != VK_SUCCESS)
+        cout << "Adding image error!" << endl;
+
+    vkGetImageMemoryRequirements(logical_device, image, &memory_requirements);
+    texture_image_memory_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    texture_image_memory_alloc_info.allocationSize = memory_requirements.size;
+    texture_image_memory_alloc_info.memoryTypeIndex = get_memory_type(memory_requirements.memoryTypeBits, properties);
+
+    if (vkAllocateMemory(logical_device, &texture_image_memory_alloc_info, nullptr, &image_memory) != VK_SUCCESS)
+        cout << "Allocating image memory error!" << endl;
+    else
+        memory_tracker.on_allocate(image_memory, texture_image_memory_alloc_info.allocationSize,
+            get_memory_heap(texture_image_memory_alloc_info.memoryTypeIndex), category);
+
+    vkBindImageMemory(logical_device, image, image_memory, 0);
+}
+
+shared_ptr<TextureData> VulkanManager::decode_texture(const string& path, const vector<uint8_t>& bytes)
+{
+    TRACE_ZONE("decode_texture");
+    int image_channels;
+    shared_ptr<TextureData> texture = make_shared<TextureData>();
+
+    texture->pixels.reset(stbi_load_from_memory(bytes.data(), static_cast<int>(bytes.size()),
+        &texture->width, &texture->height, &image_channels, STBI_rgb_alpha));
+    if (!texture->pixels)
+    {
+        cout << "Loading texture " << path << " error!" << endl;
+        return nullptr;
+    }
+
+    return texture;
+}
+
+uint64_t VulkanManager::create_texture(AssetId asset, const TextureData& texture_data)
+{
+    TRACE_ZONE("create_texture");
+    GpuTexture& texture = gpu_textures[asset];
+    VkDeviceSize image_size = static_cast<VkDeviceSize>(texture_data.width) * texture_data.height * 4;
+    VkBuffer staging_buffer;
+    VkDeviceMemory staging_buffer_memory;
+    VkImage image;
+    VkDeviceMemory image_memory;
+    void* data;
+
+    add_buffer(staging_buffer, staging_buffer_memory, image_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_STAGING);
+
+    vkMapMemory(logical_device, staging_buffer_memory, 0, image_size, 0, &data);
+    memcpy(data, texture_data.pixels.get(), static_cast<size_t>(image_size));
+    vkUnmapMemory(logical_device, staging_buffer_memory);
+
+    add_image(texture_data.width, texture_data.height, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        image, image_memory, MEMORY_TEXTURES);
+    change_image_layout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    copy_buffer_to_image(staging_buffer, image, static_cast<uint32_t>(texture_data.width), static_cast<uint32_t>(texture_data.height));
+    change_image_layout(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    release_staging_buffer(staging_buffer, staging_buffer_memory);
+
+    texture.image = resources.add_image(image, image_memory);
+    texture.view = resources.add_image_view(add_image_view(image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT));
+
+    return image_size;
+}
+
+void VulkanManager::destroy_texture(AssetId asset)
+{
+    GpuTexture& texture = gpu_textures[asset];
+
+    retire_resource(texture.view);
+    retire_resource(texture.image);
+
+    gpu_textures.erase(asset);
+}
+
+void VulkanManager::add_asset_loaders()
+{
+    AssetLoader mesh_loader;
+    AssetLoader texture_loader;
+
+    mesh_loader.decode = [this](const string& path, const vector<uint8_t>& bytes)
+        {
+            return static_pointer_cast<void>(decode_model(path, bytes));
+        };
+    mesh_loader.create = [this](AssetId asset, const shared_ptr<void>& data)
+        {
+            return create_mesh(asset, *static_pointer_cast<MeshData>(data));
+        };
+    mesh_loader.destroy = [this](AssetId asset) { destroy_mesh(asset); };
+
+    texture_loader.decode = [this](const string& path, const vector<uint8_t>& bytes)
+        {
+            return static_pointer_cast<void>(decode_texture(path, bytes));
+        };
+    texture_loader.create = [this](AssetId asset, const shared_ptr<void>& data)
+        {
+            return create_texture(asset, *static_pointer_cast<TextureData>(data));
+        };
+    texture_loader.destroy = [this](AssetId asset) { destroy_texture(asset); };
+
+    mesh_asset_type = assets.register_loader(mesh_loader);
+    texture_asset_type = assets.register_loader(texture_loader);
+}
+
+void VulkanManager::bind_scene_assets()
+{
+    if (!assets.is_ready(model_asset) or !assets.is_ready(texture_asset))
+    {
+        cout << "Loading scene assets error!" << endl;
+        return;
+    }
+
+    const GpuMesh& mesh = gpu_meshes[assets.resolve(model_asset)];
+
+    vertex_buffer = resources.buffer(mesh.vertex_buffer);
+    index_buffer = resources.buffer(mesh.index_buffer);
+    materials = mesh.materials;
+    submeshes = mesh.submeshes;
+    material_descriptor_sets = mesh.material_sets;
+    mesh_center = mesh.center;
+    mesh_radius = mesh.radius;
+    scene_mesh_bvh = mesh.bvh;
+    scene_bvh_stale = true;
+    shadow_cascades.invalidate();
+    texture_image_view = resources.image_view(gpu_textures[assets.resolve(texture_asset)].view);
+    scene_skin = mesh.skin;
+    skin_weight_buffer = resources.buffer(mesh.skin_buffer);
+    morph_target_buffer = resources.buffer(mesh.morph_buffer);
+    skinned_vertex_count = mesh.vertex_count;
+}
+
+void VulkanManager::change_image_layout(VkImage image, VkFormat format, VkImageLayout layout, VkImageLayout new_layout)
+{
+    VkCommandBuffer command_buff = begin_single_time_commands();
+    VkImageMemoryBarrier barrier{};
+    VkPipelineStageFlags source_stage;
+    VkPipelineStageFlags destination_stage;
+
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = 0;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+
+    if (new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    {
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        if (has_stencil_component(format))
+            barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+    }
+    else
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+
+    if (layout == VK_IMAGE_LAYOUT_UNDEFINED and new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        destination_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    }
+
+    else if(layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL and new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+    {
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        source_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        destination_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+    }
+    else if (layout == VK_IMAGE_LAYOUT_UNDEFINED and new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    {
+        barrier.srcAccessMask = 0;
+        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+        destination_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+    }
+
+    vkCmdPipelineBarrier(command_buff, source_stage, destination_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    end_single_time_commands(command_buff);
+}
+
+void VulkanManager::copy_buffer_to_image(VkBuffer buff, VkImage image, uint32_t width, uint32_t height)
+{
+    VkBufferImageCopy region{};
+    VkCommandBuffer command_buff = begin_single_time_commands();
+
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+
+    region.imageOffset = { 0, 0, 0 };
+    region.imageExtent = { width, height, 1 };
+
+    vkCmdCopyBufferToImage(command_buff, buff, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    end_single_time_commands(command_buff);
+}
+
+void VulkanManager::add_command_pool()
+{
+    VkCommandPoolCreateInfo command_pool_create_info{};
+    uint32_t graphics_family_index = get_graphics_family_index();
+
+    command_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    command_pool_create_info.queueFamilyIndex = graphics_family_index;
+
+    if (vkCreateCommandPool(logical_device, &command_pool_create_info, nullptr, &command_pool) != VK_SUCCESS)
+    {
+        cout << "Creating command pool error!" << endl;
+        return;
+    }
+    cout << "Creating command pool success!" << endl;
+
+    if (!async_compute)
+        return;
+
+    command_pool_create_info.queueFamilyIndex = compute_family_index;
+    if (vkCreateCommandPool(logical_device, &command_pool_create_info, nullptr, &compute_command_pool) != VK_SUCCESS)
+        cout << "Creating compute command pool error!" << endl;
+}
+
+VkCommandBuffer VulkanManager::begin_single_time_commands()
+{
+    VkCommandBufferAllocateInfo command_buffer_allocate_info{};
+    VkCommandBufferBeginInfo begin_info{};
+    VkCommandBuffer command_buff;
+
+    if (upload_command_buffer != VK_NULL_HANDLE)
+        return upload_command_buffer;
+
+    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_allocate_info.commandPool = command_pool;
+    command_buffer_allocate_info.commandBufferCount = 1;
+
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    vkAllocateCommandBuffers(logical_device, &command_buffer_allocate_info, &command_buff);
+    vkBeginCommandBuffer(command_buff, &begin_info);
+
+    return command_buff;
+}
+
+void VulkanManager::end_single_time_commands(VkCommandBuffer command_buff)
+{
+    if (command_buff == upload_command_buffer)
+        return;
+
+    vkEndCommandBuffer(command_buff);
+    wait_gpu_work(submit_to_timeline(graphics_timeline, command_buff, {}));
+
+    vkFreeCommandBuffers(logical_device, command_pool, 1, &command_buff);
+}
+
+void VulkanManager::begin_upload_batch()
+{
+    upload_command_buffer = begin_single_time_commands();
+}
+
+void VulkanManager::flush_upload_batch()
+{
+    TRACE_ZONE("flush_upload_batch");
+    VkCommandBuffer command_buff = upload_command_buffer;
+
+    upload_command_buffer = VK_NULL_HANDLE;
+    end_single_time_commands(command_buff);
+
+    for (const StagingBuffer& staging : pending_staging_buffers)
+    {
+        vkDestroyBuffer(logical_device, staging.buffer, nullptr);
+        free_memory(staging.memory);
+    }
+    pending_staging_buffers.clear();
+}
+
+void VulkanManager::release_staging_buffer(VkBuffer buff, VkDeviceMemory buff_memory)
+{
+    if (upload_command_buffer != VK_NULL_HANDLE)
+    {
+        pending_staging_buffers.push_back({ buff, buff_memory });
+        return;
+    }
+
+    vkDestroyBuffer(logical_device, buff, nullptr);
+    free_memory(buff_memory);
+}
+
+void VulkanManager::add_command_buffers()
+{
+    VkCommandBufferAllocateInfo command_buffer_allocate_info{};
+
+    command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    command_buffer_allocate_info.commandPool = command_pool;
+    command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    command_buffer_allocate_info.commandBufferCount = (uint32_t)command_buffers.size();
+
+    if (vkAllocateCommandBuffers(logical_device, &command_buffer_allocate_info, command_buffers.data()) != VK_SUCCESS)
+    {
+        cout << "Creating comand buffer error!" << endl;
+        return;
+    }
+    cout << "Creating comand buffer success!" << endl;
+}
+
+void VulkanManager::record_command_buffer(VkCommandBuffer buff, uint32_t image_index)
+{
+    TRACE_ZONE("record_command_buffer");
+    VkCommandBufferBeginInfo begin_info{};
+
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = 0;
+    begin_info.pInheritanceInfo = nullptr;
+
+    if (vkBeginCommandBuffer(buff, &begin_info) != VK_SUCCESS)
+        cout << "Begin recording error!" << endl;
+
+    if (timestamps_supported)
+    {
+        vkCmdResetQueryPool(buff, timestamp_pool, 2 * current_frame, 2);
+        vkCmdWriteTimestamp(buff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestamp_pool, 2 * current_frame);
+    }
+    record_skinning(buff);
+    if (options.particle_count > 0 and !async_compute)
+        record_particle_simulation(buff);
+    record_light_culling(buff);
+    record_shadow_passes(buff);
+
+    if (options.occlusion_culling)
+    {
+        // Early pass: what was visible last frame. Late pass: what the early pass' depth does not hide.
+        write_indirect_commands(current_frame);
+        record_cull_pass(buff, 0);
+        record_scene_pass(buff, render_pass, swap_chain_framebuffers[image_index], 0, DRAW_EARLY_LIST, DRAW_NOTHING);
+        record_depth_pyramid(buff);
+        record_cull_pass(buff, 1);
+        record_scene_pass(buff, late_render_pass, swap_chain_framebuffers[image_index], 0, DRAW_LATE_LIST, DRAW_VISIBLE_LIST);
+        frame_cull_numbers[current_frame] = frames_drawn + 1;
+    }
+    else
+    {
+        // With multiview one pass feeds every view; otherwise each view is its own pass over the whole scene.
+        for (uint32_t view_pass = 0; view_pass < view_pass_count; view_pass++)
+            record_scene_pass(buff, render_pass, swap_chain_framebuffers[image_index * view_pass_count + view_pass], view_pass,
+                DRAW_ALL_INSTANCES, DRAW_ALL_INSTANCES);
+    }
+    if (raster_upscale)
+        record_upscale_pass(buff, image_index);
+    else if (post_processing)
+        record_post_chain(buff, image_index);
+    record_readback(buff, image_index);
+
+    if (timestamps_supported)
+    {
+        vkCmdWriteTimestamp(buff, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_pool, 2 * current_frame + 1);
+        frame_timestamps_written[current_frame] = true;
+    }
+
+    if (vkEndCommandBuffer(buff) != VK_SUCCESS)
+        cout << "Recording command buffer error!" << endl;
+}
+
+void VulkanManager::record_scene_pass(VkCommandBuffer buff, VkRenderPass pass, VkFramebuffer framebuffer, uint32_t view_pass,
+    DrawSource opaque_source, DrawSource transparent_source)
+{
+    VkViewport viewport{};
+    VkRect2D scissors{};
+    VkRenderPassBeginInfo render_pass_info{};
+    VkBuffer vertex_buffers[] = { options.skinning ? skinned_vertex_buffers[current_frame] : vertex_buffer };
+    VkDeviceSize offsets[] = { 0 };
+    array<VkClearValue, 2> clear_values{};
+    uint32_t bound_pipeline = UINT32_MAX;
+    uint32_t bound_material = UINT32_MAX;
+
+    clear_values[0].color = { {0.0f, 0.0f, 0.0f, 1.0f} };
+    clear_values[1].depthStencil = { 1.0f, 0 };
+
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = pass;
+    render_pass_info.framebuffer = framebuffer;
+    render_pass_info.renderArea.offset = { 0, 0 };
+    render_pass_info.renderArea.extent = render_extent;
+    render_pass_info.clearValueCount = static_cast<uint32_t>(clear_values.size());
+    render_pass_info.pClearValues = clear_values.data();
+
+    viewport.x = 0.0;
+    viewport.y = 0.0;
+    viewport.width = static_cast<float>(render_extent.width);
+    viewport.height = static_cast<float>(render_extent.height);
+    viewport.minDepth = 0.0;
+    viewport.maxDepth = 1.0;
+
+    scissors.offset = { 0, 0 };
+    scissors.extent = render_extent;
+
+    vkCmdBeginRenderPass(buff, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    vkCmdSetViewport(buff, 0, 1, &viewport);
+    vkCmdSetScissor(buff, 0, 1, &scissors);
+    vkCmdBindVertexBuffers(buff, 0, 1, vertex_buffers, offsets);
+    vkCmdBindIndexBuffer(buff, index_buffer, 0, VK_INDEX_TYPE_UINT32);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout,
+        0, 1, &descriptor_sets[current_frame], 0, nullptr);
+    vkCmdPushConstants(buff, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(view_pass), &view_pass);
+
+    for (const vector<DrawItem>* bucket : { &draw_list.opaque, &draw_list.transparent })
+    {
+        DrawSource source = bucket == &draw_list.opaque ? opaque_source : transparent_source;
+
+        if (source == DRAW_NOTHING)
+            continue;
+
+        for (const DrawItem& item : *bucket)
+        {
+            const Submesh& submesh = submeshes[item.submesh];
+            uint32_t pipeline_id = key_pipeline(item.key);
+
+            if (pipeline_id != bound_pipeline)
+            {
+                vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_id == PIPELINE_OPAQUE ? pipeline : transparent_pipeline);
+                bound_pipeline = pipeline_id;
+                draw_stats.pipeline_binds++;
+            }
+            if (submesh.material != bound_material)
+            {
+                vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout,
+                    1, 1, &material_descriptor_sets[submesh.material], 0, nullptr);
+                bound_material = submesh.material;
+                draw_stats.material_binds++;
+            }
+
+            if (source == DRAW_ALL_INSTANCES and options.skinning)
+            {
+                record_skinned_draws(buff, submesh);
+                continue;
+            }
+
+            if (source == DRAW_ALL_INSTANCES)
+                vkCmdDrawIndexed(buff, submesh.index_count, drawn_instance_counts[current_frame], submesh.first_index, 0, 0);
+            else
+                vkCmdDrawIndexedIndirect(buff, indirect_buffers[current_frame],
+                    ((source - DRAW_EARLY_LIST) * submeshes.size() + item.submesh) * sizeof(VkDrawIndexedIndirectCommand),
+                    1, sizeof(VkDrawIndexedIndirectCommand));
+            draw_stats.draws++;
+        }
+    }
+    if (transparent_source != DRAW_NOTHING)
+    {
+        record_debug_bounds(buff);
+        record_particles(buff, view_pass);
+    }
+    vkCmdEndRenderPass(buff);
+}
+
+void VulkanManager::record_readback(VkCommandBuffer buff, uint32_t image_index)
+{
+    VkDeviceSize pixel_count = static_cast<VkDeviceSize>(swap_chain_extent.width) * swap_chain_extent.height * options.view_count;
+    VkDeviceSize size = streaming ? pixel_count * 3 / 2 : pixel_count * (options.capture_depth ? 8 : 4);
+    int32_t slot_index;
+    ReadbackSlot* slot;
+
+    if (!should_capture_frame())
+        return;
+
+    slot_index = acquire_readback_slot(size);
+    if (slot_index < 0)
+    {
+        captures_dropped++;
+        return;
+    }
+    slot = readback_slots[slot_index].get();
+
+    slot->depth_offset = pixel_count * 4;
+    slot->extent = swap_chain_extent;
+    slot->frame = frames_drawn;
+    slot->name = capture_name;
+
+    if (streaming)
+        record_yuv_readback(buff, image_index, *slot);
+    else
+        record_image_readback(buff, image_index, *slot);
+
+    frame_readback_slots[current_frame] = slot_index;
+}
+
+void VulkanManager::record_image_readback(VkCommandBuffer buff, uint32_t image_index, ReadbackSlot& slot)
+{
+    VkImageLayout color_layout = options.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    VkFormat depth_format = find_depth_format();
+    array<VkImageMemoryBarrier, 2> to_transfer{};
+    array<VkImageMemoryBarrier, 2> from_transfer{};
+    VkBufferMemoryBarrier host_barrier{};
+    VkBufferImageCopy region{};
+    uint32_t barrier_count = options.capture_depth ? 2 : 1;
+
+    to_transfer[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    to_transfer[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    to_transfer[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    to_transfer[0].oldLayout = color_layout;
+    to_transfer[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    to_transfer[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    to_transfer[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    to_transfer[0].image = swap_chain_images[image_index];
+    to_transfer[0].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, options.view_count };
+
+    to_transfer[1] = to_transfer[0];
+    to_transfer[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    to_transfer[1].oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    to_transfer[1].image = depth_image;
+    to_transfer[1].subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (has_stencil_component(depth_format))
+        to_transfer[1].subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, barrier_count, to_transfer.data());
+
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, options.view_count };
+    region.imageOffset = { 0, 0, 0 };
+    region.imageExtent = { swap_chain_extent.width, swap_chain_extent.height, 1 };
+    vkCmdCopyImageToBuffer(buff, swap_chain_images[image_index], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer, 1, &region);
+
+    if (options.capture_depth)
+    {
+        region.bufferOffset = slot.depth_offset;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+        vkCmdCopyImageToBuffer(buff, depth_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot.buffer, 1, &region);
+    }
+
+    for (uint32_t barrier = 0; barrier < barrier_count; barrier++)
+    {
+        from_transfer[barrier] = to_transfer[barrier];
+        from_transfer[barrier].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        from_transfer[barrier].dstAccessMask = 0;
+        from_transfer[barrier].oldLayout = to_transfer[barrier].newLayout;
+        from_transfer[barrier].newLayout = to_transfer[barrier].oldLayout;
+    }
+    from_transfer[1].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+
+    host_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    host_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    host_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    host_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    host_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    host_barrier.buffer = slot.buffer;
+    host_barrier.offset = 0;
+    host_barrier.size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+        0, 0, nullptr, 1, &host_barrier, barrier_count, from_transfer.data());
+}
+
+void VulkanManager::record_yuv_readback(VkCommandBuffer buff, uint32_t image_index, ReadbackSlot& slot)
+{
+    VkImageMemoryBarrier image_barrier{};
+    array<VkBufferMemoryBarrier, 2> buffer_barriers{};
+    VkBufferCopy region{};
+    uint32_t frame_size[2] = { swap_chain_extent.width, swap_chain_extent.height };
+
+    image_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    image_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    image_barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    image_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.image = swap_chain_images[image_index];
+    image_barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &image_barrier);
+
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, yuv_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, yuv_pipeline_layout,
+        0, 1, &yuv_descriptor_sets[image_index], 0, nullptr);
+    vkCmdPushConstants(buff, yuv_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(frame_size), frame_size);
+    vkCmdDispatch(buff, (frame_size[0] / 8 + 7) / 8, (frame_size[1] / 2 + 7) / 8, 1);
+
+    buffer_barriers[0].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    buffer_barriers[0].srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    buffer_barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    buffer_barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barriers[0].buffer = yuv_buffers[image_index];
+    buffer_barriers[0].offset = 0;
+    buffer_barriers[0].size = VK_WHOLE_SIZE;
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 0, nullptr, 1, &buffer_barriers[0], 0, nullptr);
+
+    region.srcOffset = 0;
+    region.dstOffset = 0;
+    region.size = static_cast<VkDeviceSize>(frame_size[0]) * frame_size[1] * 3 / 2;
+    vkCmdCopyBuffer(buff, yuv_buffers[image_index], slot.buffer, 1, &region);
+
+    buffer_barriers[1] = buffer_barriers[0];
+    buffer_barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    buffer_barriers[1].dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    buffer_barriers[1].buffer = slot.buffer;
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+        0, 0, nullptr, 1, &buffer_barriers[1], 0, nullptr);
+}
+
+void VulkanManager::add_sync_objects()
+{
+    VkSemaphoreCreateInfo semaphore_create_info{};
+
+    image_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    render_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
+    frame_timeline_points.resize(MAX_FRAMES_IN_FLIGHT);
+
+    semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+    for (size_t sync_obj_index = 0; sync_obj_index < MAX_FRAMES_IN_FLIGHT; sync_obj_index++)
+    {
+        if (vkCreateSemaphore(logical_device, &semaphore_create_info, nullptr, &image_semaphores[sync_obj_index]) != VK_SUCCESS or
+            vkCreateSemaphore(logical_device, &semaphore_create_info, nullptr, &render_semaphores[sync_obj_index]) != VK_SUCCESS)
+            cout << "Creating sync objects error!" << endl;
+    }
+
+    if (!swapchain_maintenance_supported)
+        return;
+    present_fences.resize(MAX_FRAMES_IN_FLIGHT);
+    present_fences_pending.resize(MAX_FRAMES_IN_FLIGHT, false);
+    for (VkFence& fence : present_fences)
+        fence = add_fence();
+}
+
+VkFence VulkanManager::add_fence()
+{
+    VkFenceCreateInfo fence_create_info{};
+    VkFence fence = VK_NULL_HANDLE;
+
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    if (vkCreateFence(logical_device, &fence_create_info, nullptr, &fence) != VK_SUCCESS)
+        cout << "Creating fence error!" << endl;
+    return fence;
+}
+
+void VulkanManager::add_queue_timelines()
+{
+    add_timeline(graphics_timeline, get_graphics_family_index());
+    if (async_compute)
+        add_timeline(compute_timeline, compute_family_index);
+}
+
+void VulkanManager::add_timeline(QueueTimeline& timeline, uint32_t family_index)
+{
+    VkSemaphoreTypeCreateInfo type_create_info{};
+    VkSemaphoreCreateInfo semaphore_create_info{};
+
+    type_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_create_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_create_info.initialValue = 0;
+
+    semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_create_info.pNext = &type_create_info;
+
+    vkGetDeviceQueue(logical_device, family_index, 0, &timeline.queue);
+
+    if (vkCreateSemaphore(logical_device, &semaphore_create_info, nullptr, &timeline.semaphore) != VK_SUCCESS)
+        cout << "Creating timeline semaphore error!" << endl;
+    timeline.next_value = 1;
+}
+
+GpuTimelinePoint VulkanManager::submit_to_timeline(QueueTimeline& timeline, VkCommandBuffer buff,
+    const vector<SubmitWait>& waits, VkSemaphore binary_signal)
+{
+    TRACE_ZONE("submit_to_timeline");
+    VkSubmitInfo submit_info{};
+    VkTimelineSemaphoreSubmitInfo timeline_submit_info{};
+    vector<VkSemaphore> wait_semaphores;
+    vector<uint64_t> wait_values;
+    vector<VkPipelineStageFlags> wait_stages;
+    array<VkSemaphore, 2> signal_semaphores = { timeline.semaphore, binary_signal };
+    array<uint64_t, 2> signal_values = { timeline.next_value, 0 };
+    uint32_t signal_count = binary_signal != VK_NULL_HANDLE ? 2 : 1;
+    GpuTimelinePoint point = { timeline.semaphore, timeline.next_value };
+
+    for (const SubmitWait& wait : waits)
+    {
+        wait_semaphores.push_back(wait.semaphore);
+        wait_values.push_back(wait.value);
+        wait_stages.push_back(wait.stage);
+    }
+
+    timeline_submit_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_submit_info.waitSemaphoreValueCount = static_cast<uint32_t>(wait_values.size());
+    timeline_submit_info.pWaitSemaphoreValues = wait_values.data();
+    timeline_submit_info.signalSemaphoreValueCount = signal_count;
+    timeline_submit_info.pSignalSemaphoreValues = signal_values.data();
+
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_submit_info;
+    submit_info.waitSemaphoreCount = static_cast<uint32_t>(wait_semaphores.size());
+    submit_info.pWaitSemaphores = wait_semaphores.data();
+    submit_info.pWaitDstStageMask = wait_stages.data();
+    submit_info.commandBufferCount = buff != VK_NULL_HANDLE ? 1 : 0;
+    submit_info.pCommandBuffers = &buff;
+    submit_info.signalSemaphoreCount = signal_count;
+    submit_info.pSignalSemaphores = signal_semaphores.data();
+
+    if (vkQueueSubmit(timeline.queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS)
+        cout << "Submitting to timeline error!" << endl;
+
+    timeline.next_value++;
+    return point;
+}
+
+GpuTimelinePoint VulkanManager::last_submitted(const QueueTimeline& timeline)
+{
+    return { timeline.semaphore, timeline.next_value - 1 };
+}
+
+bool VulkanManager::is_gpu_work_done(GpuTimelinePoint point)
+{
+    uint64_t value = 0;
+
+    if (point.semaphore == VK_NULL_HANDLE or point.value == 0)
+        return true;
+
+    vkGetSemaphoreCounterValue(logical_device, point.semaphore, &value);
+    return value >= point.value;
+}
+
+void VulkanManager::wait_gpu_work(GpuTimelinePoint point)
+{
+    TRACE_ZONE("wait_gpu_work");
+    VkSemaphoreWaitInfo wait_info{};
+
+    if (point.semaphore == VK_NULL_HANDLE or point.value == 0)
+        return;
+
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &point.semaphore;
+    wait_info.pValues = &point.value;
+
+    vkWaitSemaphores(logical_device, &wait_info, UINT64_MAX);
+}
+
+void VulkanManager::retire_resource(ResourceHandle handle)
+{
+    resources.release(handle, last_submitted(graphics_timeline).value);
+}
+
+void VulkanManager::collect_retired_resources()
+{
+    uint64_t completed_value = 0;
+
+    vkGetSemaphoreCounterValue(logical_device, graphics_timeline.semaphore, &completed_value);
+    resources.collect(completed_value);
+}
+
+void VulkanManager::add_surface()
+{
+    if (options.headless)
+        return;
+
+    if (glfwCreateWindowSurface(vulkan_instance, window, nullptr, &surface) != VK_SUCCESS)
+        cout << "Making Window surface error!";
+    cout << "Making surface success!" << endl;
+}
+
+void VulkanManager::draw_frame()
+{
+    TRACE_ZONE("draw_frame");
+    uint32_t image_index = current_frame;
+    VkResult acquire_next_image_result;
+    vector<SubmitWait> waits;
+    chrono::steady_clock::time_point cpu_start;
+    double cpu_ms;
+
+    frame_pacer.throttle();
+
+    wait_gpu_work(frame_timeline_points[current_frame]);
+    last_gpu_frame_ms = read_gpu_frame_time(current_frame);
+    if (gpu_trace_supported and last_gpu_frame_ms >= 0.0)
+        trace_gpu_frame(current_frame);
+    if (post_processing and last_gpu_frame_ms >= 0.0)
+    {
+        double post_ms = read_gpu_interval(2 * (MAX_FRAMES_IN_FLIGHT + current_frame), timestamp_valid_bits);
+
+        if (post_ms >= 0.0)
+        {
+            post_gpu_ms += post_ms;
+            post_frames_timed++;
+        }
+    }
+    // An async simulation finished before the frame that waited on it.
+    if (particle_timestamps and last_gpu_frame_ms >= 0.0)
+    {
+        double particle_ms = read_gpu_interval(2 * (2 * MAX_FRAMES_IN_FLIGHT + current_frame), particle_timestamp_valid_bits);
+
+        if (particle_ms >= 0.0)
+        {
+            particle_gpu_ms += particle_ms;
+            particle_frames_timed++;
+        }
+    }
+    update_render_scale();
+    collect_occlusion_stats(current_frame);
+    collect_readback(current_frame);
+    cpu_start = chrono::steady_clock::now();
+    destroy_retired_swap_chains();
+    collect_retired_resources();
+    assets.update();
+
+    if (frames_drawn % 30 == 0)
+        update_memory_budget();
+    if (options.memory_report_interval > 0 and frames_drawn % options.memory_report_interval == 0)
+        memory_tracker.print_report();
+
+    if (!options.headless)
+    {
+        TRACE_ZONE("acquire_image");
+
+        wait_for_presents(100000000);
+        acquire_next_image_result = vkAcquireNextImageKHR(logical_device, swap_chain, UINT64_MAX, image_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
+
+        if (acquire_next_image_result == VK_ERROR_OUT_OF_DATE_KHR)
+        {
+            glfwPollEvents();
+            recreate_swap_chain();
+            return;
+        }
+        if (!swapchain_maintenance_supported)
+            mark_image_acquired(image_index);
+    }
+
+    // Input is sampled only once the frame slot, the previous present and the image are available,
+    // so nothing blocks between reading it and recording the frame.
+    if (!options.headless)
+        glfwPollEvents();
+    frame_pacer.mark_input(next_present_id);
+    update_uniform_buffer(current_frame);
+
+    build_draw_list();
+    transient_geometry.begin_frame(current_frame);
+    write_debug_bounds();
+
+    // Submitted first so the simulation can overlap whatever the graphics queue is still finishing.
+    if (async_compute)
+    {
+        GpuTimelinePoint simulated = submit_particle_simulation();
+
+        waits.push_back({ simulated.semaphore, simulated.value, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT });
+    }
+    vkResetCommandBuffer(command_buffers[current_frame], 0);
+    record_command_buffer(command_buffers[current_frame], image_index);
+
+    if (!options.headless)
+        waits.push_back({ image_semaphores[current_frame], 0, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT });
+    frame_timeline_points[current_frame] = submit_to_timeline(graphics_timeline, command_buffers[current_frame], waits,
+        options.headless ? VK_NULL_HANDLE : render_semaphores[current_frame]);
+    frame_pacer.mark_submit();
+    cpu_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - cpu_start).count();
+
+    if (!options.headless)
+        present_frame(image_index);
+
+    if (benchmark)
+        benchmark->record_frame(cpu_ms, last_gpu_frame_ms);
+
+    frames_drawn++;
+    current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+}
+
+void VulkanManager::present_frame(uint32_t image_index)
+{
+    TRACE_ZONE("present_frame");
+    uint32_t present_family_index = get_present_family_index();
+    VkQueue present_queue;
+    VkPresentInfoKHR present_info{};
+    VkPresentIdKHR present_id_info{};
+    VkSwapchainPresentFenceInfoEXT present_fence_info{};
+    uint64_t present_id = next_present_id;
+    VkResult present_result;
+
+    vkGetDeviceQueue(logical_device, present_family_index, 0, &present_queue);
+
+    present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+    present_info.waitSemaphoreCount = 1;
+    present_info.pWaitSemaphores = &render_semaphores[current_frame];
+    present_info.swapchainCount = 1;
+    present_info.pSwapchains = &swap_chain;
+    present_info.pImageIndices = &image_index;
+    present_info.pResults = nullptr;
+
+    if (present_wait_supported)
+    {
+        present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+        present_id_info.swapchainCount = 1;
+        present_id_info.pPresentIds = &present_id;
+        present_info.pNext = &present_id_info;
+        next_present_id++;
+        last_present_id = present_id;
+    }
+
+    // Signalled once the presentation engine is done with this present, which is when a retired swap chain may go.
+    if (swapchain_maintenance_supported)
+    {
+        if (present_fences_pending[current_frame])
+        {
+            vkWaitForFences(logical_device, 1, &present_fences[current_frame], VK_TRUE, UINT64_MAX);
+            vkResetFences(logical_device, 1, &present_fences[current_frame]);
+        }
+        present_fence_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_PRESENT_FENCE_INFO_EXT;
+        present_fence_info.pNext = present_info.pNext;
+        present_fence_info.swapchainCount = 1;
+        present_fence_info.pFences = &present_fences[current_frame];
+        present_info.pNext = &present_fence_info;
+    }
+
+    present_result = vkQueuePresentKHR(present_queue, &present_info);
+    presents_queued++;
+    // An out-of-date present still counts as enqueued, so its fence signals and goes with the retired chain.
+    if (swapchain_maintenance_supported)
+        present_fences_pending[current_frame] = present_result == VK_SUCCESS or present_result == VK_SUBOPTIMAL_KHR or
+            present_result == VK_ERROR_OUT_OF_DATE_KHR;
+    // A lost surface or device may or may not have queued the fence signal; drain the queue so it can be reset.
+    if (swapchain_maintenance_supported and !present_fences_pending[current_frame])
+    {
+        vkQueueWaitIdle(present_queue);
+        vkResetFences(logical_device, 1, &present_fences[current_frame]);
+    }
+
+    if (present_result == VK_ERROR_OUT_OF_DATE_KHR or present_result == VK_SUBOPTIMAL_KHR or frame_buffer_resized)
+    {
+        recreate_swap_chain();
+        frame_buffer_resized = false;
+    }
+}
+
+void VulkanManager::add_readback_ring()
+{
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    uint32_t slot_count = options.capture_ring_size;
+
+    frame_readback_slots.assign(MAX_FRAMES_IN_FLIGHT, -1);
+    if (!capture_supported and !streaming)
+        return;
+
+    vkGetPhysicalDeviceMemoryProperties(phys_device, &memory_properties);
+
+    readback_memory_properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    for (uint32_t type = 0; type < memory_properties.memoryTypeCount; type++)
+    {
+        VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+
+        if ((memory_properties.memoryTypes[type].propertyFlags & cached) == cached)
+        {
+            readback_memory_properties = cached;
+            break;
+        }
+    }
+
+    // Streaming blocks instead of dropping, so every queued frame, the one being written
+    // and every frame in flight need a slot of their own.
+    if (streaming)
+        slot_count = options.stream_queue_depth + MAX_FRAMES_IN_FLIGHT + 1;
+
+    // Batch renders wait for a free slot, which needs one more than the frames in flight.
+    if (!batch_jobs.empty())
+        slot_count = max<uint32_t>(slot_count, MAX_FRAMES_IN_FLIGHT + 1);
+
+    for (uint32_t slot = 0; slot < slot_count; slot++)
+        readback_slots.push_back(make_unique<ReadbackSlot>());
+
+    if (streaming)
+    {
+        if (frame_stream.start(options.stream_output, options.stream_format, swap_chain_extent.width, swap_chain_extent.height,
+            options.stream_frame_rate, options.stream_queue_depth))
+            cout << "Streaming " << swap_chain_extent.width << "x" << swap_chain_extent.height << " YUV420 frames to " << options.stream_output << endl;
+        else
+            exit_code = EXIT_FAILURE;
+        return;
+    }
+
+    capture_writer.start(options.capture_directory, options.capture_format, slot_count);
+    cout << "Capturing frames to " << options.capture_directory << " with " << slot_count << " readback slots" << endl;
+}
+
+bool VulkanManager::should_capture_frame()
+{
+    if (streaming)
+        return frame_stream.running();
+    return capture_supported and frames_drawn % options.capture_interval == 0;
+}
+
+int32_t VulkanManager::acquire_readback_slot(VkDeviceSize size)
+{
+    for (size_t slot_index = 0; slot_index < readback_slots.size(); slot_index++)
+    {
+        ReadbackSlot* slot = readback_slots[slot_index].get();
+
+        if (slot->busy)
+            continue;
+
+        if (slot->size < size)
+        {
+            if (slot->buffer != VK_NULL_HANDLE)
+            {
+                vkDestroyBuffer(logical_device, slot->buffer, nullptr);
+                free_memory(slot->memory);
+            }
+
+            add_buffer(slot->buffer, slot->memory, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, readback_memory_properties, MEMORY_READBACK);
+            vkMapMemory(logical_device, slot->memory, 0, size, 0, reinterpret_cast<void**>(&slot->mapped));
+            slot->size = size;
+        }
+
+        slot->busy = true;
+        return static_cast<int32_t>(slot_index);
+    }
+
+    return -1;
+}
+
+void VulkanManager::release_readback_slot(ReadbackSlot* slot)
+{
+    {
+        lock_guard<mutex> lock(readback_mutex);
+        slot->busy = false;
+    }
+    readback_freed.notify_all();
+}
+
+// Slots are held by frames in flight until their timeline point passes, then by the writer
+// until the pixels are on disk.
+void VulkanManager::wait_readback_slot()
+{
+    auto slot_free = [this]()
+        {
+            return any_of(readback_slots.begin(), readback_slots.end(), [](const unique_ptr<ReadbackSlot>& slot) { return !slot->busy; });
+        };
+
+    if (slot_free())
+        return;
+
+    for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        wait_gpu_work(frame_timeline_points[frame]);
+        collect_readback(frame);
+    }
+
+    unique_lock<mutex> lock(readback_mutex);
+    readback_freed.wait(lock, slot_free);
+}
+
+void VulkanManager::collect_readback(uint32_t frame)
+{
+    TRACE_ZONE("collect_readback");
+    int32_t slot_index = frame_readback_slots.empty() ? -1 : frame_readback_slots[frame];
+    ReadbackSlot* slot;
+    CaptureJob job;
+
+    if (slot_index < 0)
+        return;
+
+    frame_readback_slots[frame] = -1;
+    slot = readback_slots[slot_index].get();
+
+    if (!(readback_memory_properties & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+    {
+        VkMappedMemoryRange range{};
+
+        range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+        range.memory = slot->memory;
+        range.offset = 0;
+        range.size = VK_WHOLE_SIZE;
+        vkInvalidateMappedMemoryRanges(logical_device, 1, &range);
+    }
+
+    if (streaming)
+    {
+        StreamFrame stream_frame;
+
+        stream_frame.frame = slot->frame;
+        stream_frame.data = slot->mapped;
+        stream_frame.size = static_cast<size_t>(slot->extent.width) * slot->extent.height * 3 / 2;
+        stream_frame.done = [this, slot]() { release_readback_slot(slot); };
+
+        if (!frame_stream.push(move(stream_frame)))
+            release_readback_slot(slot);
+        return;
+    }
 
-    if (vkCreateRenderPass(logical_device, &render_pass_create_info, nullptr, &render_pass) != VK_SUCCESS)
+    job.frame = slot->frame;
+    job.name = move(slot->name);
+    job.width = slot->extent.width;
+    job.height = slot->extent.height * options.view_count;
+    job.color_format = swap_chain_image_format;
+    job.color = slot->mapped;
+    if (options.capture_depth)
     {
-        cout << "Creating render pass error!" << endl;
-        return;
+        job.depth_format = find_depth_format();
+        job.depth = slot->mapped + slot->depth_offset;
+    }
+    job.done = [this, slot]() { release_readback_slot(slot); };
+
+    if (!capture_writer.submit(move(job)))
+    {
+        release_readback_slot(slot);
+        captures_dropped++;
     }
-    cout << "Creating render pass success!" << endl;
 }
 
-void VulkanManager::add_framebuffers()
+void VulkanManager::finish_capture()
 {
-    swap_chain_framebuffers.resize(swap_chain_image_views.size());
+    if (!capture_writer.running() and !frame_stream.running())
+        return;
+
+    for (uint32_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+        collect_readback(frame);
 
-    for (size_t i = 0; i < swap_chain_image_views.size(); i++)
+    if (streaming)
     {
-        VkFramebufferCreateInfo frame_buffer_create_info{};
-        array<VkImageView, 2> attachments = { swap_chain_image_views[i], depth_image_view };
+        frame_stream.stop();
+        frame_stream.print_stats();
+        return;
+    }
 
-        frame_buffer_create_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-        frame_buffer_create_info.renderPass = render_pass;
-        frame_buffer_create_info.attachmentCount = static_cast<uint32_t>(attachments.size());
-        frame_buffer_create_info.pAttachments = attachments.data();
-        frame_buffer_create_info.width = swap_chain_extent.width;
-        frame_buffer_create_info.height = swap_chain_extent.height;
-        frame_buffer_create_info.layers = 1;
+    capture_writer.stop();
 
-        if (vkCreateFramebuffer(logical_device, &frame_buffer_create_info, nullptr, &swap_chain_framebuffers[i]) != VK_SUCCESS)
-        {
-            cout << "Creating framebuffer error!" << endl;
-            return;
-        }
-    }
+    cout << "Captured " << capture_writer.written() << " frames, dropped " << captures_dropped << endl;
 }
 
-VkFormat VulkanManager::get_supported_format(const vector<VkFormat>& candidates, VkImageTiling tiling, VkFormatFeatureFlags features)
+void VulkanManager::remove_readback_ring()
 {
-    for (VkFormat format : candidates)
+    for (unique_ptr<ReadbackSlot>& slot : readback_slots)
     {
-        VkFormatProperties properties;
-        vkGetPhysicalDeviceFormatProperties(phys_device, format, &properties);
+        if (slot->buffer == VK_NULL_HANDLE)
+            continue;
 
-        if (tiling == VK_IMAGE_TILING_LINEAR && (properties.linearTilingFeatures & features) == features)
-            return format;
-        else if (tiling == VK_IMAGE_TILING_OPTIMAL && (properties.optimalTilingFeatures & features) == features)
-            return format;
+        vkDestroyBuffer(logical_device, slot->buffer, nullptr);
+        free_memory(slot->memory);
     }
+    readback_slots.clear();
 }
 
-bool VulkanManager::has_stencil_component(VkFormat format)
+void VulkanManager::add_stream_resources()
 {
-    return format == VK_FORMAT_D32_SFLOAT_S8_UINT or format == VK_FORMAT_D24_UNORM_S8_UINT;
+    VkSamplerCreateInfo sampler_create_info{};
+    array<VkDescriptorPoolSize, 2> sizes{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    vector<VkDescriptorSetLayout> layouts(swap_chain_images.size(), yuv_set_layout);
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkDeviceSize frame_size = static_cast<VkDeviceSize>(swap_chain_extent.width) * swap_chain_extent.height * 3 / 2;
+    uint32_t image_count = static_cast<uint32_t>(swap_chain_images.size());
+
+    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_create_info.magFilter = VK_FILTER_NEAREST;
+    sampler_create_info.minFilter = VK_FILTER_NEAREST;
+    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+
+    if (vkCreateSampler(logical_device, &sampler_create_info, nullptr, &yuv_sampler) != VK_SUCCESS)
+        cout << "Adding YUV sampler error!" << endl;
+
+    yuv_buffers.resize(image_count);
+    yuv_buffers_memory.resize(image_count);
+    for (uint32_t image_index = 0; image_index < image_count; image_index++)
+        add_buffer(yuv_buffers[image_index], yuv_buffers_memory[image_index], frame_size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_READBACK);
+
+    sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    sizes[0].descriptorCount = image_count;
+    sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    sizes[1].descriptorCount = image_count;
+
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = static_cast<uint32_t>(sizes.size());
+    pool_create_info.pPoolSizes = sizes.data();
+    pool_create_info.maxSets = image_count;
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &yuv_descriptor_pool) != VK_SUCCESS)
+        cout << "Creating YUV descriptor pool error!" << endl;
+
+    yuv_descriptor_sets.resize(image_count);
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = yuv_descriptor_pool;
+    descriptor_set_alloc_info.descriptorSetCount = image_count;
+    descriptor_set_alloc_info.pSetLayouts = layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, yuv_descriptor_sets.data()) != VK_SUCCESS)
+        cout << "Allocating YUV descriptor sets error!" << endl;
+
+    for (uint32_t image_index = 0; image_index < image_count; image_index++)
+    {
+        VkDescriptorImageInfo image_info{};
+        VkDescriptorBufferInfo buffer_info{};
+        array<VkWriteDescriptorSet, 2> descriptor_writes{};
+
+        image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        image_info.imageView = swap_chain_image_views[image_index];
+        image_info.sampler = yuv_sampler;
+
+        buffer_info.buffer = yuv_buffers[image_index];
+        buffer_info.offset = 0;
+        buffer_info.range = VK_WHOLE_SIZE;
+
+        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[0].dstSet = yuv_descriptor_sets[image_index];
+        descriptor_writes[0].dstBinding = 0;
+        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[0].descriptorCount = 1;
+        descriptor_writes[0].pImageInfo = &image_info;
+
+        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[1].dstSet = yuv_descriptor_sets[image_index];
+        descriptor_writes[1].dstBinding = 1;
+        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptor_writes[1].descriptorCount = 1;
+        descriptor_writes[1].pBufferInfo = &buffer_info;
+
+        vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
+            descriptor_writes.data(), 0, nullptr);
+    }
 }
 
-VkFormat VulkanManager::find_depth_format()
+void VulkanManager::remove_stream_resources()
 {
-    return get_supported_format({ VK_FORMAT_D32_SFLOAT, VK_FORMAT_D32_SFLOAT_S8_UINT, VK_FORMAT_D24_UNORM_S8_UINT },
-        VK_IMAGE_TILING_OPTIMAL, VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT);
+    if (!streaming)
+        return;
+
+    for (size_t image_index = 0; image_index < yuv_buffers.size(); image_index++)
+    {
+        vkDestroyBuffer(logical_device, yuv_buffers[image_index], nullptr);
+        free_memory(yuv_buffers_memory[image_index]);
+    }
+    vkDestroyDescriptorPool(logical_device, yuv_descriptor_pool, nullptr);
+    vkDestroySampler(logical_device, yuv_sampler, nullptr);
+    vkDestroyPipeline(logical_device, yuv_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, yuv_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, yuv_set_layout, nullptr);
 }
 
-void VulkanManager::add_depth_resources()
+bool VulkanManager::should_close()
 {
-    VkFormat depth_format = find_depth_format();
-
-    add_image(swap_chain_extent.width, swap_chain_extent.height, depth_format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depth_image, depth_image_memory);
-    depth_image_view = add_image_view(depth_image, depth_format, VK_IMAGE_ASPECT_DEPTH_BIT);
-    change_image_layout(depth_image, depth_format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL);
+    if (benchmark and benchmark->finished())
+        return true;
+    if (options.frame_limit > 0 and frames_drawn >= options.frame_limit)
+        return true;
+    if (streaming and (!frame_stream.running() or frame_stream.failed()))
+        return true;
+    return !options.headless and glfwWindowShouldClose(window);
 }
 
-void VulkanManager::add_texture_sampler()
+void VulkanManager::add_timestamp_queries()
 {
-    VkSamplerCreateInfo sampler_create_info{};
     VkPhysicalDeviceProperties properties{};
+    VkQueryPoolCreateInfo query_pool_create_info{};
+    uint32_t queue_family_count = 0;
+    vector<VkQueueFamilyProperties> families_property;
 
     vkGetPhysicalDeviceProperties(phys_device, &properties);
+    vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, nullptr);
+    families_property.resize(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(phys_device, &queue_family_count, families_property.data());
 
-    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-    sampler_create_info.magFilter = VK_FILTER_LINEAR;
-    sampler_create_info.minFilter = VK_FILTER_LINEAR;
-    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-    sampler_create_info.anisotropyEnable = VK_TRUE;
-    sampler_create_info.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
-    sampler_create_info.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-    sampler_create_info.unnormalizedCoordinates = VK_FALSE;
-    sampler_create_info.compareEnable = VK_FALSE;
-    sampler_create_info.compareOp = VK_COMPARE_OP_ALWAYS;
-    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-    sampler_create_info.mipLodBias = 0.0;
-    sampler_create_info.minLod = 0.0;
-    sampler_create_info.maxLod = 0.0;
+    timestamp_period = properties.limits.timestampPeriod;
+    timestamp_valid_bits = families_property[get_graphics_family_index()].timestampValidBits;
+    timestamps_supported = timestamp_valid_bits > 0;
+    frame_timestamps_written.resize(MAX_FRAMES_IN_FLIGHT, false);
 
-    if (vkCreateSampler(logical_device, &sampler_create_info, nullptr, &texture_sampler) != VK_SUCCESS)
+    if (!timestamps_supported)
     {
-        cout << "Adding texture sampler error!" << endl;
+        cout << "GPU timestamps are not supported, GPU times will be missing" << endl;
         return;
     }
 
-    cout << "Adding texture sampler success!" << endl;
+    query_pool_create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_pool_create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    // A start and end stamp per frame in flight, then the same again for the post chain and the particle simulation.
+    query_pool_create_info.queryCount = 6 * MAX_FRAMES_IN_FLIGHT;
+
+    if (vkCreateQueryPool(logical_device, &query_pool_create_info, nullptr, &timestamp_pool) != VK_SUCCESS)
+    {
+        cout << "Creating timestamp query pool error!" << endl;
+        timestamps_supported = false;
+        return;
+    }
+    // The async simulation is stamped on the compute queue, whose family may have no timestamps.
+    particle_timestamp_valid_bits = families_property[async_compute ? compute_family_index : get_graphics_family_index()].timestampValidBits;
+    particle_timestamps = options.particle_count > 0 and particle_timestamp_valid_bits > 0;
 }
 
-void VulkanManager::add_image(uint32_t texture_width, uint32_t texture_height, VkFormat format, VkImageTiling tiling,
-    VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& image_memory)
+VkDescriptorSetLayout VulkanManager::add_compute_set_layout(const vector<VkDescriptorType>& types)
 {
-    VkImageCreateInfo image_create_info{};
-    VkMemoryRequirements memory_requirements{};
-    VkMemoryAllocateInfo texture_image_memory_alloc_info{};
+    vector<VkDescriptorSetLayoutBinding> bindings(types.size());
+    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+    VkDescriptorSetLayout set_layout = VK_NULL_HANDLE;
 
-    image_create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    image_create_info.imageType = VK_IMAGE_TYPE_2D;
-    image_create_info.extent.width = texture_width;
-    image_create_info.extent.height = texture_height;
-    image_create_info.extent.depth = 1;
-    image_create_info.mipLevels = 1;
-    image_create_info.arrayLayers = 1;
-    image_create_info.format = format;
-    image_create_info.tiling = tiling;
-    image_create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    image_create_info.usage = usage;
-    image_create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-    image_create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    for (uint32_t binding = 0; binding < types.size(); binding++)
+    {
+        bindings[binding].binding = binding;
+        bindings[binding].descriptorCount = 1;
+        bindings[binding].descriptorType = types[binding];
+        bindings[binding].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
 
-    if (vkCreateImage(logical_device, &image_create_info, nullptr, &image) != VK_SUCCESS)
-        cout << "Adding image error!" << endl;
+    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_create_info.bindingCount = static_cast<uint32_t>(bindings.size());
+    layout_create_info.pBindings = bindings.data();
 
-    vkGetImageMemoryRequirements(logical_device, image, &memory_requirements);
-    texture_image_memory_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    texture_image_memory_alloc_info.allocationSize = memory_requirements.size;
-    texture_image_memory_alloc_info.memoryTypeIndex = get_memory_type(memory_requirements.memoryTypeBits, properties);
+    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &set_layout) != VK_SUCCESS)
+        cout << "Creating compute set layout error!" << endl;
 
-    if (vkAllocateMemory(logical_device, &texture_image_memory_alloc_info, nullptr, &image_memory) != VK_SUCCESS)
-        cout << "Allocating image memory error!" << endl;
+    return set_layout;
+}
 
-    vkBindImageMemory(logical_device, image, image_memory, 0);
+void VulkanManager::add_compute_pipeline(const vector<char>& code, VkDescriptorSetLayout set_layout, uint32_t push_constant_size,
+    VkPipelineLayout& pipeline_layout, VkPipeline& pipeline)
+{
+    VkPushConstantRange push_constant_range{};
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+    VkComputePipelineCreateInfo pipeline_create_info{};
+    VkShaderModule shader_module = get_shader_module(code);
+
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = push_constant_size;
+
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &set_layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, nullptr, &pipeline_layout) != VK_SUCCESS)
+        cout << "Creating compute pipeline layout error!" << endl;
+
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_create_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_create_info.stage.module = shader_module;
+    pipeline_create_info.stage.pName = "main";
+    pipeline_create_info.layout = pipeline_layout;
+
+    if (vkCreateComputePipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &pipeline) != VK_SUCCESS)
+        cout << "Creating compute pipeline error!" << endl;
+
+    vkDestroyShaderModule(logical_device, shader_module, nullptr);
 }
 
-void VulkanManager::add_texture_image()
+void VulkanManager::add_yuv_pipeline()
 {
-    int image_width, image_height, image_channels;
-    VkDeviceSize image_size;
-    stbi_uc* image_pixels = stbi_load("Textures/Gabe.jpg", 
-        &image_width, &image_height, &image_channels, STBI_rgb_alpha);
-    VkBuffer staging_buffer;
-    VkDeviceMemory staging_buffer_memory;
-    void* data;
+    VkDescriptorSetLayoutBinding image_binding{};
+    VkDescriptorSetLayoutBinding buffer_binding{};
+    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+    VkPushConstantRange push_constant_range{};
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info{};
+    VkComputePipelineCreateInfo pipeline_create_info{};
+    VkShaderModule yuv_shader_module = get_shader_module(yuv_shader_code);
 
-    image_size = image_width * image_height * 4;
+    image_binding.binding = 0;
+    image_binding.descriptorCount = 1;
+    image_binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    image_binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
-    add_buffer(staging_buffer, staging_buffer_memory, image_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    buffer_binding.binding = 1;
+    buffer_binding.descriptorCount = 1;
+    buffer_binding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    buffer_binding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
 
-    vkMapMemory(logical_device, staging_buffer_memory, 0, image_size, 0, &data);
-    memcpy(data, image_pixels, static_cast<size_t>(image_size));
-    vkUnmapMemory(logical_device, staging_buffer_memory);
+    array<VkDescriptorSetLayoutBinding, 2> bindings = { image_binding, buffer_binding };
 
-    stbi_image_free(image_pixels);
+    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_create_info.bindingCount = static_cast<uint32_t>(bindings.size());
+    layout_create_info.pBindings = bindings.data();
 
-    add_image(image_width, image_height, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL,
-        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        texture_image, texture_image_memory);
-    change_image_layout(texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    copy_buffer_to_image(staging_buffer, texture_image, static_cast<uint32_t>(image_width), static_cast<uint32_t>(image_height));
-    change_image_layout(texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    if (vkCreateDescriptorSetLayout(logical_device, &layout_create_info, nullptr, &yuv_set_layout) != VK_SUCCESS)
+        cout << "Creating YUV set layout error!" << endl;
+
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = 2 * sizeof(uint32_t);
+
+    pipeline_layout_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_create_info.setLayoutCount = 1;
+    pipeline_layout_create_info.pSetLayouts = &yuv_set_layout;
+    pipeline_layout_create_info.pushConstantRangeCount = 1;
+    pipeline_layout_create_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(logical_device, &pipeline_layout_create_info, nullptr, &yuv_pipeline_layout) != VK_SUCCESS)
+        cout << "Creating YUV pipeline layout error!" << endl;
+
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_create_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_create_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_create_info.stage.module = yuv_shader_module;
+    pipeline_create_info.stage.pName = "main";
+    pipeline_create_info.layout = yuv_pipeline_layout;
+
+    if (vkCreateComputePipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_create_info, nullptr, &yuv_pipeline) != VK_SUCCESS)
+        cout << "Creating YUV pipeline error!" << endl;
+
+    vkDestroyShaderModule(logical_device, yuv_shader_module, nullptr);
+}
+
+void VulkanManager::add_occlusion_pipelines()
+{
+    VkSamplerCreateInfo sampler_create_info{};
 
-    vkDestroyBuffer(logical_device, staging_buffer, nullptr);
-    vkFreeMemory(logical_device, staging_buffer_memory, nullptr);
+    depth_pyramid_set_layout = add_compute_set_layout({ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE });
+    // Loaded here rather than in read_shaders: the device decides whether culling stays enabled.
+    add_compute_pipeline(get_shader_code("Shaders/depth_pyramid.spv"), depth_pyramid_set_layout, 3 * sizeof(uint32_t),
+        depth_pyramid_pipeline_layout, depth_pyramid_pipeline);
+
+    cull_set_layout = add_compute_set_layout({ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        VK_DESCRIPTOR_TYPE_STORAGE_BUFFER });
+    add_compute_pipeline(get_shader_code("Shaders/occlusion_cull.spv"), cull_set_layout, sizeof(CullParams), cull_pipeline_layout, cull_pipeline);
+
+    sampler_create_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_create_info.magFilter = VK_FILTER_NEAREST;
+    sampler_create_info.minFilter = VK_FILTER_NEAREST;
+    sampler_create_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    sampler_create_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+    sampler_create_info.maxLod = VK_LOD_CLAMP_NONE;
+
+    if (vkCreateSampler(logical_device, &sampler_create_info, nullptr, &depth_pyramid_sampler) != VK_SUCCESS)
+        cout << "Adding depth pyramid sampler error!" << endl;
 }
 
-void VulkanManager::add_texture_image_view()
+void VulkanManager::add_occlusion_buffers()
 {
-    texture_image_view = add_image_view(texture_image, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_ASPECT_COLOR_BIT);
+    VkDeviceSize visibility_size = sizeof(uint32_t) * scene_transforms.size();
+    VkCommandBuffer command_buff;
+
+    // Everything starts visible, so the first early pass draws the whole scene.
+    add_buffer(visibility_buffer, visibility_buffer_memory, visibility_size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, MEMORY_CULLING);
+    command_buff = begin_single_time_commands();
+    vkCmdFillBuffer(command_buff, visibility_buffer, 0, VK_WHOLE_SIZE, 1);
+    end_single_time_commands(command_buff);
+
+    cull_count_buffers.resize(MAX_FRAMES_IN_FLIGHT);
+    cull_count_buffers_memory.resize(MAX_FRAMES_IN_FLIGHT);
+    cull_counts_mapped.resize(MAX_FRAMES_IN_FLIGHT);
+    indirect_buffers.assign(MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+    indirect_buffers_memory.assign(MAX_FRAMES_IN_FLIGHT, VK_NULL_HANDLE);
+    indirect_commands_mapped.assign(MAX_FRAMES_IN_FLIGHT, nullptr);
+    indirect_capacity.assign(MAX_FRAMES_IN_FLIGHT, 0);
+    frame_cull_numbers.assign(MAX_FRAMES_IN_FLIGHT, 0);
+
+    // Counts stay host visible so the stats can read them once the frame is done.
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        add_buffer(cull_count_buffers[frame], cull_count_buffers_memory[frame], sizeof(uint32_t) * CULL_LIST_COUNT,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_CULLING);
+        vkMapMemory(logical_device, cull_count_buffers_memory[frame], 0, sizeof(uint32_t) * CULL_LIST_COUNT, 0,
+            reinterpret_cast<void**>(&cull_counts_mapped[frame]));
+    }
 }
 
-void VulkanManager::change_image_layout(VkImage image, VkFormat format, VkImageLayout layout, VkImageLayout new_layout)
+void VulkanManager::add_depth_pyramid()
 {
-    VkCommandBuffer command_buff = begin_single_time_commands();
+    array<VkDescriptorPoolSize, 4> sizes{};
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    VkDescriptorSetAllocateInfo descriptor_set_alloc_info{};
+    VkCommandBuffer command_buff;
     VkImageMemoryBarrier barrier{};
-    VkPipelineStageFlags source_stage;
-    VkPipelineStageFlags destination_stage;
+    uint32_t width = 1;
+    uint32_t height = 1;
+
+    // Level 0 halves the depth buffer rounded up to a power of two, so a texel of level L
+    // covers exactly 2^(L + 1) pixels and every level halves the previous one.
+    while (width < (swap_chain_extent.width + 1) / 2)
+        width *= 2;
+    while (height < (swap_chain_extent.height + 1) / 2)
+        height *= 2;
+
+    depth_pyramid_extent = { width, height };
+    depth_pyramid_levels = static_cast<uint32_t>(floor(log2(max(width, height)))) + 1;
+
+    add_image(width, height, VK_FORMAT_R32G32_SFLOAT, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        depth_pyramid, depth_pyramid_memory, MEMORY_ATTACHMENTS, 1, depth_pyramid_levels);
+    depth_pyramid_view = add_image_view(depth_pyramid, VK_FORMAT_R32G32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, depth_pyramid_levels);
+    for (uint32_t level = 0; level < depth_pyramid_levels; level++)
+        depth_pyramid_level_views.push_back(add_image_view(depth_pyramid, VK_FORMAT_R32G32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, level));
 
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    barrier.oldLayout = layout;
-    barrier.newLayout = new_layout;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
     barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    barrier.image = image;
+    barrier.image = depth_pyramid;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
-    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.levelCount = depth_pyramid_levels;
     barrier.subresourceRange.layerCount = 1;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
 
-    if (new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
-    {
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-        if (has_stencil_component(format))
-            barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-    }
-    else
-        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    command_buff = begin_single_time_commands();
+    vkCmdPipelineBarrier(command_buff, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &barrier);
+    end_single_time_commands(command_buff);
 
-    if (layout == VK_IMAGE_LAYOUT_UNDEFINED and new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL)
-    {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destination_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    }
+    sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    sizes[0].descriptorCount = depth_pyramid_levels + MAX_FRAMES_IN_FLIGHT;
+    sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    sizes[1].descriptorCount = depth_pyramid_levels;
+    sizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    sizes[2].descriptorCount = MAX_FRAMES_IN_FLIGHT;
+    sizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    sizes[3].descriptorCount = 4 * MAX_FRAMES_IN_FLIGHT;
 
-    else if(layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL and new_layout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
-    {
-        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-        source_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        destination_stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-    }
-    else if (layout == VK_IMAGE_LAYOUT_UNDEFINED and new_layout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL)
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = static_cast<uint32_t>(sizes.size());
+    pool_create_info.pPoolSizes = sizes.data();
+    pool_create_info.maxSets = depth_pyramid_levels + MAX_FRAMES_IN_FLIGHT;
+
+    if (vkCreateDescriptorPool(logical_device, &pool_create_info, nullptr, &occlusion_descriptor_pool) != VK_SUCCESS)
+        cout << "Creating occlusion descriptor pool error!" << endl;
+
+    depth_pyramid_resources.push_back(resources.add_descriptor_pool(occlusion_descriptor_pool));
+    for (VkImageView level_view : depth_pyramid_level_views)
+        depth_pyramid_resources.push_back(resources.add_image_view(level_view));
+    depth_pyramid_resources.push_back(resources.add_image_view(depth_pyramid_view));
+    depth_pyramid_resources.push_back(resources.add_image(depth_pyramid, depth_pyramid_memory));
+
+    vector<VkDescriptorSetLayout> level_layouts(depth_pyramid_levels, depth_pyramid_set_layout);
+    vector<VkDescriptorSetLayout> cull_layouts(MAX_FRAMES_IN_FLIGHT, cull_set_layout);
+
+    depth_pyramid_descriptor_sets.resize(depth_pyramid_levels);
+    cull_descriptor_sets.resize(MAX_FRAMES_IN_FLIGHT);
+
+    descriptor_set_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptor_set_alloc_info.descriptorPool = occlusion_descriptor_pool;
+    descriptor_set_alloc_info.descriptorSetCount = depth_pyramid_levels;
+    descriptor_set_alloc_info.pSetLayouts = level_layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, depth_pyramid_descriptor_sets.data()) != VK_SUCCESS)
+        cout << "Allocating depth pyramid descriptor sets error!" << endl;
+
+    descriptor_set_alloc_info.descriptorSetCount = MAX_FRAMES_IN_FLIGHT;
+    descriptor_set_alloc_info.pSetLayouts = cull_layouts.data();
+
+    if (vkAllocateDescriptorSets(logical_device, &descriptor_set_alloc_info, cull_descriptor_sets.data()) != VK_SUCCESS)
+        cout << "Allocating cull descriptor sets error!" << endl;
+
+    for (uint32_t level = 0; level < depth_pyramid_levels; level++)
     {
-        barrier.srcAccessMask = 0;
-        barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-        source_stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-        destination_stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
+        VkDescriptorImageInfo source_info{};
+        VkDescriptorImageInfo level_info{};
+        array<VkWriteDescriptorSet, 2> descriptor_writes{};
+
+        source_info.imageLayout = level == 0 ? VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL : VK_IMAGE_LAYOUT_GENERAL;
+        source_info.imageView = level == 0 ? depth_image_view : depth_pyramid_level_views[level - 1];
+        source_info.sampler = depth_pyramid_sampler;
+
+        level_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        level_info.imageView = depth_pyramid_level_views[level];
+
+        descriptor_writes[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[0].dstSet = depth_pyramid_descriptor_sets[level];
+        descriptor_writes[0].dstBinding = 0;
+        descriptor_writes[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptor_writes[0].descriptorCount = 1;
+        descriptor_writes[0].pImageInfo = &source_info;
+
+        descriptor_writes[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptor_writes[1].dstSet = depth_pyramid_descriptor_sets[level];
+        descriptor_writes[1].dstBinding = 1;
+        descriptor_writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptor_writes[1].descriptorCount = 1;
+        descriptor_writes[1].pImageInfo = &level_info;
+
+        vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
+            descriptor_writes.data(), 0, nullptr);
     }
 
-    vkCmdPipelineBarrier(command_buff, source_stage, destination_stage, 0, 0, nullptr, 0, nullptr, 1, &barrier);
-    end_single_time_commands(command_buff);
-}
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
+    {
+        VkDescriptorImageInfo pyramid_info{};
+        array<VkDescriptorBufferInfo, 6> buffer_infos{};
+        array<VkWriteDescriptorSet, 6> descriptor_writes{};
+        array<VkBuffer, 6> buffers = { uniform_buffers[frame], instance_buffers[frame], VK_NULL_HANDLE,
+            visibility_buffer, visible_instance_buffers[frame], cull_count_buffers[frame] };
 
-void VulkanManager::copy_buffer_to_image(VkBuffer buff, VkImage image, uint32_t width, uint32_t height)
-{
-    VkBufferImageCopy region{};
-    VkCommandBuffer command_buff = begin_single_time_commands();
+        pyramid_info.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        pyramid_info.imageView = depth_pyramid_view;
+        pyramid_info.sampler = depth_pyramid_sampler;
 
-    region.bufferOffset = 0;
-    region.bufferRowLength = 0;
-    region.bufferImageHeight = 0;
-    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
-    region.imageSubresource.baseArrayLayer = 0;
-    region.imageSubresource.layerCount = 1;
+        for (uint32_t binding = 0; binding < descriptor_writes.size(); binding++)
+        {
+            descriptor_writes[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            descriptor_writes[binding].dstSet = cull_descriptor_sets[frame];
+            descriptor_writes[binding].dstBinding = binding;
+            descriptor_writes[binding].descriptorCount = 1;
 
-    region.imageOffset = { 0, 0, 0 };
-    region.imageExtent = { width, height, 1 };
+            if (binding == 2)
+            {
+                descriptor_writes[binding].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptor_writes[binding].pImageInfo = &pyramid_info;
+                continue;
+            }
+
+            buffer_infos[binding].buffer = buffers[binding];
+            buffer_infos[binding].offset = 0;
+            buffer_infos[binding].range = binding == 0 ? sizeof(UniformBufferObject) : VK_WHOLE_SIZE;
+            descriptor_writes[binding].descriptorType = binding == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            descriptor_writes[binding].pBufferInfo = &buffer_infos[binding];
+        }
 
-    vkCmdCopyBufferToImage(command_buff, buff, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
-    end_single_time_commands(command_buff);
+        vkUpdateDescriptorSets(logical_device, static_cast<uint32_t>(descriptor_writes.size()),
+            descriptor_writes.data(), 0, nullptr);
+    }
 }
 
-void VulkanManager::add_command_pool()
+void VulkanManager::remove_depth_pyramid()
 {
-    VkCommandPoolCreateInfo command_pool_create_info{};
-    uint32_t graphics_family_index = get_graphics_family_index();
+    for (ResourceHandle handle : depth_pyramid_resources)
+        retire_resource(handle);
+    depth_pyramid_resources.clear();
+    depth_pyramid_level_views.clear();
+}
 
-    command_pool_create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    command_pool_create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
-    command_pool_create_info.queueFamilyIndex = graphics_family_index;
+void VulkanManager::remove_occlusion_resources()
+{
+    if (!options.occlusion_culling)
+        return;
 
-    if (vkCreateCommandPool(logical_device, &command_pool_create_info, nullptr, &command_pool) != VK_SUCCESS)
+    remove_depth_pyramid();
+    for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++)
     {
-        cout << "Creating command pool error!" << endl;
-        return;
+        vkDestroyBuffer(logical_device, cull_count_buffers[frame], nullptr);
+        free_memory(cull_count_buffers_memory[frame]);
+        if (indirect_buffers[frame] == VK_NULL_HANDLE)
+            continue;
+        vkDestroyBuffer(logical_device, indirect_buffers[frame], nullptr);
+        free_memory(indirect_buffers_memory[frame]);
     }
-    cout << "Creating command pool success!" << endl;
+    vkDestroyBuffer(logical_device, visibility_buffer, nullptr);
+    free_memory(visibility_buffer_memory);
+
+    vkDestroySampler(logical_device, depth_pyramid_sampler, nullptr);
+    vkDestroyPipeline(logical_device, cull_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, cull_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, cull_set_layout, nullptr);
+    vkDestroyPipeline(logical_device, depth_pyramid_pipeline, nullptr);
+    vkDestroyPipelineLayout(logical_device, depth_pyramid_pipeline_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, depth_pyramid_set_layout, nullptr);
+    vkDestroyRenderPass(logical_device, late_render_pass, nullptr);
 }
 
-VkCommandBuffer VulkanManager::begin_single_time_commands()
+void VulkanManager::write_indirect_commands(uint32_t frame)
 {
-    VkCommandBufferAllocateInfo command_buffer_allocate_info{};
-    VkCommandBufferBeginInfo begin_info{};
-    VkCommandBuffer command_buff;
+    size_t command_count = CULL_LIST_COUNT * submeshes.size();
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
 
-    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    command_buffer_allocate_info.commandPool = command_pool;
-    command_buffer_allocate_info.commandBufferCount = 1;
+    // The GPU fills in instanceCount; the rest follows the bound mesh, which batch renders swap.
+    if (indirect_capacity[frame] < command_count)
+    {
+        VkDeviceSize size = sizeof(VkDrawIndexedIndirectCommand) * command_count;
 
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (indirect_buffers[frame] != VK_NULL_HANDLE)
+        {
+            vkDestroyBuffer(logical_device, indirect_buffers[frame], nullptr);
+            free_memory(indirect_buffers_memory[frame]);
+        }
 
-    vkAllocateCommandBuffers(logical_device, &command_buffer_allocate_info, &command_buff);
-    vkBeginCommandBuffer(command_buff, &begin_info);
+        add_buffer(indirect_buffers[frame], indirect_buffers_memory[frame], size,
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, MEMORY_CULLING);
+        vkMapMemory(logical_device, indirect_buffers_memory[frame], 0, size, 0, reinterpret_cast<void**>(&indirect_commands_mapped[frame]));
+        indirect_capacity[frame] = command_count;
+    }
 
-    return command_buff;
+    for (uint32_t list = 0; list < CULL_LIST_COUNT; list++)
+    {
+        for (size_t submesh_index = 0; submesh_index < submeshes.size(); submesh_index++)
+        {
+            VkDrawIndexedIndirectCommand& command = indirect_commands_mapped[frame][list * submeshes.size() + submesh_index];
+
+            command.indexCount = submeshes[submesh_index].index_count;
+            command.instanceCount = 0;
+            command.firstIndex = submeshes[submesh_index].first_index;
+            command.vertexOffset = 0;
+            command.firstInstance = list * instance_count;
+        }
+    }
 }
 
-void VulkanManager::end_single_time_commands(VkCommandBuffer command_buff)
+void VulkanManager::record_cull_pass(VkCommandBuffer buff, uint32_t phase)
 {
-    VkQueue graphics_queue;
-    VkSubmitInfo submit_info{};
+    CullParams params{};
+    VkMemoryBarrier barrier{};
+    vector<VkBufferCopy> copies;
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
+    uint32_t first_list = phase == 0 ? 0 : 1;
+    uint32_t list_end = phase == 0 ? 1 : CULL_LIST_COUNT;
 
-    vkGetDeviceQueue(logical_device, get_graphics_family_index(), 0, &graphics_queue);
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
 
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &command_buff;
+    // The previous frame's late cull wrote the visibility this pass reads and still reads the pyramid.
+    if (phase == 0)
+    {
+        vkCmdFillBuffer(buff, cull_count_buffers[current_frame], 0, VK_WHOLE_SIZE, 0);
 
-    vkEndCommandBuffer(command_buff);
-    vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphics_queue);
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
 
-    vkFreeCommandBuffers(logical_device, command_pool, 1, &command_buff);
+    params.sphere = glm::vec4(mesh_center, mesh_radius);
+    params.viewport[0] = swap_chain_extent.width;
+    params.viewport[1] = swap_chain_extent.height;
+    params.instance_count = instance_count;
+    params.levels = depth_pyramid_levels;
+    params.phase = phase;
+    params.test_occlusion = !occlusion_probes or frames_drawn % OCCLUSION_PROBE_INTERVAL != 0;
+
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline_layout, 0, 1, &cull_descriptor_sets[current_frame], 0, nullptr);
+    vkCmdPushConstants(buff, cull_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    vkCmdDispatch(buff, (instance_count + 63) / 64, 1, 1);
+
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+    for (uint32_t list = first_list; list < list_end; list++)
+    {
+        for (size_t submesh_index = 0; submesh_index < submeshes.size(); submesh_index++)
+        {
+            VkBufferCopy copy{};
+
+            copy.srcOffset = list * sizeof(uint32_t);
+            copy.dstOffset = (list * submeshes.size() + submesh_index) * sizeof(VkDrawIndexedIndirectCommand)
+                + offsetof(VkDrawIndexedIndirectCommand, instanceCount);
+            copy.size = sizeof(uint32_t);
+            copies.push_back(copy);
+        }
+    }
+    if (!copies.empty())
+        vkCmdCopyBuffer(buff, cull_count_buffers[current_frame], indirect_buffers[current_frame], static_cast<uint32_t>(copies.size()), copies.data());
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
 }
 
-void VulkanManager::add_command_buffers()
+void VulkanManager::record_depth_pyramid(VkCommandBuffer buff)
 {
-    VkCommandBufferAllocateInfo command_buffer_allocate_info{};
-
-    command_buffers.resize(MAX_FRAMES_IN_FLIGHT);
-    command_buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    command_buffer_allocate_info.commandPool = command_pool;
-    command_buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    command_buffer_allocate_info.commandBufferCount = (uint32_t)command_buffers.size();
+    VkImageMemoryBarrier depth_barrier{};
+    VkMemoryBarrier level_barrier{};
+    VkExtent2D source_extent = swap_chain_extent;
+    VkFormat depth_format = find_depth_format();
 
-    if (vkAllocateCommandBuffers(logical_device, &command_buffer_allocate_info, command_buffers.data()) != VK_SUCCESS)
+    depth_barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    depth_barrier.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+    depth_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    depth_barrier.oldLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_barrier.newLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    depth_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depth_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    depth_barrier.image = depth_image;
+    depth_barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+    if (has_stencil_component(depth_format))
+        depth_barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+    depth_barrier.subresourceRange.levelCount = 1;
+    depth_barrier.subresourceRange.layerCount = 1;
+
+    level_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    level_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    level_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+    vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        0, 0, nullptr, 0, nullptr, 1, &depth_barrier);
+    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_COMPUTE, depth_pyramid_pipeline);
+
+    for (uint32_t level = 0; level < depth_pyramid_levels; level++)
     {
-        cout << "Creating comand buffer error!" << endl;
-        return;
+        uint32_t level_width = max(depth_pyramid_extent.width >> level, 1u);
+        uint32_t level_height = max(depth_pyramid_extent.height >> level, 1u);
+        array<uint32_t, 3> params = { source_extent.width, source_extent.height, level == 0 ? 1u : 0u };
+
+        vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_COMPUTE, depth_pyramid_pipeline_layout,
+            0, 1, &depth_pyramid_descriptor_sets[level], 0, nullptr);
+        vkCmdPushConstants(buff, depth_pyramid_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), params.data());
+        vkCmdDispatch(buff, (level_width + 7) / 8, (level_height + 7) / 8, 1);
+        vkCmdPipelineBarrier(buff, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0, 1, &level_barrier, 0, nullptr, 0, nullptr);
+
+        source_extent = { level_width, level_height };
     }
-    cout << "Creating comand buffer success!" << endl;
 }
 
-void VulkanManager::record_command_buffer(VkCommandBuffer buff, uint32_t image_index)
+void VulkanManager::collect_occlusion_stats(uint32_t frame)
 {
-    VkViewport viewport{};
-    VkRect2D scissors{};
-    VkCommandBufferBeginInfo begin_info{};
-    VkRenderPassBeginInfo render_pass_info{};
-    VkBuffer vertex_buffers[] = { vertex_buffer };
-    VkDeviceSize offsets[] = { 0 };
-    array<VkClearValue, 2> clear_values{};
-    
-    clear_values[0].color = { {0.0f, 0.0f, 0.0f, 1.0f} };
-    clear_values[1].depthStencil = { 1.0f, 0 };
-
-    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    begin_info.flags = 0;
-    begin_info.pInheritanceInfo = nullptr;
+    uint64_t frame_number;
+    uint32_t instance_count = static_cast<uint32_t>(scene_transforms.size());
+    const uint32_t* counts;
 
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_pass_info.renderPass = render_pass;
-    render_pass_info.framebuffer = swap_chain_framebuffers[image_index];
-    render_pass_info.renderArea.offset = { 0, 0 };
-    render_pass_info.renderArea.extent = swap_chain_extent;
-    render_pass_info.clearValueCount = static_cast<uint32_t>(clear_values.size());
-    render_pass_info.pClearValues = clear_values.data();
+    if (!options.occlusion_culling or frame_cull_numbers[frame] == 0)
+        return;
 
-    viewport.x = 0.0;
-    viewport.y = 0.0;
-    viewport.width = static_cast<float>(swap_chain_extent.width);
-    viewport.height = static_cast<float>(swap_chain_extent.height);
-    viewport.minDepth = 0.0;
-    viewport.maxDepth = 1.0;
+    frame_number = frame_cull_numbers[frame] - 1;
+    frame_cull_numbers[frame] = 0;
+    counts = cull_counts_mapped[frame];
 
-    scissors.offset = { 0, 0 };
-    scissors.extent = swap_chain_extent;
+    occlusion_stats.frames++;
+    occlusion_stats.instances_tested += instance_count;
+    occlusion_stats.instances_culled += instance_count - min(counts[DRAW_VISIBLE_LIST - DRAW_EARLY_LIST], instance_count);
+    occlusion_stats.late_instances += counts[DRAW_LATE_LIST - DRAW_EARLY_LIST];
 
-    if (vkBeginCommandBuffer(buff, &begin_info) != VK_SUCCESS)
-        cout << "Begin recording error!" << endl;
-    vkCmdBeginRenderPass(buff, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
-    vkCmdSetViewport(buff, 0, 1, &viewport);
-    vkCmdSetScissor(buff, 0, 1, &scissors);
-    vkCmdBindVertexBuffers(buff, 0, 1, vertex_buffers, offsets);
-    vkCmdBindIndexBuffer(buff, index_buffer, 0, VK_INDEX_TYPE_UINT32);
-    vkCmdBindDescriptorSets(buff, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout,
-        0, 1, &descriptor_sets[current_frame], 0, nullptr);
-    vkCmdDrawIndexed(buff, static_cast<uint32_t>(indices.size()), 1, 0, 0, 0);
-    vkCmdEndRenderPass(buff);
+    if (last_gpu_frame_ms < 0.0)
+        return;
 
-    if (vkEndCommandBuffer(buff) != VK_SUCCESS)
-        cout << "Recording command buffer error!" << endl;
+    // The frame after a probe redraws everything the probe marked visible, so it counts as neither.
+    if (!occlusion_probes)
+    {
+        occlusion_stats.culled_frames++;
+        occlusion_stats.culled_gpu_ms += last_gpu_frame_ms;
+    }
+    else if (frame_number % OCCLUSION_PROBE_INTERVAL == 0)
+    {
+        occlusion_stats.probe_frames++;
+        occlusion_stats.probe_gpu_ms += last_gpu_frame_ms;
+    }
+    else if (frame_number % OCCLUSION_PROBE_INTERVAL != 1)
+    {
+        occlusion_stats.culled_frames++;
+        occlusion_stats.culled_gpu_ms += last_gpu_frame_ms;
+    }
 }
 
-void VulkanManager::add_sync_objects()
+void VulkanManager::print_occlusion_stats()
 {
-    VkSemaphoreCreateInfo semaphore_create_info{};
-    VkFenceCreateInfo fence_create_info{};
-
-    image_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    render_semaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    in_flight_fences.resize(MAX_FRAMES_IN_FLIGHT);
+    const OcclusionStats& stats = occlusion_stats;
 
-    semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-
-    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    if (stats.frames == 0)
+        return;
 
-    for (size_t sync_obj_index = 0; sync_obj_index < MAX_FRAMES_IN_FLIGHT; sync_obj_index++)
+    cout << "Occlusion culling: " << 100.0 * stats.instances_culled / stats.instances_tested << "% of instances culled"
+        << ", " << static_cast<double>(stats.late_instances) / stats.frames << " per frame drawn by the late pass";
+    if (stats.probe_frames > 0 and stats.culled_frames > 0)
     {
-        if (vkCreateSemaphore(logical_device, &semaphore_create_info, nullptr, &image_semaphores[sync_obj_index]) != VK_SUCCESS or
-            vkCreateSemaphore(logical_device, &semaphore_create_info, nullptr, &render_semaphores[sync_obj_index]) != VK_SUCCESS or
-            vkCreateFence(logical_device, &fence_create_info, nullptr, &in_flight_fences[sync_obj_index]) != VK_SUCCESS)
-            cout << "Creating sync objects error!" << endl;
+        double culled_ms = stats.culled_gpu_ms / stats.culled_frames;
+        double unculled_ms = stats.probe_gpu_ms / stats.probe_frames;
+
+        cout << ", GPU frame " << culled_ms << " ms culled vs " << unculled_ms << " ms without the occlusion test ("
+            << unculled_ms - culled_ms << " ms saved)";
     }
+    cout << endl;
 }
 
-void VulkanManager::add_surface()
+double VulkanManager::read_gpu_frame_time(uint32_t frame)
 {
-    if (glfwCreateWindowSurface(vulkan_instance, window, nullptr, &surface) != VK_SUCCESS)
-        cout << "Making Window surface error!";
-    cout << "Making surface success!" << endl;
+    if (!timestamps_supported or !frame_timestamps_written[frame])
+        return -1.0;
+
+    return read_gpu_interval(2 * frame, timestamp_valid_bits);
 }
 
-void VulkanManager::draw_frame()
+double VulkanManager::read_gpu_interval(uint32_t first_query, uint32_t valid_bits)
 {
-    uint32_t image_index;
-    uint32_t graphics_family_index = get_graphics_family_index();
-    uint32_t present_family_index = get_present_family_index();
-    VkSubmitInfo submit_info{};
-    VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-    VkQueue graphics_queue;
-    VkQueue present_queue;
-    VkPresentInfoKHR present_info{};
-    VkSwapchainKHR swap_chains[] = { swap_chain };
-    VkResult acquire_next_image_result;
-    VkResult present_result;
+    array<uint64_t, 2> timestamps{};
 
-    update_uniform_buffer(current_frame);
+    if (!read_gpu_timestamps(first_query, timestamps))
+        return -1.0;
 
-    vkGetDeviceQueue(logical_device, graphics_family_index, 0, &graphics_queue);
-    vkGetDeviceQueue(logical_device, present_family_index, 0, &present_queue);
+    return timestamp_delta(timestamps[0], timestamps[1], valid_bits) * timestamp_period / 1000000.0;
+}
 
-    vkWaitForFences(logical_device, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX);
+// Only the low valid_bits of a timestamp count, so the difference wraps at that width. A difference past
+// half the range means to was the earlier stamp.
+int64_t VulkanManager::timestamp_delta(uint64_t from, uint64_t to, uint32_t valid_bits)
+{
+    uint64_t delta = to - from;
+
+    if (valid_bits >= 64)
+        return static_cast<int64_t>(delta);
+    delta &= (1ull << valid_bits) - 1;
+    if (delta >= 1ull << (valid_bits - 1))
+        return static_cast<int64_t>(delta) - static_cast<int64_t>(1ull << valid_bits);
+    return static_cast<int64_t>(delta);
+}
 
-    acquire_next_image_result = vkAcquireNextImageKHR(logical_device, swap_chain, UINT64_MAX, image_semaphores[current_frame], VK_NULL_HANDLE, &image_index);
-    
-    if (acquire_next_image_result == VK_ERROR_OUT_OF_DATE_KHR)
+bool VulkanManager::read_gpu_timestamps(uint32_t first_query, array<uint64_t, 2>& timestamps)
+{
+    return vkGetQueryPoolResults(logical_device, timestamp_pool, first_query, 2, sizeof(timestamps), timestamps.data(),
+        sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS;
+}
+
+// Portable stand-in for pairing the device domain with a host domain: the host clock domains are
+// not steady_clock on every platform, so the device clock is read between two steady_clock reads
+// and placed at their midpoint.
+void VulkanManager::calibrate_gpu_clock()
+{
+    VkCalibratedTimestampInfoEXT timestamp_info{};
+    uint64_t device_ticks = 0;
+    uint64_t max_deviation = 0;
+    chrono::steady_clock::time_point before;
+    chrono::steady_clock::time_point after;
+
+    timestamp_info.sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+    timestamp_info.timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+
+    before = chrono::steady_clock::now();
+    if (get_calibrated_timestamps(logical_device, 1, &timestamp_info, &device_ticks, &max_deviation) != VK_SUCCESS)
     {
-        recreate_swap_chain();
+        cout << "Calibrating GPU timestamps error!" << endl;
+        gpu_trace_supported = false;
         return;
     }
+    after = chrono::steady_clock::now();
 
-    vkResetFences(logical_device, 1, &in_flight_fences[current_frame]);
+    gpu_clock_ticks = device_ticks;
+    gpu_clock_ns = chrono::duration_cast<chrono::nanoseconds>((before + (after - before) / 2).time_since_epoch()).count();
+}
 
-    vkResetCommandBuffer(command_buffers[current_frame], 0);
-    record_command_buffer(command_buffers[current_frame], image_index);
+void VulkanManager::trace_gpu_frame(uint32_t frame)
+{
+    array<uint64_t, 2> timestamps{};
 
-    VkSemaphore wait_semaphores[] = { image_semaphores[current_frame] };
-    VkSemaphore signal_semaphores[] = { render_semaphores[current_frame] };
+    // Recalibrated now and then, the two clocks drift apart over a long run.
+    if (gpu_clock_ns == 0 or frames_drawn % 256 == 0)
+        calibrate_gpu_clock();
+    if (!gpu_trace_supported)
+        return;
 
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = wait_semaphores;
-    submit_info.pWaitDstStageMask = wait_stages;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &command_buffers[current_frame];
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = signal_semaphores;
-
-    if (vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fences[current_frame]) != VK_SUCCESS)
-        cout << "Submitting draw comand buffer error!" << endl;
-    
-    present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    present_info.waitSemaphoreCount = 1;
-    present_info.pWaitSemaphores = signal_semaphores;
-    present_info.swapchainCount = 1;
-    present_info.pSwapchains = swap_chains;
-    present_info.pImageIndices = &image_index;
-    present_info.pResults = nullptr;
+    auto to_steady_ns = [this](uint64_t ticks)
+        {
+            return gpu_clock_ns + static_cast<int64_t>(timestamp_delta(gpu_clock_ticks, ticks, timestamp_valid_bits) * static_cast<double>(timestamp_period));
+        };
 
-    present_result = vkQueuePresentKHR(present_queue, &present_info);
+    if (read_gpu_timestamps(2 * frame, timestamps))
+        trace_record_external("GPU", "gpu_frame", to_steady_ns(timestamps[0]), to_steady_ns(timestamps[1]));
+    if (post_processing and read_gpu_timestamps(2 * (MAX_FRAMES_IN_FLIGHT + frame), timestamps))
+        trace_record_external("GPU", "post_processing", to_steady_ns(timestamps[0]), to_steady_ns(timestamps[1]));
+}
 
-    if (present_result == VK_ERROR_OUT_OF_DATE_KHR or present_result == VK_SUBOPTIMAL_KHR or frame_buffer_resized)
-    {
-        recreate_swap_chain();
-        frame_buffer_resized = false;
-    }
+void VulkanManager::finish_benchmark()
+{
+    VkPhysicalDeviceProperties properties{};
+    string anti_aliasing = "none";
 
-    current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+    vkGetPhysicalDeviceProperties(phys_device, &properties);
+    if (post_processing)
+        anti_aliasing = options.fxaa ? "post_fxaa" : "post";
+    else if (msaa_samples > 1)
+        anti_aliasing = "msaa" + to_string(msaa_samples);
+
+    benchmark->print_results();
+    benchmark->write_json(options.benchmark_output, properties.deviceName, anti_aliasing);
+
+    if (!options.baseline_path.empty() and !benchmark->compare_with_baseline(options.baseline_path, options.baseline_tolerance))
+        exit_code = EXIT_FAILURE;
 }
 
 void VulkanManager::process()
 {
-    while (!glfwWindowShouldClose(window))
+    if (!batch_jobs.empty())
+        run_batch();
+
+    while (batch_jobs.empty() and !should_close())
     {
-        glfwPollEvents();
+        track_frame_time();
         draw_frame();
     }
     
     vkDeviceWaitIdle(logical_device);
+    print_draw_stats();
+    print_occlusion_stats();
+    print_bvh_stats();
+    print_skinning_stats();
+    print_particle_stats();
+    print_lighting_stats();
+    print_shadow_stats();
+    if (dynamic_resolution)
+        resolution.print_stats();
+    print_post_stats();
+    print_resize_stats();
+    frame_pacer.print_stats();
+    transient_geometry.print_stats();
+    update_memory_budget();
+    memory_tracker.print_report();
+    assets.print_stats();
+    resources.print_stats();
+    finish_capture();
+    print_batch_stats();
+
+    if (benchmark)
+        finish_benchmark();
+}
+
+void VulkanManager::run_batch()
+{
+    deque<BatchRequest> requests;
+    uint32_t next_request = 0;
+
+    batch_start = chrono::steady_clock::now();
+
+    for (uint32_t job_index = 0; job_index < batch_jobs.size(); job_index++)
+    {
+        // Jobs ahead of the one being rendered decode on the worker pool meanwhile.
+        for (; next_request < batch_jobs.size() and next_request <= job_index + options.batch_prefetch; next_request++)
+            requests.push_back({
+                assets.request(mesh_asset_type, batch_jobs[next_request].model_path, -static_cast<int32_t>(next_request)),
+                assets.request(texture_asset_type, batch_jobs[next_request].texture_path, -static_cast<int32_t>(next_request)) });
+
+        BatchRequest request = requests.front();
+        requests.pop_front();
+
+        // Decoding finishes on the pool, update() then creates the GPU side on this thread.
+        assets.wait_decoded(request.model);
+        assets.wait_decoded(request.texture);
+        assets.update();
+
+        // The previous use of this frame's slot has to finish before its descriptors change.
+        wait_gpu_work(frame_timeline_points[current_frame]);
+        collect_readback(current_frame);
+        wait_readback_slot();
+
+        if (bind_batch_job(batch_jobs[job_index], request))
+        {
+            track_frame_time();
+            draw_frame();
+        }
+        else
+            batch_failures++;
+
+        assets.release(request.model);
+        assets.release(request.texture);
+    }
+}
+
+bool VulkanManager::bind_batch_job(const BatchJob& job, const BatchRequest& request)
+{
+    VkDescriptorImageInfo image_info{};
+    VkWriteDescriptorSet descriptor_write{};
+    glm::vec3 eye_direction;
+
+    if (!assets.is_ready(request.model) or !assets.is_ready(request.texture))
+    {
+        cout << "Batch job " << job.output_name << " error: assets failed to load!" << endl;
+        return false;
+    }
+
+    const GpuMesh& mesh = gpu_meshes[assets.resolve(request.model)];
+
+    vertex_buffer = resources.buffer(mesh.vertex_buffer);
+    index_buffer = resources.buffer(mesh.index_buffer);
+    materials = mesh.materials;
+    submeshes = mesh.submeshes;
+    material_descriptor_sets = mesh.material_sets;
+    mesh_center = mesh.center;
+    mesh_radius = mesh.radius;
+    scene_mesh_bvh = mesh.bvh;
+    scene_bvh_stale = true;
+    shadow_cascades.invalidate();
+
+    image_info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    image_info.imageView = resources.image_view(gpu_textures[assets.resolve(request.texture)].view);
+    image_info.sampler = texture_sampler;
+
+    descriptor_write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptor_write.dstSet = descriptor_sets[current_frame];
+    descriptor_write.dstBinding = 1;
+    descriptor_write.dstArrayElement = 0;
+    descriptor_write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptor_write.descriptorCount = 1;
+    descriptor_write.pImageInfo = &image_info;
+    vkUpdateDescriptorSets(logical_device, 1, &descriptor_write, 0, nullptr);
+
+    // The model is scaled to a unit bounding sphere so one camera distance fits every size.
+    eye_direction = glm::vec3(cos(glm::radians(job.pitch)) * cos(glm::radians(job.yaw)),
+        cos(glm::radians(job.pitch)) * sin(glm::radians(job.yaw)), sin(glm::radians(job.pitch)));
+    batch_model = glm::scale(glm::mat4(1.0f), glm::vec3(1.0f / mesh.radius)) * glm::translate(glm::mat4(1.0f), -mesh.center);
+    batch_view = glm::lookAt(eye_direction * job.distance, glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+    batch_camera = true;
+    capture_name = job.output_name;
+
+    return true;
+}
+
+void VulkanManager::print_batch_stats()
+{
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - batch_start).count();
+    uint64_t rendered = batch_jobs.size() - batch_failures;
+
+    if (batch_jobs.empty())
+        return;
+
+    cout << "Batch: " << rendered << " of " << batch_jobs.size() << " jobs rendered, " << batch_failures << " failed, "
+        << captures_dropped << " dropped in " << seconds << " s (" << rendered / seconds << " jobs/s)" << endl;
 }
 
 void VulkanManager::cleanup()
 {
+    TRACE_ZONE("cleanup");
+    destroy_retired_swap_chains(true);
+
     vkDestroyImageView(logical_device, depth_image_view, nullptr);
+    for (VkImageView image_view : depth_layer_views)
+        vkDestroyImageView(logical_device, image_view, nullptr);
     vkDestroyImage(logical_device, depth_image, nullptr);
-    vkFreeMemory(logical_device, depth_image_memory, nullptr);
+    free_memory(depth_image_memory);
     remove_swap_chain();
 
     vkDestroySampler(logical_device, texture_sampler, nullptr);
-    vkDestroyImageView(logical_device, texture_image_view, nullptr);
 
-    vkDestroyImage(logical_device, texture_image, nullptr);
-    vkFreeMemory(logical_device, texture_image_memory, nullptr);
+    assets.release(model_asset);
+    assets.release(texture_asset);
+    assets.destroy_all();
+    remove_readback_ring();
+    remove_stream_resources();
+    remove_occlusion_resources();
+    remove_transient_geometry();
+    remove_skinning_resources();
+    remove_particle_resources();
+    remove_light_resources();
+    remove_shadow_resources();
+    remove_upscale_resources();
+    remove_post_resources();
+    resources.destroy_all();
 
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
     {
         vkDestroyBuffer(logical_device, uniform_buffers[i], nullptr);
-        vkFreeMemory(logical_device, uniform_buffers_memory[i], nullptr);
+        free_memory(uniform_buffers_memory[i]);
+        vkDestroyBuffer(logical_device, view_buffers[i], nullptr);
+        free_memory(view_buffers_memory[i]);
+        vkDestroyBuffer(logical_device, shadow_buffers[i], nullptr);
+        free_memory(shadow_buffers_memory[i]);
+        vkDestroyBuffer(logical_device, instance_buffers[i], nullptr);
+        free_memory(instance_buffers_memory[i]);
+        vkDestroyBuffer(logical_device, visible_instance_buffers[i], nullptr);
+        free_memory(visible_instance_buffers_memory[i]);
     }
 
     vkDestroyDescriptorPool(logical_device, descriptor_pool, nullptr);
 
+
     vkDestroyDescriptorSetLayout(logical_device, descriptor_set_layout, nullptr);
+    vkDestroyDescriptorSetLayout(logical_device, material_set_layout, nullptr);
 
-    vkDestroyBuffer(logical_device, index_buffer, nullptr);
-    vkFreeMemory(logical_device, index_buffer_memory, nullptr);
-    vkDestroyBuffer(logical_device, vertex_buffer, nullptr);
-    vkFreeMemory(logical_device, vertex_buffer_memory, nullptr);
     
     for (size_t sync_obj_index = 0; sync_obj_index < MAX_FRAMES_IN_FLIGHT; sync_obj_index++)
     {
         vkDestroySemaphore(logical_device, image_semaphores[sync_obj_index], nullptr);
         vkDestroySemaphore(logical_device, render_semaphores[sync_obj_index], nullptr);
-        vkDestroyFence(logical_device, in_flight_fences[sync_obj_index], nullptr);
     }
+    for (VkFence fence : present_fences)
+        vkDestroyFence(logical_device, fence, nullptr);
+    vkDestroySemaphore(logical_device, graphics_timeline.semaphore, nullptr);
+    if (timestamp_pool != VK_NULL_HANDLE)
+        vkDestroyQueryPool(logical_device, timestamp_pool, nullptr);
     vkDestroyCommandPool(logical_device, command_pool, nullptr);
+    if (async_compute)
+    {
+        vkDestroySemaphore(logical_device, compute_timeline.semaphore, nullptr);
+        vkDestroyCommandPool(logical_device, compute_command_pool, nullptr);
+    }
     vkDestroyPipeline(logical_device, pipeline, nullptr);
+    vkDestroyPipeline(logical_device, transparent_pipeline, nullptr);
     vkDestroyPipelineLayout(logical_device, pipeline_layout, nullptr);
     vkDestroyRenderPass(logical_device, render_pass, nullptr);
-    vkDestroySurfaceKHR(vulkan_instance, surface, nullptr);
+    if (!options.headless)
+        vkDestroySurfaceKHR(vulkan_instance, surface, nullptr);
     vkDestroyInstance(vulkan_instance, nullptr);
 
+    if (options.headless)
+        return;
+
     glfwDestroyWindow(window);
     glfwTerminate();
 }
@@ -1561,9 +7331,24 @@ void VulkanManager::frame_buffer_resize_callback(GLFWwindow* window, int width,
     vulkan->frame_buffer_resized = true;
 }
 
+void VulkanManager::mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    VulkanManager* vulkan = reinterpret_cast<VulkanManager*>(glfwGetWindowUserPointer(window));
+    double cursor_x, cursor_y;
+
+    if (button != GLFW_MOUSE_BUTTON_LEFT or action != GLFW_PRESS)
+        return;
+
+    glfwGetCursorPos(window, &cursor_x, &cursor_y);
+    vulkan->pick(cursor_x, cursor_y);
+}
+
 void VulkanManager::make_window()
 {
-    int window_h = 640, window_w = 800;
+    int window_h = static_cast<int>(options.height), window_w = static_cast<int>(options.width);
+
+    if (options.headless)
+        return;
 
     glfwInit();
 
@@ -1575,10 +7360,51 @@ void VulkanManager::make_window()
 
     glfwSetWindowUserPointer(window, this);
     glfwSetFramebufferSizeCallback(window, frame_buffer_resize_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    VulkanManager vulkan;
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    // Frames streamed to stdout own it, so the log goes to stderr instead.
+    for (int arg_index = 1; arg_index + 1 < argc; arg_index++)
+        if (string(argv[arg_index]) == "--stream" and string(argv[arg_index + 1]) == "-")
+            cout.rdbuf(cerr.rdbuf());
+
+    LaunchOptions options = parse_launch_options(argc, argv);
+
+    if (options.transform_benchmark)
+    {
+        run_transform_benchmark();
+        return 0;
+    }
+
+    if (options.mesh_benchmark)
+    {
+        run_mesh_attribute_benchmark();
+        return 0;
+    }
+
+    if (options.bvh_benchmark)
+    {
+        run_bvh_benchmark();
+        return 0;
+    }
+
+    if (options.trace_benchmark)
+    {
+        run_trace_benchmark();
+        return 0;
+    }
+
+    if (!options.trace_output.empty())
+        trace_start();
+
+    VulkanManager vulkan(options);
+
+    if (!options.trace_output.empty())
+    {
+        trace_stop();
+        trace_write_chrome_json(options.trace_output);
+    }
+    return vulkan.get_exit_code();
+}
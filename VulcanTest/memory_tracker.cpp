@@ -0,0 +1,152 @@
+#include "memory_tracker.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+static const char* category_names[MEMORY_CATEGORY_COUNT] = { "meshes", "textures", "attachments", "staging", "uniforms", "readback", "transient", "particles", "lights", "culling", "skinning" };
+
+static double to_megabytes(VkDeviceSize bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+void MemoryTracker::set_heaps(const VkPhysicalDeviceMemoryProperties& properties)
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    heaps.resize(properties.memoryHeapCount);
+
+    for (uint32_t heap = 0; heap < properties.memoryHeapCount; heap++)
+    {
+        heaps[heap].size = properties.memoryHeaps[heap].size;
+        heaps[heap].budget = properties.memoryHeaps[heap].size;
+        heaps[heap].device_local = (properties.memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
+    }
+}
+
+void MemoryTracker::set_budget_fraction(double fraction)
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    budget_fraction = fraction;
+}
+
+void MemoryTracker::set_pressure_handler(PressureHandler handler)
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    pressure_handler = move(handler);
+}
+
+void MemoryTracker::on_allocate(VkDeviceMemory memory, VkDeviceSize size, uint32_t heap, MemoryCategory category)
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    if (memory == VK_NULL_HANDLE or heap >= heaps.size())
+        return;
+
+    allocations[memory] = { size, heap, category };
+
+    heaps[heap].tracked += size;
+    heaps[heap].peak = max(heaps[heap].peak, heaps[heap].tracked);
+    category_bytes[category] += size;
+    category_peak[category] = max(category_peak[category], category_bytes[category]);
+    total_bytes += size;
+    total_peak = max(total_peak, total_bytes);
+}
+
+void MemoryTracker::on_free(VkDeviceMemory memory)
+{
+    lock_guard<mutex> lock(tracker_mutex);
+    auto allocation = allocations.find(memory);
+
+    if (allocation == allocations.end())
+        return;
+
+    heaps[allocation->second.heap].tracked -= allocation->second.size;
+    category_bytes[allocation->second.category] -= allocation->second.size;
+    total_bytes -= allocation->second.size;
+    allocations.erase(allocation);
+}
+
+void MemoryTracker::update_budget(uint32_t heap, VkDeviceSize budget, VkDeviceSize usage)
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    if (heap >= heaps.size())
+        return;
+
+    heaps[heap].budget = budget;
+    heaps[heap].usage = usage;
+}
+
+void MemoryTracker::check_pressure()
+{
+    vector<pair<uint32_t, VkDeviceSize>> excesses;
+    PressureHandler handler;
+
+    {
+        lock_guard<mutex> lock(tracker_mutex);
+
+        under_pressure = false;
+        for (uint32_t heap = 0; heap < heaps.size(); heap++)
+        {
+            VkDeviceSize usage = max(heaps[heap].usage, heaps[heap].tracked);
+            VkDeviceSize limit = static_cast<VkDeviceSize>(heaps[heap].budget * budget_fraction);
+
+            if (usage <= limit)
+                continue;
+
+            under_pressure = true;
+            excesses.push_back({ heap, usage - limit });
+        }
+        handler = pressure_handler;
+    }
+
+    if (!handler)
+        return;
+    for (const auto& [heap, excess] : excesses)
+        handler(heap, excess);
+}
+
+bool MemoryTracker::streaming_throttled() const
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    return under_pressure;
+}
+
+VkDeviceSize MemoryTracker::category_usage(MemoryCategory category) const
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    return category_bytes[category];
+}
+
+void MemoryTracker::print_report() const
+{
+    lock_guard<mutex> lock(tracker_mutex);
+
+    cout << "Memory: " << allocations.size() << " allocations, " << to_megabytes(total_bytes) << " MB"
+        << " (peak " << to_megabytes(total_peak) << " MB)" << endl;
+
+    for (uint32_t heap = 0; heap < heaps.size(); heap++)
+    {
+        if (heaps[heap].peak == 0 and heaps[heap].usage == 0)
+            continue;
+
+        cout << "  heap " << heap << (heaps[heap].device_local ? " (device local)" : " (host)")
+            << ": tracked " << to_megabytes(heaps[heap].tracked) << " MB"
+            << ", peak " << to_megabytes(heaps[heap].peak) << " MB"
+            << ", process usage " << to_megabytes(heaps[heap].usage) << " MB"
+            << " of budget " << to_megabytes(heaps[heap].budget) << " MB" << endl;
+    }
+
+    for (uint32_t category = 0; category < MEMORY_CATEGORY_COUNT; category++)
+    {
+        cout << "  " << category_names[category] << ": " << to_megabytes(category_bytes[category]) << " MB"
+            << " (peak " << to_megabytes(category_peak[category]) << " MB)" << endl;
+    }
+}
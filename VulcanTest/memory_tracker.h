@@ -0,0 +1,78 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+enum MemoryCategory : uint32_t
+{
+    MEMORY_MESHES = 0,
+    MEMORY_TEXTURES,
+    MEMORY_ATTACHMENTS,
+    MEMORY_STAGING,
+    MEMORY_UNIFORMS,
+    MEMORY_READBACK,
+    MEMORY_TRANSIENT,
+    MEMORY_PARTICLES,
+    MEMORY_LIGHTS,
+    MEMORY_CULLING,
+    MEMORY_SKINNING,
+    MEMORY_CATEGORY_COUNT
+};
+
+struct HeapUsage
+{
+    VkDeviceSize size = 0;
+    VkDeviceSize budget = 0;
+    VkDeviceSize usage = 0;
+    VkDeviceSize tracked = 0;
+    VkDeviceSize peak = 0;
+    bool device_local = false;
+};
+
+// Buffers are created on asset worker threads as well as the main thread, so every call takes the lock.
+// The pressure handler runs outside it and may free memory.
+class MemoryTracker
+{
+public:
+    using PressureHandler = std::function<void(uint32_t heap, VkDeviceSize excess)>;
+
+    void set_heaps(const VkPhysicalDeviceMemoryProperties& properties);
+    void set_budget_fraction(double fraction);
+    void set_pressure_handler(PressureHandler handler);
+
+    void on_allocate(VkDeviceMemory memory, VkDeviceSize size, uint32_t heap, MemoryCategory category);
+    void on_free(VkDeviceMemory memory);
+
+    // budget/usage come from VK_EXT_memory_budget; without it the heap size and tracked bytes are used.
+    void update_budget(uint32_t heap, VkDeviceSize budget, VkDeviceSize usage);
+    void check_pressure();
+
+    bool streaming_throttled() const;
+    VkDeviceSize category_usage(MemoryCategory category) const;
+    void print_report() const;
+
+private:
+    struct Allocation
+    {
+        VkDeviceSize size;
+        uint32_t heap;
+        MemoryCategory category;
+    };
+
+    mutable std::mutex tracker_mutex;
+    std::unordered_map<VkDeviceMemory, Allocation> allocations;
+    std::vector<HeapUsage> heaps;
+    std::array<VkDeviceSize, MEMORY_CATEGORY_COUNT> category_bytes{};
+    std::array<VkDeviceSize, MEMORY_CATEGORY_COUNT> category_peak{};
+    VkDeviceSize total_bytes = 0;
+    VkDeviceSize total_peak = 0;
+    double budget_fraction = 0.9;
+    bool under_pressure = false;
+    PressureHandler pressure_handler;
+};
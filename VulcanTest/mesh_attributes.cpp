@@ -0,0 +1,258 @@
+#include "mesh_attributes.h"
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+struct FaceFrame
+{
+    // Cross product of two edges, twice the face area long.
+    glm::vec3 area_normal;
+    // Zero for degenerate faces.
+    glm::vec3 normal;
+    // From the texture mapping, zero when the mapping is degenerate.
+    glm::vec3 tangent;
+    bool orientation_preserving;
+};
+
+static uint32_t hash_position(const glm::vec3& position)
+{
+    // Adding zero turns -0 into +0, which compare equal and must hash the same.
+    float coordinates[3] = { position.x + 0.0f, position.y + 0.0f, position.z + 0.0f };
+    uint32_t bits[3];
+    uint32_t hash;
+
+    memcpy(bits, coordinates, sizeof(bits));
+    hash = bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+static float corner_angle(const glm::vec3& corner, const glm::vec3& next, const glm::vec3& previous)
+{
+    glm::vec3 to_next = next - corner;
+    glm::vec3 to_previous = previous - corner;
+    float lengths = glm::length(to_next) * glm::length(to_previous);
+
+    if (lengths <= 0.0f)
+        return 0.0f;
+    return acos(glm::clamp(glm::dot(to_next, to_previous) / lengths, -1.0f, 1.0f));
+}
+
+static FaceFrame face_frame(const glm::vec3* positions, const glm::vec2* tex_coords)
+{
+    FaceFrame face{};
+    glm::vec3 edge_1 = positions[1] - positions[0];
+    glm::vec3 edge_2 = positions[2] - positions[0];
+    glm::vec2 delta_1 = tex_coords[1] - tex_coords[0];
+    glm::vec2 delta_2 = tex_coords[2] - tex_coords[0];
+    float area = delta_1.x * delta_2.y - delta_2.x * delta_1.y;
+    float length;
+
+    face.area_normal = glm::cross(edge_1, edge_2);
+    length = glm::length(face.area_normal);
+    face.normal = length > 0.0f ? face.area_normal / length : glm::vec3(0.0f);
+
+    // The sign of the mapped area decides the handedness, as in MikkTSpace.
+    face.orientation_preserving = area > 0.0f;
+    if (abs(area) > 1e-12f)
+        face.tangent = (edge_1 * delta_2.y - edge_2 * delta_1.y) / area;
+    return face;
+}
+
+static glm::vec3 any_perpendicular(const glm::vec3& normal)
+{
+    glm::vec3 axis = abs(normal.x) < 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+
+    return glm::normalize(glm::cross(axis, normal));
+}
+
+MeshAttributeStats generate_mesh_attributes(MeshStreams& mesh, const MeshAttributeSettings& settings, WorkerPool& workers)
+{
+    TRACE_ZONE("mesh_attributes");
+    MeshAttributeStats stats;
+    uint32_t triangle_count = static_cast<uint32_t>(mesh.positions.size() / 3);
+    uint32_t corner_count = 3 * triangle_count;
+    uint32_t table_size = 1;
+    float crease_cosine = cos(glm::radians(settings.crease_angle));
+    atomic<uint32_t> generated_normals{ 0 };
+    atomic<uint32_t> fallback_tangents{ 0 };
+
+    stats.triangles = triangle_count;
+    mesh.tex_coords.resize(corner_count, glm::vec2(0.0f));
+    mesh.normals.resize(corner_count, glm::vec3(0.0f));
+    mesh.tangents.resize(corner_count, glm::vec4(0.0f));
+    mesh.missing_normals.resize(triangle_count, 1);
+    if (triangle_count == 0)
+        return stats;
+
+    while (table_size < 2 * corner_count)
+        table_size *= 2;
+
+    // Open addressing table of first corner + 1 per distinct position, 0 when free.
+    vector<atomic<uint32_t>> position_table(table_size);
+    // Corner -> corner that stands for all corners at the same position.
+    vector<uint32_t> welded(corner_count);
+    vector<atomic<uint32_t>> shared_counts(corner_count);
+    vector<uint32_t> shared_offsets(corner_count + 1);
+    vector<uint32_t> shared_corners(corner_count);
+    vector<FaceFrame> faces(triangle_count);
+    vector<float> angles(corner_count);
+
+    workers.parallel_for(triangle_count, settings.grain, [&](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t triangle = begin; triangle < end; triangle++)
+            {
+                const glm::vec3* positions = &mesh.positions[3 * triangle];
+
+                for (uint32_t corner = 3 * triangle; corner < 3 * triangle + 3; corner++)
+                {
+                    const glm::vec3& position = mesh.positions[corner];
+                    uint32_t slot = hash_position(position) & (table_size - 1);
+
+                    while (true)
+                    {
+                        uint32_t first = 0;
+
+                        if (position_table[slot].compare_exchange_strong(first, corner + 1))
+                        {
+                            welded[corner] = corner;
+                            break;
+                        }
+                        if (mesh.positions[first - 1] == position)
+                        {
+                            welded[corner] = first - 1;
+                            break;
+                        }
+                        slot = (slot + 1) & (table_size - 1);
+                    }
+                    shared_counts[welded[corner]].fetch_add(1, memory_order_relaxed);
+                }
+
+                faces[triangle] = face_frame(positions, &mesh.tex_coords[3 * triangle]);
+                for (uint32_t corner = 0; corner < 3; corner++)
+                    angles[3 * triangle + corner] = corner_angle(positions[corner], positions[(corner + 1) % 3], positions[(corner + 2) % 3]);
+            }
+        });
+
+    // Corners around each position, as one list per welded corner. The counters double as fill cursors.
+    for (uint32_t corner = 0; corner < corner_count; corner++)
+    {
+        uint32_t count = shared_counts[corner].exchange(0, memory_order_relaxed);
+
+        shared_offsets[corner + 1] = shared_offsets[corner] + count;
+        stats.welded_positions += count > 0 ? 1 : 0;
+    }
+
+    workers.parallel_for(triangle_count, settings.grain, [&](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t corner = 3 * begin; corner < 3 * end; corner++)
+            {
+                uint32_t shared = welded[corner];
+
+                shared_corners[shared_offsets[shared] + shared_counts[shared].fetch_add(1, memory_order_relaxed)] = corner;
+            }
+        });
+
+    // The fill order depends on thread timing; sorted lists make the sums below reproducible.
+    workers.parallel_for(triangle_count, settings.grain, [&](uint32_t begin, uint32_t end)
+        {
+            for (uint32_t corner = 3 * begin; corner < 3 * end; corner++)
+                if (welded[corner] == corner)
+                    sort(shared_corners.begin() + shared_offsets[corner], shared_corners.begin() + shared_offsets[corner + 1]);
+        });
+
+    workers.parallel_for(triangle_count, settings.grain, [&](uint32_t begin, uint32_t end)
+        {
+            uint32_t generated = 0;
+
+            for (uint32_t triangle = begin; triangle < end; triangle++)
+            {
+                const FaceFrame& face = faces[triangle];
+
+                if (!mesh.missing_normals[triangle])
+                    continue;
+
+                for (uint32_t corner = 3 * triangle; corner < 3 * triangle + 3; corner++)
+                {
+                    uint32_t shared = welded[corner];
+                    glm::vec3 sum(0.0f);
+                    float length;
+
+                    // Faces that brought their own normals stay out of the smoothing.
+                    for (uint32_t entry = shared_offsets[shared]; entry < shared_offsets[shared + 1]; entry++)
+                    {
+                        uint32_t other = shared_corners[entry];
+                        const FaceFrame& other_face = faces[other / 3];
+
+                        if (!mesh.missing_normals[other / 3] or glm::dot(other_face.normal, face.normal) < crease_cosine)
+                            continue;
+                        sum += settings.weighting == NORMAL_WEIGHT_AREA ? other_face.area_normal : other_face.normal * angles[other];
+                    }
+
+                    length = glm::length(sum);
+                    mesh.normals[corner] = length > 0.0f ? sum / length : glm::vec3(0.0f, 0.0f, 1.0f);
+                    generated++;
+                }
+            }
+            generated_normals.fetch_add(generated, memory_order_relaxed);
+        });
+
+    workers.parallel_for(triangle_count, settings.grain, [&](uint32_t begin, uint32_t end)
+        {
+            uint32_t fallbacks = 0;
+
+            for (uint32_t triangle = begin; triangle < end; triangle++)
+            {
+                const FaceFrame& face = faces[triangle];
+
+                for (uint32_t corner = 3 * triangle; corner < 3 * triangle + 3; corner++)
+                {
+                    uint32_t shared = welded[corner];
+                    const glm::vec3& normal = mesh.normals[corner];
+                    glm::vec3 sum(0.0f);
+                    float length;
+
+                    // Texture seams, hard edges and mirrored mappings split the tangent space.
+                    for (uint32_t entry = shared_offsets[shared]; entry < shared_offsets[shared + 1]; entry++)
+                    {
+                        uint32_t other = shared_corners[entry];
+                        const FaceFrame& other_face = faces[other / 3];
+                        glm::vec3 projected;
+                        float projected_length;
+
+                        if (other_face.orientation_preserving != face.orientation_preserving
+                            or !(mesh.tex_coords[other] == mesh.tex_coords[corner]) or glm::dot(mesh.normals[other], normal) < 0.9999f)
+                            continue;
+
+                        projected = other_face.tangent - normal * glm::dot(normal, other_face.tangent);
+                        projected_length = glm::length(projected);
+                        if (projected_length > 0.0f)
+                            sum += projected * (angles[other] / projected_length);
+                    }
+
+                    length = glm::length(sum);
+                    if (length > 1e-6f)
+                        sum /= length;
+                    else
+                    {
+                        sum = any_perpendicular(normal);
+                        fallbacks++;
+                    }
+                    mesh.tangents[corner] = glm::vec4(sum, face.orientation_preserving ? 1.0f : -1.0f);
+                }
+            }
+            fallback_tangents.fetch_add(fallbacks, memory_order_relaxed);
+        });
+
+    stats.generated_normals = generated_normals;
+    stats.fallback_tangents = fallback_tangents;
+    return stats;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+enum NormalWeighting : uint32_t
+{
+    // Each face counts with its area, big faces dominate.
+    NORMAL_WEIGHT_AREA,
+    // Each face counts with its angle at the vertex, independent of tessellation.
+    NORMAL_WEIGHT_ANGLE
+};
+
+// Unwelded triangle list as decode_model builds it: corner 3 * t + k belongs to triangle t
+// and every corner is its own vertex.
+struct MeshStreams
+{
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec2> tex_coords;
+    std::vector<glm::vec3> normals;
+    // xyz tangent, w bitangent sign: bitangent = w * cross(normal, tangent).
+    std::vector<glm::vec4> tangents;
+    // One flag per triangle whose corners came without normals. Left empty, every triangle gets new normals.
+    std::vector<uint8_t> missing_normals;
+};
+
+struct MeshAttributeSettings
+{
+    // Faces meeting at a larger angle than this keep separate normals.
+    float crease_angle = 60.0f;
+    NormalWeighting weighting = NORMAL_WEIGHT_ANGLE;
+    // Triangles per parallel_for chunk.
+    uint32_t grain = 4096;
+};
+
+struct MeshAttributeStats
+{
+    uint32_t triangles = 0;
+    uint32_t welded_positions = 0;
+    uint32_t generated_normals = 0;
+    // Corners whose faces had no usable texture mapping and got an arbitrary tangent.
+    uint32_t fallback_tangents = 0;
+};
+
+// Smooths the normals of flagged triangles over the faces that share a position and lie within
+// the crease angle, then builds MikkTSpace style tangents for every corner: face tangents from the
+// texture mapping, projected into each corner's normal plane and angle weighted over the faces that
+// share its position, normal, texture coordinate and handedness.
+// Runs over triangle ranges on the pool; the shared-position lists are built with atomic counters
+// and sorted, so the sums come out the same whatever the thread timing.
+MeshAttributeStats generate_mesh_attributes(MeshStreams& mesh, const MeshAttributeSettings& settings, WorkerPool& workers);
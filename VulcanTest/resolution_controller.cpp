@@ -0,0 +1,66 @@
+#include "resolution_controller.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+
+void ResolutionController::init(double target_ms, float min_scale, float max_scale)
+{
+    this->target_ms = target_ms;
+    this->min_scale = min_scale;
+    this->max_scale = max_scale;
+    current_scale = max_scale;
+    lowest_scale = max_scale;
+}
+
+float ResolutionController::update(double gpu_ms, float measured_scale)
+{
+    double cost;
+    float fitted_scale;
+
+    if (gpu_ms < 0.0 or measured_scale <= 0.0f)
+        return current_scale;
+
+    measured_frames++;
+    total_scale += measured_scale;
+    if (gpu_ms > target_ms)
+        frames_over_budget++;
+
+    cost = gpu_ms / (static_cast<double>(measured_scale) * measured_scale);
+    if (cost > area_cost_ms)
+        area_cost_ms = cost;
+    else
+        area_cost_ms += (cost - area_cost_ms) * COST_DECAY;
+
+    fitted_scale = static_cast<float>(sqrt(target_ms * HEADROOM / area_cost_ms));
+    fitted_scale = clamp(floor(fitted_scale / SCALE_STEP) * SCALE_STEP, min_scale, max_scale);
+
+    if (fitted_scale != current_scale)
+    {
+        current_scale = fitted_scale;
+        scale_changes++;
+        lowest_scale = min(lowest_scale, current_scale);
+    }
+
+    return current_scale;
+}
+
+float ResolutionController::scale() const
+{
+    return current_scale;
+}
+
+void ResolutionController::print_stats() const
+{
+    if (measured_frames == 0)
+    {
+        cout << "Dynamic resolution: no GPU times measured, scale stayed at " << current_scale << endl;
+        return;
+    }
+
+    cout << "Dynamic resolution: target " << target_ms << " ms, scale avg " << total_scale / measured_frames
+        << " (lowest " << lowest_scale << ", now " << current_scale << "), " << scale_changes << " changes, "
+        << frames_over_budget << " of " << measured_frames << " frames over budget" << endl;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+// Picks the render scale (fraction of the output extent per axis) from measured GPU frame times.
+// GPU time is modelled as proportional to the rendered area, so the cost per unit area is tracked
+// and the scale that fits the budget follows from it. Rising cost is taken at once, so a spike is
+// answered on the next measurement; falling cost is smoothed, so the scale creeps back up.
+class ResolutionController
+{
+public:
+    void init(double target_ms, float min_scale, float max_scale);
+    // gpu_ms is a finished frame's GPU time and scale the one it was rendered at. Negative times are ignored.
+    float update(double gpu_ms, float measured_scale);
+
+    float scale() const;
+    void print_stats() const;
+
+private:
+    // Scales are kept on a grid so the controller does not change the viewport by a pixel every frame.
+    static constexpr float SCALE_STEP = 1.0f / 32.0f;
+    // The budget the scale aims for, as a share of the target, leaving room for noise.
+    static constexpr double HEADROOM = 0.9;
+    static constexpr double COST_DECAY = 0.1;
+
+    double target_ms = 0.0;
+    float min_scale = 0.5f;
+    float max_scale = 1.0f;
+    float current_scale = 1.0f;
+    double area_cost_ms = 0.0;
+
+    uint64_t measured_frames = 0;
+    uint64_t frames_over_budget = 0;
+    uint64_t scale_changes = 0;
+    double total_scale = 0.0;
+    float lowest_scale = 1.0f;
+};
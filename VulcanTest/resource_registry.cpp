@@ -0,0 +1,190 @@
+#include "resource_registry.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+void ResourceRegistry::init(VkDevice device, MemoryFree free_memory)
+{
+    this->device = device;
+    this->free_memory = move(free_memory);
+}
+
+ResourceHandle ResourceRegistry::add_buffer(VkBuffer buffer, VkDeviceMemory memory)
+{
+    Object object;
+
+    object.kind = RESOURCE_BUFFER;
+    object.buffer = buffer;
+    object.memory = memory;
+    return add(object);
+}
+
+ResourceHandle ResourceRegistry::add_image(VkImage image, VkDeviceMemory memory)
+{
+    Object object;
+
+    object.kind = RESOURCE_IMAGE;
+    object.image = image;
+    object.memory = memory;
+    return add(object);
+}
+
+ResourceHandle ResourceRegistry::add_image_view(VkImageView image_view)
+{
+    Object object;
+
+    object.kind = RESOURCE_IMAGE_VIEW;
+    object.image_view = image_view;
+    return add(object);
+}
+
+ResourceHandle ResourceRegistry::add_descriptor_pool(VkDescriptorPool descriptor_pool)
+{
+    Object object;
+
+    object.kind = RESOURCE_DESCRIPTOR_POOL;
+    object.descriptor_pool = descriptor_pool;
+    return add(object);
+}
+
+bool ResourceRegistry::is_alive(ResourceHandle handle) const
+{
+    return handle.index < slots.size() and slots[handle.index].generation == handle.generation
+        and slots[handle.index].object.kind != RESOURCE_NONE;
+}
+
+VkBuffer ResourceRegistry::buffer(ResourceHandle handle) const
+{
+    const Object* object = resolve(handle, RESOURCE_BUFFER);
+    return object ? object->buffer : VK_NULL_HANDLE;
+}
+
+VkImage ResourceRegistry::image(ResourceHandle handle) const
+{
+    const Object* object = resolve(handle, RESOURCE_IMAGE);
+    return object ? object->image : VK_NULL_HANDLE;
+}
+
+VkImageView ResourceRegistry::image_view(ResourceHandle handle) const
+{
+    const Object* object = resolve(handle, RESOURCE_IMAGE_VIEW);
+    return object ? object->image_view : VK_NULL_HANDLE;
+}
+
+VkDescriptorPool ResourceRegistry::descriptor_pool(ResourceHandle handle) const
+{
+    const Object* object = resolve(handle, RESOURCE_DESCRIPTOR_POOL);
+    return object ? object->descriptor_pool : VK_NULL_HANDLE;
+}
+
+void ResourceRegistry::release(ResourceHandle handle, uint64_t retire_after)
+{
+    if (!is_alive(handle))
+        return;
+
+    Slot& slot = slots[handle.index];
+
+    pending.push_back({ slot.object, retire_after });
+    peak_pending = max(peak_pending, pending.size());
+    released++;
+
+    slot.object = Object{};
+    slot.generation++;
+    free_slots.push_back(handle.index);
+}
+
+void ResourceRegistry::collect(uint64_t completed_value)
+{
+    size_t kept = 0;
+
+    for (PendingDestroy& entry : pending)
+    {
+        if (entry.retire_after > completed_value)
+        {
+            pending[kept++] = entry;
+            continue;
+        }
+        destroy(entry.object);
+    }
+    pending.resize(kept);
+}
+
+void ResourceRegistry::destroy_all()
+{
+    for (const PendingDestroy& entry : pending)
+        destroy(entry.object);
+    pending.clear();
+
+    for (Slot& slot : slots)
+    {
+        if (slot.object.kind == RESOURCE_NONE)
+            continue;
+        destroy(slot.object);
+        slot.object = Object{};
+        slot.generation++;
+    }
+    slots.clear();
+    free_slots.clear();
+}
+
+void ResourceRegistry::print_stats() const
+{
+    cout << "Resources: " << created << " created, " << released << " released, " << destroyed << " destroyed, "
+        << pending.size() << " pending (peak " << peak_pending << ")" << endl;
+}
+
+ResourceHandle ResourceRegistry::add(const Object& object)
+{
+    ResourceHandle handle;
+
+    if (free_slots.empty())
+    {
+        handle.index = static_cast<uint32_t>(slots.size());
+        slots.emplace_back();
+    }
+    else
+    {
+        handle.index = free_slots.back();
+        free_slots.pop_back();
+    }
+
+    slots[handle.index].object = object;
+    handle.generation = slots[handle.index].generation;
+    created++;
+
+    return handle;
+}
+
+const ResourceRegistry::Object* ResourceRegistry::resolve(ResourceHandle handle, ResourceKind kind) const
+{
+    if (!is_alive(handle) or slots[handle.index].object.kind != kind)
+        return nullptr;
+    return &slots[handle.index].object;
+}
+
+void ResourceRegistry::destroy(const Object& object)
+{
+    switch (object.kind)
+    {
+    case RESOURCE_BUFFER:
+        vkDestroyBuffer(device, object.buffer, nullptr);
+        break;
+    case RESOURCE_IMAGE:
+        vkDestroyImage(device, object.image, nullptr);
+        break;
+    case RESOURCE_IMAGE_VIEW:
+        vkDestroyImageView(device, object.image_view, nullptr);
+        break;
+    case RESOURCE_DESCRIPTOR_POOL:
+        vkDestroyDescriptorPool(device, object.descriptor_pool, nullptr);
+        break;
+    default:
+        return;
+    }
+
+    if (object.memory != VK_NULL_HANDLE)
+        free_memory(object.memory);
+    destroyed++;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+enum ResourceKind : uint32_t
+{
+    RESOURCE_NONE = 0,
+    RESOURCE_BUFFER,
+    RESOURCE_IMAGE,
+    RESOURCE_IMAGE_VIEW,
+    RESOURCE_DESCRIPTOR_POOL
+};
+
+// Slot index plus the generation the slot had when the handle was issued.
+// A released handle stops resolving at once, even after its slot is reused.
+struct ResourceHandle
+{
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+};
+
+// Owns the buffers, images, views and descriptor pools of loaded assets behind generational handles.
+// Samplers and pipelines live for the whole run and stay with their owners. release() only retires a handle:
+// the objects are destroyed by collect() once the graphics timeline has passed the
+// value that was last submitted when they were released, so unloads never wait on the GPU.
+class ResourceRegistry
+{
+public:
+    using MemoryFree = std::function<void(VkDeviceMemory memory)>;
+
+    void init(VkDevice device, MemoryFree free_memory);
+
+    ResourceHandle add_buffer(VkBuffer buffer, VkDeviceMemory memory);
+    ResourceHandle add_image(VkImage image, VkDeviceMemory memory);
+    ResourceHandle add_image_view(VkImageView image_view);
+    ResourceHandle add_descriptor_pool(VkDescriptorPool descriptor_pool);
+
+    // Stale or null handles resolve to VK_NULL_HANDLE.
+    bool is_alive(ResourceHandle handle) const;
+    VkBuffer buffer(ResourceHandle handle) const;
+    VkImage image(ResourceHandle handle) const;
+    VkImageView image_view(ResourceHandle handle) const;
+    VkDescriptorPool descriptor_pool(ResourceHandle handle) const;
+
+    void release(ResourceHandle handle, uint64_t retire_after);
+    void collect(uint64_t completed_value);
+    // Destroys live and pending objects alike, the device must be idle.
+    void destroy_all();
+
+    void print_stats() const;
+
+private:
+    struct Object
+    {
+        ResourceKind kind = RESOURCE_NONE;
+        VkBuffer buffer = VK_NULL_HANDLE;
+        VkImage image = VK_NULL_HANDLE;
+        VkImageView image_view = VK_NULL_HANDLE;
+        VkDescriptorPool descriptor_pool = VK_NULL_HANDLE;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+    };
+
+    struct Slot
+    {
+        Object object;
+        uint32_t generation = 0;
+    };
+
+    struct PendingDestroy
+    {
+        Object object;
+        uint64_t retire_after = 0;
+    };
+
+    VkDevice device = VK_NULL_HANDLE;
+    MemoryFree free_memory;
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
+    std::vector<PendingDestroy> pending;
+
+    uint64_t created = 0;
+    uint64_t released = 0;
+    uint64_t destroyed = 0;
+    size_t peak_pending = 0;
+
+    ResourceHandle add(const Object& object);
+    const Object* resolve(ResourceHandle handle, ResourceKind kind) const;
+    void destroy(const Object& object);
+};
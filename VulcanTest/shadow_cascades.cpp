@@ -0,0 +1,156 @@
+#include "shadow_cascades.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+using namespace std;
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ull;
+static const uint64_t FNV_PRIME = 1099511628211ull;
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+
+    for (size_t index = 0; index < size; index++)
+        hash = (hash ^ bytes[index]) * FNV_PRIME;
+    return hash;
+}
+
+void ShadowCascades::init(uint32_t cascade_count, uint32_t map_size, const glm::vec3& light_direction)
+{
+    glm::vec3 up = abs(light_direction.z) > 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+
+    cascades.assign(min(cascade_count, MAX_SHADOW_CASCADES), ShadowCascade{});
+    this->map_size = map_size;
+    this->light_direction = glm::normalize(light_direction);
+    // One fixed light basis through the origin: boxes only ever translate in it, never rotate.
+    light_view = glm::lookAt(glm::vec3(0.0f), this->light_direction, up);
+}
+
+void ShadowCascades::update(const glm::mat4& view, float fov_y, float aspect, float near_plane, float far_plane,
+    const vector<glm::mat4>& casters, const glm::vec3& local_center, float local_radius, bool force)
+{
+    glm::mat4 inverse_view = glm::inverse(view);
+    vector<glm::vec4> spheres(casters.size());
+    float caster_reach = 0.0f;
+    float slice_near = near_plane;
+
+    // Light-space caster spheres. Everything that can cast lies within caster_reach of the origin,
+    // rounded up to whole units so small motions do not move the depth range.
+    for (size_t caster = 0; caster < casters.size(); caster++)
+    {
+        const glm::mat4& world = casters[caster];
+        float scale = max(glm::length(glm::vec3(world[0])), max(glm::length(glm::vec3(world[1])), glm::length(glm::vec3(world[2]))));
+        glm::vec3 center = glm::vec3(world * glm::vec4(local_center, 1.0f));
+
+        spheres[caster] = glm::vec4(glm::vec3(light_view * glm::vec4(center, 1.0f)), local_radius * scale);
+        caster_reach = max(caster_reach, glm::length(center) + local_radius * scale);
+    }
+    caster_reach = ceil(caster_reach);
+
+    frame_stats.frames++;
+    for (uint32_t index = 0; index < cascades.size(); index++)
+    {
+        ShadowCascade& cascade = cascades[index];
+        float slice_far = near_plane * pow(far_plane / near_plane, static_cast<float>(index + 1) / cascades.size());
+        uint64_t signature;
+
+        fit(cascade, inverse_view, tan(fov_y * 0.5f), aspect, slice_near, slice_far, caster_reach);
+        slice_near = slice_far;
+
+        signature = hash_bytes(FNV_OFFSET, &cascade.view_proj, sizeof(cascade.view_proj));
+        cascade.casters = 0;
+        for (uint32_t caster = 0; caster < spheres.size(); caster++)
+        {
+            const glm::vec4& sphere = spheres[caster];
+            float reach = cascade.half_extent + sphere.w;
+
+            // Casters toward the light from the box still throw shadows into it; ones past its far end do not.
+            if (abs(sphere.x - cascade.center.x) > reach or abs(sphere.y - cascade.center.y) > reach
+                or sphere.z + sphere.w < cascade.center.z - cascade.half_extent)
+                continue;
+
+            signature = hash_bytes(signature, &caster, sizeof(caster));
+            signature = hash_bytes(signature, &casters[caster], sizeof(casters[caster]));
+            cascade.casters++;
+        }
+
+        cascade.dirty = force or !cascade.rendered or signature != cascade.signature;
+        cascade.signature = signature;
+        cascade.rendered = true;
+
+        if (cascade.dirty)
+            frame_stats.rendered++;
+        else
+            frame_stats.cached++;
+    }
+}
+
+void ShadowCascades::fit(ShadowCascade& cascade, const glm::mat4& inverse_view, float tan_half_fov, float aspect,
+    float slice_near, float slice_far, float caster_reach)
+{
+    glm::vec3 corners[8];
+    glm::vec3 center(0.0f);
+    float radius = 0.0f;
+    float half_extent;
+    float near_distance;
+
+    for (uint32_t corner = 0; corner < 8; corner++)
+    {
+        float depth = corner < 4 ? slice_near : slice_far;
+        glm::vec4 view_corner((corner & 1 ? 1.0f : -1.0f) * depth * tan_half_fov * aspect,
+            (corner & 2 ? 1.0f : -1.0f) * depth * tan_half_fov, -depth, 1.0f);
+
+        corners[corner] = glm::vec3(light_view * inverse_view * view_corner);
+        center += corners[corner] / 8.0f;
+    }
+    for (const glm::vec3& corner : corners)
+        radius = max(radius, glm::length(corner - center));
+
+    // The slice's sphere has the same size in every orientation; the box around it gets some slack
+    // so it can stay put while the camera moves, and its size is quantized so it never changes by a hair.
+    half_extent = ceil(radius * 1.25f * 16.0f) / 16.0f;
+    if (half_extent != cascade.half_extent or abs(center.x - cascade.center.x) + radius > half_extent
+        or abs(center.y - cascade.center.y) + radius > half_extent or abs(center.z - cascade.center.z) + radius > half_extent)
+    {
+        cascade.half_extent = half_extent;
+        cascade.texel_size = 2.0f * half_extent / map_size;
+        cascade.center = glm::floor(center / cascade.texel_size) * cascade.texel_size;
+    }
+
+    // The light looks down -z: the box's far end is its lowest z, the near plane reaches back to every caster.
+    near_distance = -max(cascade.center.z + cascade.half_extent, caster_reach);
+    cascade.split_depth = slice_far;
+    cascade.view_proj = glm::ortho(cascade.center.x - cascade.half_extent, cascade.center.x + cascade.half_extent,
+        cascade.center.y - cascade.half_extent, cascade.center.y + cascade.half_extent,
+        near_distance, -(cascade.center.z - cascade.half_extent)) * light_view;
+}
+
+void ShadowCascades::invalidate()
+{
+    for (ShadowCascade& cascade : cascades)
+        cascade.rendered = false;
+}
+
+uint32_t ShadowCascades::count() const
+{
+    return static_cast<uint32_t>(cascades.size());
+}
+
+const ShadowCascade& ShadowCascades::cascade(uint32_t index) const
+{
+    return cascades[index];
+}
+
+const glm::vec3& ShadowCascades::direction() const
+{
+    return light_direction;
+}
+
+const ShadowStats& ShadowCascades::stats() const
+{
+    return frame_stats;
+}
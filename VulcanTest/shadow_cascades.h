@@ -0,0 +1,59 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <cstdint>
+#include <vector>
+
+const uint32_t MAX_SHADOW_CASCADES = 4;
+
+struct ShadowCascade
+{
+    glm::mat4 view_proj = glm::mat4(1.0f);
+    // Light-space box center, kept on whole texels so the shadow raster does not crawl as the camera moves.
+    glm::vec3 center = glm::vec3(0.0f);
+    float half_extent = 0.0f;
+    float split_depth = 0.0f;
+    float texel_size = 0.0f;
+    // Hash of the cascade matrix and of every caster inside the box, as last rendered.
+    uint64_t signature = 0;
+    uint32_t casters = 0;
+    bool rendered = false;
+    bool dirty = true;
+};
+
+struct ShadowStats
+{
+    uint64_t frames = 0;
+    uint64_t rendered = 0;
+    uint64_t cached = 0;
+};
+
+// Directional light cascades over logarithmic slices of the view frustum. A cascade keeps its box while
+// its slice stays inside, and is only marked dirty when the box moved or a caster inside it changed.
+class ShadowCascades
+{
+public:
+    void init(uint32_t cascade_count, uint32_t map_size, const glm::vec3& light_direction);
+    // casters are instance world matrices; every instance shares the model-space bounding sphere.
+    // force marks every cascade dirty, for geometry that changes without its transform changing.
+    void update(const glm::mat4& view, float fov_y, float aspect, float near_plane, float far_plane,
+        const std::vector<glm::mat4>& casters, const glm::vec3& local_center, float local_radius, bool force);
+    // Drops every cached cascade, for when the scene's geometry was replaced.
+    void invalidate();
+
+    uint32_t count() const;
+    const ShadowCascade& cascade(uint32_t index) const;
+    const glm::vec3& direction() const;
+    const ShadowStats& stats() const;
+
+private:
+    std::vector<ShadowCascade> cascades;
+    uint32_t map_size = 0;
+    glm::vec3 light_direction = glm::vec3(0.0f, 0.0f, -1.0f);
+    glm::mat4 light_view = glm::mat4(1.0f);
+    ShadowStats frame_stats;
+
+    void fit(ShadowCascade& cascade, const glm::mat4& inverse_view, float tan_half_fov, float aspect,
+        float slice_near, float slice_far, float caster_reach);
+};
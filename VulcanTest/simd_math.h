@@ -0,0 +1,117 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Four-wide float helpers over SSE or NEON, with a scalar fallback.
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SIMD_SSE
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+#if defined(SIMD_SSE)
+typedef __m128 float4;
+
+static inline float4 load4(const float* from) { return _mm_loadu_ps(from); }
+static inline void store4(float* to, float4 value) { _mm_storeu_ps(to, value); }
+static inline float4 splat4(float value) { return _mm_set1_ps(value); }
+static inline float4 add4(float4 a, float4 b) { return _mm_add_ps(a, b); }
+static inline float4 sub4(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+static inline float4 mul4(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+static inline float4 min4(float4 a, float4 b) { return _mm_min_ps(a, b); }
+static inline float4 max4(float4 a, float4 b) { return _mm_max_ps(a, b); }
+// Bit i is set where lane i of a is less than lane i of b.
+static inline int less_mask4(float4 a, float4 b) { return _mm_movemask_ps(_mm_cmplt_ps(a, b)); }
+static inline void transpose4(float4& a, float4& b, float4& c, float4& d) { _MM_TRANSPOSE4_PS(a, b, c, d); }
+#elif defined(SIMD_NEON)
+typedef float32x4_t float4;
+
+static inline float4 load4(const float* from) { return vld1q_f32(from); }
+static inline void store4(float* to, float4 value) { vst1q_f32(to, value); }
+static inline float4 splat4(float value) { return vdupq_n_f32(value); }
+static inline float4 add4(float4 a, float4 b) { return vaddq_f32(a, b); }
+static inline float4 sub4(float4 a, float4 b) { return vsubq_f32(a, b); }
+static inline float4 mul4(float4 a, float4 b) { return vmulq_f32(a, b); }
+static inline float4 min4(float4 a, float4 b) { return vminq_f32(a, b); }
+static inline float4 max4(float4 a, float4 b) { return vmaxq_f32(a, b); }
+
+static inline int less_mask4(float4 a, float4 b)
+{
+    uint32x4_t less = vcltq_f32(a, b);
+
+    return static_cast<int>((vgetq_lane_u32(less, 0) & 1) | (vgetq_lane_u32(less, 1) & 2) | (vgetq_lane_u32(less, 2) & 4) | (vgetq_lane_u32(less, 3) & 8));
+}
+
+static inline void transpose4(float4& a, float4& b, float4& c, float4& d)
+{
+    float32x4x2_t ab = vtrnq_f32(a, b);
+    float32x4x2_t cd = vtrnq_f32(c, d);
+
+    a = vcombine_f32(vget_low_f32(ab.val[0]), vget_low_f32(cd.val[0]));
+    b = vcombine_f32(vget_low_f32(ab.val[1]), vget_low_f32(cd.val[1]));
+    c = vcombine_f32(vget_high_f32(ab.val[0]), vget_high_f32(cd.val[0]));
+    d = vcombine_f32(vget_high_f32(ab.val[1]), vget_high_f32(cd.val[1]));
+}
+#else
+struct float4
+{
+    float lanes[4];
+};
+
+static inline float4 load4(const float* from) { float4 r; std::memcpy(r.lanes, from, sizeof(r.lanes)); return r; }
+static inline void store4(float* to, float4 value) { std::memcpy(to, value.lanes, sizeof(value.lanes)); }
+static inline float4 splat4(float value) { return { { value, value, value, value } }; }
+static inline float4 add4(float4 a, float4 b) { for (int i = 0; i < 4; i++) a.lanes[i] += b.lanes[i]; return a; }
+static inline float4 sub4(float4 a, float4 b) { for (int i = 0; i < 4; i++) a.lanes[i] -= b.lanes[i]; return a; }
+static inline float4 mul4(float4 a, float4 b) { for (int i = 0; i < 4; i++) a.lanes[i] *= b.lanes[i]; return a; }
+static inline float4 min4(float4 a, float4 b) { for (int i = 0; i < 4; i++) a.lanes[i] = std::min(a.lanes[i], b.lanes[i]); return a; }
+static inline float4 max4(float4 a, float4 b) { for (int i = 0; i < 4; i++) a.lanes[i] = std::max(a.lanes[i], b.lanes[i]); return a; }
+static inline int less_mask4(float4 a, float4 b) { int mask = 0; for (int i = 0; i < 4; i++) mask |= a.lanes[i] < b.lanes[i] ? 1 << i : 0; return mask; }
+
+static inline void transpose4(float4& a, float4& b, float4& c, float4& d)
+{
+    float4* rows[4] = { &a, &b, &c, &d };
+
+    for (int row = 0; row < 4; row++)
+        for (int column = row + 1; column < 4; column++)
+            std::swap(rows[row]->lanes[column], rows[column]->lanes[row]);
+}
+#endif
+
+static inline float* matrix_data(glm::mat4& matrix)
+{
+    return &matrix[0][0];
+}
+
+static inline const float* matrix_data(const glm::mat4& matrix)
+{
+    return &matrix[0][0];
+}
+
+static inline void multiply_matrices(const glm::mat4& parent, const glm::mat4& local, glm::mat4& result)
+{
+    const float* p = matrix_data(parent);
+    const float* l = matrix_data(local);
+    float* r = matrix_data(result);
+
+    float4 p0 = load4(p);
+    float4 p1 = load4(p + 4);
+    float4 p2 = load4(p + 8);
+    float4 p3 = load4(p + 12);
+
+    for (int column = 0; column < 4; column++)
+    {
+        const float* c = l + column * 4;
+        float4 value = mul4(p0, splat4(c[0]));
+
+        value = add4(value, mul4(p1, splat4(c[1])));
+        value = add4(value, mul4(p2, splat4(c[2])));
+        value = add4(value, mul4(p3, splat4(c[3])));
+        store4(r + column * 4, value);
+    }
+}
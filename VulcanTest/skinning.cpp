@@ -0,0 +1,174 @@
+#include "skinning.h"
+#include "simd_math.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+using namespace std;
+
+Skin build_chain_skin(const vector<glm::vec3>& positions, uint32_t joint_count)
+{
+    Skin skin;
+    glm::vec3 bounds_min(FLT_MAX);
+    glm::vec3 bounds_max(-FLT_MAX);
+    glm::vec3 extent;
+    int axis = 0;
+
+    for (const glm::vec3& position : positions)
+    {
+        bounds_min = glm::min(bounds_min, position);
+        bounds_max = glm::max(bounds_max, position);
+    }
+    if (positions.empty())
+        bounds_min = bounds_max = glm::vec3(0.0f);
+
+    extent = bounds_max - bounds_min;
+    if (extent.y > extent[axis])
+        axis = 1;
+    if (extent.z > extent[axis])
+        axis = 2;
+
+    skin.joint_count = max(joint_count, 1u);
+    skin.morph_target_count = 1;
+    skin.axis = glm::vec3(0.0f);
+    skin.axis[axis] = 1.0f;
+    skin.bend_axis = glm::vec3(0.0f);
+    skin.bend_axis[(axis + 1) % 3] = 1.0f;
+    skin.base = (bounds_min + bounds_max) * 0.5f;
+    skin.base[axis] = bounds_min[axis];
+    skin.segment = skin.joint_count > 1 ? extent[axis] / (skin.joint_count - 1) : 0.0f;
+
+    skin.vertices.resize(positions.size());
+    skin.morph_deltas.resize(positions.size());
+
+    for (size_t vertex = 0; vertex < positions.size(); vertex++)
+    {
+        glm::vec3 offset = positions[vertex] - skin.base;
+        float along = glm::dot(offset, skin.axis);
+        SkinVertex& skin_vertex = skin.vertices[vertex];
+
+        if (skin.segment > 0.0f)
+        {
+            float t = min(along / skin.segment, static_cast<float>(skin.joint_count - 1));
+            uint32_t joint = min(static_cast<uint32_t>(t), skin.joint_count - 2);
+            float blend = t - joint;
+
+            skin_vertex.joints = glm::uvec4(joint, joint + 1, 0, 0);
+            skin_vertex.weights = glm::vec4(1.0f - blend, blend, 0.0f, 0.0f);
+        }
+
+        skin.morph_deltas[vertex] = glm::vec4((offset - skin.axis * along) * 0.15f, 0.0f);
+    }
+
+    return skin;
+}
+
+void sample_skin_poses(const Skin& skin, float time, uint32_t first_pose, uint32_t last_pose,
+    glm::mat4* palettes, float* morph_weights)
+{
+    const float amplitude = 0.6f / skin.joint_count;
+    const glm::vec3 side = glm::cross(skin.bend_axis, skin.axis);
+    const float4 zero = splat4(0.0f);
+    const float4 one = splat4(1.0f);
+    glm::vec3 basis_cross[3];
+    float basis_outer[3][3];
+
+    // Rotation about the bend axis, column k: cos * e_k + sin * (B x e_k) + (1 - cos) * B_k * B.
+    for (int column = 0; column < 3; column++)
+    {
+        glm::vec3 unit(0.0f);
+
+        unit[column] = 1.0f;
+        basis_cross[column] = glm::cross(skin.bend_axis, unit);
+        for (int row = 0; row < 3; row++)
+            basis_outer[column][row] = skin.bend_axis[column] * skin.bend_axis[row];
+    }
+
+    for (uint32_t block = first_pose; block < last_pose; block += 4)
+    {
+        uint32_t lanes = min(4u, last_pose - block);
+        float phases[4];
+        float4 angle = zero;
+        float4 position[3] = { splat4(skin.base.x), splat4(skin.base.y), splat4(skin.base.z) };
+        float4 previous_cos = one;
+        float4 previous_sin = zero;
+
+        for (uint32_t lane = 0; lane < 4; lane++)
+            phases[lane] = 0.7f * (block + lane);
+
+        for (uint32_t lane = 0; lane < lanes; lane++)
+            morph_weights[(block + lane) * skin.morph_target_count] = 0.5f + 0.5f * sin(time * 3.0f + phases[lane]);
+
+        // All joints bend around one axis, so a joint's global rotation is the sum of the angles up the chain.
+        for (uint32_t joint = 0; joint < skin.joint_count; joint++)
+        {
+            float joint_angles[4];
+            float cosines[4];
+            float sines[4];
+            float4 rotation[3][3];
+            float4 columns[4][4];
+            glm::vec3 bind = skin.base + skin.axis * (skin.segment * joint);
+
+            if (joint > 0)
+                for (int row = 0; row < 3; row++)
+                {
+                    float4 along = mul4(previous_cos, splat4(skin.segment * skin.axis[row]));
+
+                    along = add4(along, mul4(previous_sin, splat4(skin.segment * side[row])));
+                    position[row] = add4(position[row], along);
+                }
+
+            for (uint32_t lane = 0; lane < 4; lane++)
+                joint_angles[lane] = amplitude * sin(time * 2.0f + phases[lane] + 0.6f * joint);
+            angle = add4(angle, load4(joint_angles));
+
+            store4(joint_angles, angle);
+            for (uint32_t lane = 0; lane < 4; lane++)
+            {
+                cosines[lane] = cos(joint_angles[lane]);
+                sines[lane] = sin(joint_angles[lane]);
+            }
+            previous_cos = load4(cosines);
+            previous_sin = load4(sines);
+
+            float4 one_minus_cos = sub4(one, previous_cos);
+
+            for (int column = 0; column < 3; column++)
+                for (int row = 0; row < 3; row++)
+                {
+                    float4 value = mul4(previous_sin, splat4(basis_cross[column][row]));
+
+                    value = add4(value, mul4(one_minus_cos, splat4(basis_outer[column][row])));
+                    if (row == column)
+                        value = add4(value, previous_cos);
+                    rotation[column][row] = value;
+                }
+
+            // Skin matrix = global * inverse bind: [R | P - R * bind].
+            for (int column = 0; column < 3; column++)
+            {
+                columns[column][0] = rotation[column][0];
+                columns[column][1] = rotation[column][1];
+                columns[column][2] = rotation[column][2];
+                columns[column][3] = zero;
+            }
+            for (int row = 0; row < 3; row++)
+            {
+                float4 translation = position[row];
+
+                for (int column = 0; column < 3; column++)
+                    translation = sub4(translation, mul4(rotation[column][row], splat4(bind[column])));
+                columns[3][row] = translation;
+            }
+            columns[3][3] = one;
+
+            for (int column = 0; column < 4; column++)
+            {
+                transpose4(columns[column][0], columns[column][1], columns[column][2], columns[column][3]);
+                for (uint32_t lane = 0; lane < lanes; lane++)
+                    store4(matrix_data(palettes[(block + lane) * skin.joint_count + joint]) + column * 4, columns[column][lane]);
+            }
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <cstdint>
+#include <vector>
+
+// Matches SkinVertex in skin.comp (std430).
+struct SkinVertex
+{
+    glm::uvec4 joints = glm::uvec4(0);
+    glm::vec4 weights = glm::vec4(1.0f, 0.0f, 0.0f, 0.0f);
+};
+
+// A chain of joints rigged along the mesh's longest axis. The sampled animation bends the chain
+// around bend_axis and blends in one morph target that swells the mesh away from the chain.
+struct Skin
+{
+    glm::vec3 base = glm::vec3(0.0f);
+    glm::vec3 axis = glm::vec3(0.0f, 0.0f, 1.0f);
+    glm::vec3 bend_axis = glm::vec3(1.0f, 0.0f, 0.0f);
+    float segment = 0.0f;
+    uint32_t joint_count = 0;
+    uint32_t morph_target_count = 0;
+    std::vector<SkinVertex> vertices;
+    // morph_deltas[target * vertex_count + vertex], w unused.
+    std::vector<glm::vec4> morph_deltas;
+};
+
+// Each vertex is weighted between the two joints around it along the chain.
+Skin build_chain_skin(const std::vector<glm::vec3>& positions, uint32_t joint_count);
+
+// Writes palettes[pose * joint_count + joint] and morph_weights[pose * morph_target_count + target]
+// for poses [first_pose, last_pose), four poses per SIMD lane set. Every pose plays the same
+// animation with its own phase, so instances sharing a mesh do not move in lockstep.
+void sample_skin_poses(const Skin& skin, float time, uint32_t first_pose, uint32_t last_pose,
+    glm::mat4* palettes, float* morph_weights);
@@ -0,0 +1,195 @@
+#include "task_graph.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+TaskId TaskGraph::add_task(const string& name, TaskAffinity affinity, const vector<TaskId>& dependencies, function<void()> work)
+{
+    TaskId id = static_cast<TaskId>(tasks.size());
+    Task task;
+
+    task.name = name;
+    task.affinity = affinity;
+    task.work = move(work);
+
+    for (TaskId dependency : dependencies)
+    {
+        if (dependency >= id)
+        {
+            cout << "Adding task " << name << " error: dependencies must be added first!" << endl;
+            continue;
+        }
+        task.dependencies.push_back(dependency);
+        tasks[dependency].dependents.push_back(id);
+    }
+
+    tasks.push_back(move(task));
+    return id;
+}
+
+void TaskGraph::run(WorkerPool* pool)
+{
+    auto start = chrono::steady_clock::now();
+    mutex graph_mutex;
+    condition_variable graph_changed;
+    deque<TaskId> main_ready;
+    size_t completed = 0;
+
+    auto elapsed_ms = [start]()
+        {
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        };
+
+    auto execute = [&](TaskId id)
+        {
+            Task& task = tasks[id];
+
+            task.worker = WorkerPool::current_worker();
+            task.start_ms = elapsed_ms();
+            task.work();
+            task.end_ms = elapsed_ms();
+        };
+
+    function<void(TaskId)> finish;
+    function<void(TaskId)> dispatch = [&](TaskId id)
+        {
+            if (pool and tasks[id].affinity == TASK_ANY_THREAD)
+                pool->submit([&, id]()
+                    {
+                        execute(id);
+                        finish(id);
+                    });
+            else
+                main_ready.push_back(id);
+        };
+
+    finish = [&](TaskId id)
+        {
+            lock_guard<mutex> lock(graph_mutex);
+
+            completed++;
+            for (TaskId dependent : tasks[id].dependents)
+                if (--tasks[dependent].remaining == 0)
+                    dispatch(dependent);
+            graph_changed.notify_all();
+        };
+
+    {
+        lock_guard<mutex> lock(graph_mutex);
+
+        for (Task& task : tasks)
+            task.remaining = static_cast<uint32_t>(task.dependencies.size());
+        for (TaskId id = 0; id < tasks.size(); id++)
+            if (tasks[id].remaining == 0)
+                dispatch(id);
+    }
+
+    while (true)
+    {
+        TaskId id;
+
+        {
+            unique_lock<mutex> lock(graph_mutex);
+
+            graph_changed.wait(lock, [&]() { return !main_ready.empty() or completed == tasks.size(); });
+            if (main_ready.empty())
+                break;
+
+            id = main_ready.front();
+            main_ready.pop_front();
+        }
+
+        execute(id);
+        finish(id);
+    }
+
+    total_ms = elapsed_ms();
+}
+
+double TaskGraph::wall_ms() const
+{
+    return total_ms;
+}
+
+double TaskGraph::serial_ms() const
+{
+    double sum = 0.0;
+
+    for (const Task& task : tasks)
+        sum += task.end_ms - task.start_ms;
+    return sum;
+}
+
+vector<TaskId> TaskGraph::critical_path() const
+{
+    vector<double> path_ms(tasks.size(), 0.0);
+    vector<int64_t> previous(tasks.size(), -1);
+    vector<TaskId> path;
+    TaskId last = 0;
+
+    for (TaskId id = 0; id < tasks.size(); id++)
+    {
+        for (TaskId dependency : tasks[id].dependencies)
+        {
+            if (path_ms[dependency] > path_ms[id])
+            {
+                path_ms[id] = path_ms[dependency];
+                previous[id] = dependency;
+            }
+        }
+        path_ms[id] += tasks[id].end_ms - tasks[id].start_ms;
+
+        if (path_ms[id] > path_ms[last])
+            last = id;
+    }
+
+    if (tasks.empty())
+        return path;
+
+    for (int64_t id = last; id >= 0; id = previous[id])
+        path.push_back(static_cast<TaskId>(id));
+    reverse(path.begin(), path.end());
+
+    return path;
+}
+
+void TaskGraph::print_timeline() const
+{
+    vector<TaskId> order(tasks.size());
+    vector<TaskId> path = critical_path();
+    double path_ms = 0.0;
+
+    for (TaskId id = 0; id < tasks.size(); id++)
+        order[id] = id;
+    sort(order.begin(), order.end(), [this](TaskId a, TaskId b) { return tasks[a].start_ms < tasks[b].start_ms; });
+
+    cout << "Startup timeline:" << endl;
+    for (TaskId id : order)
+    {
+        const Task& task = tasks[id];
+        bool critical = find(path.begin(), path.end(), id) != path.end();
+
+        cout << fixed << setprecision(1)
+            << "  " << setw(8) << task.start_ms << " .. " << setw(8) << task.end_ms << " ms  "
+            << (task.worker < 0 ? string("main    ") : "worker " + to_string(task.worker))
+            << (critical ? "  * " : "    ") << task.name << endl;
+    }
+
+    cout << "  critical path:";
+    for (TaskId id : path)
+    {
+        cout << " " << tasks[id].name;
+        path_ms += tasks[id].end_ms - tasks[id].start_ms;
+    }
+    cout << " (" << path_ms << " ms)" << endl;
+
+    cout << "  wall " << wall_ms() << " ms, serial " << serial_ms() << " ms, saved " << serial_ms() - wall_ms() << " ms"
+        << defaultfloat << setprecision(6) << endl;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "worker_pool.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+enum TaskAffinity : uint32_t
+{
+    TASK_ANY_THREAD = 0,
+    TASK_MAIN_THREAD = 1
+};
+
+typedef uint32_t TaskId;
+
+// One-shot dependency graph. Main-thread tasks run on the thread calling run(),
+// the rest go to the worker pool as soon as their dependencies finish.
+class TaskGraph
+{
+public:
+    TaskId add_task(const std::string& name, TaskAffinity affinity, const std::vector<TaskId>& dependencies, std::function<void()> work);
+
+    // Without a pool every task runs on the calling thread in dependency order.
+    void run(WorkerPool* pool);
+
+    double wall_ms() const;
+    double serial_ms() const;
+    void print_timeline() const;
+
+private:
+    struct Task
+    {
+        std::string name;
+        TaskAffinity affinity;
+        std::vector<TaskId> dependencies;
+        std::vector<TaskId> dependents;
+        std::function<void()> work;
+        uint32_t remaining = 0;
+        int32_t worker = -1;
+        double start_ms = 0.0;
+        double end_ms = 0.0;
+    };
+
+    std::vector<Task> tasks;
+    double total_ms = 0.0;
+
+    std::vector<TaskId> critical_path() const;
+};
@@ -0,0 +1,212 @@
+#include "trace.h"
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+atomic<bool> trace_enabled{ false };
+
+struct TraceEvent
+{
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Written only by its own thread. The head is published with release, so a reader that loads it
+// with acquire sees every event before it.
+struct ThreadBuffer
+{
+    vector<TraceEvent> events;
+    atomic<uint64_t> head{ 0 };
+    // Head when the trace was last started; older events belong to an earlier recording.
+    uint64_t start_head = 0;
+    uint32_t thread_id = 0;
+    string name;
+};
+
+struct ExternalEvent
+{
+    const char* track;
+    const char* name;
+    int64_t begin_ns;
+    int64_t end_ns;
+};
+
+// Buffers outlive their threads, so events of finished threads still make it into the trace.
+static mutex buffers_mutex;
+static vector<unique_ptr<ThreadBuffer>> buffers;
+static thread_local ThreadBuffer* thread_buffer = nullptr;
+static thread::id start_thread;
+
+static mutex external_mutex;
+static vector<ExternalEvent> external_events;
+
+static uint64_t start_ticks = 0;
+static int64_t start_ns = 0;
+static uint64_t stop_ticks = 0;
+static int64_t stop_ns = 0;
+
+static int64_t steady_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static ThreadBuffer* register_thread()
+{
+    lock_guard<mutex> lock(buffers_mutex);
+    unique_ptr<ThreadBuffer> buffer = make_unique<ThreadBuffer>();
+    int32_t worker = WorkerPool::current_worker();
+
+    buffer->events.resize(TRACE_BUFFER_EVENTS);
+    buffer->thread_id = static_cast<uint32_t>(buffers.size());
+    if (worker >= 0)
+        buffer->name = "worker " + to_string(worker);
+    else if (this_thread::get_id() == start_thread)
+        buffer->name = "main";
+    else
+        buffer->name = "thread " + to_string(buffer->thread_id);
+
+    thread_buffer = buffer.get();
+    buffers.push_back(move(buffer));
+    return thread_buffer;
+}
+
+void trace_start()
+{
+    lock_guard<mutex> lock(buffers_mutex);
+
+    for (const unique_ptr<ThreadBuffer>& buffer : buffers)
+        buffer->start_head = buffer->head.load(memory_order_acquire);
+    start_thread = this_thread::get_id();
+    start_ns = steady_ns();
+    start_ticks = trace_ticks();
+    stop_ticks = 0;
+    trace_enabled.store(true, memory_order_relaxed);
+}
+
+void trace_stop()
+{
+    trace_enabled.store(false, memory_order_relaxed);
+    stop_ticks = trace_ticks();
+    stop_ns = steady_ns();
+}
+
+void trace_record(const char* name, uint64_t begin_ticks, uint64_t end_ticks)
+{
+    ThreadBuffer* buffer = thread_buffer ? thread_buffer : register_thread();
+    uint64_t head = buffer->head.load(memory_order_relaxed);
+
+    buffer->events[head & (TRACE_BUFFER_EVENTS - 1)] = { name, begin_ticks, end_ticks };
+    buffer->head.store(head + 1, memory_order_release);
+}
+
+void trace_record_external(const char* track, const char* name, int64_t begin_ns, int64_t end_ns)
+{
+    lock_guard<mutex> lock(external_mutex);
+
+    external_events.push_back({ track, name, begin_ns, end_ns });
+}
+
+bool trace_write_chrome_json(const string& path)
+{
+    ofstream file(path);
+    vector<TraceEvent> events;
+    vector<string> tracks;
+    uint64_t written = 0;
+    uint64_t overwritten = 0;
+    uint64_t end_ticks = stop_ticks;
+    int64_t end_ns = stop_ns;
+    double us_per_tick;
+    bool first_event = true;
+
+    if (!file)
+    {
+        cout << "Opening trace output " << path << " error!" << endl;
+        return false;
+    }
+
+    if (trace_enabled.load(memory_order_relaxed))
+    {
+        end_ticks = trace_ticks();
+        end_ns = steady_ns();
+    }
+    us_per_tick = end_ticks > start_ticks ? (end_ns - start_ns) / 1000.0 / (end_ticks - start_ticks) : 0.0;
+
+    auto separator = [&]() -> ofstream&
+        {
+            file << (first_event ? "\n" : ",\n");
+            first_event = false;
+            return file;
+        };
+
+    file << fixed << setprecision(3);
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    separator() << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"VulcanTest\"}}";
+
+    lock_guard<mutex> lock(buffers_mutex);
+
+    for (const unique_ptr<ThreadBuffer>& buffer : buffers)
+    {
+        uint64_t head = buffer->head.load(memory_order_acquire);
+        uint64_t first = max(buffer->start_head, head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0);
+        uint64_t head_after;
+        uint64_t lapped;
+
+        events.clear();
+        for (uint64_t index = first; index < head; index++)
+            events.push_back(buffer->events[index & (TRACE_BUFFER_EVENTS - 1)]);
+
+        // A thread still recording may have lapped the copy; whatever it could have overwritten is dropped.
+        // That includes index head_after - TRACE_BUFFER_EVENTS, whose slot the next, unpublished event may be writing.
+        head_after = buffer->head.load(memory_order_acquire);
+        lapped = min<uint64_t>(head_after >= first + TRACE_BUFFER_EVENTS ? head_after - first - TRACE_BUFFER_EVENTS + 1 : 0, events.size());
+        overwritten += first - buffer->start_head + lapped;
+
+        separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->thread_id
+            << ",\"args\":{\"name\":\"" << buffer->name << "\"}}";
+        for (size_t index = lapped; index < events.size(); index++)
+        {
+            const TraceEvent& event = events[index];
+
+            if (event.begin < start_ticks)
+                continue;
+            separator() << "{\"name\":\"" << event.name << "\",\"cat\":\"cpu\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->thread_id
+                << ",\"ts\":" << (event.begin - start_ticks) * us_per_tick << ",\"dur\":" << (event.end - event.begin) * us_per_tick << "}";
+            written++;
+        }
+    }
+
+    lock_guard<mutex> external_lock(external_mutex);
+
+    for (const ExternalEvent& event : external_events)
+    {
+        size_t track = find(tracks.begin(), tracks.end(), string(event.track)) - tracks.begin();
+        uint32_t thread_id = static_cast<uint32_t>(buffers.size() + track);
+
+        if (track == tracks.size())
+        {
+            tracks.push_back(event.track);
+            separator() << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread_id
+                << ",\"args\":{\"name\":\"" << event.track << "\"}}";
+        }
+        if (event.begin_ns < start_ns)
+            continue;
+        separator() << "{\"name\":\"" << event.name << "\",\"cat\":\"" << event.track << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread_id
+            << ",\"ts\":" << (event.begin_ns - start_ns) / 1000.0 << ",\"dur\":" << (event.end_ns - event.begin_ns) / 1000.0 << "}";
+        written++;
+    }
+
+    file << "\n]}\n";
+    cout << "Trace: " << written << " events from " << buffers.size() << " threads and " << tracks.size() << " external tracks, "
+        << overwritten << " overwritten, written to " << path << endl;
+    return true;
+}
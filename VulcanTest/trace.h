@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TRACE_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_RDTSC
+#endif
+
+// Events each thread keeps before the oldest are overwritten.
+const uint32_t TRACE_BUFFER_EVENTS = 1 << 16;
+
+extern std::atomic<bool> trace_enabled;
+
+// Raw timestamp of the trace clock: the TSC on x86, steady_clock nanoseconds elsewhere.
+// Ticks are converted to steady_clock time when the trace is written, which assumes an invariant TSC.
+static inline uint64_t trace_ticks()
+{
+#if defined(TRACE_RDTSC)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+// Starts recording and calibrates the trace clock against steady_clock.
+void trace_start();
+void trace_stop();
+// Appends a finished zone to the calling thread's ring buffer. name must be a string literal:
+// only the pointer is stored.
+void trace_record(const char* name, uint64_t begin_ticks, uint64_t end_ticks);
+// Zones timed by some other clock, such as GPU timestamps, in steady_clock nanoseconds since its epoch.
+// Each track shows as its own row next to the CPU threads. Meant for a few events per frame: they go
+// through a lock.
+void trace_record_external(const char* track, const char* name, int64_t begin_ns, int64_t end_ns);
+// Chrome trace event JSON, loadable in chrome://tracing and Perfetto.
+bool trace_write_chrome_json(const std::string& path);
+
+// Times the enclosing scope while tracing is enabled. When it is not, construction is one relaxed
+// load and a branch.
+class TraceZone
+{
+public:
+    explicit TraceZone(const char* name)
+    {
+        if (trace_enabled.load(std::memory_order_relaxed))
+        {
+            this->name = name;
+            begin = trace_ticks();
+        }
+    }
+
+    ~TraceZone()
+    {
+        if (name)
+            trace_record(name, begin, trace_ticks());
+    }
+
+    TraceZone(const TraceZone&) = delete;
+    TraceZone& operator=(const TraceZone&) = delete;
+
+private:
+    const char* name = nullptr;
+    uint64_t begin = 0;
+};
+
+// Define TRACE_DISABLED to compile the zones out altogether.
+#if defined(TRACE_DISABLED)
+#define TRACE_ZONE(name)
+#else
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#endif
@@ -0,0 +1,227 @@
+#include "transform_store.h"
+#include "simd_math.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+TransformStore::TransformStore(uint32_t output_copies) : output_copies(max(output_copies, 1u))
+{
+}
+
+void TransformStore::reserve(size_t count)
+{
+    for (vector<float>* component : { &translation_x, &translation_y, &translation_z,
+        &rotation_x, &rotation_y, &rotation_z, &rotation_w, &scale_x, &scale_y, &scale_z })
+        component->reserve(count);
+
+    parents.reserve(count);
+    local_dirty.reserve(count);
+    world_changed_at.reserve(count);
+    pending_writes.reserve(count);
+    locals.reserve(count);
+    worlds.reserve(count);
+}
+
+void TransformStore::clear()
+{
+    for (vector<float>* component : { &translation_x, &translation_y, &translation_z,
+        &rotation_x, &rotation_y, &rotation_z, &rotation_w, &scale_x, &scale_y, &scale_z })
+        component->clear();
+
+    parents.clear();
+    local_dirty.clear();
+    world_changed_at.clear();
+    pending_writes.clear();
+    locals.clear();
+    worlds.clear();
+    first_dirty = 0;
+}
+
+size_t TransformStore::size() const
+{
+    return parents.size();
+}
+
+uint32_t TransformStore::add_node(int32_t parent, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale)
+{
+    uint32_t node = static_cast<uint32_t>(parents.size());
+
+    if (parent >= static_cast<int32_t>(node))
+    {
+        cout << "Adding transform node error: parent must be added before its children!" << endl;
+        parent = NO_PARENT;
+    }
+
+    translation_x.push_back(translation.x);
+    translation_y.push_back(translation.y);
+    translation_z.push_back(translation.z);
+    rotation_x.push_back(rotation.x);
+    rotation_y.push_back(rotation.y);
+    rotation_z.push_back(rotation.z);
+    rotation_w.push_back(rotation.w);
+    scale_x.push_back(scale.x);
+    scale_y.push_back(scale.y);
+    scale_z.push_back(scale.z);
+
+    parents.push_back(parent < 0 ? NO_PARENT : parent);
+    local_dirty.push_back(1);
+    world_changed_at.push_back(0);
+    pending_writes.push_back(0);
+    locals.emplace_back(1.0f);
+    worlds.emplace_back(1.0f);
+
+    first_dirty = min(first_dirty, static_cast<size_t>(node));
+
+    return node;
+}
+
+void TransformStore::set_translation(uint32_t node, const glm::vec3& translation)
+{
+    translation_x[node] = translation.x;
+    translation_y[node] = translation.y;
+    translation_z[node] = translation.z;
+    mark_dirty(node);
+}
+
+void TransformStore::set_rotation(uint32_t node, const glm::quat& rotation)
+{
+    rotation_x[node] = rotation.x;
+    rotation_y[node] = rotation.y;
+    rotation_z[node] = rotation.z;
+    rotation_w[node] = rotation.w;
+    mark_dirty(node);
+}
+
+void TransformStore::set_scale(uint32_t node, const glm::vec3& scale)
+{
+    scale_x[node] = scale.x;
+    scale_y[node] = scale.y;
+    scale_z[node] = scale.z;
+    mark_dirty(node);
+}
+
+void TransformStore::mark_dirty(uint32_t node)
+{
+    local_dirty[node] = 1;
+    first_dirty = min(first_dirty, static_cast<size_t>(node));
+}
+
+void TransformStore::mark_all_dirty()
+{
+    fill(local_dirty.begin(), local_dirty.end(), 1);
+    first_dirty = 0;
+}
+
+void TransformStore::update_locals(size_t first)
+{
+    const size_t count = size();
+    const float4 zero = splat4(0.0f);
+    const float4 one = splat4(1.0f);
+    const float4 two = splat4(2.0f);
+    size_t block = first & ~static_cast<size_t>(3);
+
+    for (; block + 4 <= count; block += 4)
+    {
+        uint32_t block_dirty;
+
+        memcpy(&block_dirty, &local_dirty[block], sizeof(block_dirty));
+        if (block_dirty == 0)
+            continue;
+
+        float4 x = load4(&rotation_x[block]);
+        float4 y = load4(&rotation_y[block]);
+        float4 z = load4(&rotation_z[block]);
+        float4 w = load4(&rotation_w[block]);
+        float4 sx = load4(&scale_x[block]);
+        float4 sy = load4(&scale_y[block]);
+        float4 sz = load4(&scale_z[block]);
+
+        float4 xx = mul4(x, x), yy = mul4(y, y), zz = mul4(z, z);
+        float4 xy = mul4(x, y), xz = mul4(x, z), yz = mul4(y, z);
+        float4 wx = mul4(w, x), wy = mul4(w, y), wz = mul4(w, z);
+
+        float4 columns[4][4] = {
+            { mul4(sub4(one, mul4(two, add4(yy, zz))), sx), mul4(mul4(two, add4(xy, wz)), sx), mul4(mul4(two, sub4(xz, wy)), sx), zero },
+            { mul4(mul4(two, sub4(xy, wz)), sy), mul4(sub4(one, mul4(two, add4(xx, zz))), sy), mul4(mul4(two, add4(yz, wx)), sy), zero },
+            { mul4(mul4(two, add4(xz, wy)), sz), mul4(mul4(two, sub4(yz, wx)), sz), mul4(sub4(one, mul4(two, add4(xx, yy))), sz), zero },
+            { load4(&translation_x[block]), load4(&translation_y[block]), load4(&translation_z[block]), one }
+        };
+
+        for (int column = 0; column < 4; column++)
+        {
+            float4* rows = columns[column];
+
+            transpose4(rows[0], rows[1], rows[2], rows[3]);
+            for (int lane = 0; lane < 4; lane++)
+                store4(matrix_data(locals[block + lane]) + column * 4, rows[lane]);
+        }
+    }
+
+    for (size_t node = block; node < count; node++)
+    {
+        if (!local_dirty[node])
+            continue;
+
+        glm::quat rotation(rotation_w[node], rotation_x[node], rotation_y[node], rotation_z[node]);
+        glm::mat4& local = locals[node];
+
+        local = glm::mat4_cast(rotation);
+        local[0] = local[0] * scale_x[node];
+        local[1] = local[1] * scale_y[node];
+        local[2] = local[2] * scale_z[node];
+        local[3] = glm::vec4(translation_x[node], translation_y[node], translation_z[node], 1.0f);
+    }
+}
+
+uint32_t TransformStore::update(glm::mat4* output)
+{
+    const size_t count = size();
+    size_t next_first_dirty = count;
+    uint32_t recomputed = 0;
+
+    if (first_dirty >= count)
+        return 0;
+
+    update_locals(first_dirty);
+    update_index++;
+
+    for (size_t node = first_dirty; node < count; node++)
+    {
+        int32_t parent = parents[node];
+        bool parent_changed = parent != NO_PARENT and world_changed_at[parent] == update_index;
+
+        if (local_dirty[node] or parent_changed)
+        {
+            if (parent == NO_PARENT)
+                worlds[node] = locals[node];
+            else
+                multiply_matrices(worlds[parent], locals[node], worlds[node]);
+
+            local_dirty[node] = 0;
+            world_changed_at[node] = update_index;
+            pending_writes[node] = static_cast<uint8_t>(min(output_copies, 255u));
+            recomputed++;
+        }
+
+        if (pending_writes[node] == 0)
+            continue;
+
+        if (output)
+            memcpy(&output[node], &worlds[node], sizeof(glm::mat4));
+
+        if (--pending_writes[node] > 0 and next_first_dirty == count)
+            next_first_dirty = node;
+    }
+
+    first_dirty = next_first_dirty;
+
+    return recomputed;
+}
+
+const glm::mat4& TransformStore::world(uint32_t node) const
+{
+    return worlds[node];
+}
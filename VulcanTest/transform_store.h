@@ -0,0 +1,55 @@
+#pragma once
+
+#include "glm_config.h"
+
+#include <glm/gtc/quaternion.hpp>
+
+#include <cstdint>
+#include <vector>
+
+// Scene transforms kept as structure-of-arrays. Nodes are stored in topological
+// order (a parent always precedes its children), so a single forward pass can
+// propagate world matrices and dirty flags.
+class TransformStore
+{
+public:
+    static constexpr int32_t NO_PARENT = -1;
+
+    // output_copies is the number of mapped buffers fed by update(), one per frame in flight.
+    explicit TransformStore(uint32_t output_copies = 1);
+
+    void reserve(size_t count);
+    void clear();
+    size_t size() const;
+
+    uint32_t add_node(int32_t parent, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale);
+    void set_translation(uint32_t node, const glm::vec3& translation);
+    void set_rotation(uint32_t node, const glm::quat& rotation);
+    void set_scale(uint32_t node, const glm::vec3& scale);
+    void mark_all_dirty();
+
+    // Recomputes dirty subtrees and writes changed world matrices to output (may be null).
+    // Returns the number of world matrices recomputed.
+    uint32_t update(glm::mat4* output);
+    const glm::mat4& world(uint32_t node) const;
+
+private:
+    uint32_t output_copies;
+
+    std::vector<float> translation_x, translation_y, translation_z;
+    std::vector<float> rotation_x, rotation_y, rotation_z, rotation_w;
+    std::vector<float> scale_x, scale_y, scale_z;
+    std::vector<int32_t> parents;
+
+    std::vector<uint8_t> local_dirty;
+    std::vector<uint32_t> world_changed_at;
+    std::vector<uint8_t> pending_writes;
+    std::vector<glm::mat4> locals;
+    std::vector<glm::mat4> worlds;
+
+    size_t first_dirty = 0;
+    uint32_t update_index = 0;
+
+    void mark_dirty(uint32_t node);
+    void update_locals(size_t first);
+};
@@ -0,0 +1,51 @@
+#include "transient_ring.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace std;
+
+void TransientRing::init(uint8_t* mapped, VkDeviceSize region_size, uint32_t region_count)
+{
+    this->mapped = mapped;
+    this->region_size = region_size;
+    this->region_count = region_count;
+    region_start = 0;
+    head = 0;
+}
+
+void TransientRing::begin_frame(uint32_t frame)
+{
+    region_start = static_cast<VkDeviceSize>(frame % region_count) * region_size;
+    head = 0;
+}
+
+bool TransientRing::allocate(VkDeviceSize size, VkDeviceSize alignment, TransientAllocation& allocation)
+{
+    VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+
+    if (!mapped or offset + size > region_size)
+    {
+        failures++;
+        return false;
+    }
+
+    allocation.offset = region_start + offset;
+    allocation.data = mapped + allocation.offset;
+    head = offset + size;
+    peak = max(peak, head);
+    allocations++;
+
+    return true;
+}
+
+VkDeviceSize TransientRing::used() const
+{
+    return head;
+}
+
+void TransientRing::print_stats() const
+{
+    cout << "Transient geometry: peak " << peak / 1024 << " of " << region_size / 1024 << " KB per frame, "
+        << allocations << " allocations, " << failures << " did not fit" << endl;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <cstdint>
+
+struct TransientAllocation
+{
+    // Offset from the start of the ring buffer, used when binding.
+    VkDeviceSize offset = 0;
+    void* data = nullptr;
+};
+
+// Bump allocator over a persistently mapped buffer split into one region per frame in flight.
+// begin_frame() rewinds a region, so it may only run once the GPU is done with the frame that
+// last used it. Requests that do not fit fail rather than spill into a region still in flight.
+class TransientRing
+{
+public:
+    void init(uint8_t* mapped, VkDeviceSize region_size, uint32_t region_count);
+    void begin_frame(uint32_t frame);
+    bool allocate(VkDeviceSize size, VkDeviceSize alignment, TransientAllocation& allocation);
+
+    VkDeviceSize used() const;
+    void print_stats() const;
+
+private:
+    uint8_t* mapped = nullptr;
+    VkDeviceSize region_size = 0;
+    uint32_t region_count = 0;
+    VkDeviceSize region_start = 0;
+    VkDeviceSize head = 0;
+
+    VkDeviceSize peak = 0;
+    uint64_t allocations = 0;
+    uint64_t failures = 0;
+};
@@ -0,0 +1,137 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+static thread_local int32_t worker_index_of_thread = -1;
+
+WorkerPool::WorkerPool(uint32_t thread_count)
+{
+    if (thread_count == 0)
+        thread_count = max(2u, thread::hardware_concurrency()) - 1;
+
+    for (uint32_t worker = 0; worker < thread_count; worker++)
+        threads.emplace_back(&WorkerPool::worker_loop, this, static_cast<int32_t>(worker));
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        stopping = true;
+    }
+    jobs_ready.notify_all();
+
+    for (thread& worker : threads)
+        worker.join();
+}
+
+void WorkerPool::submit(Job job)
+{
+    {
+        lock_guard<mutex> lock(jobs_mutex);
+        jobs.push_back(move(job));
+    }
+    jobs_ready.notify_one();
+}
+
+void WorkerPool::wait_idle()
+{
+    unique_lock<mutex> lock(jobs_mutex);
+
+    jobs_done.wait(lock, [this]() { return jobs.empty() and busy_workers == 0; });
+}
+
+void WorkerPool::parallel_for(uint32_t count, uint32_t grain, RangeJob job)
+{
+    struct Range
+    {
+        RangeJob job;
+        uint32_t count;
+        uint32_t grain;
+        atomic<uint32_t> next{ 0 };
+        atomic<uint32_t> done{ 0 };
+        mutex done_mutex;
+        condition_variable finished;
+    };
+
+    shared_ptr<Range> range = make_shared<Range>();
+    uint32_t chunks;
+
+    grain = max(grain, 1u);
+    chunks = (count + grain - 1) / grain;
+    range->job = move(job);
+    range->count = count;
+    range->grain = grain;
+
+    // Helpers that start after the caller took every chunk find nothing left and return at once.
+    auto run_chunks = [range]()
+        {
+            while (true)
+            {
+                uint32_t begin = range->next.fetch_add(range->grain);
+                uint32_t end;
+
+                if (begin >= range->count)
+                    return;
+
+                end = min(begin + range->grain, range->count);
+                range->job(begin, end);
+                if (range->done.fetch_add(end - begin) + (end - begin) == range->count)
+                {
+                    lock_guard<mutex> lock(range->done_mutex);
+                    range->finished.notify_all();
+                }
+            }
+        };
+
+    for (uint32_t helper = 0; helper + 1 < min(chunks, size() + 1); helper++)
+        submit(run_chunks);
+    run_chunks();
+
+    unique_lock<mutex> lock(range->done_mutex);
+    range->finished.wait(lock, [&range]() { return range->done == range->count; });
+}
+
+uint32_t WorkerPool::size() const
+{
+    return static_cast<uint32_t>(threads.size());
+}
+
+int32_t WorkerPool::current_worker()
+{
+    return worker_index_of_thread;
+}
+
+void WorkerPool::worker_loop(int32_t worker_index)
+{
+    worker_index_of_thread = worker_index;
+
+    while (true)
+    {
+        Job job;
+
+        {
+            unique_lock<mutex> lock(jobs_mutex);
+
+            jobs_ready.wait(lock, [this]() { return stopping or !jobs.empty(); });
+            if (jobs.empty())
+                return;
+
+            job = move(jobs.front());
+            jobs.pop_front();
+            busy_workers++;
+        }
+
+        job();
+
+        {
+            lock_guard<mutex> lock(jobs_mutex);
+            busy_workers--;
+        }
+        jobs_done.notify_all();
+    }
+}
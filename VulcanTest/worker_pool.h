@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool
+{
+public:
+    typedef std::function<void()> Job;
+    typedef std::function<void(uint32_t begin, uint32_t end)> RangeJob;
+
+    // thread_count 0 picks one worker per hardware thread minus the main thread.
+    explicit WorkerPool(uint32_t thread_count = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void submit(Job job);
+    void wait_idle();
+    // Splits [0, count) into chunks of grain items, runs them on the pool and the calling thread
+    // and returns once all are done. Unlike wait_idle() it never waits on unrelated jobs.
+    void parallel_for(uint32_t count, uint32_t grain, RangeJob job);
+    uint32_t size() const;
+
+    // Index of the calling worker thread, or -1 when called from outside the pool.
+    static int32_t current_worker();
+
+private:
+    std::vector<std::thread> threads;
+    std::deque<Job> jobs;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_ready;
+    std::condition_variable jobs_done;
+    uint32_t busy_workers = 0;
+    bool stopping = false;
+
+    void worker_loop(int32_t worker_index);
+};